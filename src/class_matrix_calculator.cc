@@ -6,35 +6,82 @@
  * Copyright (c) 2024, Thomas Truong.
  */
 
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 
+#include "matrix_allocator.h"
+#include "matrix_batch.h"
+#include "matrix_benchmark.h"
+#include "matrix_cache.h"
+#include "matrix_element.h"
+#include "matrix_expression.h"
+#include "matrix_fixed.h"
+#include "matrix_format.h"
+#include "matrix_gemm.h"
+#include "matrix_incremental.h"
+#include "matrix_instrumentation.h"
+#include "matrix_out_of_core.h"
+#include "matrix_parser.h"
+#include "matrix_simd.h"
+#include "matrix_storage.h"
 
-const int MIN_SIZE = 1;
-const int MAX_SIZE = 100;
 
+// Matrices with at most this many elements are stored inside the object itself.
+const int INLINE_CAPACITY = 64;
 
+
+template <typename T>
+int runCalculator();
+template <typename R>
+bool printCachedResult(const char* title, const ResultKey &key);
 void printMenu();
 
 
-class Matrix {
+/**
+ * Base of a matrix of T: float matrices take part in expressions, the other
+ * element types have eager operators (see below the class).
+ */
+template <typename T, typename Derived>
+class MatrixOperand {};
+
+template <typename Derived>
+class MatrixOperand<float, Derived> : public MatrixExpression<Derived> {};
+
+
+/**
+ * Runtime-sized matrix of T (float, double, Half, BFloat16, int8_t or an
+ * int32_t product; see matrix_element.h). For float matrices the +, - and *
+ * operators (see matrix_expression.h) build lazy expressions that are
+ * evaluated in one pass when assigned to a Matrix; the other types are
+ * evaluated right away. Fixed-size matrices are in matrix_fixed.h.
+ */
+template <typename T>
+class BasicMatrix<T, DYNAMIC, DYNAMIC> : public MatrixOperand<T, BasicMatrix<T>> {
  public:
+  static const bool IS_LEAF = true;
+  static const bool IS_PRODUCT = false;
+
+
   /**
    * Constructor.
    *
    * @param id - the ID number of the matrix.
    * @param width - the width of the matrix.
    * @param height - the height of the matrix.
-   * @throws std::invalid_argument - invalid width/height error.
+   * @throws std::invalid_argument - width/height rejected by the dimension policy.
    */
-  Matrix(int id, int width, int height) {
+  BasicMatrix(int id, int width, int height) {
     // Invalid width/height.
-    if (width < MIN_SIZE || width > MAX_SIZE) {
-      throw std::invalid_argument("Width out of range: " + std::to_string(MIN_SIZE)
-                                  + " >= width <= " + std::to_string(MAX_SIZE));
-    }
-    if (height < MIN_SIZE || height > MAX_SIZE) {
-      throw std::invalid_argument("Height out of range: " + std::to_string(MIN_SIZE)
-                                  + " >= height <= " + std::to_string(MAX_SIZE));
+    std::string error;
+    if (!checkDimensions(width, height, &error, sizeof(T))) {
+      throw std::invalid_argument(error);
     }
 
     // Valid width/height.
@@ -50,27 +97,157 @@ class Matrix {
    * 
    * @param id - the ID number of the matrix.
    */
-  explicit Matrix(int id) {
+  explicit BasicMatrix(int id) {
     _id = id;
 
     getDimensions();
   }
 
 
+  /**
+   * Constructor; evaluates an expression such as a + b - c * d.
+   * 
+   * @param expression - the expression to evaluate.
+   */
+  template <typename E>
+  BasicMatrix(const MatrixExpression<E> &expression) {
+    const E &tree = expression.self();
+    _id = tree.resultId();
+    _width = tree.getWidth();
+    _height = tree.getHeight();
+
+    double bytes = expressionBytes(tree) + sizeof(T) * static_cast<double>(_width) * _height;
+    ProfileScope profile(expressionSection<E>(), expressionFlops(tree), bytes);
+    createMatrix();
+    evaluateExpression(tree, view());
+  }
+
+
+  /**
+   * Constructor; copies a fixed-size matrix.
+   *
+   * @param id - the ID number of the matrix.
+   * @param matrix - the fixed-size matrix.
+   */
+  template <int R, int C>
+  BasicMatrix(int id, const BasicMatrix<T, R, C> &matrix) : BasicMatrix(id, C, R) {
+    matrix.copyTo(view());
+  }
+
+
+  /**
+   * Creates a matrix that takes ownership of existing storage.
+   * 
+   * @param id - the ID number of the matrix.
+   * @param storage - elements from allocateElements() or loadMatrixBinary().
+   * @return BasicMatrix - the matrix; it frees the storage with freeElements().
+   */
+  static BasicMatrix adopt(int id, const BasicMatrixView<T> &storage) {
+    BasicMatrix matrix;
+    matrix._id = id;
+    matrix._width = storage.width;
+    matrix._height = storage.height;
+    matrix._stride = storage.stride;
+    matrix._data = storage.data;
+    return matrix;
+  }
+
+
+  /**
+   * Copy constructor; makes a deep copy of the elements.
+   * 
+   * @param matrix - the matrix to copy.
+   */
+  BasicMatrix(const BasicMatrix &matrix) {
+    _id = matrix._id;
+    _width = matrix._width;
+    _height = matrix._height;
+
+    createMatrix();
+    copyElements(matrix);
+  }
+
+
+  /**
+   * Move constructor; takes over the other matrix's buffer in O(1).
+   * The other matrix is left empty (0 x 0).
+   * 
+   * @param matrix - the matrix to move from.
+   */
+  BasicMatrix(BasicMatrix &&matrix) noexcept {
+    stealStorage(matrix);
+  }
+
+
   /**
    * Destructor.
    */
-  ~Matrix() {
-    // Data doesn't exist.
-    if (_data == nullptr) {
-      return;
+  ~BasicMatrix() {
+    releaseMatrix();
+  }
+
+
+  /**
+   * Copy assignment; makes a deep copy, reusing the current buffer when it fits.
+   * 
+   * @param matrix - the matrix to copy.
+   * @return BasicMatrix& - this matrix.
+   */
+  BasicMatrix &operator=(const BasicMatrix &matrix) {
+    if (this == &matrix) {
+      return *this;
     }
 
-    // Data exists; for each row, delete array.
-    for (int i = 0; i < _height; ++i) {
-      delete[] _data[i];
+    if (_data == nullptr || _width != matrix._width || _height != matrix._height) {
+      _width = matrix._width;
+      _height = matrix._height;
+      createMatrix();
+    }
+    _id = matrix._id;
+    copyElements(matrix);
+
+    return *this;
+  }
+
+
+  /**
+   * Move assignment; releases this matrix's buffer and takes over the other's.
+   * 
+   * @param matrix - the matrix to move from.
+   * @return BasicMatrix& - this matrix.
+   */
+  BasicMatrix &operator=(BasicMatrix &&matrix) noexcept {
+    if (this != &matrix) {
+      releaseMatrix();
+      stealStorage(matrix);
+    }
+
+    return *this;
+  }
+
+
+  /**
+   * Assigns the value of an expression, in place when the dimensions match and
+   * no element would be overwritten before it is read.
+   * 
+   * @param expression - the expression to evaluate.
+   * @return BasicMatrix& - this matrix.
+   */
+  template <typename E>
+  BasicMatrix &operator=(const MatrixExpression<E> &expression) {
+    const E &tree = expression.self();
+    if (_data != nullptr && _width == tree.getWidth() && _height == tree.getHeight()
+        && operandAliasSafe(tree, view())) {
+      double bytes = expressionBytes(tree) + sizeof(T) * static_cast<double>(_width) * _height;
+      ProfileScope profile(expressionSection<E>(), expressionFlops(tree), bytes);
+      evaluateExpression(tree, view());
+    } else {
+      int id = _id;
+      *this = BasicMatrix(expression);
+      _id = id;
     }
-    delete[] _data;
+
+    return *this;
   }
 
 
@@ -79,11 +256,105 @@ class Matrix {
    * 
    * @return int - the matrix's ID number.
    */
-  int getID() {
+  int getID() const {
+    return _id;
+  }
+
+
+  /**
+   * Retrieves the width of the matrix.
+   * 
+   * @return int - the width.
+   */
+  int getWidth() const {
+    return _width;
+  }
+
+
+  /**
+   * Retrieves the height of the matrix.
+   * 
+   * @return int - the height.
+   */
+  int getHeight() const {
+    return _height;
+  }
+
+
+  /**
+   * Retrieves the ID number given to results evaluated from this matrix alone.
+   * 
+   * @return int - the matrix's ID number.
+   */
+  int resultId() const {
     return _id;
   }
 
 
+  /**
+   * Retrieves an element of the matrix.
+   * 
+   * @param i - the row index.
+   * @param j - the column index.
+   * @return T - the element.
+   */
+  T at(int i, int j) const {
+    return _data[static_cast<size_t>(i) * _stride + j];
+  }
+
+
+  /**
+   * Retrieves a row of the matrix.
+   * 
+   * @param i - the row index.
+   * @return T* - the first element of the row.
+   */
+  T* row(int i) const {
+    return _data + static_cast<size_t>(i) * _stride;
+  }
+
+
+  /**
+   * Retrieves a view of the whole matrix.
+   * 
+   * @return BasicMatrixView<T> - the view.
+   */
+  BasicMatrixView<T> view() const {
+    return BasicMatrixView<T>{_data, _width, _height, _stride};
+  }
+
+
+  /**
+   * Retrieves a view of a block of the matrix; it shares this matrix's storage.
+   * 
+   * @param rowOffset - the first row of the block.
+   * @param colOffset - the first column of the block.
+   * @param width - the width of the block.
+   * @param height - the height of the block.
+   * @return BasicMatrixView<T> - the view.
+   * @throws std::invalid_argument - block outside of the matrix.
+   */
+  BasicMatrixView<T> block(int rowOffset, int colOffset, int width, int height) const {
+    if (rowOffset < 0 || colOffset < 0 || width < 0 || height < 0
+        || rowOffset + height > _height || colOffset + width > _width) {
+      throw std::invalid_argument("Block outside of the matrix.");
+    }
+    return view().block(rowOffset, colOffset, width, height);
+  }
+
+
+  /**
+   * Copies the matrix into a fixed-size matrix.
+   *
+   * @return BasicMatrix<T, R, C> - the copy.
+   * @throws std::invalid_argument - the dimensions are not R x C.
+   */
+  template <int R, int C>
+  BasicMatrix<T, R, C> toFixed() const {
+    return BasicMatrix<T, R, C>::fromView(view());
+  }
+
+
   /**
    * Asks user to input the dimensions of the matrices.
    */
@@ -91,23 +362,30 @@ class Matrix {
     std::cout << "Enter the dimensions for matrix " << _id << " (width x height)." << std::endl;
     bool valid = false;
 
-    // Get input and repeat if invalid (invalid = MIN_SIZE < x > MAX_SIZE).
+    // Get input and repeat if rejected by the dimension policy or too large for memory.
+    long width = 0;
+    long height = 0;
     do {
       std::cout << "Dimensions <x y>: ";
-      std::cin >> _width;
-      std::cin >> _height;
+      if (!readDimensions(&width, &height)) {
+        continue;
+      }
 
       // Validate input.
-      if (_width < MIN_SIZE || _height < MIN_SIZE) {
-        std::cout << "Invalid size, min is " << MIN_SIZE << std::endl;
-      } else if (_width > MAX_SIZE || _height > MAX_SIZE) {
-        std::cout << "Invalid size, max is " << MAX_SIZE << std::endl;
-      } else {
+      std::string error;
+      if (!checkDimensions(width, height, &error, sizeof(T))) {
+        std::cout << error << std::endl;
+        continue;
+      }
+      _width = static_cast<int>(width);
+      _height = static_cast<int>(height);
+      try {
+        createMatrix();
         valid = true;
+      } catch (const std::bad_alloc &) {
+        std::cout << "Invalid size, not enough memory" << std::endl;
       }
     } while (!valid);
-
-    createMatrix();
   }
 
 
@@ -116,117 +394,145 @@ class Matrix {
    */
   void getMatrixValues() {
     std::cout << "===== Matrix " << _id << " =====" << std::endl;
-    std::cout << "Enter " << _width * _height << " value(s) individually or seperated by space."
-              << std::endl;
+    std::cout << "Enter " << static_cast<long>(_width) * _height
+              << " value(s) individually or seperated by space." << std::endl;
 
     // Take user input for each valid slot.
-    for (int i = 0; i < _height; ++i) {
-      for (int j = 0; j < _width; ++j) {
-        std::cin >> _data[i][j];
-      }
+    if (!readMatrixValues(standardInput(), view(), std::cout)) {
+      exitAtEndOfInput();
     }
   }
 
 
   /**
-   * Operator overload for addition.
+   * Asks user to change some values of the matrix.
    * 
-   * @param matrix - the rhs matrix to be added.
-   * @return Matrix - the sum matrix.
-   * @throws std::string - invalid dimensions.
+   * @param dirty - a region of view() that receives the changes.
    */
-  Matrix operator+(const Matrix &matrix) {
-    // Check for same size.
-    if (_width != matrix._width || _height != matrix._height) {
-      throw(std::string("[Sum] ERROR: dimensions are not matching."));
-    }
+  void updateMatrixValues(DirtyRegion<T> &dirty) {
+    std::cout << "===== Matrix " << _id << " =====" << std::endl;
+    std::cout << "Enter changes as <row column count> followed by count value(s), counting from 1."
+              << " Enter 0 to finish." << std::endl;
 
-    // Add each position from both matrices with each other.
-    Matrix sum = Matrix(3, _width, _height);
-    for (int i = 0; i < _height; ++i) {
-      for (int j = 0; j < _width; ++j) {
-        sum._data[i][j] = _data[i][j] + matrix._data[i][j];
-      }
+    if (!readMatrixUpdates(standardInput(), dirty, std::cout)) {
+      exitAtEndOfInput();
     }
-
-    return sum;
   }
 
 
   /**
-   * Operator overload for subtraction.
+   * Fused scaled addition: this + alpha * matrix in a single pass.
    * 
-   * @param matrix - the rhs matrix to be subtracted.
-   * @return Matrix - the difference matrix.
+   * @param matrix - the rhs matrix to be scaled and added.
+   * @param alpha - the scale applied to the rhs matrix.
+   * @return BasicMatrix - the result matrix.
    * @throws std::string - invalid dimensions.
    */
-  Matrix operator-(const Matrix &matrix) {
-    // Check for same size.
-    if (_width != matrix._width || _height != matrix._height) {
-      throw(std::string("[Difference] ERROR: dimensions are not matching."));
-    }
-
-    // Subtract each position from both matrices with each other.
-    Matrix difference = Matrix(4, _width, _height);
-    for (int i = 0; i < _height; ++i) {
-      for (int j = 0; j < _width; ++j) {
-        difference._data[i][j] = _data[i][j] - matrix._data[i][j];
-      }
-    }
-
-    return difference;
+  BasicMatrix scaledAdd(const BasicMatrix &matrix, float alpha) const {
+    return *this + alpha * matrix;
   }
 
 
   /**
-   * Operator overload for multiplication.
+   * Multiplies with an explicitly chosen algorithm.
    * 
    * @param matrix - the rhs matrix to be multiplied.
-   * @return Matrix - the product matrix.
+   * @param algorithm - the multiplication algorithm to use.
+   * @return BasicMatrix - the product matrix.
    * @throws std::string - invalid dimensions.
    */
-  Matrix operator*(const Matrix &matrix) {
+  BasicMatrix multiply(const BasicMatrix &matrix, GemmAlgorithm algorithm) const {
     // Check for same size.
     if (_width != matrix._height) {
       throw(std::string("[Product] ERROR: matrix 1's width does not match matrix 2's height."));
     }
 
-    // Matrix 1's height & matrix 2's width = new matrix's dimensions.
-    Matrix product = Matrix(5, _height, matrix._width);
-
-    // For each row for matrix 1.
-    for (int i = 0; i < _height; ++i) {
-      // For each column for matrix 2.
-      for (int k = 0; k < matrix._width; ++k) {
-        float sum = 0;
-        // For each column in row for matrix 1.
-        for (int j = 0; j < _width; ++j) {
-          sum += _data[i][j] * matrix._data[j][k];
-        }
-        product._data[i][k] = sum;
-      }
-    }
+    // Matrix 2's width & matrix 1's height = new matrix's dimensions.
+    BasicMatrix product = BasicMatrix(5, matrix._width, _height);
+    ::multiply(algorithm, _height, matrix._width, _width, _data, _stride, matrix._data, matrix._stride,
+               product._data, product._stride);
 
     return product;
   }
 
 
  private:
-  int _id;
-  int _width;
-  int _height;
-  float** _data;
+  int _id = 0;
+  int _width = 0;
+  int _height = 0;
+  int _stride = 0;
+  T* _data = nullptr;
+  alignas(MATRIX_ALIGNMENT) T _inline[INLINE_CAPACITY];
+
+
+  /**
+   * Constructor for an empty (0 x 0) matrix.
+   */
+  BasicMatrix() = default;
 
 
   /**
    * Allocates the matrix.
+   * Small matrices use the inline array with unpadded rows; larger ones get one
+   * aligned block with padded rows. Any previous storage is released first.
    */
   void createMatrix() {
-    _data = new float*[_height];
-    // Create array inside of array.
+    releaseMatrix();
+    if (static_cast<long>(_width) * _height <= INLINE_CAPACITY) {
+      _stride = _width;
+      _data = _inline;
+    } else {
+      _stride = paddedStrideOf<T>(_width);
+      _data = allocateElements<T>(static_cast<size_t>(_stride) * _height);
+    }
+  }
+
+
+  /**
+   * Frees the matrix's storage if it was allocated.
+   */
+  void releaseMatrix() {
+    if (_data != _inline) {
+      freeElements(_data);
+    }
+    _data = nullptr;
+  }
+
+
+  /**
+   * Copies the elements of a matrix with the same dimensions, row by row.
+   * 
+   * @param matrix - the matrix to copy from.
+   */
+  void copyElements(const BasicMatrix &matrix) {
     for (int i = 0; i < _height; ++i) {
-      _data[i] = new float[_width];
+      std::memcpy(row(i), matrix.row(i), sizeof(T) * _width);
+    }
+  }
+
+
+  /**
+   * Takes over another matrix's storage and leaves it empty.
+   * Heap buffers change owner; inline elements (at most INLINE_CAPACITY) are copied.
+   * 
+   * @param matrix - the matrix to take the storage from.
+   */
+  void stealStorage(BasicMatrix &matrix) noexcept {
+    _id = matrix._id;
+    _width = matrix._width;
+    _height = matrix._height;
+    _stride = matrix._stride;
+    if (matrix._data == matrix._inline) {
+      std::memcpy(_inline, matrix._inline, sizeof(T) * _stride * _height);
+      _data = _inline;
+    } else {
+      _data = matrix._data;
     }
+
+    matrix._width = 0;
+    matrix._height = 0;
+    matrix._stride = 0;
+    matrix._data = nullptr;
   }
 
 
@@ -236,27 +542,375 @@ class Matrix {
    * @param os - the output stream.
    * @param matrix - the matrix to print.
    */
-  friend std::ostream &operator<<(std::ostream &os, const Matrix &matrix) {
-    std::string output = "";
-    // For every row.
-    for (int i = 0; i < matrix._height; ++i) {
-      // For every column.
-      for (int j = 0; j < matrix._width; ++j) {
-        output += std::to_string(matrix._data[i][j]) + " ";
-      }
-      output += "\n";
+  friend std::ostream &operator<<(std::ostream &os, const BasicMatrix &matrix) {
+    writeMatrix(os, matrix.view(), outputFormat(FIXED_FORMAT));
+    return os;
+  }
+};
+
+// The calculator's matrix; batch mode and the benchmarks use it.
+using Matrix = BasicMatrix<float>;
+
+
+/**
+ * Checks whether T is an element type with eager operators.
+ */
+template <typename T>
+using EagerElement = std::enable_if_t<!std::is_same<T, float>::value>;
+
+
+/**
+ * Operator overloading for addition of matrices of an element type other
+ * than float; sums are carried out in the type's accumulator.
+ *
+ * @param matrix1 - the lhs matrix.
+ * @param matrix2 - the rhs matrix.
+ * @return BasicMatrix<T> - the sum.
+ * @throws std::string - invalid dimensions.
+ */
+template <typename T, typename = EagerElement<T>>
+BasicMatrix<T> operator+(const BasicMatrix<T> &matrix1, const BasicMatrix<T> &matrix2) {
+  if (matrix1.getWidth() != matrix2.getWidth() || matrix1.getHeight() != matrix2.getHeight()) {
+    throw(std::string("[Sum] ERROR: dimensions are not matching."));
+  }
+
+  double elements = static_cast<double>(matrix1.getWidth()) * matrix1.getHeight();
+  ProfileScope profile(ProfileSection::ADD, elements, 3 * sizeof(T) * elements);
+  BasicMatrix<T> sum(3, matrix1.getWidth(), matrix1.getHeight());
+  combineElements(matrix1.view(), matrix2.view(), sum.view(), false);
+  return sum;
+}
+
+
+/**
+ * Operator overloading for subtraction of matrices of an element type other
+ * than float; differences are carried out in the type's accumulator.
+ *
+ * @param matrix1 - the lhs matrix.
+ * @param matrix2 - the rhs matrix.
+ * @return BasicMatrix<T> - the difference.
+ * @throws std::string - invalid dimensions.
+ */
+template <typename T, typename = EagerElement<T>>
+BasicMatrix<T> operator-(const BasicMatrix<T> &matrix1, const BasicMatrix<T> &matrix2) {
+  if (matrix1.getWidth() != matrix2.getWidth() || matrix1.getHeight() != matrix2.getHeight()) {
+    throw(std::string("[Difference] ERROR: dimensions are not matching."));
+  }
+
+  double elements = static_cast<double>(matrix1.getWidth()) * matrix1.getHeight();
+  ProfileScope profile(ProfileSection::SUBTRACT, elements, 3 * sizeof(T) * elements);
+  BasicMatrix<T> difference(4, matrix1.getWidth(), matrix1.getHeight());
+  combineElements(matrix1.view(), matrix2.view(), difference.view(), true);
+  return difference;
+}
+
+
+/**
+ * Operator overloading for multiplication of matrices of an element type
+ * other than float. Dot products are accumulated in the type's accumulator;
+ * int8 matrices give an int32 product.
+ *
+ * @param matrix1 - the lhs matrix.
+ * @param matrix2 - the rhs matrix.
+ * @return BasicMatrix - the product.
+ * @throws std::string - invalid dimensions.
+ */
+template <typename T, typename = EagerElement<T>>
+BasicMatrix<typename ElementTraits<T>::Product> operator*(const BasicMatrix<T> &matrix1,
+                                                          const BasicMatrix<T> &matrix2) {
+  using Product = typename ElementTraits<T>::Product;
+  if (matrix1.getWidth() != matrix2.getHeight()) {
+    throw(std::string("[Product] ERROR: matrix 1's width does not match matrix 2's height."));
+  }
+
+  double m = matrix1.getHeight();
+  double n = matrix2.getWidth();
+  double k = matrix1.getWidth();
+  ProfileScope profile(ProfileSection::MULTIPLY, 2 * m * n * k,
+                       sizeof(T) * (m * k + k * n) + sizeof(Product) * m * n);
+  BasicMatrix<Product> product(5, matrix2.getWidth(), matrix1.getHeight());
+  multiplyElements(matrix1.view(), matrix2.view(), product.view());
+  return product;
+}
+
+
+/**
+ * Named matrices for batch mode (see matrix_batch.h).
+ */
+class BatchWorkspace {
+ public:
+  /**
+   * Stores a matrix whose storage was loaded elsewhere (e.g. a mapped file).
+   *
+   * @param name - the name.
+   * @param storage - the storage, which the workspace now owns.
+   */
+  void adopt(const std::string &name, const MatrixView &storage) {
+    _matrices.insert_or_assign(name, Matrix::adopt(0, storage));
+  }
+
+
+  /**
+   * Stores lhs + rhs under target.
+   *
+   * @param target - the result name.
+   * @param lhs - the left operand.
+   * @param rhs - the right operand.
+   * @throws std::string - unknown operand or invalid dimensions.
+   */
+  void add(const std::string &target, const std::string &lhs, const std::string &rhs) {
+    const Matrix &matrix1 = find(lhs);
+    const Matrix &matrix2 = find(rhs);
+    store(target, Matrix(matrix1 + matrix2));
+  }
+
+
+  /**
+   * Stores lhs - rhs under target.
+   *
+   * @param target - the result name.
+   * @param lhs - the left operand.
+   * @param rhs - the right operand.
+   * @throws std::string - unknown operand or invalid dimensions.
+   */
+  void subtract(const std::string &target, const std::string &lhs, const std::string &rhs) {
+    const Matrix &matrix1 = find(lhs);
+    const Matrix &matrix2 = find(rhs);
+    store(target, Matrix(matrix1 - matrix2));
+  }
+
+
+  /**
+   * Stores op(lhs) * op(rhs) under target.
+   *
+   * @param target - the result name.
+   * @param lhs - the left operand.
+   * @param rhs - the right operand.
+   * @param transposeLhs - whether lhs is used transposed.
+   * @param transposeRhs - whether rhs is used transposed.
+   * @throws std::string - unknown operand or invalid dimensions.
+   */
+  void multiply(const std::string &target, const std::string &lhs, const std::string &rhs,
+                Transpose transposeLhs, Transpose transposeRhs) {
+    const Matrix &matrix1 = find(lhs);
+    const Matrix &matrix2 = find(rhs);
+    bool transposed1 = transposeLhs == Transpose::TRANSPOSED;
+    bool transposed2 = transposeRhs == Transpose::TRANSPOSED;
+    if (transposed1 && transposed2) {
+      store(target, Matrix(::transpose(matrix1) * ::transpose(matrix2)));
+    } else if (transposed1) {
+      store(target, Matrix(::transpose(matrix1) * matrix2));
+    } else if (transposed2) {
+      store(target, Matrix(matrix1 * ::transpose(matrix2)));
+    } else {
+      store(target, Matrix(matrix1 * matrix2));
+    }
+  }
+
+
+  /**
+   * Stores source^T under target.
+   *
+   * @param target - the result name.
+   * @param source - the operand.
+   * @throws std::string - unknown operand.
+   */
+  void transpose(const std::string &target, const std::string &source) {
+    store(target, Matrix(::transpose(find(source))));
+  }
+
+
+  /**
+   * Retrieves a view of a stored matrix.
+   *
+   * @param name - the name.
+   * @return MatrixView - the view.
+   * @throws std::string - unknown name.
+   */
+  MatrixView view(const std::string &name) {
+    return find(name).view();
+  }
+
+
+  /**
+   * Checks whether a matrix is stored under a name.
+   *
+   * @param name - the name.
+   * @return bool - whether it is.
+   */
+  bool contains(const std::string &name) const {
+    return _matrices.count(name) > 0;
+  }
+
+
+  /**
+   * Releases a stored matrix.
+   *
+   * @param name - the name.
+   * @throws std::string - unknown name.
+   */
+  void release(const std::string &name) {
+    if (_matrices.erase(name) == 0) {
+      throw(std::string("[Batch] ERROR: no matrix named \"" + name + "\"."));
+    }
+  }
+
+
+ private:
+  std::unordered_map<std::string, Matrix> _matrices;
+
+
+  /**
+   * Looks up a stored matrix.
+   *
+   * @param name - the name.
+   * @return Matrix& - the matrix.
+   * @throws std::string - unknown name.
+   */
+  Matrix &find(const std::string &name) {
+    auto found = _matrices.find(name);
+    if (found == _matrices.end()) {
+      throw(std::string("[Batch] ERROR: no matrix named \"" + name + "\"."));
+    }
+    return found->second;
+  }
+
+
+  /**
+   * Stores a result, replacing any previous matrix of that name.
+   *
+   * @param name - the name.
+   * @param matrix - the result.
+   */
+  void store(const std::string &name, Matrix &&matrix) {
+    _matrices.insert_or_assign(name, std::move(matrix));
+  }
+};
+
+
+/**
+ * Benchmark subject (see matrix_benchmark.h): operands and results are
+ * Matrix objects combined with the overloaded operators.
+ */
+class BenchmarkSubject {
+ public:
+  /**
+   * Creates and fills the operands of a case.
+   *
+   * @param operation - the operation.
+   * @param shape - the shape.
+   */
+  void setUp(BenchmarkOperation operation, const BenchmarkShape &shape) {
+    _operation = operation;
+    bool product = operation == BenchmarkOperation::MULTIPLY;
+    _matrix1 = std::make_unique<Matrix>(1, product ? shape.k : shape.n, shape.m);
+    _matrix2 = std::make_unique<Matrix>(2, shape.n, product ? shape.k : shape.m);
+    fillBenchmarkMatrix(_matrix1->view(), 1);
+    fillBenchmarkMatrix(_matrix2->view(), 2);
+  }
+
+
+  /**
+   * Carries out the operation once, like the menu does.
+   *
+   * @return float - the first element of the result.
+   */
+  float run() {
+    RequestAllocatorScope requestScope;
+    if (_operation == BenchmarkOperation::ADD) {
+      return firstElement(*_matrix1 + *_matrix2);
+    } else if (_operation == BenchmarkOperation::SUBTRACT) {
+      return firstElement(*_matrix1 - *_matrix2);
     }
-    return os << output;
+    return firstElement(*_matrix1 * *_matrix2);
+  }
+
+
+  /**
+   * Frees the operands.
+   */
+  void tearDown() {
+    _matrix1.reset();
+    _matrix2.reset();
+  }
+
+
+ private:
+  BenchmarkOperation _operation = BenchmarkOperation::ADD;
+  std::unique_ptr<Matrix> _matrix1;
+  std::unique_ptr<Matrix> _matrix2;
+
+
+  /**
+   * Retrieves the first element of a result.
+   *
+   * @param result - the result, evaluated into a new Matrix.
+   * @return float - its first element.
+   */
+  static float firstElement(const Matrix &result) {
+    return result.view().row(0)[0];
   }
 };
 
 
-int main(void) {
-  std::cout << "[ Class Matrix Calculator ]" << std::endl;
+int main(int argc, char* argv[]) {
+  // Convert a matrix file between the text and binary formats.
+  if (argc == 4 && std::strcmp(argv[1], "--convert") == 0) {
+    return convertMatrixFile(argv[2], argv[3]);
+  }
+
+  // Multiply binary matrix files too large for memory, a tile at a time.
+  if (argc == 5 && std::strcmp(argv[1], "--multiply") == 0) {
+    return multiplyMatrixFiles(argv[2], argv[3], argv[4]);
+  }
+
+  // Benchmark add, subtract and multiply; optionally save the results as JSON.
+  if ((argc == 2 || argc == 3) && std::strcmp(argv[1], "--benchmark") == 0) {
+    BenchmarkSubject subject;
+    return runBenchmarks("class", subject, argc == 3 ? argv[2] : nullptr);
+  }
+
+  // Batch mode: run a job file (or standard input with "-") without prompts.
+  if (argc == 3 && std::strcmp(argv[1], "--batch") == 0) {
+    BatchWorkspace workspace;
+    int status = runBatchFile(argv[2], workspace, outputFormat(FIXED_FORMAT));
+    reportAllocatorStats(std::cerr);
+    reportResultCacheStats(std::cerr);
+    return status;
+  }
+
+  // Interactive mode on matrices of the element type picked by MATRIX_ELEMENT.
+  switch (elementTypeSetting()) {
+    case ElementType::DOUBLE:
+      return runCalculator<double>();
+    case ElementType::FLOAT16:
+      return runCalculator<Half>();
+    case ElementType::BFLOAT16:
+      return runCalculator<BFloat16>();
+    case ElementType::INT8:
+      return runCalculator<int8_t>();
+    default:
+      return runCalculator<float>();
+  }
+}
+
+
+/**
+ * Runs the interactive calculator on matrices of T.
+ *
+ * @return int - the exit status.
+ */
+template <typename T>
+int runCalculator() {
+  if (std::is_same<T, float>::value) {
+    std::cout << "[ Class Matrix Calculator ]" << std::endl;
+  } else {
+    std::cout << "[ Class Matrix Calculator (" << ElementTraits<T>::NAME << ") ]" << std::endl;
+  }
 
   // Get dimensions and create matrix.
-  Matrix matrix1 = Matrix(1);
-  Matrix matrix2 = Matrix(2);
+  BasicMatrix<T> matrix1 = BasicMatrix<T>(1);
+  BasicMatrix<T> matrix2 = BasicMatrix<T>(2);
 
   // Get values for matrix 1.
   std::cout << std::endl;
@@ -270,6 +924,10 @@ int main(void) {
   std::cout << "----- Matrix " << std::to_string(matrix2.getID()) << " -----\n";
   std::cout << matrix2;
 
+  // Content hashes key the cached results until a matrix changes.
+  uint64_t hash1 = hashMatrix(matrix1.view());
+  uint64_t hash2 = hashMatrix(matrix2.view());
+
   bool exit = false;
   int choice = 0;
   do {
@@ -277,36 +935,53 @@ int main(void) {
     std::cout << std::endl;
     printMenu();
     std::cout << "Input: ";
-    std::cin >> choice;
+    choice = readMenuChoice(10);
 
     // Process choice.
     std::cout << std::endl;
     switch (choice) {
       case 1: {  // Calculate and print sum.
+        // Results only live for this request; recycle their buffers.
+        RequestAllocatorScope requestScope;
         try {
-          Matrix sum = matrix1 + matrix2;
-          std::cout << "[[[ Sum ]]]" << std::endl;
-          std::cout << sum;
+          ResultKey key = resultKey(CachedOperation::SUM, matrix1.view(), hash1, matrix2.view(), hash2);
+          if (!printCachedResult<T>("Sum", key)) {
+            BasicMatrix<T> sum = matrix1 + matrix2;
+            resultCache().insert(key, sum.view());
+            std::cout << "[[[ Sum ]]]\n";
+            std::cout << sum;
+          }
         } catch (std::string errorMessage) {
           std::cout << errorMessage << std::endl;
         }
         break;
       }
       case 2: {  // Calculate and print difference.
+        RequestAllocatorScope requestScope;
         try {
-          Matrix difference = matrix1 - matrix2;
-          std::cout << "[[[ Difference ]]]" << std::endl;
-          std::cout << difference;
+          ResultKey key = resultKey(CachedOperation::DIFFERENCE, matrix1.view(), hash1, matrix2.view(), hash2);
+          if (!printCachedResult<T>("Difference", key)) {
+            BasicMatrix<T> difference = matrix1 - matrix2;
+            resultCache().insert(key, difference.view());
+            std::cout << "[[[ Difference ]]]\n";
+            std::cout << difference;
+          }
         } catch (std::string errorMessage) {
           std::cout << errorMessage << std::endl;
         }
         break;
       }
       case 3: {  // Calculate and print product.
+        RequestAllocatorScope requestScope;
         try {
-          Matrix product = matrix1 * matrix2;
-          std::cout << "[[[ Product ]]]" << std::endl;
-          std::cout << product;
+          using Product = typename ElementTraits<T>::Product;
+          ResultKey key = resultKey(CachedOperation::PRODUCT, matrix1.view(), hash1, matrix2.view(), hash2);
+          if (!printCachedResult<Product>("Product", key)) {
+            BasicMatrix<Product> product = matrix1 * matrix2;
+            resultCache().insert(key, product.view());
+            std::cout << "[[[ Product ]]]\n";
+            std::cout << product;
+          }
         } catch (std::string errorMessage) {
           std::cout << errorMessage << std::endl;
         }
@@ -323,20 +998,48 @@ int main(void) {
         break;
       }
       case 6: {  // Re-input matrix 1.
+        resultCache().invalidate(hash1);
         matrix1.getDimensions();
         matrix1.getMatrixValues();
+        hash1 = hashMatrix(matrix1.view());
         std::cout << "----- Matrix " << std::to_string(matrix1.getID()) << " -----\n";
         std::cout << matrix1;
         break;
       }
       case 7: {  // Re-input matrix 2.
+        resultCache().invalidate(hash2);
         matrix2.getDimensions();
         matrix2.getMatrixValues();
+        hash2 = hashMatrix(matrix2.view());
         std::cout << "----- Matrix " << std::to_string(matrix2.getID()) << " -----\n";
         std::cout << matrix2;
         break;
       }
-      case 8: {  // Exit program.
+      case 8: {  // Update matrix 1.
+        DirtyRegion<T> dirty(matrix1.view());
+        matrix1.updateMatrixValues(dirty);
+        if (!dirty.empty()) {
+          uint64_t oldHash = hash1;
+          hash1 = hashMatrix(matrix1.view());
+          patchCachedResults(dirty, true, matrix1.view(), hash1, matrix2.view(), hash2, oldHash);
+        }
+        std::cout << "----- Matrix " << std::to_string(matrix1.getID()) << " -----\n";
+        std::cout << matrix1;
+        break;
+      }
+      case 9: {  // Update matrix 2.
+        DirtyRegion<T> dirty(matrix2.view());
+        matrix2.updateMatrixValues(dirty);
+        if (!dirty.empty()) {
+          uint64_t oldHash = hash2;
+          hash2 = hashMatrix(matrix2.view());
+          patchCachedResults(dirty, false, matrix1.view(), hash1, matrix2.view(), hash2, oldHash);
+        }
+        std::cout << "----- Matrix " << std::to_string(matrix2.getID()) << " -----\n";
+        std::cout << matrix2;
+        break;
+      }
+      case 10: {  // Exit program.
         exit = true;
         break;
       }
@@ -345,11 +1048,32 @@ int main(void) {
 
   // User exited; unallocate matrices.
   std::cout << "Goodbye!" << std::endl;
+  reportAllocatorStats(std::cerr);
+  reportResultCacheStats(std::cerr);
 
   return 0;
 }
 
 
+/**
+ * Prints a result computed earlier from the same operands, if it is cached.
+ *
+ * @param title - the name of the result, e.g. "Sum".
+ * @param key - the operation and its operands.
+ * @return bool - whether the result was cached and printed.
+ */
+template <typename R>
+bool printCachedResult(const char* title, const ResultKey &key) {
+  BasicMatrixView<R> cached = resultCache().find<R>(key);
+  if (cached.data == nullptr) {
+    return false;
+  }
+  std::cout << "[[[ " << title << " ]]]\n";
+  writeMatrix(std::cout, cached, outputFormat(FIXED_FORMAT));
+  return true;
+}
+
+
 /**
  * Prints the menu.
  */
@@ -362,5 +1086,7 @@ void printMenu() {
   std::cout << "[5] Print Matrix 2" << std::endl;
   std::cout << "[6] Re-input Matrix 1" << std::endl;
   std::cout << "[7] Re-input Matrix 2" << std::endl;
-  std::cout << "[8] Exit" << std::endl;
+  std::cout << "[8] Update Matrix 1" << std::endl;
+  std::cout << "[9] Update Matrix 2" << std::endl;
+  std::cout << "[10] Exit" << std::endl;
 }
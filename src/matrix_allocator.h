@@ -0,0 +1,525 @@
+/**
+ * matrix_allocator.h
+ * Pluggable allocators for matrix buffers.
+ * - SystemAllocator: straight to the heap, or mmap for huge blocks.
+ * - PoolAllocator: power-of-two size classes with free lists, so result
+ *   buffers of recurring shapes are recycled instead of going back to malloc.
+ * - ArenaAllocator: bump allocation for the results of one request, all
+ *   released at once when the request ends (see RequestAllocatorScope).
+ * Every allocator counts hits (served from memory it already held), misses
+ * (had to ask the system) and the bytes it holds.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_ALLOCATOR_H_
+#define MATRIX_ALLOCATOR_H_
+
+#include <sys/mman.h>
+
+#include <cstddef>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+// Byte alignment of every block handed out.
+const size_t ALLOCATOR_ALIGNMENT = 64;
+
+// Blocks at least this large are mmap'd instead of taken from the heap.
+const size_t MATRIX_MMAP_THRESHOLD = size_t(32) << 20;
+
+// Pool size classes run from 2^POOL_MIN_CLASS to 2^POOL_MAX_CLASS bytes.
+const int POOL_MIN_CLASS = 8;
+const int POOL_MAX_CLASS = 24;
+
+// Idle bytes a pool keeps before handing blocks back to the system.
+const size_t POOL_DEFAULT_CAPACITY = size_t(256) << 20;
+
+// Smallest chunk an arena requests from the system.
+const size_t ARENA_CHUNK_SIZE = size_t(1) << 20;
+
+
+/**
+ * Counters reported by every allocator.
+ */
+struct AllocatorStats {
+  size_t allocations = 0;
+  size_t deallocations = 0;
+  size_t hits = 0;          // Served from memory the allocator already held.
+  size_t misses = 0;        // Needed new memory from the system.
+  size_t bytesInUse = 0;    // Handed out and not yet returned.
+  size_t bytesHeld = 0;     // Kept by the allocator while idle.
+};
+
+
+/**
+ * Interface of an allocator for 64-byte aligned matrix blocks.
+ */
+class MatrixAllocator {
+ public:
+  virtual ~MatrixAllocator() = default;
+
+  /**
+   * Allocates an aligned block.
+   *
+   * @param bytes - the block size (a multiple of ALLOCATOR_ALIGNMENT).
+   * @return void* - the block.
+   * @throws std::bad_alloc - out of memory.
+   */
+  virtual void* allocate(size_t bytes) = 0;
+
+  /**
+   * Returns a block from allocate().
+   *
+   * @param block - the block.
+   * @param bytes - the size it was allocated with.
+   */
+  virtual void deallocate(void* block, size_t bytes) = 0;
+
+  /**
+   * Retrieves the allocator's counters.
+   *
+   * @return AllocatorStats - a snapshot of the counters.
+   */
+  virtual AllocatorStats stats() const = 0;
+
+  /**
+   * Retrieves the allocator's name.
+   *
+   * @return const char* - the name.
+   */
+  virtual const char* name() const = 0;
+};
+
+
+/**
+ * Gets blocks from the system: aligned heap memory, or mmap for huge blocks
+ * (with transparent huge pages requested).
+ */
+class SystemAllocator : public MatrixAllocator {
+ public:
+  void* allocate(size_t bytes) override {
+    void* block = nullptr;
+    if (bytes >= MATRIX_MMAP_THRESHOLD) {
+      block = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (block == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+#ifdef MADV_HUGEPAGE
+      madvise(block, bytes, MADV_HUGEPAGE);
+#endif
+    } else {
+      block = std::aligned_alloc(ALLOCATOR_ALIGNMENT, bytes);
+      if (block == nullptr) {
+        throw std::bad_alloc();
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    ++_stats.allocations;
+    ++_stats.misses;
+    _stats.bytesInUse += bytes;
+    return block;
+  }
+
+  void deallocate(void* block, size_t bytes) override {
+    if (bytes >= MATRIX_MMAP_THRESHOLD) {
+      munmap(block, bytes);
+    } else {
+      std::free(block);
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    ++_stats.deallocations;
+    _stats.bytesInUse -= bytes;
+  }
+
+  AllocatorStats stats() const override {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+  }
+
+  const char* name() const override {
+    return "system";
+  }
+
+ private:
+  mutable std::mutex _mutex;
+  AllocatorStats _stats;
+};
+
+
+/**
+ * Retrieves the process-wide system allocator.
+ *
+ * @return SystemAllocator& - the allocator.
+ */
+inline SystemAllocator &systemAllocator() {
+  static SystemAllocator allocator;
+  return allocator;
+}
+
+
+/**
+ * Size-class pool: requests are rounded up to a power of two and freed blocks
+ * wait on a free list for the next request of the same class. Blocks past the
+ * largest class go straight to the system allocator.
+ */
+class PoolAllocator : public MatrixAllocator {
+ public:
+  /**
+   * Constructor.
+   *
+   * @param capacity - the most idle bytes to keep on the free lists.
+   */
+  explicit PoolAllocator(size_t capacity = POOL_DEFAULT_CAPACITY) : _capacity(capacity) {
+    // Construct the system allocator first so it outlives this one at exit.
+    systemAllocator();
+  }
+
+  PoolAllocator(const PoolAllocator &) = delete;
+  PoolAllocator &operator=(const PoolAllocator &) = delete;
+
+  ~PoolAllocator() override {
+    trim();
+  }
+
+  void* allocate(size_t bytes) override {
+    int sizeClass = classOf(bytes);
+    if (sizeClass > POOL_MAX_CLASS) {
+      void* block = systemAllocator().allocate(bytes);
+      std::lock_guard<std::mutex> lock(_mutex);
+      ++_stats.allocations;
+      ++_stats.misses;
+      _stats.bytesInUse += bytes;
+      return block;
+    }
+
+    size_t classBytes = size_t(1) << sizeClass;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      ++_stats.allocations;
+      _stats.bytesInUse += classBytes;
+      std::vector<void*> &freeList = _freeLists[sizeClass - POOL_MIN_CLASS];
+      if (!freeList.empty()) {
+        void* block = freeList.back();
+        freeList.pop_back();
+        ++_stats.hits;
+        _stats.bytesHeld -= classBytes;
+        return block;
+      }
+      ++_stats.misses;
+    }
+    return systemAllocator().allocate(classBytes);
+  }
+
+  void deallocate(void* block, size_t bytes) override {
+    int sizeClass = classOf(bytes);
+    if (sizeClass > POOL_MAX_CLASS) {
+      systemAllocator().deallocate(block, bytes);
+      std::lock_guard<std::mutex> lock(_mutex);
+      ++_stats.deallocations;
+      _stats.bytesInUse -= bytes;
+      return;
+    }
+
+    size_t classBytes = size_t(1) << sizeClass;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      ++_stats.deallocations;
+      _stats.bytesInUse -= classBytes;
+      if (_stats.bytesHeld + classBytes <= _capacity) {
+        _freeLists[sizeClass - POOL_MIN_CLASS].push_back(block);
+        _stats.bytesHeld += classBytes;
+        return;
+      }
+    }
+    systemAllocator().deallocate(block, classBytes);
+  }
+
+  AllocatorStats stats() const override {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+  }
+
+  const char* name() const override {
+    return "pool";
+  }
+
+  /**
+   * Returns every idle block to the system.
+   */
+  void trim() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (int i = 0; i <= POOL_MAX_CLASS - POOL_MIN_CLASS; ++i) {
+      for (void* block : _freeLists[i]) {
+        systemAllocator().deallocate(block, size_t(1) << (i + POOL_MIN_CLASS));
+      }
+      _freeLists[i].clear();
+    }
+    _stats.bytesHeld = 0;
+  }
+
+ private:
+  mutable std::mutex _mutex;
+  size_t _capacity;
+  AllocatorStats _stats;
+  std::vector<void*> _freeLists[POOL_MAX_CLASS - POOL_MIN_CLASS + 1];
+
+  /**
+   * Finds the size class of a request.
+   *
+   * @param bytes - the request.
+   * @return int - log2 of the class size (may exceed POOL_MAX_CLASS).
+   */
+  static int classOf(size_t bytes) {
+    int sizeClass = POOL_MIN_CLASS;
+    while ((size_t(1) << sizeClass) < bytes) {
+      ++sizeClass;
+    }
+    return sizeClass;
+  }
+};
+
+
+/**
+ * Bump allocator for the results of one request.
+ * Blocks are carved out of large chunks and never freed one by one; reset()
+ * rewinds every chunk once all blocks are returned, so the next request reuses
+ * the same memory.
+ */
+class ArenaAllocator : public MatrixAllocator {
+ public:
+  ArenaAllocator() {
+    systemAllocator();
+  }
+
+  ArenaAllocator(const ArenaAllocator &) = delete;
+  ArenaAllocator &operator=(const ArenaAllocator &) = delete;
+
+  ~ArenaAllocator() override {
+    for (Chunk &chunk : _chunks) {
+      systemAllocator().deallocate(chunk.data, chunk.size);
+    }
+  }
+
+  void* allocate(size_t bytes) override {
+    std::lock_guard<std::mutex> lock(_mutex);
+    ++_stats.allocations;
+    ++_live;
+    _stats.bytesInUse += bytes;
+
+    // First chunk (from the current one on) with room left.
+    for (; _current < _chunks.size(); ++_current) {
+      Chunk &chunk = _chunks[_current];
+      if (chunk.size - chunk.used >= bytes) {
+        void* block = chunk.data + chunk.used;
+        chunk.used += bytes;
+        ++_stats.hits;
+        return block;
+      }
+    }
+
+    size_t size = bytes > ARENA_CHUNK_SIZE ? bytes : ARENA_CHUNK_SIZE;
+    Chunk chunk = {static_cast<char*>(systemAllocator().allocate(size)), size, bytes};
+    _chunks.push_back(chunk);
+    _current = _chunks.size() - 1;
+    ++_stats.misses;
+    _stats.bytesHeld += size;
+    return chunk.data;
+  }
+
+  void deallocate(void*, size_t bytes) override {
+    std::lock_guard<std::mutex> lock(_mutex);
+    ++_stats.deallocations;
+    --_live;
+    _stats.bytesInUse -= bytes;
+  }
+
+  AllocatorStats stats() const override {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+  }
+
+  const char* name() const override {
+    return "arena";
+  }
+
+  /**
+   * Rewinds every chunk if no block is still in use.
+   *
+   * @return bool - whether the arena was rewound.
+   */
+  bool reset() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_live != 0) {
+      return false;
+    }
+    for (Chunk &chunk : _chunks) {
+      chunk.used = 0;
+    }
+    _current = 0;
+    return true;
+  }
+
+ private:
+  struct Chunk {
+    char* data;
+    size_t size;
+    size_t used;
+  };
+
+  mutable std::mutex _mutex;
+  AllocatorStats _stats;
+  std::vector<Chunk> _chunks;
+  size_t _current = 0;
+  size_t _live = 0;
+};
+
+
+/**
+ * Retrieves the process-wide allocator for long-lived matrices.
+ * MATRIX_ALLOCATOR=system picks the system allocator, anything else the pool.
+ *
+ * @return MatrixAllocator* - the allocator.
+ */
+inline MatrixAllocator* persistentMatrixAllocator() {
+  static PoolAllocator pool;
+  static MatrixAllocator* allocator = [] {
+    const char* env = std::getenv("MATRIX_ALLOCATOR");
+    if (env != nullptr && std::string(env) == "system") {
+      return static_cast<MatrixAllocator*>(&systemAllocator());
+    }
+    return static_cast<MatrixAllocator*>(&pool);
+  }();
+  return allocator;
+}
+
+
+/**
+ * Retrieves the mutable allocator used for new matrices on this thread.
+ * MATRIX_ALLOCATOR=system|pool|arena picks the default (pool); with arena,
+ * long-lived matrices come from the pool and each request's results from
+ * the request arena. The choice is per thread, so the batch stages can
+ * switch it independently; a block is always freed by the allocator it
+ * came from, whichever thread frees it.
+ *
+ * @return MatrixAllocator*& - the allocator.
+ */
+inline MatrixAllocator* &currentMatrixAllocator() {
+  static thread_local MatrixAllocator* allocator = persistentMatrixAllocator();
+  return allocator;
+}
+
+
+/**
+ * Retrieves the process-wide request arena.
+ *
+ * @return ArenaAllocator& - the arena.
+ */
+inline ArenaAllocator &requestArena() {
+  static ArenaAllocator arena;
+  return arena;
+}
+
+
+/**
+ * Retrieves whether requests should allocate their results from the arena.
+ *
+ * @return bool - whether MATRIX_ALLOCATOR=arena.
+ */
+inline bool requestArenaEnabled() {
+  static bool enabled = [] {
+    const char* env = std::getenv("MATRIX_ALLOCATOR");
+    return env != nullptr && std::string(env) == "arena";
+  }();
+  return enabled;
+}
+
+
+/**
+ * Routes new matrices made on this thread to the request arena for the
+ * lifetime of the scope and rewinds the arena afterwards. Does nothing unless MATRIX_ALLOCATOR=arena.
+ * Declare it before the result matrices so they are destroyed first.
+ */
+class RequestAllocatorScope {
+ public:
+  RequestAllocatorScope() : _previous(currentMatrixAllocator()), _active(requestArenaEnabled()) {
+    if (_active) {
+      currentMatrixAllocator() = &requestArena();
+    }
+  }
+
+  RequestAllocatorScope(const RequestAllocatorScope &) = delete;
+  RequestAllocatorScope &operator=(const RequestAllocatorScope &) = delete;
+
+  ~RequestAllocatorScope() {
+    if (_active) {
+      currentMatrixAllocator() = _previous;
+      requestArena().reset();
+    }
+  }
+
+ private:
+  MatrixAllocator* _previous;
+  bool _active;
+};
+
+
+/**
+ * Routes new matrices made on this thread to the long-lived allocator for the
+ * lifetime of the scope, for storage that outlives the request it is made in (e.g. cached results).
+ */
+class PersistentAllocatorScope {
+ public:
+  PersistentAllocatorScope() : _previous(currentMatrixAllocator()) {
+    currentMatrixAllocator() = persistentMatrixAllocator();
+  }
+
+  PersistentAllocatorScope(const PersistentAllocatorScope &) = delete;
+  PersistentAllocatorScope &operator=(const PersistentAllocatorScope &) = delete;
+
+  ~PersistentAllocatorScope() {
+    currentMatrixAllocator() = _previous;
+  }
+
+ private:
+  MatrixAllocator* _previous;
+};
+
+
+/**
+ * Prints the counters of an allocator.
+ *
+ * @param os - the output stream.
+ * @param allocator - the allocator.
+ */
+inline void printAllocatorStats(std::ostream &os, const MatrixAllocator &allocator) {
+  AllocatorStats stats = allocator.stats();
+  os << "[" << allocator.name() << " allocator] allocations: " << stats.allocations
+     << ", hits: " << stats.hits << ", misses: " << stats.misses
+     << ", bytes in use: " << stats.bytesInUse << ", bytes held: " << stats.bytesHeld << "\n";
+}
+
+
+/**
+ * Prints the counters of the allocators in use when MATRIX_ALLOCATOR_STATS=1.
+ *
+ * @param os - the output stream.
+ */
+inline void reportAllocatorStats(std::ostream &os) {
+  const char* env = std::getenv("MATRIX_ALLOCATOR_STATS");
+  if (env == nullptr || std::string(env) != "1") {
+    return;
+  }
+  printAllocatorStats(os, *currentMatrixAllocator());
+  if (requestArenaEnabled()) {
+    printAllocatorStats(os, requestArena());
+  }
+}
+
+#endif  // MATRIX_ALLOCATOR_H_
@@ -0,0 +1,1187 @@
+/**
+ * matrix_batch.h
+ * Non-interactive batch mode shared by the calculators.
+ * A job stream (a file, or standard input with "-") holds one command per line:
+ *   load NAME PATH      reads "width height values..." from PATH ("-" = inline),
+ *                       maps PATH if it is a binary matrix file, or reads a
+ *                       Matrix Market coordinate file
+ *   add|sub|mul C A B   C = A + B, A - B or A * B; a mul operand written
+ *                       A^T is used transposed without being copied
+ *   transpose C A       C = A^T
+ *   chain C N A1..AN    C = A1 * A2 * ... * AN in the cheapest order (see
+ *                       matrix_chain.h); operands may be written A^T, and
+ *                       the planned and left-to-right FLOPs go to stderr
+ *   mulfile C A B       multiplies the binary matrix files A and B into the
+ *                       file C without loading them (see MATRIX_MEMORY_BUDGET)
+ *   set NAME R C N V..  overwrites N elements of NAME from row R, column C on
+ *                       (counting from 1) with the N values; cached results
+ *                       made from NAME are patched (see matrix_incremental.h)
+ *   print NAME          writes the matrix to standard output
+ *   save NAME PATH      writes "width height" and the matrix to PATH, a binary
+ *                       matrix file if PATH ends in .mtx, or a Matrix Market
+ *                       file if it ends in .mm
+ *   free NAME           releases the matrix
+ * Text after # is a comment. Named matrices stay resident between jobs.
+ * Jobs run through a pipeline (see matrix_pipeline.h): the next jobs and
+ * their input files are parsed, and earlier results printed or saved, while
+ * the current job computes. A file is only read once every earlier job that
+ * writes it (save, mulfile) is done. Sums, differences and products of dense
+ * matrices are looked up in the result cache (see matrix_cache.h) first.
+ * Each calculator supplies a workspace that stores matrices its own way;
+ * matrices at or below the density threshold are kept compressed instead
+ * (see matrix_sparse.h), and jobs on them only visit their nonzeros.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_BATCH_H_
+#define MATRIX_BATCH_H_
+
+#include <algorithm>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "matrix_binary.h"
+#include "matrix_cache.h"
+#include "matrix_chain.h"
+#include "matrix_format.h"
+#include "matrix_gemm.h"
+#include "matrix_incremental.h"
+#include "matrix_instrumentation.h"
+#include "matrix_out_of_core.h"
+#include "matrix_parser.h"
+#include "matrix_pipeline.h"
+#include "matrix_sparse.h"
+#include "matrix_storage.h"
+#include "matrix_transpose.h"
+
+
+/**
+ * Commands a job stream may contain.
+ */
+enum class BatchCommand {
+  LOAD,
+  ADD,
+  SUBTRACT,
+  MULTIPLY,
+  MULTIPLY_FILES,
+  CHAIN,
+  TRANSPOSE,
+  SET,
+  PRINT,
+  SAVE,
+  FREE
+};
+
+
+struct BatchJob {
+  BatchCommand command;
+  std::string target;   // The matrix (or file, MULTIPLY_FILES) created, printed, saved or freed.
+  std::string lhs;      // Left operand (ADD, SUBTRACT, MULTIPLY, MULTIPLY_FILES, TRANSPOSE).
+  std::string rhs;      // Right operand (ADD, SUBTRACT, MULTIPLY, MULTIPLY_FILES).
+  Transpose transposeLhs;  // How MULTIPLY reads the left operand.
+  Transpose transposeRhs;  // How MULTIPLY reads the right operand.
+  std::vector<std::string> factors;       // Operands of CHAIN, in order.
+  std::vector<Transpose> transposeFactors;  // How CHAIN reads each operand.
+  std::string path;     // File (LOAD, SAVE).
+  long row;             // First element SET overwrites (from 1).
+  long column;
+  std::vector<float> values;  // New values of SET.
+  size_t line;          // Line of the command in the job stream.
+};
+
+
+/**
+ * Reads one required word of a job.
+ *
+ * @param jobs - the job stream.
+ * @param word - receives the word.
+ * @param what - what the word is, for the error.
+ * @throws std::string - the stream ended.
+ */
+inline void readJobWord(MatrixTextReader &jobs, std::string* word, const char* what) {
+  if (jobs.readWord(word) != ReadStatus::OK) {
+    throw(std::string("[Batch] ERROR: missing ") + what + ".");
+  }
+}
+
+
+/**
+ * Strips the ^T suffix from a product operand.
+ *
+ * @param name - the operand; the suffix is removed.
+ * @return Transpose - TRANSPOSED if the suffix was there.
+ */
+inline Transpose stripTransposeSuffix(std::string* name) {
+  if (name->size() > 2 && name->compare(name->size() - 2, 2, "^T") == 0) {
+    name->resize(name->size() - 2);
+    return Transpose::TRANSPOSED;
+  }
+  return Transpose::NONE;
+}
+
+
+/**
+ * Reads the next job.
+ *
+ * @param jobs - the job stream.
+ * @param job - receives the job.
+ * @return bool - whether a job was read (false at end of the stream).
+ * @throws std::string - unknown command or missing arguments.
+ */
+inline bool readBatchJob(MatrixTextReader &jobs, BatchJob* job) {
+  std::string command;
+  while (true) {
+    if (jobs.readWord(&command) != ReadStatus::OK) {
+      return false;
+    }
+    if (command[0] != '#') {
+      break;
+    }
+    jobs.skipLine();
+  }
+
+  job->line = jobs.line();
+  if (command == "load" || command == "save") {
+    job->command = command == "load" ? BatchCommand::LOAD : BatchCommand::SAVE;
+    readJobWord(jobs, &job->target, "matrix name");
+    readJobWord(jobs, &job->path, "path");
+  } else if (command == "add" || command == "sub" || command == "mul") {
+    job->command = command == "add" ? BatchCommand::ADD
+                   : command == "sub" ? BatchCommand::SUBTRACT : BatchCommand::MULTIPLY;
+    readJobWord(jobs, &job->target, "result name");
+    readJobWord(jobs, &job->lhs, "left operand");
+    readJobWord(jobs, &job->rhs, "right operand");
+    job->transposeLhs = Transpose::NONE;
+    job->transposeRhs = Transpose::NONE;
+    if (job->command == BatchCommand::MULTIPLY) {
+      job->transposeLhs = stripTransposeSuffix(&job->lhs);
+      job->transposeRhs = stripTransposeSuffix(&job->rhs);
+    }
+  } else if (command == "transpose") {
+    job->command = BatchCommand::TRANSPOSE;
+    readJobWord(jobs, &job->target, "result name");
+    readJobWord(jobs, &job->lhs, "operand");
+  } else if (command == "chain") {
+    job->command = BatchCommand::CHAIN;
+    readJobWord(jobs, &job->target, "result name");
+    long count = 0;
+    if (jobs.readLong(&count) != ReadStatus::OK || count < 1) {
+      jobs.skipLine();
+      throw(std::string("[Batch] ERROR: missing or invalid number of chain operands."));
+    }
+    job->factors.clear();
+    job->transposeFactors.clear();
+    std::string factor;
+    for (long i = 0; i < count; ++i) {
+      readJobWord(jobs, &factor, "chain operand");
+      job->transposeFactors.push_back(stripTransposeSuffix(&factor));
+      job->factors.push_back(factor);
+    }
+  } else if (command == "mulfile") {
+    job->command = BatchCommand::MULTIPLY_FILES;
+    readJobWord(jobs, &job->target, "result file");
+    readJobWord(jobs, &job->lhs, "left operand file");
+    readJobWord(jobs, &job->rhs, "right operand file");
+  } else if (command == "set") {
+    job->command = BatchCommand::SET;
+    readJobWord(jobs, &job->target, "matrix name");
+    long count = 0;
+    std::string error;
+    if (jobs.readLong(&job->row) != ReadStatus::OK || jobs.readLong(&job->column) != ReadStatus::OK
+        || jobs.readLong(&count) != ReadStatus::OK || !checkDimensions(count, 1, &error)) {
+      jobs.skipLine();
+      throw(std::string("[Batch] ERROR: missing or invalid position or number of values to set."));
+    }
+    job->values.resize(static_cast<size_t>(count));
+  } else if (command == "print" || command == "free") {
+    job->command = command == "print" ? BatchCommand::PRINT : BatchCommand::FREE;
+    readJobWord(jobs, &job->target, "matrix name");
+  } else {
+    jobs.skipLine();
+    throw(std::string("[Batch] ERROR: unknown command \"" + command + "\"."));
+  }
+  return true;
+}
+
+
+/**
+ * Reads the "width height" header of a matrix.
+ *
+ * @param input - the input.
+ * @param width - receives the width.
+ * @param height - receives the height.
+ * @throws std::string - malformed, missing or rejected by the dimension policy.
+ */
+inline void readMatrixHeader(MatrixTextReader &input, int* width, int* height) {
+  long dimensions[2] = {0, 0};
+  for (long &dimension : dimensions) {
+    ReadStatus status = input.readLong(&dimension);
+    if (status == ReadStatus::END) {
+      throw(std::string("[Batch] ERROR: missing matrix dimensions."));
+    } else if (status == ReadStatus::MALFORMED) {
+      throw(input.error());
+    }
+  }
+
+  std::string error;
+  if (!checkDimensions(dimensions[0], dimensions[1], &error)) {
+    throw(std::string("[Batch] ERROR: " + error + "."));
+  }
+  *width = static_cast<int>(dimensions[0]);
+  *height = static_cast<int>(dimensions[1]);
+}
+
+
+/**
+ * Fills a matrix from the input, rejecting malformed or missing values.
+ *
+ * @param input - the input.
+ * @param matrix - the matrix to fill.
+ * @throws std::string - malformed or missing values.
+ */
+inline void readMatrixBody(MatrixTextReader &input, const MatrixView &matrix) {
+  double bytes = sizeof(float) * static_cast<double>(matrix.width) * matrix.height;
+  ProfileScope profile(ProfileSection::PARSE, 0, bytes);
+  for (int i = 0; i < matrix.height; ++i) {
+    float* row = matrix.row(i);
+    for (int j = 0; j < matrix.width; ++j) {
+      ReadStatus status = input.readFloat(row + j);
+      if (status == ReadStatus::END) {
+        long expected = static_cast<long>(matrix.width) * matrix.height;
+        long read = static_cast<long>(i) * matrix.width + j;
+        throw(std::string("[Batch] ERROR: expected " + std::to_string(expected)
+                          + " values, input ended after " + std::to_string(read) + "."));
+      } else if (status == ReadStatus::MALFORMED) {
+        throw(input.error());
+      }
+    }
+  }
+}
+
+
+/**
+ * Writes a matrix to a file in the format "load" reads.
+ * Values are written with the fewest digits that read back exactly, unless
+ * MATRIX_PRECISION says otherwise.
+ *
+ * @param path - the file.
+ * @param matrix - the matrix.
+ * @throws std::string - the file cannot be written.
+ */
+inline void saveMatrix(const std::string &path, const MatrixView &matrix) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    throw(std::string("[Batch] ERROR: cannot write \"" + path + "\"."));
+  }
+  file << matrix.width << " " << matrix.height << "\n";
+  writeMatrix(file, matrix, outputFormat(NumberFormat{FloatStyle::SHORTEST, 0}));
+  if (!file) {
+    throw(std::string("[Batch] ERROR: failed writing \"" + path + "\"."));
+  }
+}
+
+
+/**
+ * Checks whether a path names a binary matrix file.
+ *
+ * @param path - the path.
+ * @return bool - whether it ends in MATRIX_FILE_EXTENSION.
+ */
+inline bool hasBinaryExtension(const std::string &path) {
+  size_t length = std::strlen(MATRIX_FILE_EXTENSION);
+  return path.size() >= length && path.compare(path.size() - length, length, MATRIX_FILE_EXTENSION) == 0;
+}
+
+
+/**
+ * Checks whether a path names a Matrix Market file to write.
+ *
+ * @param path - the path.
+ * @return bool - whether it ends in .mm.
+ */
+inline bool hasMatrixMarketExtension(const std::string &path) {
+  return path.size() >= 3 && path.compare(path.size() - 3, 3, ".mm") == 0;
+}
+
+
+/**
+ * Dense storage that is freed when it goes out of scope unless released.
+ */
+class BatchScratch {
+ public:
+  BatchScratch() = default;
+  BatchScratch(const BatchScratch &) = delete;
+  BatchScratch &operator=(const BatchScratch &) = delete;
+
+  BatchScratch(BatchScratch &&scratch) noexcept : _view(scratch.release()) {}
+
+  BatchScratch &operator=(BatchScratch &&scratch) noexcept {
+    if (this != &scratch) {
+      freeMatrixData(_view.data);
+      _view = scratch.release();
+    }
+    return *this;
+  }
+
+  ~BatchScratch() {
+    freeMatrixData(_view.data);
+  }
+
+  /**
+   * Allocates the storage for a width x height matrix.
+   *
+   * @param width - the width.
+   * @param height - the height.
+   * @return MatrixView - the storage (stride paddedStride(width)).
+   */
+  MatrixView allocate(int width, int height) {
+    freeMatrixData(_view.data);
+    _view = MatrixView{nullptr, width, height, paddedStride(width)};
+    _view.data = allocateMatrixData(static_cast<size_t>(_view.stride) * height);
+    return _view;
+  }
+
+  /**
+   * Takes over storage, e.g. from loadMatrixBinary().
+   *
+   * @param storage - storage released with freeMatrixData().
+   */
+  void adopt(const MatrixView &storage) {
+    freeMatrixData(_view.data);
+    _view = storage;
+  }
+
+  /**
+   * Retrieves the storage.
+   *
+   * @return const MatrixView& - the storage (no data if there is none).
+   */
+  const MatrixView &view() const {
+    return _view;
+  }
+
+  /**
+   * Hands the storage over to the caller.
+   *
+   * @return MatrixView - the storage, which the caller now owns.
+   */
+  MatrixView release() {
+    MatrixView view = _view;
+    _view = MatrixView{nullptr, 0, 0, 0};
+    return view;
+  }
+
+ private:
+  MatrixView _view = MatrixView{nullptr, 0, 0, 0};
+};
+
+
+/**
+ * The matrices of a job stream: dense ones live in the calculator's workspace,
+ * those at or below the density threshold are kept here as sparse matrices.
+ */
+template <typename Workspace>
+class BatchMatrices {
+ public:
+  explicit BatchMatrices(Workspace &workspace) : _workspace(workspace) {}
+
+
+  /**
+   * Stores a sparse matrix, expanded into the workspace if it is too dense.
+   *
+   * @param name - the name.
+   * @param matrix - the matrix.
+   */
+  void storeSparse(const std::string &name, SparseMatrix &&matrix) {
+    if (!isSparseEnough(matrix)) {
+      BatchScratch scratch;
+      matrix.toDense(scratch.allocate(matrix.getWidth(), matrix.getHeight()));
+      storeDense(name, scratch);
+      return;
+    }
+    if (_workspace.contains(name)) {
+      _workspace.release(name);
+    }
+    _sparse.insert_or_assign(name, std::move(matrix));
+    _hashes.erase(name);
+  }
+
+
+  /**
+   * Stores a dense result in the workspace.
+   *
+   * @param name - the name.
+   * @param scratch - the result; the workspace takes it over.
+   */
+  void storeDense(const std::string &name, BatchScratch &scratch) {
+    _workspace.adopt(name, scratch.release());
+    _sparse.erase(name);
+    _hashes.erase(name);
+  }
+
+
+  /**
+   * Called after the workspace stored a dense matrix: drops any sparse matrix
+   * of that name, and moves the new one here if it is sparse enough.
+   *
+   * @param name - the name.
+   * @param compress - whether to check the density (loaded matrices).
+   */
+  void storedDense(const std::string &name, bool compress) {
+    _sparse.erase(name);
+    _hashes.erase(name);
+    if (compress && isSparseEnough(_workspace.view(name))) {
+      SparseMatrix matrix = SparseMatrix::fromDense(_workspace.view(name));
+      _workspace.release(name);
+      _sparse.insert_or_assign(name, std::move(matrix));
+    }
+  }
+
+
+  /**
+   * Retrieves a matrix as dense storage.
+   *
+   * @param name - the name.
+   * @param scratch - holds the expanded matrix if it is sparse.
+   * @return MatrixView - the matrix.
+   * @throws std::string - unknown name.
+   */
+  MatrixView view(const std::string &name, BatchScratch &scratch) {
+    auto found = _sparse.find(name);
+    if (found == _sparse.end()) {
+      return _workspace.view(name);
+    }
+    MatrixView view = scratch.allocate(found->second.getWidth(), found->second.getHeight());
+    found->second.toDense(view);
+    return view;
+  }
+
+
+  /**
+   * Copies a matrix out, so it can be written while later jobs change it.
+   *
+   * @param name - the name.
+   * @param scratch - receives the copy.
+   * @throws std::string - unknown name.
+   */
+  void copy(const std::string &name, BatchScratch &scratch) {
+    if (isSparse(name)) {
+      view(name, scratch);
+      return;
+    }
+    MatrixView matrix = _workspace.view(name);
+    MatrixView copy = scratch.allocate(matrix.width, matrix.height);
+    for (int i = 0; i < matrix.height; ++i) {
+      std::memcpy(copy.row(i), matrix.row(i), sizeof(float) * matrix.width);
+    }
+  }
+
+
+  /**
+   * Stores the cached result of a sum, difference or product of dense matrices, if any.
+   *
+   * @param job - the job.
+   * @param key - receives the key of the job's result, for keepResult().
+   * @return bool - whether the result was cached (and is now stored under job.target).
+   * @throws std::string - unknown operand.
+   */
+  bool findResult(const BatchJob &job, ResultKey* key) {
+    CachedOperation operation = job.command == BatchCommand::ADD ? CachedOperation::SUM
+                                : job.command == BatchCommand::SUBTRACT ? CachedOperation::DIFFERENCE
+                                : CachedOperation::PRODUCT;
+    MatrixView lhs = _workspace.view(job.lhs);
+    MatrixView rhs = _workspace.view(job.rhs);
+    *key = resultKey(operation, lhs, contentHash(job.lhs), rhs, contentHash(job.rhs), job.transposeLhs,
+                     job.transposeRhs);
+    MatrixView cached = resultCache().find<float>(*key);
+    if (cached.data == nullptr) {
+      return false;
+    }
+    BatchScratch scratch;
+    MatrixView copy = scratch.allocate(cached.width, cached.height);
+    for (int i = 0; i < cached.height; ++i) {
+      std::memcpy(copy.row(i), cached.row(i), sizeof(float) * cached.width);
+    }
+    storeDense(job.target, scratch);
+    return true;
+  }
+
+
+  /**
+   * Keeps a copy of a job's result in the result cache.
+   *
+   * @param key - the key from findResult().
+   * @param name - where the result is stored.
+   */
+  void keepResult(const ResultKey &key, const std::string &name) {
+    resultCache().insert(key, _workspace.view(name));
+  }
+
+
+  /**
+   * Overwrites a run of elements of a matrix (SET). Cached results made from
+   * its old contents are patched and kept under its new contents, as long as
+   * their other operand is still loaded unchanged.
+   *
+   * @param job - the job.
+   * @throws std::string - unknown name, or elements outside the matrix.
+   */
+  void update(const BatchJob &job) {
+    auto index = [](long number) {
+      return static_cast<int>(std::clamp<long>(number, 0, INT_MAX)) - 1;
+    };
+    int count = static_cast<int>(job.values.size());
+    if (isSparse(job.target)) {
+      BatchScratch scratch;
+      MatrixView matrix = view(job.target, scratch);
+      DirtyRegion<float> dirty(matrix);
+      dirty.set(index(job.row), index(job.column), job.values.data(), count);
+      storeSparse(job.target, SparseMatrix::fromDense(matrix));
+      return;
+    }
+
+    MatrixView matrix = _workspace.view(job.target);
+    DirtyRegion<float> dirty(matrix);
+    dirty.set(index(job.row), index(job.column), job.values.data(), count);
+    auto known = _hashes.find(job.target);
+    if (dirty.empty() || known == _hashes.end()) {
+      return;
+    }
+    uint64_t oldHash = known->second;
+    _hashes.erase(known);
+    uint64_t hash = contentHash(job.target);
+    for (const ResultKey &key : resultCache().keysWith(oldHash)) {
+      // Both operands held the old contents: which of them was this matrix is unknown.
+      if (key.hash1 == key.hash2) {
+        continue;
+      }
+      bool first = key.hash1 == oldHash;
+      const std::string* other = nameOf(first ? key.hash2 : key.hash1);
+      if (other != nullptr) {
+        MatrixView partner = _workspace.view(*other);
+        patchCachedResult(key, dirty, first, first ? matrix : partner, first ? partner : matrix, hash);
+      }
+    }
+  }
+
+
+  /**
+   * Retrieves a matrix as a sparse matrix.
+   *
+   * @param name - the name.
+   * @return SparseMatrix - the matrix (compressed now if it is dense).
+   * @throws std::string - unknown name.
+   */
+  SparseMatrix sparse(const std::string &name) {
+    auto found = _sparse.find(name);
+    return found != _sparse.end() ? found->second : SparseMatrix::fromDense(_workspace.view(name));
+  }
+
+
+  /**
+   * Carries out a job that involves a sparse matrix.
+   * Sparse with sparse gives a sparse result, sparse with dense a dense one.
+   *
+   * @param job - the job.
+   * @return bool - whether the job was carried out; false leaves it to the workspace.
+   * @throws std::string - unknown operand or invalid dimensions.
+   */
+  bool run(const BatchJob &job) {
+    switch (job.command) {
+      case BatchCommand::ADD:
+      case BatchCommand::SUBTRACT: {
+        bool sparseLhs = isSparse(job.lhs);
+        bool sparseRhs = isSparse(job.rhs);
+        if (!sparseLhs && !sparseRhs) {
+          return false;
+        }
+        bool add = job.command == BatchCommand::ADD;
+        float sign = add ? 1.0f : -1.0f;
+        const char* name = add ? "Sum" : "Difference";
+        if (sparseLhs && sparseRhs) {
+          storeSparse(job.target, combineSparse(_sparse.at(job.lhs), _sparse.at(job.rhs), sign, name));
+          return true;
+        }
+        MatrixView dense = _workspace.view(sparseLhs ? job.rhs : job.lhs);
+        BatchScratch scratch;
+        MatrixView out = scratch.allocate(dense.width, dense.height);
+        if (sparseLhs) {
+          combineSparseDense(1.0f, _sparse.at(job.lhs), sign, dense, out, name);
+        } else {
+          combineSparseDense(sign, _sparse.at(job.rhs), 1.0f, dense, out, name);
+        }
+        storeDense(job.target, scratch);
+        return true;
+      }
+      case BatchCommand::MULTIPLY: {
+        bool sparseLhs = isSparse(job.lhs);
+        bool sparseRhs = isSparse(job.rhs);
+        if (!sparseLhs && !sparseRhs) {
+          return false;
+        }
+        if (sparseLhs && sparseRhs) {
+          storeSparse(job.target, multiplySparse(sparseOperand(job.lhs, job.transposeLhs),
+                                                 sparseOperand(job.rhs, job.transposeRhs)));
+          return true;
+        }
+        BatchScratch transposed;
+        BatchScratch scratch;
+        if (sparseLhs) {
+          SparseMatrix lhs = sparseOperand(job.lhs, job.transposeLhs);
+          MatrixView rhs = denseOperand(job.rhs, job.transposeRhs, transposed);
+          if (lhs.getWidth() != rhs.height) {
+            throw(std::string("[Product] ERROR: matrix 1's width does not match matrix 2's height."));
+          }
+          multiplySparseDense(lhs, rhs, scratch.allocate(rhs.width, lhs.getHeight()));
+        } else {
+          MatrixView lhs = denseOperand(job.lhs, job.transposeLhs, transposed);
+          SparseMatrix rhs = sparseOperand(job.rhs, job.transposeRhs);
+          if (lhs.width != rhs.getHeight()) {
+            throw(std::string("[Product] ERROR: matrix 1's width does not match matrix 2's height."));
+          }
+          multiplyDenseSparse(lhs, rhs, scratch.allocate(rhs.getWidth(), lhs.height));
+        }
+        storeDense(job.target, scratch);
+        return true;
+      }
+      case BatchCommand::TRANSPOSE:
+        if (!isSparse(job.lhs)) {
+          return false;
+        }
+        storeSparse(job.target, _sparse.at(job.lhs).transposed());
+        return true;
+      case BatchCommand::FREE:
+        _hashes.erase(job.target);
+        return _sparse.erase(job.target) > 0;
+      default:
+        return false;
+    }
+  }
+
+
+ private:
+  Workspace &_workspace;
+  std::unordered_map<std::string, SparseMatrix> _sparse;
+  std::unordered_map<std::string, uint64_t> _hashes;  // Content hashes of dense matrices, once needed.
+
+
+  /**
+   * Retrieves the content hash of a dense matrix, hashing it on first use.
+   *
+   * @param name - the name.
+   * @return uint64_t - the hash.
+   * @throws std::string - unknown name.
+   */
+  uint64_t contentHash(const std::string &name) {
+    auto found = _hashes.find(name);
+    if (found != _hashes.end()) {
+      return found->second;
+    }
+    uint64_t hash = hashMatrix(_workspace.view(name));
+    _hashes.emplace(name, hash);
+    return hash;
+  }
+
+
+  /**
+   * Finds a dense matrix by its content hash, among those hashed so far.
+   *
+   * @param hash - the hash.
+   * @return const std::string* - the matrix's name, or nullptr if none.
+   */
+  const std::string* nameOf(uint64_t hash) const {
+    for (const auto &entry : _hashes) {
+      if (entry.second == hash) {
+        return &entry.first;
+      }
+    }
+    return nullptr;
+  }
+
+
+  /**
+   * Checks whether a name refers to a sparse matrix.
+   *
+   * @param name - the name.
+   * @return bool - whether it is kept here.
+   */
+  bool isSparse(const std::string &name) const {
+    return _sparse.count(name) > 0;
+  }
+
+
+  /**
+   * Retrieves a sparse product operand (transposing only swaps its layout).
+   *
+   * @param name - the name.
+   * @param trans - whether it is used transposed.
+   * @return SparseMatrix - op(matrix).
+   */
+  SparseMatrix sparseOperand(const std::string &name, Transpose trans) const {
+    const SparseMatrix &matrix = _sparse.at(name);
+    return trans == Transpose::TRANSPOSED ? matrix.transposed() : matrix;
+  }
+
+
+  /**
+   * Retrieves a dense product operand; the sparse kernels read its rows, so a
+   * transposed operand is transposed into scratch first.
+   *
+   * @param name - the name.
+   * @param trans - whether it is used transposed.
+   * @param scratch - holds the transpose.
+   * @return MatrixView - op(matrix).
+   * @throws std::string - unknown name.
+   */
+  MatrixView denseOperand(const std::string &name, Transpose trans, BatchScratch &scratch) {
+    MatrixView matrix = _workspace.view(name);
+    if (trans == Transpose::NONE) {
+      return matrix;
+    }
+    MatrixView view = scratch.allocate(matrix.height, matrix.width);
+    transposeMatrix(matrix, view);
+    return view;
+  }
+};
+
+
+/**
+ * Carries out a chain job: plans the order, reports its cost against left to
+ * right, and stores the product.
+ *
+ * @param job - the job.
+ * @param matrices - the matrices of the job stream.
+ * @param report - where the order and its cost go.
+ * @throws std::string - unknown operand or invalid dimensions.
+ */
+template <typename Workspace>
+void runChainJob(const BatchJob &job, BatchMatrices<Workspace> &matrices, std::ostream &report) {
+  // Sparse operands are expanded; multiply() may still hand a product with a
+  // sparse operand to the sparse kernels.
+  std::vector<BatchScratch> expanded(job.factors.size());
+  std::vector<ChainFactor> factors;
+  for (size_t i = 0; i < job.factors.size(); ++i) {
+    factors.push_back(ChainFactor{matrices.view(job.factors[i], expanded[i]), job.transposeFactors[i]});
+  }
+  ChainPlan plan(factors);
+
+  std::vector<std::string> names;
+  for (size_t i = 0; i < job.factors.size(); ++i) {
+    bool transposed = job.transposeFactors[i] == Transpose::TRANSPOSED;
+    names.push_back(job.factors[i] + (transposed ? "^T" : ""));
+  }
+  report << "[Chain] " << job.target << " = " << plan.describe(names) << ": " << plan.getFlops()
+            << " FLOPs (left to right: " << plan.getNaiveFlops() << ")" << std::endl;
+
+  BatchScratch scratch;
+  multiplyChain(plan, factors, scratch.allocate(plan.getWidth(), plan.getHeight()));
+  matrices.storeDense(job.target, scratch);
+}
+
+
+/**
+ * Converts a matrix file between the text format and the binary format; the
+ * direction follows from the input.
+ *
+ * @param input - the file to read.
+ * @param output - the file to write.
+ * @return int - the process exit status.
+ */
+inline int convertMatrixFile(const std::string &input, const std::string &output) {
+  try {
+    MatrixView matrix = {nullptr, 0, 0, 0};
+    bool binary = isMatrixBinaryFile(input);
+    if (binary) {
+      matrix = loadMatrixBinary(input);
+    } else {
+      MatrixTextReader reader(input);
+      readMatrixHeader(reader, &matrix.width, &matrix.height);
+      matrix.stride = paddedStride(matrix.width);
+      matrix.data = allocateMatrixData(static_cast<size_t>(matrix.stride) * matrix.height);
+      try {
+        readMatrixBody(reader, matrix);
+      } catch (std::string errorMessage) {
+        freeMatrixData(matrix.data);
+        throw;
+      }
+    }
+
+    try {
+      if (binary) {
+        saveMatrix(output, matrix);
+      } else {
+        saveMatrixBinary(output, matrix);
+      }
+    } catch (std::string errorMessage) {
+      freeMatrixData(matrix.data);
+      throw;
+    }
+    freeMatrixData(matrix.data);
+  } catch (std::string errorMessage) {
+    std::cerr << errorMessage << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+
+/**
+ * A job on its way through the pipeline, with what its stages hand on.
+ */
+struct BatchItem {
+  BatchJob job;
+  std::string error;    // Why a stage failed; later stages skip the job.
+  BatchScratch dense;   // LOAD: the parsed matrix. PRINT, SAVE: a copy to write.
+  SparseMatrix sparse;  // LOAD of a Matrix Market file, SAVE to a .mm file.
+  std::string notes;    // Messages for standard error (CHAIN).
+};
+
+
+/**
+ * Files that jobs still in the pipeline are going to write. A stage that reads
+ * a file waits until no earlier job writes it any more; files are told apart
+ * by the path as written in the jobs, and jobs by their line in the stream.
+ */
+class BatchFiles {
+ public:
+  /**
+   * Notes that a job will write a file (called in job order).
+   *
+   * @param path - the file.
+   * @param line - the job's line.
+   */
+  void expect(const std::string &path, size_t line) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _pending.emplace(path, line);
+  }
+
+  /**
+   * Notes that a job has written a file, or given up on it.
+   *
+   * @param path - the file.
+   * @param line - the job's line.
+   */
+  void done(const std::string &path, size_t line) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto range = _pending.equal_range(path);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second == line) {
+        _pending.erase(it);
+        break;
+      }
+    }
+    _changed.notify_all();
+  }
+
+  /**
+   * Waits until no job before the given one writes a file. Writes by the job
+   * itself or later ones are not waited for (e.g. "mulfile a a a").
+   *
+   * @param path - the file.
+   * @param line - the waiting job's line.
+   */
+  void waitFor(const std::string &path, size_t line) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _changed.wait(lock, [this, &path, line] { return _closed || !writtenBefore(path, line); });
+  }
+
+  /**
+   * Releases every waiter for good (the pipeline is stopping).
+   */
+  void close() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _closed = true;
+    _changed.notify_all();
+  }
+
+ private:
+  std::mutex _mutex;
+  std::condition_variable _changed;
+  std::multimap<std::string, size_t> _pending;
+  bool _closed = false;
+
+
+  /**
+   * Checks whether a job before the given one still has to write a file.
+   *
+   * @param path - the file.
+   * @param line - the job's line.
+   * @return bool - whether an earlier write is pending.
+   */
+  bool writtenBefore(const std::string &path, size_t line) const {
+    auto range = _pending.equal_range(path);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second < line) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+
+/**
+ * Turns a standard exception thrown by a job (e.g. std::bad_alloc) into an
+ * error message like the ones the engines throw.
+ *
+ * @param error - the exception.
+ * @return std::string - the message.
+ */
+inline std::string batchErrorMessage(const std::exception &error) {
+  return std::string("[Batch] ERROR: ") + error.what() + ".";
+}
+
+
+/**
+ * Parse stage: reads the next job, and the matrix of a load or the values of a set.
+ *
+ * @param jobs - the job stream.
+ * @param files - the files still to be written.
+ * @param item - receives the job; a failure is kept in item->error.
+ * @return bool - whether a job was read (false at end of the stream).
+ */
+inline bool parseBatchItem(MatrixTextReader &jobs, BatchFiles &files, BatchItem* item) {
+  BatchJob &job = item->job;
+  try {
+    if (!readBatchJob(jobs, &job)) {
+      return false;
+    }
+    if (job.command == BatchCommand::SAVE) {
+      files.expect(job.path, job.line);
+    } else if (job.command == BatchCommand::MULTIPLY_FILES) {
+      files.expect(job.target, job.line);
+    } else if (job.command == BatchCommand::SET) {
+      int count = static_cast<int>(job.values.size());
+      readMatrixBody(jobs, MatrixView{job.values.data(), count, 1, count});
+    } else if (job.command == BatchCommand::LOAD) {
+      if (job.path == "-") {
+        MatrixView view = {nullptr, 0, 0, 0};
+        readMatrixHeader(jobs, &view.width, &view.height);
+        readMatrixBody(jobs, item->dense.allocate(view.width, view.height));
+        return true;
+      }
+      files.waitFor(job.path, job.line);
+      if (isMatrixBinaryFile(job.path)) {
+        item->dense.adopt(loadMatrixBinary(job.path));
+      } else if (isMatrixMarketFile(job.path)) {
+        item->sparse = loadMatrixMarket(job.path);
+      } else {
+        MatrixTextReader file(job.path);
+        MatrixView view = {nullptr, 0, 0, 0};
+        readMatrixHeader(file, &view.width, &view.height);
+        readMatrixBody(file, item->dense.allocate(view.width, view.height));
+      }
+    }
+  } catch (std::string errorMessage) {
+    item->error = errorMessage;
+  } catch (const std::exception &error) {
+    item->error = batchErrorMessage(error);
+  }
+  return true;
+}
+
+
+/**
+ * Runs every job of a job stream.
+ * The workspace stores the named matrices and provides
+ *   void adopt(const std::string &name, const MatrixView &storage);  // owns storage
+ *   void add(target, lhs, rhs), subtract(...);
+ *   void multiply(target, lhs, rhs, Transpose transposeLhs, Transpose transposeRhs);
+ *   void transpose(target, source);
+ *   MatrixView view(const std::string &name);   // throws if unknown
+ *   bool contains(const std::string &name);
+ *   void release(const std::string &name);
+ * Only the compute stage touches the workspace. The stages do share some
+ * process-wide state, all of it safe to use from several threads:
+ * - the allocators, which lock internally; which one new matrices come from
+ *   is chosen per thread (see currentMatrixAllocator()), so the compute
+ *   stage's request and cache scopes do not affect what "load" parses into;
+ * - the shared thread pool, which the write stage uses to format large
+ *   matrices while the compute stage runs kernels on it; concurrent
+ *   parallelFor() calls take turns;
+ * - the profiler, whose counters are atomic.
+ * A failed job is reported on standard error and the stream goes on.
+ *
+ * @param jobs - the job stream.
+ * @param workspace - the workspace.
+ * @param format - the element format for "print".
+ * @return int - the number of failed jobs.
+ */
+template <typename Workspace>
+int runBatch(MatrixTextReader &jobs, Workspace &workspace, NumberFormat format) {
+  int failures = 0;
+  BatchMatrices<Workspace> matrices(workspace);
+  BatchFiles files;
+
+  auto parse = [&jobs, &files](BatchItem* item) {
+    try {
+      return parseBatchItem(jobs, files, item);
+    } catch (...) {
+      files.close();
+      throw;
+    }
+  };
+
+  auto compute = [&workspace, &matrices, &files](BatchItem &item) {
+    const BatchJob &job = item.job;
+    if (!item.error.empty()) {
+      return;
+    }
+    try {
+      if (matrices.run(job)) {
+        return;
+      }
+
+      switch (job.command) {
+        case BatchCommand::LOAD:
+          if (item.dense.view().data == nullptr) {
+            matrices.storeSparse(job.target, std::move(item.sparse));
+          } else {
+            workspace.adopt(job.target, item.dense.release());
+            matrices.storedDense(job.target, true);
+          }
+          break;
+        case BatchCommand::ADD:
+        case BatchCommand::SUBTRACT:
+        case BatchCommand::MULTIPLY: {
+          ResultKey key;
+          bool cached = resultCache().enabled();
+          if (cached && matrices.findResult(job, &key)) {
+            break;
+          }
+          if (job.command == BatchCommand::ADD) {
+            workspace.add(job.target, job.lhs, job.rhs);
+          } else if (job.command == BatchCommand::SUBTRACT) {
+            workspace.subtract(job.target, job.lhs, job.rhs);
+          } else {
+            workspace.multiply(job.target, job.lhs, job.rhs, job.transposeLhs, job.transposeRhs);
+          }
+          matrices.storedDense(job.target, false);
+          if (cached) {
+            matrices.keepResult(key, job.target);
+          }
+          break;
+        }
+        case BatchCommand::TRANSPOSE:
+          workspace.transpose(job.target, job.lhs);
+          matrices.storedDense(job.target, false);
+          break;
+        case BatchCommand::SET:
+          matrices.update(job);
+          break;
+        case BatchCommand::CHAIN: {
+          std::ostringstream report;
+          runChainJob(job, matrices, report);
+          item.notes = report.str();
+          break;
+        }
+        case BatchCommand::MULTIPLY_FILES:
+          files.waitFor(job.lhs, job.line);
+          files.waitFor(job.rhs, job.line);
+          multiplyOutOfCore(job.lhs, job.rhs, job.target);
+          break;
+        case BatchCommand::PRINT:
+          matrices.copy(job.target, item.dense);
+          break;
+        case BatchCommand::SAVE:
+          if (hasMatrixMarketExtension(job.path)) {
+            item.sparse = matrices.sparse(job.target);
+          } else {
+            matrices.copy(job.target, item.dense);
+          }
+          break;
+        case BatchCommand::FREE:
+          workspace.release(job.target);
+          break;
+      }
+    } catch (std::string errorMessage) {
+      item.error = errorMessage;
+    } catch (const std::exception &error) {
+      item.error = batchErrorMessage(error);
+    } catch (...) {
+      files.close();
+      throw;
+    }
+  };
+
+  auto write = [&failures, &files, format](BatchItem &item) {
+    const BatchJob &job = item.job;
+    try {
+      if (item.error.empty() && job.command == BatchCommand::PRINT) {
+        std::cout << "[[[ " << job.target << " ]]]\n";
+        writeMatrix(std::cout, item.dense.view(), format);
+      } else if (item.error.empty() && job.command == BatchCommand::SAVE) {
+        if (hasMatrixMarketExtension(job.path)) {
+          saveMatrixMarket(job.path, item.sparse);
+        } else if (hasBinaryExtension(job.path)) {
+          saveMatrixBinary(job.path, item.dense.view());
+        } else {
+          saveMatrix(job.path, item.dense.view());
+        }
+      }
+    } catch (std::string errorMessage) {
+      item.error = errorMessage;
+    } catch (const std::exception &error) {
+      item.error = batchErrorMessage(error);
+    } catch (...) {
+      files.close();
+      throw;
+    }
+
+    if (job.command == BatchCommand::SAVE) {
+      files.done(job.path, job.line);
+    } else if (job.command == BatchCommand::MULTIPLY_FILES) {
+      files.done(job.target, job.line);
+    }
+    std::cerr << item.notes;
+    if (!item.error.empty()) {
+      ++failures;
+      std::cerr << "line " << job.line << ": " << item.error << std::endl;
+    }
+  };
+
+  runPipeline<BatchItem>(parse, compute, write);
+  return failures;
+}
+
+
+/**
+ * Runs a job file (or standard input for "-") through a workspace.
+ *
+ * @param path - the job file.
+ * @param workspace - the workspace.
+ * @param format - the element format for "print".
+ * @return int - the process exit status.
+ */
+template <typename Workspace>
+int runBatchFile(const std::string &path, Workspace &workspace, NumberFormat format) {
+  try {
+    if (path == "-") {
+      // Not standardInput(): it flushes std::cout, which the write stage owns.
+      MatrixTextReader jobs(STDIN_FILENO);
+      return runBatch(jobs, workspace, format) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    MatrixTextReader jobs(path);
+    return runBatch(jobs, workspace, format) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  } catch (std::string errorMessage) {
+    std::cerr << errorMessage << std::endl;
+    return EXIT_FAILURE;
+  } catch (const std::exception &error) {
+    std::cerr << batchErrorMessage(error) << std::endl;
+    return EXIT_FAILURE;
+  }
+}
+
+#endif  // MATRIX_BATCH_H_
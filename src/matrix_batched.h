@@ -0,0 +1,474 @@
+/**
+ * matrix_batched.h
+ * Sums, differences and products of many independent small matrices of one
+ * shape in a single call. A batch is stored interleaved (structure of
+ * arrays): element (i, j) of every matrix is one contiguous vector, lane b
+ * holding matrix b, so the kernels vectorize across the batch instead of
+ * inside each tiny matrix, and there is one allocation and one call for the
+ * whole batch. Blocks of lanes are spread over the thread pool.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_BATCHED_H_
+#define MATRIX_BATCHED_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "matrix_instrumentation.h"
+#include "matrix_simd.h"
+#include "matrix_storage.h"
+#include "thread_pool.h"
+
+
+// Lanes handed to one pool task (a multiple of every vector width).
+const int BATCHED_TASK_LANES = 1024;
+
+// Batched operations with fewer floating point operations than this run on one thread.
+const double BATCHED_PARALLEL_THRESHOLD = 1 << 18;
+
+
+/**
+ * Non-owning window onto an interleaved batch of count width x height matrices.
+ * Element (i, j) of lane b is at data[(i * width + j) * laneStride + b]; lanes
+ * count to laneStride are zero padding that the kernels process along.
+ */
+struct BatchedView {
+  float* data;
+  int width;
+  int height;
+  int count;
+  int laneStride;
+
+  /**
+   * Retrieves element (i, j) of every lane.
+   *
+   * @param i - the row index.
+   * @param j - the column index.
+   * @return float* - the vector of lanes.
+   */
+  float* element(int i, int j) const {
+    return data + (static_cast<size_t>(i) * width + j) * laneStride;
+  }
+
+  /**
+   * Retrieves element (i, j) of one lane.
+   *
+   * @param lane - the matrix.
+   * @param i - the row index.
+   * @param j - the column index.
+   * @return float& - the element.
+   */
+  float &at(int lane, int i, int j) const {
+    return element(i, j)[lane];
+  }
+};
+
+
+/**
+ * Interleaved batch of matrices that owns its storage.
+ */
+class BatchedMatrices {
+ public:
+  /**
+   * Constructor; all elements start at zero.
+   *
+   * @param width - the width of every matrix.
+   * @param height - the height of every matrix.
+   * @param count - the number of matrices.
+   * @throws std::invalid_argument - dimensions rejected by the dimension policy or a negative count.
+   */
+  BatchedMatrices(int width, int height, int count) {
+    std::string error;
+    if (!checkDimensions(width, height, &error)) {
+      throw std::invalid_argument(error);
+    }
+    if (count < 0) {
+      throw std::invalid_argument("Invalid batch, the count may not be negative");
+    }
+
+    int laneStride = paddedStride(count);
+    size_t total = static_cast<size_t>(width) * height * laneStride;
+    _view = BatchedView{allocateMatrixData(total), width, height, count, laneStride};
+    std::memset(_view.data, 0, sizeof(float) * total);
+  }
+
+  BatchedMatrices(const BatchedMatrices &) = delete;
+  BatchedMatrices &operator=(const BatchedMatrices &) = delete;
+
+
+  /**
+   * Move constructor; the other batch is left empty.
+   *
+   * @param batch - the batch to move from.
+   */
+  BatchedMatrices(BatchedMatrices &&batch) noexcept : _view(batch._view) {
+    batch._view = BatchedView{nullptr, 0, 0, 0, 0};
+  }
+
+
+  /**
+   * Move assignment; frees this batch and takes over the other's storage.
+   *
+   * @param batch - the batch to move from.
+   * @return BatchedMatrices& - this batch.
+   */
+  BatchedMatrices &operator=(BatchedMatrices &&batch) noexcept {
+    if (this != &batch) {
+      freeMatrixData(_view.data);
+      _view = batch._view;
+      batch._view = BatchedView{nullptr, 0, 0, 0, 0};
+    }
+    return *this;
+  }
+
+
+  /**
+   * Destructor.
+   */
+  ~BatchedMatrices() {
+    freeMatrixData(_view.data);
+  }
+
+
+  /**
+   * Retrieves a view of the batch.
+   *
+   * @return const BatchedView& - the view.
+   */
+  const BatchedView &view() const {
+    return _view;
+  }
+
+
+  /**
+   * Copies a matrix into one lane.
+   *
+   * @param lane - the lane.
+   * @param matrix - the matrix (same dimensions as the batch).
+   * @throws std::invalid_argument - lane or dimensions do not match the batch.
+   */
+  void pack(int lane, const MatrixView &matrix) {
+    checkLane(lane, matrix);
+    for (int i = 0; i < _view.height; ++i) {
+      const float* row = matrix.row(i);
+      for (int j = 0; j < _view.width; ++j) {
+        _view.at(lane, i, j) = row[j];
+      }
+    }
+  }
+
+
+  /**
+   * Copies one lane out into a matrix.
+   *
+   * @param lane - the lane.
+   * @param matrix - the destination (same dimensions as the batch).
+   * @throws std::invalid_argument - lane or dimensions do not match the batch.
+   */
+  void unpack(int lane, const MatrixView &matrix) const {
+    checkLane(lane, matrix);
+    for (int i = 0; i < _view.height; ++i) {
+      float* row = matrix.row(i);
+      for (int j = 0; j < _view.width; ++j) {
+        row[j] = _view.at(lane, i, j);
+      }
+    }
+  }
+
+
+ private:
+  BatchedView _view = BatchedView{nullptr, 0, 0, 0, 0};
+
+
+  /**
+   * Checks that a lane and a matrix fit the batch.
+   *
+   * @param lane - the lane.
+   * @param matrix - the matrix.
+   * @throws std::invalid_argument - they do not.
+   */
+  void checkLane(int lane, const MatrixView &matrix) const {
+    if (lane < 0 || lane >= _view.count) {
+      throw std::invalid_argument("Invalid lane, the batch has " + std::to_string(_view.count) + " matrices");
+    }
+    if (matrix.width != _view.width || matrix.height != _view.height) {
+      throw std::invalid_argument("Invalid size, the batch holds " + std::to_string(_view.width) + " x "
+                                  + std::to_string(_view.height) + " matrices");
+    }
+  }
+};
+
+
+/**
+ * Runs a task over blocks of lanes, on the thread pool when the work is large.
+ *
+ * @param laneStride - the lanes, padding included.
+ * @param work - the floating point operations of the whole batch.
+ * @param task - called as task(firstLane, lanes).
+ */
+template <typename Task>
+inline void forEachLaneBlock(int laneStride, double work, Task task) {
+  size_t blocks = static_cast<size_t>((laneStride + BATCHED_TASK_LANES - 1) / BATCHED_TASK_LANES);
+  auto block = [&](size_t index) {
+    int first = static_cast<int>(index) * BATCHED_TASK_LANES;
+    task(first, std::min(BATCHED_TASK_LANES, laneStride - first));
+  };
+  if (blocks == 1 || getThreadCount() == 1 || work < BATCHED_PARALLEL_THRESHOLD) {
+    for (size_t index = 0; index < blocks; ++index) {
+      block(index);
+    }
+  } else {
+    defaultThreadPool().parallelFor(blocks, block);
+  }
+}
+
+
+/**
+ * Checks that batches hold the same number of matrices of the same dimensions.
+ *
+ * @param a - the first batch.
+ * @param b - the second batch.
+ * @param out - the result batch.
+ * @param operation - the operation, for the message ("Sum" or "Difference").
+ * @throws std::string - they do not.
+ */
+inline void checkBatchedOperands(const BatchedView &a, const BatchedView &b, const BatchedView &out,
+                                 const char* operation) {
+  if (a.width != b.width || a.height != b.height || a.width != out.width || a.height != out.height) {
+    throw(std::string("[") + operation + "] ERROR: dimensions are not matching.");
+  }
+  if (a.count != b.count || a.count != out.count) {
+    throw(std::string("[") + operation + "] ERROR: batch sizes are not matching.");
+  }
+}
+
+
+/**
+ * Computes out = a + b or a - b for every lane with the element-wise kernels.
+ *
+ * @param a - the first batch.
+ * @param b - the second batch.
+ * @param out - the result (may alias a or b).
+ * @param kernel - the element-wise kernel.
+ */
+inline void combineBatched(const BatchedView &a, const BatchedView &b, const BatchedView &out,
+                           ElementwiseKernel kernel) {
+  size_t elements = static_cast<size_t>(out.width) * out.height;
+  double work = static_cast<double>(elements) * out.laneStride;
+  forEachLaneBlock(out.laneStride, work, [&](int first, int lanes) {
+    for (size_t e = 0; e < elements; ++e) {
+      size_t offset = e * out.laneStride + first;
+      kernel(a.data + offset, b.data + offset, out.data + offset, lanes, 1.0f, false);
+    }
+  });
+}
+
+
+/**
+ * Computes out = a + b for every lane.
+ *
+ * @param a - the first batch.
+ * @param b - the second batch.
+ * @param out - the result (may alias a or b).
+ * @throws std::string - invalid dimensions or batch sizes.
+ */
+inline void addBatched(const BatchedView &a, const BatchedView &b, const BatchedView &out) {
+  checkBatchedOperands(a, b, out, "Sum");
+  double elements = static_cast<double>(out.width) * out.height * out.count;
+  ProfileScope profile(ProfileSection::ADD, elements, 3 * sizeof(float) * elements);
+  combineBatched(a, b, out, elementwiseKernels().add);
+}
+
+
+/**
+ * Computes out = a - b for every lane.
+ *
+ * @param a - the first batch.
+ * @param b - the second batch.
+ * @param out - the result (may alias a or b).
+ * @throws std::string - invalid dimensions or batch sizes.
+ */
+inline void subtractBatched(const BatchedView &a, const BatchedView &b, const BatchedView &out) {
+  checkBatchedOperands(a, b, out, "Difference");
+  double elements = static_cast<double>(out.width) * out.height * out.count;
+  ProfileScope profile(ProfileSection::SUBTRACT, elements, 3 * sizeof(float) * elements);
+  combineBatched(a, b, out, elementwiseKernels().subtract);
+}
+
+
+/**
+ * Portable product kernel: every output element of a block of lanes is
+ * accumulated in a small local array the compiler keeps in vector registers.
+ *
+ * @param a - the left batch.
+ * @param b - the right batch.
+ * @param out - the result batch.
+ * @param first - the first lane.
+ * @param lanes - the number of lanes (a multiple of 16).
+ */
+inline void multiplyBatchedGeneric(const BatchedView &a, const BatchedView &b, const BatchedView &out,
+                                   int first, int lanes) {
+  const int step = 16;
+  for (int l = first; l < first + lanes; l += step) {
+    for (int i = 0; i < out.height; ++i) {
+      for (int j = 0; j < out.width; ++j) {
+        float sum[step] = {};
+        for (int p = 0; p < a.width; ++p) {
+          const float* x = a.element(i, p) + l;
+          const float* y = b.element(p, j) + l;
+          for (int v = 0; v < step; ++v) {
+            sum[v] += x[v] * y[v];
+          }
+        }
+        std::memcpy(out.element(i, j) + l, sum, sizeof(sum));
+      }
+    }
+  }
+}
+
+
+#ifdef MATRIX_SIMD_X86
+/**
+ * AVX2 product kernel: 8 lanes per vector, four output columns at a time so
+ * every vector of a is loaded once per four fused multiply-adds.
+ *
+ * @param a - the left batch.
+ * @param b - the right batch.
+ * @param out - the result batch.
+ * @param first - the first lane.
+ * @param lanes - the number of lanes (a multiple of 16).
+ */
+__attribute__((target("avx2,fma")))
+inline void multiplyBatchedAvx2(const BatchedView &a, const BatchedView &b, const BatchedView &out,
+                                int first, int lanes) {
+  for (int l = first; l < first + lanes; l += 8) {
+    for (int i = 0; i < out.height; ++i) {
+      int j = 0;
+      for (; j + 4 <= out.width; j += 4) {
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        __m256 sum2 = _mm256_setzero_ps();
+        __m256 sum3 = _mm256_setzero_ps();
+        for (int p = 0; p < a.width; ++p) {
+          __m256 x = _mm256_load_ps(a.element(i, p) + l);
+          sum0 = _mm256_fmadd_ps(x, _mm256_load_ps(b.element(p, j) + l), sum0);
+          sum1 = _mm256_fmadd_ps(x, _mm256_load_ps(b.element(p, j + 1) + l), sum1);
+          sum2 = _mm256_fmadd_ps(x, _mm256_load_ps(b.element(p, j + 2) + l), sum2);
+          sum3 = _mm256_fmadd_ps(x, _mm256_load_ps(b.element(p, j + 3) + l), sum3);
+        }
+        _mm256_store_ps(out.element(i, j) + l, sum0);
+        _mm256_store_ps(out.element(i, j + 1) + l, sum1);
+        _mm256_store_ps(out.element(i, j + 2) + l, sum2);
+        _mm256_store_ps(out.element(i, j + 3) + l, sum3);
+      }
+      for (; j < out.width; ++j) {
+        __m256 sum = _mm256_setzero_ps();
+        for (int p = 0; p < a.width; ++p) {
+          sum = _mm256_fmadd_ps(_mm256_load_ps(a.element(i, p) + l), _mm256_load_ps(b.element(p, j) + l), sum);
+        }
+        _mm256_store_ps(out.element(i, j) + l, sum);
+      }
+    }
+  }
+}
+
+
+/**
+ * AVX-512 product kernel: 16 lanes per vector, four output columns at a time.
+ *
+ * @param a - the left batch.
+ * @param b - the right batch.
+ * @param out - the result batch.
+ * @param first - the first lane.
+ * @param lanes - the number of lanes (a multiple of 16).
+ */
+__attribute__((target("avx512f")))
+inline void multiplyBatchedAvx512(const BatchedView &a, const BatchedView &b, const BatchedView &out,
+                                  int first, int lanes) {
+  for (int l = first; l < first + lanes; l += 16) {
+    for (int i = 0; i < out.height; ++i) {
+      int j = 0;
+      for (; j + 4 <= out.width; j += 4) {
+        __m512 sum0 = _mm512_setzero_ps();
+        __m512 sum1 = _mm512_setzero_ps();
+        __m512 sum2 = _mm512_setzero_ps();
+        __m512 sum3 = _mm512_setzero_ps();
+        for (int p = 0; p < a.width; ++p) {
+          __m512 x = _mm512_load_ps(a.element(i, p) + l);
+          sum0 = _mm512_fmadd_ps(x, _mm512_load_ps(b.element(p, j) + l), sum0);
+          sum1 = _mm512_fmadd_ps(x, _mm512_load_ps(b.element(p, j + 1) + l), sum1);
+          sum2 = _mm512_fmadd_ps(x, _mm512_load_ps(b.element(p, j + 2) + l), sum2);
+          sum3 = _mm512_fmadd_ps(x, _mm512_load_ps(b.element(p, j + 3) + l), sum3);
+        }
+        _mm512_store_ps(out.element(i, j) + l, sum0);
+        _mm512_store_ps(out.element(i, j + 1) + l, sum1);
+        _mm512_store_ps(out.element(i, j + 2) + l, sum2);
+        _mm512_store_ps(out.element(i, j + 3) + l, sum3);
+      }
+      for (; j < out.width; ++j) {
+        __m512 sum = _mm512_setzero_ps();
+        for (int p = 0; p < a.width; ++p) {
+          sum = _mm512_fmadd_ps(_mm512_load_ps(a.element(i, p) + l), _mm512_load_ps(b.element(p, j) + l), sum);
+        }
+        _mm512_store_ps(out.element(i, j) + l, sum);
+      }
+    }
+  }
+}
+#endif
+
+
+/**
+ * Picks the product kernel for the detected instruction set level.
+ *
+ * @return function pointer - the kernel.
+ */
+inline void (*selectBatchedProductKernel())(const BatchedView &, const BatchedView &, const BatchedView &, int,
+                                            int) {
+  static void (*kernel)(const BatchedView &, const BatchedView &, const BatchedView &, int, int) = [] {
+#ifdef MATRIX_SIMD_X86
+    if (simdLevel() >= SimdLevel::AVX512) {
+      return &multiplyBatchedAvx512;
+    }
+    if (simdLevel() >= SimdLevel::AVX2) {
+      return &multiplyBatchedAvx2;
+    }
+#endif
+    return &multiplyBatchedGeneric;
+  }();
+  return kernel;
+}
+
+
+/**
+ * Computes out = a * b for every lane.
+ *
+ * @param a - the left batch.
+ * @param b - the right batch (as high as a is wide).
+ * @param out - the result (b.width wide, a.height high; must not alias a or b).
+ * @throws std::string - invalid dimensions or batch sizes.
+ */
+inline void multiplyBatched(const BatchedView &a, const BatchedView &b, const BatchedView &out) {
+  if (a.width != b.height || out.width != b.width || out.height != a.height) {
+    throw(std::string("[Product] ERROR: matrix 1's width does not match matrix 2's height."));
+  }
+  if (a.count != b.count || a.count != out.count) {
+    throw(std::string("[Product] ERROR: batch sizes are not matching."));
+  }
+
+  double flops = 2.0 * out.width * out.height * a.width * out.count;
+  double bytes = sizeof(float) * (static_cast<double>(a.width) * a.height + static_cast<double>(b.width) * b.height
+                                  + static_cast<double>(out.width) * out.height) * out.count;
+  ProfileScope profile(ProfileSection::MULTIPLY, flops, bytes);
+  auto kernel = selectBatchedProductKernel();
+  forEachLaneBlock(out.laneStride, flops, [&](int first, int lanes) {
+    kernel(a, b, out, first, lanes);
+  });
+}
+
+#endif  // MATRIX_BATCHED_H_
@@ -0,0 +1,448 @@
+/**
+ * matrix_benchmark.h
+ * Benchmark harness shared by the calculators (run with --benchmark).
+ * Each calculator supplies a subject that carries out add, subtract and
+ * multiply on its own storage; the harness sweeps sizes and aspect ratios,
+ * times every case Google Benchmark style (iterations grow until a run takes
+ * long enough, then the run is repeated and the median kept), prints a table
+ * and can write the results as Google Benchmark compatible JSON, so runs from
+ * different releases can be compared with its tools.
+ * Batched cases time the same operations on many tiny pairs at once
+ * (matrix_batched.h), for comparison with one pair per call.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_BENCHMARK_H_
+#define MATRIX_BENCHMARK_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "matrix_allocator.h"
+#include "matrix_batched.h"
+#include "matrix_gemm.h"
+#include "matrix_instrumentation.h"
+#include "matrix_simd.h"
+#include "matrix_storage.h"
+#include "thread_pool.h"
+
+
+// Minimum duration of a timed run when MATRIX_BENCH_MIN_TIME is not set (seconds).
+const double BENCHMARK_DEFAULT_MIN_TIME = 0.1;
+
+// Timed runs per case; the median is reported.
+const int BENCHMARK_REPETITIONS = 3;
+
+// Most iterations a run may be grown to.
+const long BENCHMARK_MAX_ITERATIONS = 1000000000L;
+
+
+/**
+ * Operations every calculator is measured on.
+ */
+enum class BenchmarkOperation {
+  ADD,
+  SUBTRACT,
+  MULTIPLY
+};
+
+
+/**
+ * Shape of one case: m x n operands for ADD and SUBTRACT,
+ * (m x k) * (k x n) for MULTIPLY.
+ */
+struct BenchmarkShape {
+  int m;
+  int n;
+  int k;
+};
+
+
+// Element-wise shapes: small (inside the stack calculator's arrays), square, tall and wide.
+const BenchmarkShape ELEMENTWISE_SHAPES[] = {
+  {16, 16, 0}, {64, 64, 0}, {256, 256, 0}, {1024, 1024, 0}, {2048, 2048, 0},
+  {4096, 256, 0}, {256, 4096, 0}
+};
+
+// Product shapes: small, square, tall-skinny, short-wide and deep inner dimension.
+const BenchmarkShape PRODUCT_SHAPES[] = {
+  {16, 16, 16}, {64, 64, 64}, {256, 256, 256}, {1024, 1024, 1024},
+  {2048, 128, 128}, {128, 2048, 128}, {128, 128, 2048}, {1024, 1024, 32}
+};
+
+
+// Batched shapes: many independent tiny pairs per call.
+const BenchmarkShape BATCHED_SHAPES[] = {
+  {2, 2, 2}, {4, 4, 4}, {8, 8, 8}, {3, 4, 2}
+};
+
+// Pairs per batched call.
+const int BENCHMARK_BATCH_COUNT = 4096;
+
+
+// Receives every result so the work cannot be optimized away.
+inline volatile float benchmarkSink = 0.0f;
+
+
+struct BenchmarkResult {
+  std::string name;     // implementation/operation/shape.
+  long iterations;      // Operations per timed run.
+  double realTime;      // Wall time per operation (ns), median of the runs.
+  double cpuTime;       // Process CPU time per operation (ns), median of the runs.
+  double flops;         // Floating-point operations per operation.
+  double bytes;         // Operand and result bytes per operation.
+};
+
+
+/**
+ * Retrieves the name of an operation.
+ *
+ * @param operation - the operation.
+ * @return const char* - the name.
+ */
+inline const char* benchmarkOperationName(BenchmarkOperation operation) {
+  switch (operation) {
+    case BenchmarkOperation::ADD:
+      return "add";
+    case BenchmarkOperation::SUBTRACT:
+      return "subtract";
+    default:
+      return "multiply";
+  }
+}
+
+
+/**
+ * Retrieves the minimum duration of a timed run, from MATRIX_BENCH_MIN_TIME.
+ *
+ * @return double - the duration in seconds.
+ */
+inline double benchmarkMinTime() {
+  static double seconds = [] {
+    const char* env = std::getenv("MATRIX_BENCH_MIN_TIME");
+    double value = env != nullptr ? std::atof(env) : 0.0;
+    return value > 0.0 ? value : BENCHMARK_DEFAULT_MIN_TIME;
+  }();
+  return seconds;
+}
+
+
+/**
+ * Checks a case name against MATRIX_BENCH_FILTER (a substring; unset runs all).
+ *
+ * @param name - the case name.
+ * @return bool - whether the case should run.
+ */
+inline bool benchmarkSelected(const std::string &name) {
+  static const char* filter = std::getenv("MATRIX_BENCH_FILTER");
+  return filter == nullptr || name.find(filter) != std::string::npos;
+}
+
+
+/**
+ * Fills a matrix with reproducible values in [-1, 1).
+ *
+ * @param matrix - the matrix.
+ * @param seed - selects the sequence.
+ */
+inline void fillBenchmarkMatrix(const MatrixView &matrix, unsigned int seed) {
+  unsigned int state = seed * 2654435761u + 1;
+  for (int i = 0; i < matrix.height; ++i) {
+    float* row = matrix.row(i);
+    for (int j = 0; j < matrix.width; ++j) {
+      state = state * 1664525u + 1013904223u;
+      row[j] = static_cast<float>(state >> 8) / static_cast<float>(1 << 23) - 1.0f;
+    }
+  }
+}
+
+
+/**
+ * Benchmark subject for the batched cases: BENCHMARK_BATCH_COUNT pairs per
+ * operation, stored interleaved. It is the same for every calculator.
+ */
+class BatchedBenchmarkSubject {
+ public:
+  /**
+   * Creates and fills the operand batches of a case.
+   *
+   * @param operation - the operation.
+   * @param shape - the shape of one pair.
+   */
+  void setUp(BenchmarkOperation operation, const BenchmarkShape &shape) {
+    _operation = operation;
+    bool product = operation == BenchmarkOperation::MULTIPLY;
+    _batch1 = std::make_unique<BatchedMatrices>(product ? shape.k : shape.n, shape.m, BENCHMARK_BATCH_COUNT);
+    _batch2 = std::make_unique<BatchedMatrices>(shape.n, product ? shape.k : shape.m, BENCHMARK_BATCH_COUNT);
+    _result = std::make_unique<BatchedMatrices>(shape.n, shape.m, BENCHMARK_BATCH_COUNT);
+    const BatchedView &view1 = _batch1->view();
+    const BatchedView &view2 = _batch2->view();
+    fillBenchmarkMatrix(MatrixView{view1.data, view1.count, view1.width * view1.height,
+                                   view1.laneStride}, 1);
+    fillBenchmarkMatrix(MatrixView{view2.data, view2.count, view2.width * view2.height,
+                                   view2.laneStride}, 2);
+  }
+
+
+  /**
+   * Carries out the operation on the whole batch once.
+   *
+   * @return float - the first element of the first result.
+   */
+  float run() {
+    if (_operation == BenchmarkOperation::ADD) {
+      addBatched(_batch1->view(), _batch2->view(), _result->view());
+    } else if (_operation == BenchmarkOperation::SUBTRACT) {
+      subtractBatched(_batch1->view(), _batch2->view(), _result->view());
+    } else {
+      multiplyBatched(_batch1->view(), _batch2->view(), _result->view());
+    }
+    return _result->view().at(0, 0, 0);
+  }
+
+
+  /**
+   * Frees the batches.
+   */
+  void tearDown() {
+    _batch1.reset();
+    _batch2.reset();
+    _result.reset();
+  }
+
+
+ private:
+  BenchmarkOperation _operation = BenchmarkOperation::ADD;
+  std::unique_ptr<BatchedMatrices> _batch1;
+  std::unique_ptr<BatchedMatrices> _batch2;
+  std::unique_ptr<BatchedMatrices> _result;
+};
+
+
+/**
+ * Times a number of operations.
+ *
+ * @param subject - the calculator's subject, already set up.
+ * @param iterations - the number of operations.
+ * @param cpuTime - receives the process CPU time (ns).
+ * @return double - the wall time (ns).
+ */
+template <typename Subject>
+double timeBenchmarkRun(Subject &subject, long iterations, double* cpuTime) {
+  std::clock_t cpuStart = std::clock();
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < iterations; ++i) {
+    benchmarkSink = subject.run();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  *cpuTime = 1e9 * static_cast<double>(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+  return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+
+/**
+ * Measures one case.
+ *
+ * @param subject - the calculator's subject.
+ * @param name - the case name.
+ * @param operation - the operation.
+ * @param shape - the shape.
+ * @return BenchmarkResult - the result.
+ */
+template <typename Subject>
+BenchmarkResult measureBenchmark(Subject &subject, const std::string &name,
+                                 BenchmarkOperation operation, const BenchmarkShape &shape) {
+  BenchmarkResult result;
+  result.name = name;
+  if (operation == BenchmarkOperation::MULTIPLY) {
+    result.flops = productFlops(shape.m, shape.n, shape.k);
+    result.bytes = productBytes(shape.m, shape.n, shape.k);
+  } else {
+    result.flops = static_cast<double>(shape.m) * shape.n;
+    result.bytes = 3 * sizeof(float) * result.flops;
+  }
+
+  subject.setUp(operation, shape);
+  double cpuTime = 0.0;
+  timeBenchmarkRun(subject, 1, &cpuTime);  // Warm up caches, pools and threads.
+
+  // Grow the run until it lasts long enough to time reliably.
+  double minTime = 1e9 * benchmarkMinTime();
+  long iterations = 1;
+  double realTime = timeBenchmarkRun(subject, iterations, &cpuTime);
+  while (realTime < minTime && iterations < BENCHMARK_MAX_ITERATIONS) {
+    double factor = realTime > 0.0 ? std::min(10.0, 1.4 * minTime / realTime) : 10.0;
+    iterations = std::min(BENCHMARK_MAX_ITERATIONS,
+                          std::max(iterations + 1, static_cast<long>(iterations * factor)));
+    realTime = timeBenchmarkRun(subject, iterations, &cpuTime);
+  }
+
+  std::vector<double> realTimes;
+  std::vector<double> cpuTimes;
+  for (int r = 0; r < BENCHMARK_REPETITIONS; ++r) {
+    realTimes.push_back(timeBenchmarkRun(subject, iterations, &cpuTime) / iterations);
+    cpuTimes.push_back(cpuTime / iterations);
+  }
+  subject.tearDown();
+
+  std::sort(realTimes.begin(), realTimes.end());
+  std::sort(cpuTimes.begin(), cpuTimes.end());
+  result.iterations = iterations;
+  result.realTime = realTimes[BENCHMARK_REPETITIONS / 2];
+  result.cpuTime = cpuTimes[BENCHMARK_REPETITIONS / 2];
+  return result;
+}
+
+
+/**
+ * Prints one result as a table row.
+ *
+ * @param os - the output stream.
+ * @param result - the result.
+ */
+inline void printBenchmarkResult(std::ostream &os, const BenchmarkResult &result) {
+  char line[256];
+  std::snprintf(line, sizeof(line), "%-40s %14.0f ns %10.3f GFLOP/s %10.3f GB/s %12ld\n",
+                result.name.c_str(), result.realTime, result.flops / result.realTime,
+                result.bytes / result.realTime, result.iterations);
+  os << line;
+}
+
+
+/**
+ * Writes results as Google Benchmark JSON.
+ *
+ * @param path - the file.
+ * @param implementation - the calculator's name.
+ * @param results - the results.
+ * @throws std::string - the file cannot be written.
+ */
+inline void writeBenchmarkJson(const std::string &path, const char* implementation,
+                               const std::vector<BenchmarkResult> &results) {
+  std::ofstream file(path, std::ios::trunc);
+  if (!file) {
+    throw(std::string("[Benchmark] ERROR: cannot write \"" + path + "\"."));
+  }
+
+  char date[32];
+  std::time_t now = std::time(nullptr);
+  std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", std::localtime(&now));
+  file << "{\n  \"context\": {\n"
+       << "    \"date\": \"" << date << "\",\n"
+       << "    \"implementation\": \"" << implementation << "\",\n"
+       << "    \"num_threads\": " << getThreadCount() << ",\n"
+       << "    \"simd\": \"" << simdLevelName(simdLevel()) << "\",\n"
+       << "    \"gemm\": \"" << gemmAlgorithmName(getGemmAlgorithm()) << "\",\n"
+       << "    \"allocator\": \"" << currentMatrixAllocator()->name() << "\",\n"
+       << "    \"repetitions\": " << BENCHMARK_REPETITIONS << ",\n"
+       << "    \"library_build_type\": \"release\"\n  },\n"
+       << "  \"benchmarks\": [";
+
+  char entry[1024];
+  for (size_t i = 0; i < results.size(); ++i) {
+    const BenchmarkResult &result = results[i];
+    std::snprintf(entry, sizeof(entry),
+                  "%s\n    {\n      \"name\": \"%s\",\n      \"run_name\": \"%s\",\n"
+                  "      \"run_type\": \"iteration\",\n      \"iterations\": %ld,\n"
+                  "      \"real_time\": %.3f,\n      \"cpu_time\": %.3f,\n"
+                  "      \"time_unit\": \"ns\",\n      \"bytes_per_second\": %.6e,\n"
+                  "      \"items_per_second\": %.6e,\n      \"GFLOPS\": %.6f\n    }",
+                  i == 0 ? "" : ",", result.name.c_str(), result.name.c_str(), result.iterations,
+                  result.realTime, result.cpuTime, 1e9 * result.bytes / result.realTime,
+                  1e9 * result.flops / result.realTime, result.flops / result.realTime);
+    file << entry;
+  }
+  file << "\n  ]\n}\n";
+  if (!file) {
+    throw(std::string("[Benchmark] ERROR: failed writing \"" + path + "\"."));
+  }
+}
+
+
+/**
+ * Runs every case against a calculator. The subject provides
+ *   void setUp(BenchmarkOperation operation, const BenchmarkShape &shape);
+ *   float run();       // one operation, creating its result the calculator's way;
+ *                      // returns any element of the result
+ *   void tearDown();
+ * Set-up and tear-down are not timed.
+ *
+ * @param implementation - the calculator's name, the first part of every case name.
+ * @param subject - the subject.
+ * @param jsonPath - where to write the JSON results (nullptr for none).
+ * @return int - the process exit status.
+ */
+template <typename Subject>
+int runBenchmarks(const char* implementation, Subject &subject, const char* jsonPath) {
+  std::vector<BenchmarkResult> results;
+  char header[256];
+  std::snprintf(header, sizeof(header), "%-40s %17s %18s %15s %12s\n", "Benchmark", "Time",
+                "Compute", "Memory", "Iterations");
+  std::cout << header << std::string(106, '-') << "\n";
+
+  const BenchmarkOperation operations[] = {BenchmarkOperation::ADD, BenchmarkOperation::SUBTRACT,
+                                           BenchmarkOperation::MULTIPLY};
+  for (BenchmarkOperation operation : operations) {
+    std::vector<BenchmarkShape> shapes(std::begin(ELEMENTWISE_SHAPES), std::end(ELEMENTWISE_SHAPES));
+    if (operation == BenchmarkOperation::MULTIPLY) {
+      shapes.assign(std::begin(PRODUCT_SHAPES), std::end(PRODUCT_SHAPES));
+    }
+
+    for (const BenchmarkShape &shape : shapes) {
+      std::string name = std::string(implementation) + "/" + benchmarkOperationName(operation) + "/"
+                         + std::to_string(shape.m) + "x" + std::to_string(shape.n);
+      if (operation == BenchmarkOperation::MULTIPLY) {
+        name += "x" + std::to_string(shape.k);
+      }
+      if (!benchmarkSelected(name)) {
+        continue;
+      }
+      results.push_back(measureBenchmark(subject, name, operation, shape));
+      printBenchmarkResult(std::cout, results.back());
+      std::cout.flush();
+    }
+  }
+
+  // The same operations on BENCHMARK_BATCH_COUNT tiny pairs per call.
+  BatchedBenchmarkSubject batched;
+  for (BenchmarkOperation operation : {BenchmarkOperation::ADD, BenchmarkOperation::MULTIPLY}) {
+    for (const BenchmarkShape &shape : BATCHED_SHAPES) {
+      std::string name = std::string(implementation) + "/batched_" + benchmarkOperationName(operation) + "/"
+                         + std::to_string(shape.m) + "x" + std::to_string(shape.n);
+      if (operation == BenchmarkOperation::MULTIPLY) {
+        name += "x" + std::to_string(shape.k);
+      }
+      name += "/" + std::to_string(BENCHMARK_BATCH_COUNT);
+      if (!benchmarkSelected(name)) {
+        continue;
+      }
+      BenchmarkResult result = measureBenchmark(batched, name, operation, shape);
+      result.flops *= BENCHMARK_BATCH_COUNT;
+      result.bytes *= BENCHMARK_BATCH_COUNT;
+      results.push_back(result);
+      printBenchmarkResult(std::cout, results.back());
+      std::cout.flush();
+    }
+  }
+
+  if (jsonPath != nullptr) {
+    try {
+      writeBenchmarkJson(jsonPath, implementation, results);
+    } catch (std::string errorMessage) {
+      std::cerr << errorMessage << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+#endif  // MATRIX_BENCHMARK_H_
@@ -0,0 +1,352 @@
+/**
+ * matrix_binary.h
+ * Binary matrix files that load without parsing or copying.
+ * Layout (little endian):
+ *   bytes 0-63    MatrixFileHeader
+ *   bytes 64-     height rows of stride floats; only the first width are used
+ * The stride is paddedStride(width), so the data section has exactly the
+ * layout of the in-memory storage. Loading maps the file copy-on-write and
+ * adopts the mapping as the matrix's storage; the header page doubles as the
+ * allocation header.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_BINARY_H_
+#define MATRIX_BINARY_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+#include "matrix_allocator.h"
+#include "matrix_storage.h"
+
+
+// First bytes of every matrix file.
+const char MATRIX_FILE_MAGIC[8] = {'C', 'S', '4', '0', '8', '0', 'M', 'X'};
+
+const uint32_t MATRIX_FILE_VERSION = 1;
+
+// Written as a number; reads back differently on a machine of the other endianness.
+const uint32_t MATRIX_FILE_BYTE_ORDER = 0x01020304;
+
+// Header flag: the checksum field is valid.
+const uint32_t MATRIX_FILE_HAS_CHECKSUM = 1;
+
+// Extension that makes "save" in batch mode write a binary file.
+const char MATRIX_FILE_EXTENSION[] = ".mtx";
+
+
+/**
+ * Element types a matrix file may hold.
+ */
+enum class MatrixDataType : uint32_t {
+  FLOAT32 = 1
+};
+
+
+struct MatrixFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t dataType;
+  uint32_t flags;
+  uint32_t width;
+  uint32_t height;
+  uint64_t stride;        // Elements from the start of one row to the next.
+  uint64_t dataOffset;    // Bytes from the start of the file to the first element.
+  uint64_t checksum;      // matrixChecksum() of the elements, if flagged.
+  uint8_t reserved[8];
+};
+
+static_assert(sizeof(MatrixFileHeader) == MATRIX_ALIGNMENT, "header must fill one aligned slot");
+
+
+/**
+ * Releases matrix storage that is a mapped file.
+ */
+class MappedFileAllocator : public MatrixAllocator {
+ public:
+  /**
+   * Not supported; mappings are created by loadMatrixBinary().
+   *
+   * @throws std::bad_alloc - always.
+   */
+  void* allocate(size_t) override {
+    throw std::bad_alloc();
+  }
+
+  void deallocate(void* block, size_t bytes) override {
+    munmap(block, bytes);
+    std::lock_guard<std::mutex> lock(_mutex);
+    ++_stats.deallocations;
+    _stats.bytesInUse -= bytes;
+  }
+
+  AllocatorStats stats() const override {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+  }
+
+  const char* name() const override {
+    return "mapped file";
+  }
+
+  /**
+   * Records a new mapping handed to the matrix storage.
+   *
+   * @param bytes - the length of the mapping.
+   */
+  void adopted(size_t bytes) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    ++_stats.allocations;
+    _stats.bytesInUse += bytes;
+  }
+
+ private:
+  mutable std::mutex _mutex;
+  AllocatorStats _stats;
+};
+
+
+/**
+ * Retrieves the process-wide allocator of mapped files.
+ *
+ * @return MappedFileAllocator& - the allocator.
+ */
+inline MappedFileAllocator &mappedFileAllocator() {
+  static MappedFileAllocator allocator;
+  return allocator;
+}
+
+
+/**
+ * Hashes the elements of a matrix (not its padding), 32 bits at a time.
+ *
+ * @param matrix - the matrix.
+ * @return uint64_t - the checksum.
+ */
+inline uint64_t matrixChecksum(const MatrixView &matrix) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (int i = 0; i < matrix.height; ++i) {
+    const float* row = matrix.row(i);
+    for (int j = 0; j < matrix.width; ++j) {
+      uint32_t word = 0;
+      std::memcpy(&word, row + j, sizeof(word));
+      hash = (hash ^ word) * 0x100000001b3ull;
+    }
+  }
+  return hash;
+}
+
+
+/**
+ * Checks whether a file starts with the matrix file magic.
+ *
+ * @param path - the file.
+ * @return bool - whether it is a binary matrix file.
+ */
+inline bool isMatrixBinaryFile(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  char magic[sizeof(MATRIX_FILE_MAGIC)] = {};
+  bool binary = pread(fd, magic, sizeof(magic), 0) == static_cast<ssize_t>(sizeof(magic))
+                && std::memcmp(magic, MATRIX_FILE_MAGIC, sizeof(magic)) == 0;
+  close(fd);
+  return binary;
+}
+
+
+/**
+ * Builds the header of a file in the native layout.
+ *
+ * @param width - the width of the matrix.
+ * @param height - the height of the matrix.
+ * @param flags - the header flags.
+ * @param checksum - the checksum (0 without MATRIX_FILE_HAS_CHECKSUM).
+ * @return MatrixFileHeader - the header.
+ */
+inline MatrixFileHeader makeMatrixFileHeader(int width, int height, uint32_t flags, uint64_t checksum) {
+  MatrixFileHeader header = {};
+  std::memcpy(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic));
+  header.version = MATRIX_FILE_VERSION;
+  header.byteOrder = MATRIX_FILE_BYTE_ORDER;
+  header.dataType = static_cast<uint32_t>(MatrixDataType::FLOAT32);
+  header.flags = flags;
+  header.width = static_cast<uint32_t>(width);
+  header.height = static_cast<uint32_t>(height);
+  header.stride = static_cast<uint64_t>(paddedStride(width));
+  header.dataOffset = MATRIX_ALIGNMENT;
+  header.checksum = checksum;
+  return header;
+}
+
+
+/**
+ * Checks a file header against the format and the dimension policy.
+ *
+ * @param header - the header.
+ * @param fileBytes - the size of the file.
+ * @param error - receives the reason when the header is rejected (may be nullptr).
+ * @return bool - whether the header describes a readable matrix.
+ */
+inline bool checkMatrixFileHeader(const MatrixFileHeader &header, size_t fileBytes, std::string* error) {
+  std::string reason;
+  std::string dimensionError;
+  if (std::memcmp(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic)) != 0) {
+    reason = "not a matrix file";
+  } else if (header.version != MATRIX_FILE_VERSION) {
+    reason = "unsupported version " + std::to_string(header.version);
+  } else if (header.byteOrder != MATRIX_FILE_BYTE_ORDER) {
+    reason = "written with the other byte order";
+  } else if (header.dataType != static_cast<uint32_t>(MatrixDataType::FLOAT32)) {
+    reason = "unsupported element type " + std::to_string(header.dataType);
+  } else if (!checkDimensions(header.width, header.height, &dimensionError)) {
+    reason = dimensionError;
+  } else if (header.stride < header.width || header.stride > (uint64_t(1) << 40)
+             || header.dataOffset < sizeof(MatrixFileHeader) || header.dataOffset % sizeof(float) != 0
+             || header.dataOffset > fileBytes) {
+    reason = "data section does not fit the file";
+  } else {
+    // The last row starts stride * (height - 1) elements in; divide rather
+    // than multiply so a huge stride cannot wrap around.
+    uint64_t available = (fileBytes - header.dataOffset) / sizeof(float);
+    if (available < header.width || header.height - 1 > (available - header.width) / header.stride) {
+      reason = "data section does not fit the file";
+    }
+  }
+
+  if (error != nullptr) {
+    *error = reason;
+  }
+  return reason.empty();
+}
+
+
+/**
+ * Loads a binary matrix file.
+ * Files in the native layout are mapped copy-on-write and used in place, so
+ * loading costs no parsing or copying and pages are read on first touch.
+ * Other strides or data offsets are copied into fresh storage.
+ *
+ * @param path - the file.
+ * @param verify - whether to check the checksum, when the file has one.
+ * @return MatrixView - the matrix; its stride is paddedStride(width) and its
+ *                      storage is released with freeMatrixData(view.data).
+ * @throws std::string - unreadable, malformed or corrupt file.
+ */
+inline MatrixView loadMatrixBinary(const std::string &path, bool verify = true) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw(std::string("[Binary] ERROR: cannot open \"" + path + "\": " + std::strerror(errno)));
+  }
+  struct stat status;
+  if (fstat(fd, &status) != 0 || static_cast<size_t>(status.st_size) < sizeof(MatrixFileHeader)) {
+    close(fd);
+    throw(std::string("[Binary] ERROR: \"" + path + "\" is too short for a matrix file."));
+  }
+  size_t fileBytes = static_cast<size_t>(status.st_size);
+  void* mapping = mmap(nullptr, fileBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    throw(std::string("[Binary] ERROR: cannot map \"" + path + "\": " + std::strerror(errno)));
+  }
+
+  // Validate the header before trusting any of it.
+  MatrixFileHeader header;
+  std::memcpy(&header, mapping, sizeof(header));
+  std::string error;
+  if (!checkMatrixFileHeader(header, fileBytes, &error)) {
+    munmap(mapping, fileBytes);
+    throw(std::string("[Binary] ERROR: \"" + path + "\": " + error + "."));
+  }
+
+  int width = static_cast<int>(header.width);
+  int height = static_cast<int>(header.height);
+  int stride = paddedStride(width);
+  MatrixView matrix = {nullptr, width, height, stride};
+  bool native = header.dataOffset == MATRIX_ALIGNMENT && header.stride == static_cast<uint64_t>(stride)
+                && (fileBytes - MATRIX_ALIGNMENT) / sizeof(float) >= static_cast<size_t>(stride) * height;
+  if (native) {
+    matrix.data = adoptMatrixData(mapping, fileBytes, &mappedFileAllocator());
+    mappedFileAllocator().adopted(fileBytes);
+  } else {
+    matrix.data = allocateMatrixData(static_cast<size_t>(stride) * height);
+    const float* source = reinterpret_cast<const float*>(static_cast<char*>(mapping) + header.dataOffset);
+    for (int i = 0; i < height; ++i) {
+      std::memcpy(matrix.row(i), source + header.stride * i, sizeof(float) * width);
+    }
+    munmap(mapping, fileBytes);
+  }
+
+  if (verify && (header.flags & MATRIX_FILE_HAS_CHECKSUM) != 0
+      && matrixChecksum(matrix) != header.checksum) {
+    freeMatrixData(matrix.data);
+    throw(std::string("[Binary] ERROR: \"" + path + "\": checksum mismatch."));
+  }
+  return matrix;
+}
+
+
+/**
+ * Writes a binary matrix file in the native layout.
+ * The file is built under a temporary name and renamed into place, so a
+ * matrix mapped from the old file stays valid.
+ *
+ * @param path - the file.
+ * @param matrix - the matrix.
+ * @param checksum - whether to store a checksum.
+ * @throws std::string - the file cannot be written.
+ */
+inline void saveMatrixBinary(const std::string &path, const MatrixView &matrix, bool checksum = true) {
+  int stride = paddedStride(matrix.width);
+  size_t fileBytes = MATRIX_ALIGNMENT + sizeof(float) * static_cast<size_t>(stride) * matrix.height;
+  std::string temporary = path + ".tmp";
+  int fd = open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw(std::string("[Binary] ERROR: cannot write \"" + path + "\": " + std::strerror(errno)));
+  }
+  void* mapping = MAP_FAILED;
+  if (ftruncate(fd, static_cast<off_t>(fileBytes)) == 0) {
+    mapping = mmap(nullptr, fileBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (mapping == MAP_FAILED) {
+    std::string reason = std::strerror(errno);
+    close(fd);
+    unlink(temporary.c_str());
+    throw(std::string("[Binary] ERROR: cannot write \"" + path + "\": " + reason));
+  }
+
+  uint64_t sum = checksum ? matrixChecksum(matrix) : 0;
+  MatrixFileHeader header = makeMatrixFileHeader(matrix.width, matrix.height,
+                                                 checksum ? MATRIX_FILE_HAS_CHECKSUM : 0, sum);
+  std::memcpy(mapping, &header, sizeof(header));
+
+  // The padding stays zero from ftruncate().
+  MatrixView file = {reinterpret_cast<float*>(static_cast<char*>(mapping) + MATRIX_ALIGNMENT),
+                     matrix.width, matrix.height, stride};
+  for (int i = 0; i < matrix.height; ++i) {
+    std::memcpy(file.row(i), matrix.row(i), sizeof(float) * matrix.width);
+  }
+
+  munmap(mapping, fileBytes);
+  close(fd);
+  if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::string reason = std::strerror(errno);
+    unlink(temporary.c_str());
+    throw(std::string("[Binary] ERROR: cannot write \"" + path + "\": " + reason));
+  }
+}
+
+#endif  // MATRIX_BINARY_H_
@@ -0,0 +1,451 @@
+/**
+ * matrix_cache.h
+ * Memoized results of sums, differences and products.
+ * A result is keyed by the operation and a 64-bit content hash of each
+ * operand (plus their dimensions and element type), so asking again for the
+ * same operation on unchanged operands costs a lookup instead of the
+ * arithmetic. Callers compute an operand's hash once, when its values are
+ * entered, and keep it until they change; a re-entered matrix also drops the
+ * results made from its old contents, while an edited one has them patched
+ * and filed under its new contents (see matrix_incremental.h). Entries are evicted least recently used
+ * first once the cached results exceed MATRIX_CACHE_BYTES. Two different
+ * operands with the same hash would share a result; with a 64-bit hash that
+ * takes billions of distinct operands.
+ * The cache is not synchronized: use it from one thread (the menu loop, or
+ * the compute stage of batch mode).
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_CACHE_H_
+#define MATRIX_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <list>
+#include <ostream>
+#include <string>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+#include "matrix_allocator.h"
+#include "matrix_gemm.h"
+#include "matrix_storage.h"
+
+
+// Bytes of results kept by default (MATRIX_CACHE_BYTES).
+const size_t DEFAULT_CACHE_BYTES = size_t(256) << 20;
+
+// Multipliers of the content hash (those of XXH64).
+const uint64_t HASH_PRIME_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t HASH_PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t HASH_PRIME_3 = 0x165667B19E3779F9ULL;
+
+
+/**
+ * Operations whose results are cached.
+ */
+enum class CachedOperation {
+  SUM,
+  DIFFERENCE,
+  PRODUCT
+};
+
+
+/**
+ * Mixes one 64-bit word into a hash lane.
+ *
+ * @param lane - the lane.
+ * @param word - the word.
+ * @return uint64_t - the new lane.
+ */
+inline uint64_t hashRound(uint64_t lane, uint64_t word) {
+  lane += word * HASH_PRIME_2;
+  lane = (lane << 31) | (lane >> 33);
+  return lane * HASH_PRIME_1;
+}
+
+
+/**
+ * Hashes a run of bytes into a running hash. Four independent lanes take
+ * 32 bytes per step, so hashing runs at several bytes per cycle.
+ *
+ * @param bytes - the bytes.
+ * @param count - the number of bytes.
+ * @param hash - the running hash.
+ * @return uint64_t - the new hash.
+ */
+inline uint64_t hashBytes(const unsigned char* bytes, size_t count, uint64_t hash) {
+  uint64_t lanes[4] = {hash + HASH_PRIME_1 + HASH_PRIME_2, hash + HASH_PRIME_2, hash, hash - HASH_PRIME_1};
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    for (int l = 0; l < 4; ++l) {
+      uint64_t word;
+      std::memcpy(&word, bytes + i + 8 * l, sizeof(word));
+      lanes[l] = hashRound(lanes[l], word);
+    }
+  }
+  for (; i + 8 <= count; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, bytes + i, sizeof(word));
+    lanes[0] = hashRound(lanes[0], word);
+  }
+  for (; i < count; ++i) {
+    lanes[1] = hashRound(lanes[1], bytes[i]);
+  }
+
+  hash = hashRound(hashRound(hashRound(hashRound(count, lanes[0]), lanes[1]), lanes[2]), lanes[3]);
+  hash ^= hash >> 33;
+  hash *= HASH_PRIME_2;
+  hash ^= hash >> 29;
+  hash *= HASH_PRIME_3;
+  return hash ^ (hash >> 32);
+}
+
+
+/**
+ * Hashes the elements of a matrix (not its padding).
+ *
+ * @param matrix - the matrix.
+ * @return uint64_t - the hash.
+ */
+template <typename T>
+uint64_t hashMatrix(const BasicMatrixView<T> &matrix) {
+  uint64_t hash = hashRound(static_cast<uint64_t>(matrix.width), static_cast<uint64_t>(matrix.height));
+  for (int i = 0; i < matrix.height; ++i) {
+    hash = hashBytes(reinterpret_cast<const unsigned char*>(matrix.row(i)), sizeof(T) * matrix.width, hash);
+  }
+  return hash;
+}
+
+
+/**
+ * What a cached result was computed from.
+ */
+struct ResultKey {
+  CachedOperation operation;
+  std::type_index type = typeid(void);  // Element type of the operands.
+  uint64_t hash1;
+  uint64_t hash2;
+  int width1;
+  int height1;
+  int width2;
+  int height2;
+  Transpose transpose1;
+  Transpose transpose2;
+
+  /**
+   * Operator overloading for equality of keys.
+   *
+   * @param key - the other key.
+   * @return bool - whether every field matches.
+   */
+  bool operator==(const ResultKey &key) const {
+    return operation == key.operation && type == key.type && hash1 == key.hash1 && hash2 == key.hash2
+           && width1 == key.width1 && height1 == key.height1 && width2 == key.width2
+           && height2 == key.height2 && transpose1 == key.transpose1 && transpose2 == key.transpose2;
+  }
+};
+
+
+/**
+ * Hash of a key for the cache's index.
+ */
+struct ResultKeyHash {
+  size_t operator()(const ResultKey &key) const {
+    uint64_t hash = hashRound(key.hash1, key.hash2);
+    hash = hashRound(hash, static_cast<uint64_t>(key.operation) << 2 | static_cast<uint64_t>(key.transpose1) << 1
+                               | static_cast<uint64_t>(key.transpose2));
+    return static_cast<size_t>(hashRound(hash, key.type.hash_code()));
+  }
+};
+
+
+/**
+ * Builds the key of an operation on two matrices.
+ *
+ * @param operation - the operation.
+ * @param matrix1 - the first operand.
+ * @param hash1 - its content hash (hashMatrix()).
+ * @param matrix2 - the second operand.
+ * @param hash2 - its content hash.
+ * @param transpose1 - whether a product reads the first operand transposed.
+ * @param transpose2 - whether a product reads the second operand transposed.
+ * @return ResultKey - the key.
+ */
+template <typename T>
+ResultKey resultKey(CachedOperation operation, const BasicMatrixView<T> &matrix1, uint64_t hash1,
+                    const BasicMatrixView<T> &matrix2, uint64_t hash2, Transpose transpose1 = Transpose::NONE,
+                    Transpose transpose2 = Transpose::NONE) {
+  return ResultKey{operation, typeid(T), hash1, hash2, matrix1.width, matrix1.height, matrix2.width,
+                   matrix2.height, transpose1, transpose2};
+}
+
+
+/**
+ * Counters of a result cache.
+ */
+struct ResultCacheStats {
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t insertions = 0;
+  size_t evictions = 0;
+  size_t invalidations = 0;
+  size_t patches = 0;
+  size_t bytesHeld = 0;
+  size_t entries = 0;
+};
+
+
+/**
+ * Byte-bounded LRU map from operations to copies of their results.
+ */
+class ResultCache {
+ public:
+  /**
+   * Constructor.
+   *
+   * @param capacity - the most bytes of results to keep (0 disables the cache).
+   */
+  explicit ResultCache(size_t capacity) : _capacity(capacity) {
+    // Construct the allocator first so it outlives the entries at exit.
+    persistentMatrixAllocator();
+  }
+
+  ResultCache(const ResultCache &) = delete;
+  ResultCache &operator=(const ResultCache &) = delete;
+
+  ~ResultCache() {
+    clear();
+  }
+
+
+  /**
+   * Retrieves whether results are kept at all.
+   *
+   * @return bool - whether the capacity is above zero.
+   */
+  bool enabled() const {
+    return _capacity > 0;
+  }
+
+
+  /**
+   * Looks a result up and marks it most recently used.
+   *
+   * @param key - what the result was computed from.
+   * @return BasicMatrixView<R> - the cached result, valid until the next
+   *                              insert(), invalidate() or clear(); no data on a miss.
+   */
+  template <typename R>
+  BasicMatrixView<R> find(const ResultKey &key) {
+    auto found = _index.find(key);
+    if (found == _index.end() || found->second->resultType != typeid(R)) {
+      ++_stats.misses;
+      return BasicMatrixView<R>{nullptr, 0, 0, 0};
+    }
+    ++_stats.hits;
+    _entries.splice(_entries.begin(), _entries, found->second);
+    const Entry &entry = *found->second;
+    return BasicMatrixView<R>{static_cast<R*>(entry.data), entry.width, entry.height, entry.stride};
+  }
+
+
+  /**
+   * Keeps a copy of a result, evicting the least recently used ones to make room.
+   * Results larger than the whole cache are not kept.
+   *
+   * @param key - what the result was computed from.
+   * @param result - the result.
+   */
+  template <typename R>
+  void insert(const ResultKey &key, const BasicMatrixView<R> &result) {
+    int stride = paddedStrideOf<R>(result.width);
+    size_t bytes = sizeof(R) * static_cast<size_t>(stride) * result.height;
+    if (bytes > _capacity) {
+      return;
+    }
+    erase(key);
+    while (_stats.bytesHeld + bytes > _capacity) {
+      ++_stats.evictions;
+      erase(_entries.back().key);
+    }
+
+    // Entries outlive the request they are made in, so keep them out of the request arena.
+    PersistentAllocatorScope persistent;
+    R* data = allocateElements<R>(static_cast<size_t>(stride) * result.height);
+    for (int i = 0; i < result.height; ++i) {
+      std::memcpy(data + static_cast<size_t>(i) * stride, result.row(i), sizeof(R) * result.width);
+    }
+    _entries.push_front(Entry{key, typeid(R), data, result.width, result.height, stride, bytes});
+    _index[key] = _entries.begin();
+    _stats.bytesHeld += bytes;
+    ++_stats.insertions;
+  }
+
+
+  /**
+   * Files a result under a new key, for a caller that patches it after an
+   * operand was edited (see matrix_incremental.h). Any result already under
+   * the new key is replaced.
+   *
+   * @param from - the key the result is kept under.
+   * @param to - the key to keep it under.
+   * @return BasicMatrixView<R> - the result, writable and valid until the next
+   *                              insert(), invalidate() or clear(); no data if
+   *                              nothing was kept under from.
+   */
+  template <typename R>
+  BasicMatrixView<R> rekey(const ResultKey &from, const ResultKey &to) {
+    auto found = _index.find(from);
+    if (found == _index.end() || found->second->resultType != typeid(R)) {
+      return BasicMatrixView<R>{nullptr, 0, 0, 0};
+    }
+    auto entry = found->second;
+    _index.erase(found);
+    if (!(to == from)) {
+      erase(to);
+    }
+    entry->key = to;
+    _index[to] = entry;
+    _entries.splice(_entries.begin(), _entries, entry);
+    ++_stats.patches;
+    return BasicMatrixView<R>{static_cast<R*>(entry->data), entry->width, entry->height, entry->stride};
+  }
+
+
+  /**
+   * Lists the keys of every result computed from an operand with the given content.
+   *
+   * @param hash - the operand's content hash.
+   * @return std::vector<ResultKey> - the keys, most recently used first.
+   */
+  std::vector<ResultKey> keysWith(uint64_t hash) const {
+    std::vector<ResultKey> keys;
+    for (const Entry &entry : _entries) {
+      if (entry.key.hash1 == hash || entry.key.hash2 == hash) {
+        keys.push_back(entry.key);
+      }
+    }
+    return keys;
+  }
+
+
+  /**
+   * Drops every result computed from an operand with the given content.
+   *
+   * @param hash - the operand's content hash.
+   */
+  void invalidate(uint64_t hash) {
+    for (auto entry = _entries.begin(); entry != _entries.end();) {
+      auto next = std::next(entry);
+      if (entry->key.hash1 == hash || entry->key.hash2 == hash) {
+        ++_stats.invalidations;
+        erase(entry->key);
+      }
+      entry = next;
+    }
+  }
+
+
+  /**
+   * Drops every result.
+   */
+  void clear() {
+    while (!_entries.empty()) {
+      erase(_entries.back().key);
+    }
+  }
+
+
+  /**
+   * Retrieves the counters.
+   *
+   * @return ResultCacheStats - the counters.
+   */
+  ResultCacheStats stats() const {
+    ResultCacheStats stats = _stats;
+    stats.entries = _entries.size();
+    return stats;
+  }
+
+
+ private:
+  struct Entry {
+    ResultKey key;
+    std::type_index resultType;
+    void* data;
+    int width;
+    int height;
+    int stride;
+    size_t bytes;
+  };
+
+  size_t _capacity;
+  std::list<Entry> _entries;  // Most recently used first.
+  std::unordered_map<ResultKey, std::list<Entry>::iterator, ResultKeyHash> _index;
+  ResultCacheStats _stats;
+
+
+  /**
+   * Removes an entry and frees its result.
+   *
+   * @param key - the entry's key.
+   */
+  void erase(const ResultKey &key) {
+    auto found = _index.find(key);
+    if (found == _index.end()) {
+      return;
+    }
+    _stats.bytesHeld -= found->second->bytes;
+    freeElements(static_cast<unsigned char*>(found->second->data));
+    _entries.erase(found->second);
+    _index.erase(found);
+  }
+};
+
+
+/**
+ * Retrieves the process-wide result cache, sized by MATRIX_CACHE_BYTES
+ * (default 256 MiB; 0 turns caching off).
+ *
+ * @return ResultCache& - the cache.
+ */
+inline ResultCache &resultCache() {
+  static ResultCache cache([] {
+    const char* setting = std::getenv("MATRIX_CACHE_BYTES");
+    if (setting == nullptr || *setting == '\0') {
+      return DEFAULT_CACHE_BYTES;
+    }
+    char* end = nullptr;
+    unsigned long long value = std::strtoull(setting, &end, 10);
+    return *end == '\0' ? static_cast<size_t>(value) : DEFAULT_CACHE_BYTES;
+  }());
+  return cache;
+}
+
+
+/**
+ * Prints the counters of the result cache when MATRIX_CACHE_STATS=1.
+ *
+ * @param os - the output stream.
+ */
+inline void reportResultCacheStats(std::ostream &os) {
+  const char* env = std::getenv("MATRIX_CACHE_STATS");
+  if (env == nullptr || std::string(env) != "1") {
+    return;
+  }
+  ResultCacheStats stats = resultCache().stats();
+  os << "[result cache] hits: " << stats.hits << ", misses: " << stats.misses
+     << ", insertions: " << stats.insertions << ", evictions: " << stats.evictions
+     << ", invalidations: " << stats.invalidations << ", patched: " << stats.patches
+     << ", entries: " << stats.entries
+     << ", bytes held: " << stats.bytesHeld << "\n";
+}
+
+#endif  // MATRIX_CACHE_H_
@@ -0,0 +1,379 @@
+/**
+ * matrix_chain.h
+ * Products of many matrices, A1 * A2 * ... * An, evaluated in the cheapest
+ * order. Left to right can cost orders of magnitude more than necessary when
+ * the shapes differ (a tall-skinny factor early on keeps every intermediate
+ * small, a wide one makes them all huge), so the order is planned first by
+ * the classic O(n^3) dynamic program over the dimensions. The plan then runs
+ * through the GEMM engine; each intermediate product goes into a buffer from
+ * a small pool, so a buffer is reused as soon as its product has been consumed,
+ * and the last product is written straight into the destination.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_CHAIN_H_
+#define MATRIX_CHAIN_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "matrix_gemm.h"
+#include "matrix_instrumentation.h"
+#include "matrix_storage.h"
+#include "matrix_transpose.h"
+
+
+/**
+ * One factor of a chain: a matrix and whether it is used transposed.
+ */
+struct ChainFactor {
+  MatrixView matrix;
+  Transpose trans;
+
+  /**
+   * Retrieves the rows of op(matrix).
+   *
+   * @return int - the rows.
+   */
+  int rows() const {
+    return trans == Transpose::TRANSPOSED ? matrix.width : matrix.height;
+  }
+
+  /**
+   * Retrieves the columns of op(matrix).
+   *
+   * @return int - the columns.
+   */
+  int columns() const {
+    return trans == Transpose::TRANSPOSED ? matrix.height : matrix.width;
+  }
+};
+
+
+/**
+ * The cheapest order of a chain and what it costs.
+ */
+class ChainPlan {
+ public:
+  /**
+   * Plans a chain by dynamic programming over its dimensions.
+   *
+   * @param factors - the factors, at least one.
+   * @throws std::string - no factors, or adjacent factors whose dimensions do not match.
+   */
+  explicit ChainPlan(const std::vector<ChainFactor> &factors) : _count(static_cast<int>(factors.size())) {
+    if (_count == 0) {
+      throw(std::string("[Chain] ERROR: no matrices to multiply."));
+    }
+    _dimensions.push_back(factors[0].rows());
+    for (int i = 0; i < _count; ++i) {
+      if (factors[i].rows() != _dimensions.back()) {
+        throw(std::string("[Chain] ERROR: matrix " + std::to_string(i) + "'s width does not match matrix "
+                          + std::to_string(i + 1) + "'s height."));
+      }
+      _dimensions.push_back(factors[i].columns());
+    }
+
+    // cost(i, j) is the cheapest way to form factors i..j; split(i, j) is the
+    // last factor of its left part. Costs are doubles: they overflow 64 bits.
+    std::vector<double> cost(static_cast<size_t>(_count) * _count, 0.0);
+    _split.assign(static_cast<size_t>(_count) * _count, 0);
+    for (int length = 2; length <= _count; ++length) {
+      for (int i = 0; i + length <= _count; ++i) {
+        int j = i + length - 1;
+        double best = -1.0;
+        for (int s = i; s < j; ++s) {
+          double candidate = cost[index(i, s)] + cost[index(s + 1, j)] + productFlops(i, s, j);
+          if (best < 0.0 || candidate < best) {
+            best = candidate;
+            _split[index(i, j)] = s;
+          }
+        }
+        cost[index(i, j)] = best;
+      }
+    }
+    _flops = cost[index(0, _count - 1)];
+
+    _naiveFlops = 0.0;
+    for (int s = 0; s + 1 < _count; ++s) {
+      _naiveFlops += productFlops(0, s, s + 1);
+    }
+  }
+
+
+  /**
+   * Retrieves the number of factors.
+   *
+   * @return int - the count.
+   */
+  int getCount() const {
+    return _count;
+  }
+
+
+  /**
+   * Retrieves the width of the product.
+   *
+   * @return int - the columns of the last factor.
+   */
+  int getWidth() const {
+    return _dimensions.back();
+  }
+
+
+  /**
+   * Retrieves the height of the product.
+   *
+   * @return int - the rows of the first factor.
+   */
+  int getHeight() const {
+    return _dimensions.front();
+  }
+
+
+  /**
+   * Retrieves the floating-point operations of the planned order.
+   *
+   * @return double - 2 * m * n * k summed over its products.
+   */
+  double getFlops() const {
+    return _flops;
+  }
+
+
+  /**
+   * Retrieves the floating-point operations of the left-to-right order.
+   *
+   * @return double - 2 * m * n * k summed over its products.
+   */
+  double getNaiveFlops() const {
+    return _naiveFlops;
+  }
+
+
+  /**
+   * Retrieves where the product of factors first..last is split.
+   *
+   * @param first - the first factor.
+   * @param last - the last factor (greater than first).
+   * @return int - the last factor of the left part.
+   */
+  int getSplit(int first, int last) const {
+    return _split[index(first, last)];
+  }
+
+
+  /**
+   * Retrieves the rows of a factor, or the columns of the one before it.
+   *
+   * @param i - the factor, 0 to getCount(); getCount() gives the product's width.
+   * @return int - the dimension.
+   */
+  int getDimension(int i) const {
+    return _dimensions[i];
+  }
+
+
+  /**
+   * Writes the order out with parentheses, e.g. "(A (B C)) D".
+   *
+   * @param names - the factor names, getCount() of them.
+   * @return std::string - the order.
+   */
+  std::string describe(const std::vector<std::string> &names) const {
+    return describe(names, 0, _count - 1, false);
+  }
+
+
+ private:
+  int _count;
+  std::vector<int> _dimensions;  // Factor i is _dimensions[i] x _dimensions[i + 1].
+  std::vector<int> _split;
+  double _flops;
+  double _naiveFlops;
+
+
+  /**
+   * Retrieves where the entry of factors first..last is kept in the tables.
+   *
+   * @param first - the first factor.
+   * @param last - the last factor.
+   * @return size_t - the index.
+   */
+  size_t index(int first, int last) const {
+    return static_cast<size_t>(first) * _count + last;
+  }
+
+
+  /**
+   * Retrieves the operations of multiplying the product of factors first..split
+   * by the product of split + 1..last.
+   *
+   * @param first - the first factor.
+   * @param split - the last factor of the left part.
+   * @param last - the last factor.
+   * @return double - 2 * m * n * k.
+   */
+  double productFlops(int first, int split, int last) const {
+    return 2.0 * _dimensions[first] * _dimensions[split + 1] * _dimensions[last + 1];
+  }
+
+
+  /**
+   * Writes the order of factors first..last out.
+   *
+   * @param names - the factor names.
+   * @param first - the first factor.
+   * @param last - the last factor.
+   * @param nested - whether to put the product in parentheses.
+   * @return std::string - the order.
+   */
+  std::string describe(const std::vector<std::string> &names, int first, int last, bool nested) const {
+    if (first == last) {
+      return names[first];
+    }
+    int split = getSplit(first, last);
+    std::string text = describe(names, first, split, true) + " " + describe(names, split + 1, last, true);
+    return nested ? "(" + text + ")" : text;
+  }
+};
+
+
+/**
+ * Aligned buffers for the intermediate products of a chain. A released buffer
+ * is handed out again for any later product that fits in it.
+ */
+class ChainBuffers {
+ public:
+  ChainBuffers() = default;
+  ChainBuffers(const ChainBuffers &) = delete;
+  ChainBuffers &operator=(const ChainBuffers &) = delete;
+
+  ~ChainBuffers() {
+    for (Block &block : _blocks) {
+      freeMatrixData(block.data);
+    }
+  }
+
+  /**
+   * Takes a buffer for a width x height product: the smallest free one that
+   * is large enough, or a new one.
+   *
+   * @param width - the width.
+   * @param height - the height.
+   * @return MatrixView - the buffer (stride paddedStride(width)).
+   */
+  MatrixView take(int width, int height) {
+    int stride = paddedStride(width);
+    size_t count = static_cast<size_t>(stride) * height;
+    Block* best = nullptr;
+    for (Block &block : _blocks) {
+      if (!block.used && block.capacity >= count && (best == nullptr || block.capacity < best->capacity)) {
+        best = &block;
+      }
+    }
+    if (best == nullptr) {
+      _blocks.push_back(Block{allocateMatrixData(count), count, false});
+      best = &_blocks.back();
+    }
+    best->used = true;
+    return MatrixView{best->data, width, height, stride};
+  }
+
+  /**
+   * Gives a buffer back for reuse.
+   *
+   * @param view - a buffer from take().
+   */
+  void release(const MatrixView &view) {
+    for (Block &block : _blocks) {
+      if (block.data == view.data) {
+        block.used = false;
+      }
+    }
+  }
+
+ private:
+  struct Block {
+    float* data;
+    size_t capacity;
+    bool used;
+  };
+
+  std::vector<Block> _blocks;
+};
+
+
+/**
+ * Forms the product of factors first..last following the plan.
+ *
+ * @param plan - the plan.
+ * @param factors - the factors.
+ * @param first - the first factor.
+ * @param last - the last factor.
+ * @param out - the destination, or no data to take a buffer from the pool.
+ * @param buffers - the pool for intermediate products.
+ * @return ChainFactor - the product (out, a pooled buffer, or the factor itself if first == last).
+ */
+inline ChainFactor multiplyChainRange(const ChainPlan &plan, const std::vector<ChainFactor> &factors, int first,
+                                      int last, MatrixView out, ChainBuffers &buffers) {
+  if (first == last) {
+    return factors[first];
+  }
+  int split = plan.getSplit(first, last);
+  ChainFactor lhs = multiplyChainRange(plan, factors, first, split, MatrixView{nullptr, 0, 0, 0}, buffers);
+  ChainFactor rhs = multiplyChainRange(plan, factors, split + 1, last, MatrixView{nullptr, 0, 0, 0}, buffers);
+
+  int m = plan.getDimension(first);
+  int k = plan.getDimension(split + 1);
+  int n = plan.getDimension(last + 1);
+  if (out.data == nullptr) {
+    out = buffers.take(n, m);
+  }
+  multiply(lhs.trans, rhs.trans, m, n, k, lhs.matrix.data, lhs.matrix.stride, rhs.matrix.data, rhs.matrix.stride,
+           out.data, out.stride);
+
+  // Intermediate operands have been consumed; their buffers can hold later products.
+  if (split > first) {
+    buffers.release(lhs.matrix);
+  }
+  if (last > split + 1) {
+    buffers.release(rhs.matrix);
+  }
+  return ChainFactor{out, Transpose::NONE};
+}
+
+
+/**
+ * Computes out = op(A1) * op(A2) * ... * op(An) in the planned order.
+ * out must not overlap any factor.
+ *
+ * @param plan - the plan of the factors.
+ * @param factors - the factors.
+ * @param out - the destination (plan.getWidth() wide, plan.getHeight() high).
+ */
+inline void multiplyChain(const ChainPlan &plan, const std::vector<ChainFactor> &factors, const MatrixView &out) {
+  double bytes = sizeof(float) * static_cast<double>(plan.getWidth()) * plan.getHeight();
+  for (const ChainFactor &factor : factors) {
+    bytes += sizeof(float) * static_cast<double>(factor.matrix.width) * factor.matrix.height;
+  }
+  ProfileScope profile(ProfileSection::MULTIPLY, plan.getFlops(), bytes);
+
+  if (plan.getCount() == 1) {
+    if (factors[0].trans == Transpose::TRANSPOSED) {
+      transposeMatrix(factors[0].matrix, out);
+    } else {
+      for (int i = 0; i < out.height; ++i) {
+        std::copy(factors[0].matrix.row(i), factors[0].matrix.row(i) + out.width, out.row(i));
+      }
+    }
+    return;
+  }
+  ChainBuffers buffers;
+  multiplyChainRange(plan, factors, 0, plan.getCount() - 1, out, buffers);
+}
+
+#endif  // MATRIX_CHAIN_H_
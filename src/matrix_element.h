@@ -0,0 +1,916 @@
+/**
+ * matrix_element.h
+ * Element types other than float and the kernels that go with them.
+ * Every type has an accumulation rule (ElementTraits): double accumulates in
+ * double, the 16-bit types (fp16, bf16) are storage only and accumulate in
+ * float, int8 accumulates in int32 and its products are int32 matrices.
+ * Results are rounded (to nearest even) or saturated back to the stored type
+ * once, after the whole sum, never per step.
+ * float matrices keep using the kernels of matrix_simd.h and matrix_gemm.h;
+ * fp16 and bf16 are widened a block at a time and reuse them too.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_ELEMENT_H_
+#define MATRIX_ELEMENT_H_
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "matrix_format.h"
+#include "matrix_gemm.h"
+#include "matrix_instrumentation.h"
+#include "matrix_parser.h"
+#include "matrix_simd.h"
+#include "matrix_storage.h"
+#include "thread_pool.h"
+
+
+// Elements of the 16-bit types widened to float at a time by sums.
+const int ELEMENT_CONVERT_CHUNK = 1024;
+
+// Rows of a product accumulated together, so each row of b is loaded once per block.
+const int ELEMENT_BLOCK_ROWS = 8;
+
+// Columns of a product accumulated together (8 x 512 doubles = 32 KiB of accumulators).
+const int ELEMENT_BLOCK_COLS = 512;
+
+// Products with fewer multiply-adds than this run on one thread.
+const double ELEMENT_PARALLEL_THRESHOLD = 1 << 20;
+
+
+/**
+ * IEEE 754 half precision (binary16) number, stored only.
+ */
+struct Half {
+  uint16_t bits;
+};
+
+
+/**
+ * bfloat16 number (the upper half of a float), stored only.
+ */
+struct BFloat16 {
+  uint16_t bits;
+};
+
+
+/**
+ * The element types a matrix can hold.
+ */
+enum class ElementType {
+  FLOAT,
+  DOUBLE,
+  FLOAT16,
+  BFLOAT16,
+  INT8
+};
+
+
+/**
+ * Parses an element type name: float, double, fp16, bf16 or int8.
+ *
+ * @param text - the name.
+ * @param type - receives the type.
+ * @return bool - whether the name was valid.
+ */
+inline bool parseElementType(const std::string &text, ElementType* type) {
+  if (text == "float") {
+    *type = ElementType::FLOAT;
+  } else if (text == "double") {
+    *type = ElementType::DOUBLE;
+  } else if (text == "fp16") {
+    *type = ElementType::FLOAT16;
+  } else if (text == "bf16") {
+    *type = ElementType::BFLOAT16;
+  } else if (text == "int8") {
+    *type = ElementType::INT8;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+
+/**
+ * Retrieves the element type picked with MATRIX_ELEMENT (default float).
+ *
+ * @return ElementType - the type.
+ */
+inline ElementType elementTypeSetting() {
+  static ElementType type = [] {
+    ElementType parsed = ElementType::FLOAT;
+    const char* env = std::getenv("MATRIX_ELEMENT");
+    if (env != nullptr && !parseElementType(env, &parsed)) {
+      parsed = ElementType::FLOAT;
+    }
+    return parsed;
+  }();
+  return type;
+}
+
+
+/**
+ * Converts a float to the nearest half, ties to even; overflow gives infinity.
+ *
+ * @param value - the float.
+ * @return Half - the half.
+ */
+inline Half floatToHalf(float value) {
+  uint32_t bits = 0;
+  std::memcpy(&bits, &value, sizeof(bits));
+  uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000u);
+  uint32_t magnitude = bits & 0x7FFFFFFFu;
+
+  if (magnitude >= 0x7F800000u) {
+    // Infinity stays infinity, NaN stays a (quiet) NaN.
+    return Half{static_cast<uint16_t>(sign | 0x7C00u | (magnitude > 0x7F800000u ? 0x0200u : 0))};
+  }
+  if (magnitude >= 0x477FF000u) {
+    // At least 65520 rounds past the largest half.
+    return Half{static_cast<uint16_t>(sign | 0x7C00u)};
+  }
+  if (magnitude < 0x38800000u) {
+    // Below the smallest normal half: shift the mantissa into a subnormal.
+    int shift = 113 - static_cast<int>(magnitude >> 23);
+    if (shift > 11) {
+      // Less than half the smallest subnormal (ties go to the even zero).
+      return Half{sign};
+    }
+    uint32_t mantissa = (magnitude & 0x007FFFFFu) | 0x00800000u;
+    uint32_t half = mantissa >> (shift + 13);
+    uint32_t rest = mantissa & ((1u << (shift + 13)) - 1);
+    uint32_t midpoint = 1u << (shift + 12);
+    if (rest > midpoint || (rest == midpoint && (half & 1u))) {
+      ++half;
+    }
+    return Half{static_cast<uint16_t>(sign | half)};
+  }
+
+  // Normal: rebias the exponent and round the mantissa to 10 bits.
+  uint32_t half = (magnitude - 0x38000000u) >> 13;
+  uint32_t rest = magnitude & 0x1FFFu;
+  if (rest > 0x1000u || (rest == 0x1000u && (half & 1u))) {
+    ++half;
+  }
+  return Half{static_cast<uint16_t>(sign | half)};
+}
+
+
+/**
+ * Converts a half to a float (exactly).
+ *
+ * @param value - the half.
+ * @return float - the float.
+ */
+inline float halfToFloat(Half value) {
+  uint32_t sign = static_cast<uint32_t>(value.bits & 0x8000u) << 16;
+  uint32_t exponent = (value.bits >> 10) & 0x1Fu;
+  uint32_t mantissa = value.bits & 0x03FFu;
+  uint32_t bits = 0;
+  if (exponent == 0x1Fu) {
+    bits = sign | 0x7F800000u | (mantissa << 13);
+  } else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa != 0) {
+    // Subnormal: normalize the mantissa.
+    exponent = 113;
+    while ((mantissa & 0x0400u) == 0) {
+      mantissa <<= 1;
+      --exponent;
+    }
+    bits = sign | (exponent << 23) | ((mantissa & 0x03FFu) << 13);
+  } else {
+    bits = sign;
+  }
+  float result = 0.0f;
+  std::memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+
+/**
+ * Converts a float to the nearest bfloat16, ties to even.
+ *
+ * @param value - the float.
+ * @return BFloat16 - the bfloat16.
+ */
+inline BFloat16 floatToBFloat16(float value) {
+  uint32_t bits = 0;
+  std::memcpy(&bits, &value, sizeof(bits));
+  if ((bits & 0x7FFFFFFFu) > 0x7F800000u) {
+    return BFloat16{static_cast<uint16_t>((bits >> 16) | 0x0040u)};
+  }
+  bits += 0x7FFFu + ((bits >> 16) & 1u);
+  return BFloat16{static_cast<uint16_t>(bits >> 16)};
+}
+
+
+/**
+ * Converts a bfloat16 to a float (exactly).
+ *
+ * @param value - the bfloat16.
+ * @return float - the float.
+ */
+inline float bfloat16ToFloat(BFloat16 value) {
+  uint32_t bits = static_cast<uint32_t>(value.bits) << 16;
+  float result = 0.0f;
+  std::memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+
+/**
+ * Saturates an integer to a narrower type.
+ *
+ * @param value - the value.
+ * @return T - the nearest value of T.
+ */
+template <typename T, typename Wide>
+constexpr T saturate(Wide value) {
+  return static_cast<T>(std::min<Wide>(std::max<Wide>(value, std::numeric_limits<T>::min()),
+                                       std::numeric_limits<T>::max()));
+}
+
+
+/**
+ * Accumulation rules of an element type:
+ *   Accumulator - the type sums and dot products are carried out in.
+ *   Product - the element type of a product matrix.
+ *   widen() / narrow() - conversions to and from the accumulator; narrow()
+ *   rounds to nearest even or saturates.
+ */
+template <typename T>
+struct ElementTraits;
+
+template <>
+struct ElementTraits<float> {
+  using Accumulator = float;
+  using Product = float;
+  static constexpr const char* NAME = "float";
+  static constexpr float widen(float value) { return value; }
+  static constexpr float narrow(float value) { return value; }
+};
+
+template <>
+struct ElementTraits<double> {
+  using Accumulator = double;
+  using Product = double;
+  static constexpr const char* NAME = "double";
+  static constexpr double widen(double value) { return value; }
+  static constexpr double narrow(double value) { return value; }
+};
+
+template <>
+struct ElementTraits<Half> {
+  using Accumulator = float;
+  using Product = Half;
+  static constexpr const char* NAME = "fp16";
+  static float widen(Half value) { return halfToFloat(value); }
+  static Half narrow(float value) { return floatToHalf(value); }
+};
+
+template <>
+struct ElementTraits<BFloat16> {
+  using Accumulator = float;
+  using Product = BFloat16;
+  static constexpr const char* NAME = "bf16";
+  static float widen(BFloat16 value) { return bfloat16ToFloat(value); }
+  static BFloat16 narrow(float value) { return floatToBFloat16(value); }
+};
+
+template <>
+struct ElementTraits<int8_t> {
+  using Accumulator = int32_t;
+  using Product = int32_t;
+  static constexpr const char* NAME = "int8";
+  static constexpr int32_t widen(int8_t value) { return value; }
+  static constexpr int8_t narrow(int32_t value) { return saturate<int8_t>(value); }
+};
+
+template <>
+struct ElementTraits<int32_t> {
+  using Accumulator = int64_t;
+  using Product = int32_t;
+  static constexpr const char* NAME = "int32";
+  static constexpr int64_t widen(int32_t value) { return value; }
+  static constexpr int32_t narrow(int64_t value) { return saturate<int32_t>(value); }
+};
+
+
+/**
+ * Checks whether a type is one of the 16-bit storage-only float types.
+ */
+template <typename T>
+struct IsHalfPrecision : std::integral_constant<bool, std::is_same<T, Half>::value
+                                                          || std::is_same<T, BFloat16>::value> {};
+
+
+/**
+ * Portable kernel: widens 16-bit elements to float.
+ *
+ * @param in - the elements.
+ * @param out - the floats.
+ * @param n - the number of elements.
+ */
+template <typename T>
+inline void widenGeneric(const T* in, float* out, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = ElementTraits<T>::widen(in[i]);
+  }
+}
+
+
+/**
+ * Portable kernel: rounds floats to 16-bit elements.
+ *
+ * @param in - the floats.
+ * @param out - the elements.
+ * @param n - the number of elements.
+ */
+template <typename T>
+inline void narrowGeneric(const float* in, T* out, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = ElementTraits<T>::narrow(in[i]);
+  }
+}
+
+
+#ifdef MATRIX_SIMD_X86
+/**
+ * F16C kernel: widens halves to floats 8 at a time.
+ *
+ * @param in - the halves.
+ * @param out - the floats.
+ * @param n - the number of elements.
+ */
+__attribute__((target("avx,f16c")))
+inline void widenHalfF16c(const Half* in, float* out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i halves = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(halves));
+  }
+  widenGeneric(in + i, out + i, n - i);
+}
+
+
+/**
+ * F16C kernel: rounds floats to halves (to nearest even) 8 at a time.
+ *
+ * @param in - the floats.
+ * @param out - the halves.
+ * @param n - the number of elements.
+ */
+__attribute__((target("avx,f16c")))
+inline void narrowHalfF16c(const float* in, Half* out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i halves = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), halves);
+  }
+  narrowGeneric(in + i, out + i, n - i);
+}
+
+
+/**
+ * AVX2 kernel: widens bfloat16s to floats 8 at a time (a 16-bit shift).
+ *
+ * @param in - the bfloat16s.
+ * @param out - the floats.
+ * @param n - the number of elements.
+ */
+__attribute__((target("avx2")))
+inline void widenBFloat16Avx2(const BFloat16* in, float* out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    __m256i bits = _mm256_slli_epi32(_mm256_cvtepu16_epi32(values), 16);
+    _mm256_storeu_ps(out + i, _mm256_castsi256_ps(bits));
+  }
+  widenGeneric(in + i, out + i, n - i);
+}
+
+
+/**
+ * AVX2 kernel: rounds floats to bfloat16s (to nearest even, NaN kept) 8 at a time.
+ *
+ * @param in - the floats.
+ * @param out - the bfloat16s.
+ * @param n - the number of elements.
+ */
+__attribute__((target("avx2")))
+inline void narrowBFloat16Avx2(const float* in, BFloat16* out, size_t n) {
+  const __m256i bias = _mm256_set1_epi32(0x7FFF);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i quiet = _mm256_set1_epi32(0x00400000);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 values = _mm256_loadu_ps(in + i);
+    __m256i bits = _mm256_castps_si256(values);
+    __m256i odd = _mm256_and_si256(_mm256_srli_epi32(bits, 16), one);
+    __m256i rounded = _mm256_add_epi32(bits, _mm256_add_epi32(bias, odd));
+    __m256 nan = _mm256_cmp_ps(values, values, _CMP_UNORD_Q);
+    rounded = _mm256_blendv_epi8(rounded, _mm256_or_si256(bits, quiet), _mm256_castps_si256(nan));
+    __m256i high = _mm256_srli_epi32(rounded, 16);
+    __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(high), _mm256_extracti128_si256(high, 1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), packed);
+  }
+  narrowGeneric(in + i, out + i, n - i);
+}
+#endif
+
+
+/**
+ * Conversion kernels of a 16-bit type at the detected instruction set level.
+ */
+template <typename T>
+struct ConversionKernels {
+  void (*widen)(const T*, float*, size_t);
+  void (*narrow)(const float*, T*, size_t);
+};
+
+
+/**
+ * Retrieves the conversion kernels of a 16-bit type, picked once from the CPU.
+ *
+ * @return const ConversionKernels<T>& - the kernels.
+ */
+template <typename T>
+inline const ConversionKernels<T> &conversionKernels() {
+  static const ConversionKernels<T> kernels = [] {
+    ConversionKernels<T> table = {&widenGeneric<T>, &narrowGeneric<T>};
+#ifdef MATRIX_SIMD_X86
+    if constexpr (std::is_same<T, Half>::value) {
+      if (simdLevel() >= SimdLevel::AVX2 && __builtin_cpu_supports("f16c")) {
+        table = {&widenHalfF16c, &narrowHalfF16c};
+      }
+    } else if constexpr (std::is_same<T, BFloat16>::value) {
+      if (simdLevel() >= SimdLevel::AVX2) {
+        table = {&widenBFloat16Avx2, &narrowBFloat16Avx2};
+      }
+    }
+#endif
+    return table;
+  }();
+  return kernels;
+}
+
+
+/**
+ * Portable kernel: out = a + b or a - b with int8 saturation.
+ *
+ * @param a - the first operand.
+ * @param b - the second operand.
+ * @param out - the result.
+ * @param n - the number of elements.
+ * @param subtract - whether to subtract.
+ */
+inline void combineInt8Generic(const int8_t* a, const int8_t* b, int8_t* out, size_t n, bool subtract) {
+  for (size_t i = 0; i < n; ++i) {
+    int32_t value = subtract ? int32_t(a[i]) - b[i] : int32_t(a[i]) + b[i];
+    out[i] = saturate<int8_t>(value);
+  }
+}
+
+
+#ifdef MATRIX_SIMD_X86
+/**
+ * AVX2 kernel: out = a + b or a - b with int8 saturation, 32 elements at a time.
+ *
+ * @param a - the first operand.
+ * @param b - the second operand.
+ * @param out - the result.
+ * @param n - the number of elements.
+ * @param subtract - whether to subtract.
+ */
+__attribute__((target("avx2")))
+inline void combineInt8Avx2(const int8_t* a, const int8_t* b, int8_t* out, size_t n, bool subtract) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+    __m256i result = subtract ? _mm256_subs_epi8(x, y) : _mm256_adds_epi8(x, y);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), result);
+  }
+  combineInt8Generic(a + i, b + i, out + i, n - i, subtract);
+}
+#endif
+
+
+/**
+ * Computes out = a + b or a - b in the accumulator type of T.
+ *
+ * @param a - the first operand.
+ * @param b - the second operand.
+ * @param out - the result (same dimensions; may alias a or b).
+ * @param subtract - whether to subtract.
+ */
+template <typename T>
+inline void combineElements(const BasicMatrixView<T> &a, const BasicMatrixView<T> &b,
+                            const BasicMatrixView<T> &out, bool subtract) {
+  using Traits = ElementTraits<T>;
+  if constexpr (std::is_same<T, float>::value) {
+    if (subtract) {
+      subtractMatrices(a, b, out);
+    } else {
+      addMatrices(a, b, out);
+    }
+  } else if constexpr (IsHalfPrecision<T>::value) {
+    // Widen a chunk, use the float kernel, round the chunk back.
+    const ConversionKernels<T> &convert = conversionKernels<T>();
+    ElementwiseKernel kernel = subtract ? elementwiseKernels().subtract : elementwiseKernels().add;
+    alignas(MATRIX_ALIGNMENT) float x[ELEMENT_CONVERT_CHUNK];
+    alignas(MATRIX_ALIGNMENT) float y[ELEMENT_CONVERT_CHUNK];
+    for (int i = 0; i < out.height; ++i) {
+      for (int j = 0; j < out.width; j += ELEMENT_CONVERT_CHUNK) {
+        size_t count = static_cast<size_t>(std::min(ELEMENT_CONVERT_CHUNK, out.width - j));
+        convert.widen(a.row(i) + j, x, count);
+        convert.widen(b.row(i) + j, y, count);
+        kernel(x, y, x, count, 1.0f, false);
+        convert.narrow(x, out.row(i) + j, count);
+      }
+    }
+  } else if constexpr (std::is_same<T, int8_t>::value) {
+    void (*kernel)(const int8_t*, const int8_t*, int8_t*, size_t, bool) = &combineInt8Generic;
+#ifdef MATRIX_SIMD_X86
+    if (simdLevel() >= SimdLevel::AVX2) {
+      kernel = &combineInt8Avx2;
+    }
+#endif
+    for (int i = 0; i < out.height; ++i) {
+      kernel(a.row(i), b.row(i), out.row(i), out.width, subtract);
+    }
+  } else {
+    for (int i = 0; i < out.height; ++i) {
+      const T* x = a.row(i);
+      const T* y = b.row(i);
+      T* result = out.row(i);
+      for (int j = 0; j < out.width; ++j) {
+        typename Traits::Accumulator value = subtract ? Traits::widen(x[j]) - Traits::widen(y[j])
+                                                      : Traits::widen(x[j]) + Traits::widen(y[j]);
+        result[j] = Traits::narrow(value);
+      }
+    }
+  }
+}
+
+
+/**
+ * Portable kernel: acc += scale * row, in the accumulator type.
+ *
+ * @param acc - the accumulators.
+ * @param row - a row of the right operand.
+ * @param scale - an element of the left operand, widened.
+ * @param n - the number of elements.
+ */
+template <typename T>
+inline void accumulateRowGeneric(typename ElementTraits<T>::Accumulator* acc, const T* row,
+                                 typename ElementTraits<T>::Accumulator scale, int n) {
+  for (int j = 0; j < n; ++j) {
+    acc[j] += scale * ElementTraits<T>::widen(row[j]);
+  }
+}
+
+
+#ifdef MATRIX_SIMD_X86
+/**
+ * AVX2 kernel: acc += scale * row for doubles with fused multiply-adds.
+ *
+ * @param acc - the accumulators.
+ * @param row - a row of the right operand.
+ * @param scale - an element of the left operand.
+ * @param n - the number of elements.
+ */
+__attribute__((target("avx2,fma")))
+inline void accumulateRowDoubleAvx2(double* acc, const double* row, double scale, int n) {
+  __m256d factor = _mm256_set1_pd(scale);
+  int j = 0;
+  for (; j + 8 <= n; j += 8) {
+    __m256d low = _mm256_fmadd_pd(factor, _mm256_loadu_pd(row + j), _mm256_loadu_pd(acc + j));
+    __m256d high = _mm256_fmadd_pd(factor, _mm256_loadu_pd(row + j + 4), _mm256_loadu_pd(acc + j + 4));
+    _mm256_storeu_pd(acc + j, low);
+    _mm256_storeu_pd(acc + j + 4, high);
+  }
+  accumulateRowGeneric(acc + j, row + j, scale, n - j);
+}
+
+
+/**
+ * AVX2 kernel: acc += scale * row for int8 rows into int32 accumulators.
+ *
+ * @param acc - the accumulators.
+ * @param row - a row of the right operand.
+ * @param scale - an element of the left operand, widened.
+ * @param n - the number of elements.
+ */
+__attribute__((target("avx2")))
+inline void accumulateRowInt8Avx2(int32_t* acc, const int8_t* row, int32_t scale, int n) {
+  // int8 * int8 fits in int16, so multiply 16 at a time and widen the products.
+  __m256i factor = _mm256_set1_epi16(static_cast<int16_t>(scale));
+  int j = 0;
+  for (; j + 16 <= n; j += 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + j));
+    __m256i products = _mm256_mullo_epi16(_mm256_cvtepi8_epi16(bytes), factor);
+    __m256i low = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(products));
+    __m256i high = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(products, 1));
+    __m256i* out = reinterpret_cast<__m256i*>(acc + j);
+    _mm256_storeu_si256(out, _mm256_add_epi32(_mm256_loadu_si256(out), low));
+    _mm256_storeu_si256(out + 1, _mm256_add_epi32(_mm256_loadu_si256(out + 1), high));
+  }
+  accumulateRowGeneric(acc + j, row + j, scale, n - j);
+}
+#endif
+
+
+/**
+ * Picks the row kernel of a type for the running CPU.
+ *
+ * @return function pointer - the kernel.
+ */
+template <typename T>
+inline void (*selectAccumulateRow())(typename ElementTraits<T>::Accumulator*, const T*,
+                                     typename ElementTraits<T>::Accumulator, int) {
+#ifdef MATRIX_SIMD_X86
+  if constexpr (std::is_same<T, double>::value) {
+    if (simdLevel() >= SimdLevel::AVX2) {
+      return &accumulateRowDoubleAvx2;
+    }
+  } else if constexpr (std::is_same<T, int8_t>::value) {
+    if (simdLevel() >= SimdLevel::AVX2) {
+      return &accumulateRowInt8Avx2;
+    }
+  }
+#endif
+  return &accumulateRowGeneric<T>;
+}
+
+
+/**
+ * Computes out = a * b by accumulating rows of b into a block of
+ * ELEMENT_BLOCK_ROWS x ELEMENT_BLOCK_COLS accumulators, which are narrowed
+ * once at the end. Row blocks run on the thread pool for large products.
+ *
+ * @param a - the left operand.
+ * @param b - the right operand (a.width high).
+ * @param out - the result (b.width wide, a.height high).
+ */
+template <typename T>
+inline void multiplyAccumulated(const BasicMatrixView<T> &a, const BasicMatrixView<T> &b,
+                                const BasicMatrixView<typename ElementTraits<T>::Product> &out) {
+  using Traits = ElementTraits<T>;
+  using Accumulator = typename Traits::Accumulator;
+  using Product = typename Traits::Product;
+  auto kernel = selectAccumulateRow<T>();
+
+  auto task = [&](size_t index) {
+    int firstRow = static_cast<int>(index) * ELEMENT_BLOCK_ROWS;
+    int rows = std::min(ELEMENT_BLOCK_ROWS, a.height - firstRow);
+    static thread_local std::vector<Accumulator> acc;
+    acc.resize(static_cast<size_t>(ELEMENT_BLOCK_ROWS) * ELEMENT_BLOCK_COLS);
+    for (int col = 0; col < b.width; col += ELEMENT_BLOCK_COLS) {
+      int cols = std::min(ELEMENT_BLOCK_COLS, b.width - col);
+      std::fill(acc.begin(), acc.end(), Accumulator(0));
+      for (int p = 0; p < a.width; ++p) {
+        const T* bRow = b.row(p) + col;
+        for (int r = 0; r < rows; ++r) {
+          Accumulator scale = Traits::widen(a.at(firstRow + r, p));
+          kernel(acc.data() + static_cast<size_t>(r) * ELEMENT_BLOCK_COLS, bRow, scale, cols);
+        }
+      }
+      for (int r = 0; r < rows; ++r) {
+        const Accumulator* sums = acc.data() + static_cast<size_t>(r) * ELEMENT_BLOCK_COLS;
+        Product* result = out.row(firstRow + r) + col;
+        for (int j = 0; j < cols; ++j) {
+          result[j] = ElementTraits<Product>::narrow(sums[j]);
+        }
+      }
+    }
+  };
+
+  size_t blocks = static_cast<size_t>((a.height + ELEMENT_BLOCK_ROWS - 1) / ELEMENT_BLOCK_ROWS);
+  double work = static_cast<double>(a.height) * b.width * a.width;
+  if (getThreadCount() == 1 || work < ELEMENT_PARALLEL_THRESHOLD) {
+    for (size_t index = 0; index < blocks; ++index) {
+      task(index);
+    }
+  } else {
+    defaultThreadPool().parallelFor(blocks, task);
+  }
+}
+
+
+/**
+ * Float copy of a 16-bit matrix, freed when it goes out of scope.
+ */
+class WidenedMatrix {
+ public:
+  /**
+   * Constructor; widens a 16-bit matrix.
+   *
+   * @param matrix - the matrix.
+   */
+  template <typename T>
+  explicit WidenedMatrix(const BasicMatrixView<T> &matrix)
+      : _view{allocateMatrixData(static_cast<size_t>(paddedStride(matrix.width)) * matrix.height),
+              matrix.width, matrix.height, paddedStride(matrix.width)} {
+    for (int i = 0; i < matrix.height; ++i) {
+      conversionKernels<T>().widen(matrix.row(i), _view.row(i), matrix.width);
+    }
+  }
+
+  /**
+   * Constructor for an uninitialized float matrix.
+   *
+   * @param width - the width.
+   * @param height - the height.
+   */
+  WidenedMatrix(int width, int height)
+      : _view{allocateMatrixData(static_cast<size_t>(paddedStride(width)) * height), width, height,
+              paddedStride(width)} {}
+
+  WidenedMatrix(const WidenedMatrix &) = delete;
+  WidenedMatrix &operator=(const WidenedMatrix &) = delete;
+
+  ~WidenedMatrix() {
+    freeMatrixData(_view.data);
+  }
+
+
+  /**
+   * Retrieves the float elements.
+   *
+   * @return const MatrixView& - the view.
+   */
+  const MatrixView &view() const {
+    return _view;
+  }
+
+ private:
+  MatrixView _view;
+};
+
+
+/**
+ * Computes out = a * b following the accumulation rule of T.
+ * float uses the GEMM engine; fp16 and bf16 are widened to float, multiplied
+ * there and rounded once; double and int8 use the accumulating kernels.
+ *
+ * @param a - the left operand.
+ * @param b - the right operand (a.width high).
+ * @param out - the result (b.width wide, a.height high).
+ */
+template <typename T>
+inline void multiplyElements(const BasicMatrixView<T> &a, const BasicMatrixView<T> &b,
+                             const BasicMatrixView<typename ElementTraits<T>::Product> &out) {
+  if constexpr (std::is_same<T, float>::value) {
+    multiply(a.height, b.width, a.width, a.data, a.stride, b.data, b.stride, out.data, out.stride);
+  } else if constexpr (IsHalfPrecision<T>::value) {
+    WidenedMatrix x(a);
+    WidenedMatrix y(b);
+    WidenedMatrix product(b.width, a.height);
+    const MatrixView &c = product.view();
+    multiply(a.height, b.width, a.width, x.view().data, x.view().stride, y.view().data, y.view().stride,
+             c.data, c.stride);
+    for (int i = 0; i < c.height; ++i) {
+      conversionKernels<T>().narrow(c.row(i), out.row(i), c.width);
+    }
+  } else {
+    multiplyAccumulated(a, b, out);
+  }
+}
+
+
+/**
+ * Converts one element to text: floating point types in the given format,
+ * integers as integers.
+ *
+ * @param first - where to write (at least FORMAT_MAX_CHARS free).
+ * @param value - the element.
+ * @param format - the format.
+ * @return char* - one past the last character written.
+ */
+template <typename T>
+inline char* formatElement(char* first, T value, NumberFormat format) {
+  char* last = first + FORMAT_MAX_CHARS;
+  if constexpr (std::is_integral<T>::value) {
+    return std::to_chars(first, last, static_cast<long>(value)).ptr;
+  } else if constexpr (std::is_same<T, double>::value) {
+    std::to_chars_result result;
+    switch (format.style) {
+      case FloatStyle::FIXED:
+        result = std::to_chars(first, last, value, std::chars_format::fixed, format.precision);
+        break;
+      case FloatStyle::GENERAL:
+        result = std::to_chars(first, last, value, std::chars_format::general, format.precision);
+        break;
+      default:
+        result = std::to_chars(first, last, value);
+        break;
+    }
+    // Huge doubles do not fit in fixed notation; fall back to the shortest form.
+    return result.ec == std::errc() ? result.ptr : std::to_chars(first, last, value).ptr;
+  } else {
+    return formatFloat(first, ElementTraits<T>::widen(value), format);
+  }
+}
+
+
+/**
+ * Writes a matrix of any element type, one line per row with a space after
+ * every element (float matrices use the parallel writer in matrix_format.h).
+ *
+ * @param os - the output stream.
+ * @param matrix - the matrix.
+ * @param format - the format of floating point elements.
+ */
+template <typename T>
+inline void writeMatrix(std::ostream &os, const BasicMatrixView<T> &matrix, NumberFormat format) {
+  double bytes = sizeof(T) * static_cast<double>(matrix.width) * matrix.height;
+  ProfileScope profile(ProfileSection::PRINT, 0, bytes);
+  TextBuffer text;
+  for (int i = 0; i < matrix.height; ++i) {
+    char* first = text.reserve(static_cast<size_t>(matrix.width) * FORMAT_MAX_CHARS + 1);
+    char* out = first;
+    for (int j = 0; j < matrix.width; ++j) {
+      out = formatElement(out, matrix.at(i, j), format);
+      *out++ = ' ';
+    }
+    *out++ = '\n';
+    text.size += out - first;
+    if (text.size >= FORMAT_BUFFER_SIZE) {
+      os.write(text.storage.data(), static_cast<std::streamsize>(text.size));
+      text.size = 0;
+    }
+  }
+  os.write(text.storage.data(), static_cast<std::streamsize>(text.size));
+  os.flush();
+}
+
+
+/**
+ * Reads one element: doubles at full precision, the 16-bit types as floats
+ * rounded to nearest even, integers that must fit the type.
+ *
+ * @param reader - the reader.
+ * @param value - receives the element.
+ * @return ReadStatus - the outcome.
+ */
+template <typename T>
+inline ReadStatus readElement(MatrixTextReader &reader, T* value) {
+  if constexpr (std::is_same<T, float>::value) {
+    return reader.readFloat(value);
+  } else if constexpr (std::is_same<T, double>::value) {
+    return reader.readDouble(value);
+  } else if constexpr (std::is_integral<T>::value) {
+    return reader.readInteger(value);
+  } else {
+    float wide = 0.0f;
+    ReadStatus status = reader.readFloat(&wide);
+    if (status == ReadStatus::OK) {
+      *value = ElementTraits<T>::narrow(wide);
+    }
+    return status;
+  }
+}
+
+
+/**
+ * Reads width * height elements of any type into a matrix, row by row.
+ * Malformed values are reported and read again.
+ *
+ * @param reader - the reader.
+ * @param matrix - the matrix to fill.
+ * @param errors - where malformed values are reported.
+ * @return bool - false when the input ended first.
+ */
+template <typename T>
+inline bool readMatrixValues(MatrixTextReader &reader, const BasicMatrixView<T> &matrix, std::ostream &errors) {
+  double bytes = sizeof(T) * static_cast<double>(matrix.width) * matrix.height;
+  ProfileScope profile(ProfileSection::PARSE, 0, bytes);
+  for (int i = 0; i < matrix.height; ++i) {
+    T* row = matrix.row(i);
+    for (int j = 0; j < matrix.width; ++j) {
+      ReadStatus status = readElement(reader, row + j);
+      while (status == ReadStatus::MALFORMED) {
+        errors << reader.error() << std::endl;
+        status = readElement(reader, row + j);
+      }
+      if (status == ReadStatus::END) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+#endif  // MATRIX_ELEMENT_H_
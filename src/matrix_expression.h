@@ -0,0 +1,824 @@
+/**
+ * matrix_expression.h
+ * Lazy expression templates for chains of +, -, * and transpose().
+ * Operators build a tree of lightweight nodes instead of matrices; the tree is
+ * evaluated in one fused loop when it is assigned to a matrix, so A + B - C
+ * makes no temporaries. Products inside the tree run through the GEMM engine,
+ * straight into the destination when they sit at the top of the tree; a
+ * transposed operand of a product is handed to GEMM as is, never copied.
+ *
+ * Any leaf type works (see class Matrix) as long as it derives from
+ * MatrixExpression<Leaf>, sets IS_LEAF = true and IS_PRODUCT = false, and
+ * provides getWidth(), getHeight(), at(i, j), view() and resultId().
+ *
+ * Nodes keep references to leaves, so an expression must be assigned before
+ * the matrices it names go away (do not store it in an auto variable).
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_EXPRESSION_H_
+#define MATRIX_EXPRESSION_H_
+
+#include <cstddef>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "matrix_gemm.h"
+#include "matrix_instrumentation.h"
+#include "matrix_simd.h"
+#include "matrix_storage.h"
+#include "matrix_transpose.h"
+
+
+/**
+ * CRTP base of every expression node and leaf.
+ */
+template <typename Derived>
+struct MatrixExpression {
+  const Derived &self() const {
+    return static_cast<const Derived &>(*this);
+  }
+};
+
+
+/**
+ * How a node holds a child: leaves by reference, inner nodes by value.
+ */
+template <typename T>
+using ExpressionOperand = typename std::conditional<T::IS_LEAF, const T &, const T>::type;
+
+
+/**
+ * Owned, aligned result buffer for intermediate products.
+ * Copies start out empty (the buffer is a cache, not a value); moves transfer it.
+ */
+class ExpressionBuffer {
+ public:
+  ExpressionBuffer() = default;
+
+  ExpressionBuffer(const ExpressionBuffer &) {}
+
+  ExpressionBuffer(ExpressionBuffer &&buffer) noexcept : _view(buffer._view) {
+    buffer._view = MatrixView{nullptr, 0, 0, 0};
+  }
+
+  ExpressionBuffer &operator=(const ExpressionBuffer &) = delete;
+
+  ~ExpressionBuffer() {
+    freeMatrixData(_view.data);
+  }
+
+  /**
+   * Allocates the buffer for a width x height result.
+   *
+   * @param width - the width.
+   * @param height - the height.
+   * @return MatrixView - the buffer.
+   */
+  MatrixView allocate(int width, int height) {
+    freeMatrixData(_view.data);
+    _view = MatrixView{nullptr, width, height, paddedStride(width)};
+    _view.data = allocateMatrixData(static_cast<size_t>(_view.stride) * height);
+    return _view;
+  }
+
+  /**
+   * Retrieves whether the buffer holds a result.
+   *
+   * @return bool - whether allocate() was called.
+   */
+  bool empty() const {
+    return _view.data == nullptr;
+  }
+
+  /**
+   * Retrieves the buffer.
+   *
+   * @return const MatrixView& - the buffer.
+   */
+  const MatrixView &view() const {
+    return _view;
+  }
+
+ private:
+  MatrixView _view = MatrixView{nullptr, 0, 0, 0};
+};
+
+
+/**
+ * Checks whether two strided regions share any memory.
+ *
+ * @param a - the first region.
+ * @param b - the second region.
+ * @return bool - whether they overlap.
+ */
+inline bool viewsOverlap(const MatrixView &a, const MatrixView &b) {
+  if (a.data == nullptr || b.data == nullptr || a.height == 0 || b.height == 0) {
+    return false;
+  }
+  const float* aEnd = a.row(a.height - 1) + a.width;
+  const float* bEnd = b.row(b.height - 1) + b.width;
+  return a.data < bEnd && b.data < aEnd;
+}
+
+
+/**
+ * Checks whether writing out element by element could change a leaf before it is read.
+ * Reading and writing the very same element (same base and stride) is fine.
+ *
+ * @param leaf - the leaf's storage.
+ * @param out - the destination.
+ * @return bool - whether the leaf is safe to read while writing out.
+ */
+inline bool leafAliasSafe(const MatrixView &leaf, const MatrixView &out) {
+  return !viewsOverlap(leaf, out) || (leaf.data == out.data && leaf.stride == out.stride);
+}
+
+
+template <typename E>
+void evaluateExpression(const E &expression, const MatrixView &out);
+
+
+/**
+ * Computes any products below an operand (leaves need nothing).
+ *
+ * @param operand - the operand.
+ */
+template <typename E>
+void prepareOperand(const E &operand) {
+  if constexpr (!E::IS_LEAF) {
+    operand.prepare();
+  }
+}
+
+
+/**
+ * Checks whether an operand can be evaluated element by element into out.
+ *
+ * @param operand - the operand.
+ * @param out - the destination.
+ * @return bool - whether no element is overwritten before it is read.
+ */
+template <typename E>
+bool operandAliasSafe(const E &operand, const MatrixView &out) {
+  if constexpr (E::IS_LEAF) {
+    return leafAliasSafe(operand.view(), out);
+  } else {
+    return operand.aliasSafe(out);
+  }
+}
+
+
+/**
+ * Checks whether an operand still reads correctly after all of out was written.
+ * Prepared products hold their own buffer, so only leaves can be affected.
+ *
+ * @param operand - the operand.
+ * @param out - the destination.
+ * @return bool - whether out and the operand's leaves are disjoint.
+ */
+template <typename E>
+bool operandSafeAfterWrite(const E &operand, const MatrixView &out) {
+  if constexpr (E::IS_LEAF) {
+    return !viewsOverlap(operand.view(), out);
+  } else {
+    return operand.safeAfterWrite(out);
+  }
+}
+
+
+/**
+ * Produces strided storage for an operand of a product.
+ * Leaves are used in place, products are computed once, anything else is
+ * evaluated into the scratch buffer.
+ *
+ * @param expression - the operand.
+ * @param scratch - storage for evaluated operands.
+ * @return MatrixView - the operand's storage.
+ */
+template <typename E>
+MatrixView materializeExpression(const E &expression, ExpressionBuffer &scratch) {
+  if constexpr (E::IS_LEAF) {
+    return expression.view();
+  } else if constexpr (E::IS_PRODUCT) {
+    return expression.result();
+  } else {
+    MatrixView view = scratch.allocate(expression.getWidth(), expression.getHeight());
+    evaluateExpression(expression, view);
+    return view;
+  }
+}
+
+
+/**
+ * Element-wise operations in the tree.
+ */
+struct AddOperation {
+  static const int RESULT_ID = 3;
+  static float apply(float a, float b) {
+    return a + b;
+  }
+};
+
+struct SubtractOperation {
+  static const int RESULT_ID = 4;
+  static float apply(float a, float b) {
+    return a - b;
+  }
+};
+
+
+/**
+ * Node for left (+|-) right.
+ */
+template <typename Operation, typename L, typename R>
+class ElementwiseExpression : public MatrixExpression<ElementwiseExpression<Operation, L, R>> {
+ public:
+  static const bool IS_LEAF = false;
+  static const bool IS_PRODUCT = false;
+  typedef Operation OperationType;
+  typedef L LeftType;
+  typedef R RightType;
+
+  ElementwiseExpression(const L &left, const R &right) : _left(left), _right(right) {}
+
+  int getWidth() const {
+    return _left.getWidth();
+  }
+
+  int getHeight() const {
+    return _left.getHeight();
+  }
+
+  int resultId() const {
+    return Operation::RESULT_ID;
+  }
+
+  float at(int i, int j) const {
+    return Operation::apply(_left.at(i, j), _right.at(i, j));
+  }
+
+  void prepare() const {
+    prepareOperand(_left);
+    prepareOperand(_right);
+  }
+
+  bool aliasSafe(const MatrixView &out) const {
+    return operandAliasSafe(_left, out) && operandAliasSafe(_right, out);
+  }
+
+  bool safeAfterWrite(const MatrixView &out) const {
+    return operandSafeAfterWrite(_left, out) && operandSafeAfterWrite(_right, out);
+  }
+
+  const L &left() const {
+    return _left;
+  }
+
+  const R &right() const {
+    return _right;
+  }
+
+ private:
+  ExpressionOperand<L> _left;
+  ExpressionOperand<R> _right;
+};
+
+
+/**
+ * Node for alpha * operand.
+ */
+template <typename E>
+class ScaledExpression : public MatrixExpression<ScaledExpression<E>> {
+ public:
+  static const bool IS_LEAF = false;
+  static const bool IS_PRODUCT = false;
+  typedef E OperandType;
+
+  ScaledExpression(float alpha, const E &operand) : _alpha(alpha), _operand(operand) {}
+
+  int getWidth() const {
+    return _operand.getWidth();
+  }
+
+  int getHeight() const {
+    return _operand.getHeight();
+  }
+
+  int resultId() const {
+    return _operand.resultId();
+  }
+
+  float at(int i, int j) const {
+    return _alpha * _operand.at(i, j);
+  }
+
+  void prepare() const {
+    prepareOperand(_operand);
+  }
+
+  bool aliasSafe(const MatrixView &out) const {
+    return operandAliasSafe(_operand, out);
+  }
+
+  bool safeAfterWrite(const MatrixView &out) const {
+    return operandSafeAfterWrite(_operand, out);
+  }
+
+  float alpha() const {
+    return _alpha;
+  }
+
+  const E &operand() const {
+    return _operand;
+  }
+
+ private:
+  float _alpha;
+  ExpressionOperand<E> _operand;
+};
+
+
+/**
+ * Node for operand^T. The operand is materialized once (leaves are used in
+ * place) and read with its indices swapped.
+ */
+template <typename E>
+class TransposeExpression : public MatrixExpression<TransposeExpression<E>> {
+ public:
+  static const bool IS_LEAF = false;
+  static const bool IS_PRODUCT = false;
+  typedef E OperandType;
+
+  explicit TransposeExpression(const E &operand) : _operand(operand) {}
+
+  int getWidth() const {
+    return _operand.getHeight();
+  }
+
+  int getHeight() const {
+    return _operand.getWidth();
+  }
+
+  int resultId() const {
+    return _operand.resultId();
+  }
+
+  float at(int i, int j) const {
+    if constexpr (E::IS_LEAF || E::IS_PRODUCT) {
+      return _operand.at(j, i);
+    } else {
+      return _scratch.view().at(j, i);
+    }
+  }
+
+  /**
+   * Computes the operand (once) so at() can read it.
+   */
+  void prepare() const {
+    if constexpr (E::IS_PRODUCT) {
+      _operand.prepare();
+    } else if constexpr (!E::IS_LEAF) {
+      if (_scratch.empty()) {
+        evaluateExpression(_operand, _scratch.allocate(_operand.getWidth(), _operand.getHeight()));
+      }
+    }
+  }
+
+  /**
+   * Retrieves the operand's storage, computing it first if needed.
+   *
+   * @return MatrixView - the untransposed operand.
+   */
+  MatrixView source() const {
+    if constexpr (E::IS_LEAF) {
+      return _operand.view();
+    } else if constexpr (E::IS_PRODUCT) {
+      return _operand.result();
+    } else {
+      prepare();
+      return _scratch.view();
+    }
+  }
+
+  /**
+   * Element (i, j) reads the operand at (j, i), so a leaf must not share any
+   * memory with out; other operands are computed into their own storage first.
+   *
+   * @param out - the destination.
+   * @return bool - whether the transpose may be written straight into out.
+   */
+  bool aliasSafe(const MatrixView &out) const {
+    return safeAfterWrite(out);
+  }
+
+  bool safeAfterWrite(const MatrixView &out) const {
+    if constexpr (E::IS_LEAF) {
+      return !viewsOverlap(_operand.view(), out);
+    } else {
+      return true;
+    }
+  }
+
+  const E &operand() const {
+    return _operand;
+  }
+
+ private:
+  ExpressionOperand<E> _operand;
+  mutable ExpressionBuffer _scratch;
+};
+
+
+/**
+ * Type checks used to pick an evaluation strategy.
+ */
+template <typename E>
+struct IsTransposeExpression : std::false_type {};
+
+template <typename E>
+struct IsTransposeExpression<TransposeExpression<E>> : std::true_type {};
+
+
+/**
+ * Produces GEMM storage for an operand of a product. A transposed operand is
+ * passed as its untransposed storage plus Transpose::TRANSPOSED.
+ *
+ * @param operand - the operand.
+ * @param scratch - storage for evaluated operands.
+ * @param trans - set to how GEMM must read the storage.
+ * @return MatrixView - the storage.
+ */
+template <typename E>
+MatrixView productOperand(const E &operand, ExpressionBuffer &scratch, Transpose* trans) {
+  if constexpr (IsTransposeExpression<E>::value) {
+    *trans = Transpose::TRANSPOSED;
+    return materializeExpression(operand.operand(), scratch);
+  } else {
+    *trans = Transpose::NONE;
+    return materializeExpression(operand, scratch);
+  }
+}
+
+
+/**
+ * Node for left * right; computed by the GEMM engine, never element by element.
+ */
+template <typename L, typename R>
+class ProductExpression : public MatrixExpression<ProductExpression<L, R>> {
+ public:
+  static const bool IS_LEAF = false;
+  static const bool IS_PRODUCT = true;
+  typedef L LeftType;
+  typedef R RightType;
+
+  ProductExpression(const L &left, const R &right) : _left(left), _right(right) {}
+
+  const L &left() const {
+    return _left;
+  }
+
+  const R &right() const {
+    return _right;
+  }
+
+  int getWidth() const {
+    return _right.getWidth();
+  }
+
+  int getHeight() const {
+    return _left.getHeight();
+  }
+
+  int resultId() const {
+    return 5;
+  }
+
+  float at(int i, int j) const {
+    return _result.view().at(i, j);
+  }
+
+  /**
+   * Computes the product into its own buffer (once) so at() can read it.
+   */
+  void prepare() const {
+    if (_result.empty()) {
+      multiplyInto(_result.allocate(getWidth(), getHeight()));
+    }
+  }
+
+  /**
+   * Retrieves the computed product, computing it first if needed.
+   *
+   * @return MatrixView - the product.
+   */
+  MatrixView result() const {
+    prepare();
+    return _result.view();
+  }
+
+  /**
+   * Runs the GEMM engine with out as the destination.
+   *
+   * @param out - the destination (must not overlap the operands).
+   */
+  void multiplyInto(const MatrixView &out) const {
+    ExpressionBuffer leftScratch;
+    ExpressionBuffer rightScratch;
+    Transpose transA;
+    Transpose transB;
+    MatrixView a = productOperand(_left, leftScratch, &transA);
+    MatrixView b = productOperand(_right, rightScratch, &transB);
+    multiply(transA, transB, getHeight(), getWidth(), _left.getWidth(), a.data, a.stride, b.data, b.stride,
+             out.data, out.stride);
+  }
+
+  /**
+   * GEMM writes its destination while still reading leaf operands, so those
+   * must not overlap it; other operands are evaluated into scratch first.
+   *
+   * @param out - the destination.
+   * @return bool - whether the product may be computed straight into out.
+   */
+  bool aliasSafe(const MatrixView &out) const {
+    return operandSafeAfterWrite(_left, out) && operandSafeAfterWrite(_right, out);
+  }
+
+  bool safeAfterWrite(const MatrixView &) const {
+    return true;
+  }
+
+ private:
+  ExpressionOperand<L> _left;
+  ExpressionOperand<R> _right;
+  mutable ExpressionBuffer _result;
+};
+
+
+template <typename E>
+struct IsElementwiseExpression : std::false_type {};
+
+template <typename Operation, typename L, typename R>
+struct IsElementwiseExpression<ElementwiseExpression<Operation, L, R>> : std::true_type {};
+
+template <typename E>
+struct IsScaledExpression : std::false_type {};
+
+template <typename E>
+struct IsScaledExpression<ScaledExpression<E>> : std::true_type {};
+
+
+/**
+ * Evaluates an expression into out in one pass (products through GEMM).
+ * The caller makes sure out has the expression's dimensions and that
+ * expression.aliasSafe(out) holds.
+ *
+ * @param expression - the expression.
+ * @param out - the destination.
+ */
+template <typename E>
+void evaluateExpression(const E &expression, const MatrixView &out) {
+  if constexpr (E::IS_LEAF) {
+    for (int i = 0; i < out.height; ++i) {
+      for (int j = 0; j < out.width; ++j) {
+        out.row(i)[j] = expression.at(i, j);
+      }
+    }
+    return;
+  } else if constexpr (E::IS_PRODUCT) {
+    // A lone product: GEMM straight into the destination.
+    expression.multiplyInto(out);
+    return;
+  } else if constexpr (IsTransposeExpression<E>::value) {
+    // A lone transpose: the cache-oblivious kernel instead of a strided loop.
+    transposeMatrix(expression.source(), out);
+    return;
+  } else if constexpr (IsElementwiseExpression<E>::value) {
+    typedef typename E::LeftType L;
+    typedef typename E::RightType R;
+    typedef typename E::OperationType Operation;
+    const bool isAdd = std::is_same<Operation, AddOperation>::value;
+
+    if constexpr (L::IS_LEAF && R::IS_LEAF) {
+      // Two plain matrices: use the vector kernels.
+      if (isAdd) {
+        addMatrices(expression.left().view(), expression.right().view(), out);
+      } else {
+        subtractMatrices(expression.left().view(), expression.right().view(), out);
+      }
+      return;
+    } else if constexpr (L::IS_LEAF && IsScaledExpression<R>::value) {
+      if constexpr (R::OperandType::IS_LEAF) {
+        // a +/- alpha * b: one fused kernel pass.
+        float alpha = isAdd ? expression.right().alpha() : -expression.right().alpha();
+        scaledAddMatrices(expression.left().view(), expression.right().operand().view(), alpha, out);
+        return;
+      }
+    } else if constexpr (L::IS_PRODUCT) {
+      // Product on the left: GEMM into out, then fold in the right side.
+      if (expression.left().aliasSafe(out) && operandSafeAfterWrite(expression.right(), out)) {
+        prepareOperand(expression.right());
+        expression.left().multiplyInto(out);
+        for (int i = 0; i < out.height; ++i) {
+          float* row = out.row(i);
+          for (int j = 0; j < out.width; ++j) {
+            row[j] = Operation::apply(row[j], expression.right().at(i, j));
+          }
+        }
+        return;
+      }
+    } else if constexpr (R::IS_PRODUCT) {
+      // Product on the right: GEMM into out, then fold in the left side.
+      if (expression.right().aliasSafe(out) && operandSafeAfterWrite(expression.left(), out)) {
+        prepareOperand(expression.left());
+        expression.right().multiplyInto(out);
+        for (int i = 0; i < out.height; ++i) {
+          float* row = out.row(i);
+          for (int j = 0; j < out.width; ++j) {
+            row[j] = Operation::apply(expression.left().at(i, j), row[j]);
+          }
+        }
+        return;
+      }
+    }
+  }
+
+  // General case: compute any products, then one fused loop over every element.
+  expression.prepare();
+  for (int i = 0; i < out.height; ++i) {
+    float* row = out.row(i);
+    for (int j = 0; j < out.width; ++j) {
+      row[j] = expression.at(i, j);
+    }
+  }
+}
+
+
+/**
+ * Counts the floating-point operations needed to evaluate an expression.
+ *
+ * @param expression - the expression.
+ * @return double - the operations.
+ */
+template <typename E>
+double expressionFlops(const E &expression) {
+  double elements = static_cast<double>(expression.getWidth()) * expression.getHeight();
+  if constexpr (E::IS_LEAF) {
+    return 0.0;
+  } else if constexpr (E::IS_PRODUCT) {
+    return productFlops(expression.getHeight(), expression.getWidth(), expression.left().getWidth())
+           + expressionFlops(expression.left()) + expressionFlops(expression.right());
+  } else if constexpr (IsScaledExpression<E>::value) {
+    return elements + expressionFlops(expression.operand());
+  } else if constexpr (IsTransposeExpression<E>::value) {
+    return expressionFlops(expression.operand());
+  } else {
+    return elements + expressionFlops(expression.left()) + expressionFlops(expression.right());
+  }
+}
+
+
+/**
+ * Counts the bytes of the leaves an expression reads.
+ *
+ * @param expression - the expression.
+ * @return double - the bytes.
+ */
+template <typename E>
+double expressionBytes(const E &expression) {
+  if constexpr (E::IS_LEAF) {
+    return sizeof(float) * static_cast<double>(expression.getWidth()) * expression.getHeight();
+  } else if constexpr (IsScaledExpression<E>::value || IsTransposeExpression<E>::value) {
+    return expressionBytes(expression.operand());
+  } else {
+    return expressionBytes(expression.left()) + expressionBytes(expression.right());
+  }
+}
+
+
+/**
+ * Checks whether GEMM can read an operand without evaluating it first.
+ *
+ * @return bool - whether the operand is a matrix or a matrix's transpose.
+ */
+template <typename E>
+constexpr bool isStoredOperand() {
+  if constexpr (IsTransposeExpression<E>::value) {
+    return E::OperandType::IS_LEAF;
+  } else {
+    return E::IS_LEAF;
+  }
+}
+
+
+/**
+ * Picks the profile section an expression is recorded under.
+ *
+ * @return ProfileSection - MULTIPLY, TRANSPOSE, ADD or SUBTRACT for a lone
+ *                          operation on matrices, otherwise EXPRESSION.
+ */
+template <typename E>
+ProfileSection expressionSection() {
+  if constexpr (E::IS_PRODUCT) {
+    if constexpr (isStoredOperand<typename E::LeftType>() && isStoredOperand<typename E::RightType>()) {
+      return ProfileSection::MULTIPLY;
+    }
+  } else if constexpr (IsTransposeExpression<E>::value) {
+    if constexpr (E::OperandType::IS_LEAF) {
+      return ProfileSection::TRANSPOSE;
+    }
+  } else if constexpr (IsElementwiseExpression<E>::value) {
+    if constexpr (E::LeftType::IS_LEAF && E::RightType::IS_LEAF) {
+      return std::is_same<typename E::OperationType, AddOperation>::value ? ProfileSection::ADD
+                                                                          : ProfileSection::SUBTRACT;
+    }
+  }
+  return ProfileSection::EXPRESSION;
+}
+
+
+/**
+ * Operator overload for addition.
+ *
+ * @param left - the lhs expression.
+ * @param right - the rhs expression.
+ * @return ElementwiseExpression - the lazy sum.
+ * @throws std::string - invalid dimensions.
+ */
+template <typename L, typename R>
+ElementwiseExpression<AddOperation, L, R> operator+(const MatrixExpression<L> &left,
+                                                    const MatrixExpression<R> &right) {
+  // Check for same size.
+  if (left.self().getWidth() != right.self().getWidth()
+      || left.self().getHeight() != right.self().getHeight()) {
+    throw(std::string("[Sum] ERROR: dimensions are not matching."));
+  }
+  return ElementwiseExpression<AddOperation, L, R>(left.self(), right.self());
+}
+
+
+/**
+ * Operator overload for subtraction.
+ *
+ * @param left - the lhs expression.
+ * @param right - the rhs expression.
+ * @return ElementwiseExpression - the lazy difference.
+ * @throws std::string - invalid dimensions.
+ */
+template <typename L, typename R>
+ElementwiseExpression<SubtractOperation, L, R> operator-(const MatrixExpression<L> &left,
+                                                         const MatrixExpression<R> &right) {
+  // Check for same size.
+  if (left.self().getWidth() != right.self().getWidth()
+      || left.self().getHeight() != right.self().getHeight()) {
+    throw(std::string("[Difference] ERROR: dimensions are not matching."));
+  }
+  return ElementwiseExpression<SubtractOperation, L, R>(left.self(), right.self());
+}
+
+
+/**
+ * Operator overload for multiplication.
+ *
+ * @param left - the lhs expression.
+ * @param right - the rhs expression.
+ * @return ProductExpression - the lazy product.
+ * @throws std::string - invalid dimensions.
+ */
+template <typename L, typename R>
+ProductExpression<L, R> operator*(const MatrixExpression<L> &left, const MatrixExpression<R> &right) {
+  // Check if left's width == right's height.
+  if (left.self().getWidth() != right.self().getHeight()) {
+    throw(std::string("[Product] ERROR: matrix 1's width does not match matrix 2's height."));
+  }
+  return ProductExpression<L, R>(left.self(), right.self());
+}
+
+
+/**
+ * Operator overload for scaling.
+ *
+ * @param alpha - the scale.
+ * @param operand - the expression to scale.
+ * @return ScaledExpression - the lazy scaled expression.
+ */
+template <typename E>
+ScaledExpression<E> operator*(float alpha, const MatrixExpression<E> &operand) {
+  return ScaledExpression<E>(alpha, operand.self());
+}
+
+
+/**
+ * Transposes an expression.
+ *
+ * @param operand - the expression to transpose.
+ * @return TransposeExpression - the lazy transpose.
+ */
+template <typename E>
+TransposeExpression<E> transpose(const MatrixExpression<E> &operand) {
+  return TransposeExpression<E>(operand.self());
+}
+
+#endif  // MATRIX_EXPRESSION_H_
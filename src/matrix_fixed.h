@@ -0,0 +1,291 @@
+/**
+ * matrix_fixed.h
+ * Matrices whose dimensions are template arguments, for the many tiny
+ * (2x2 to 8x8) operands that dominate some workloads. The elements live in
+ * the object, every loop is expanded at compile time and all operations are
+ * constexpr, so there is no allocation and no runtime bound check; operands
+ * of mismatching dimensions do not compile.
+ * BasicMatrix<T, R, C> is the fixed-size matrix; BasicMatrix<T> (R = C =
+ * DYNAMIC) is the class calculator's runtime-sized matrix, and the two
+ * convert explicitly into each other.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_FIXED_H_
+#define MATRIX_FIXED_H_
+
+#include <cstddef>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "matrix_element.h"
+#include "matrix_format.h"
+#include "matrix_storage.h"
+
+
+// Dimension of a matrix whose size is only known at runtime.
+const int DYNAMIC = -1;
+
+
+/**
+ * Matrix of T with R rows and C columns fixed at compile time.
+ * The runtime-sized matrix is the BasicMatrix<T, DYNAMIC, DYNAMIC>
+ * specialization (see class_matrix_calculator.cc).
+ */
+template <typename T, int R = DYNAMIC, int C = DYNAMIC>
+class BasicMatrix {
+  static_assert(R > 0 && C > 0, "fixed-size matrix dimensions must be positive");
+  static_assert(std::is_arithmetic<T>::value, "fixed-size matrices hold arithmetic types");
+
+ public:
+  /**
+   * Constructor for a zero matrix.
+   */
+  constexpr BasicMatrix() : _data() {}
+
+
+  /**
+   * Constructor from the elements, row by row.
+   *
+   * @param values - the R * C elements.
+   */
+  constexpr explicit BasicMatrix(const T (&values)[R * C]) : _data() {
+    for (int i = 0; i < R * C; ++i) {
+      _data[i] = values[i];
+    }
+  }
+
+
+  /**
+   * Copies a runtime-sized matrix of the same dimensions.
+   *
+   * @param view - the elements.
+   * @return BasicMatrix - the matrix.
+   * @throws std::invalid_argument - the dimensions are not R x C.
+   */
+  static BasicMatrix fromView(const BasicMatrixView<T> &view) {
+    if (view.width != C || view.height != R) {
+      throw std::invalid_argument("Invalid size, expected " + std::to_string(C) + " x " + std::to_string(R));
+    }
+    BasicMatrix matrix;
+    for (int i = 0; i < R; ++i) {
+      for (int j = 0; j < C; ++j) {
+        matrix._data[i * C + j] = view.at(i, j);
+      }
+    }
+    return matrix;
+  }
+
+
+  /**
+   * Retrieves the width of the matrix.
+   *
+   * @return int - the width.
+   */
+  static constexpr int getWidth() {
+    return C;
+  }
+
+
+  /**
+   * Retrieves the height of the matrix.
+   *
+   * @return int - the height.
+   */
+  static constexpr int getHeight() {
+    return R;
+  }
+
+
+  /**
+   * Retrieves an element of the matrix.
+   *
+   * @param i - the row index.
+   * @param j - the column index.
+   * @return T - the element.
+   */
+  constexpr T at(int i, int j) const {
+    return _data[i * C + j];
+  }
+
+
+  /**
+   * Retrieves an element of the matrix for writing.
+   *
+   * @param i - the row index.
+   * @param j - the column index.
+   * @return T& - the element.
+   */
+  constexpr T &at(int i, int j) {
+    return _data[i * C + j];
+  }
+
+
+  /**
+   * Retrieves a view of the elements (stride C), e.g. to hand them to the kernels.
+   *
+   * @return BasicMatrixView<T> - the view.
+   */
+  BasicMatrixView<T> view() {
+    return BasicMatrixView<T>{_data, C, R, C};
+  }
+
+
+  /**
+   * Copies the elements into runtime-sized storage of the same dimensions.
+   *
+   * @param view - the destination.
+   * @throws std::invalid_argument - the dimensions are not R x C.
+   */
+  void copyTo(const BasicMatrixView<T> &view) const {
+    if (view.width != C || view.height != R) {
+      throw std::invalid_argument("Invalid size, expected " + std::to_string(C) + " x " + std::to_string(R));
+    }
+    for (int i = 0; i < R; ++i) {
+      for (int j = 0; j < C; ++j) {
+        view.at(i, j) = _data[i * C + j];
+      }
+    }
+  }
+
+
+ private:
+  T _data[R * C];
+
+
+  /**
+   * Operator overloading for prints; same format as the runtime-sized matrix.
+   *
+   * @param os - the output stream.
+   * @param matrix - the matrix to print.
+   */
+  friend std::ostream &operator<<(std::ostream &os, const BasicMatrix &matrix) {
+    BasicMatrix copy = matrix;
+    writeMatrix(os, copy.view(), outputFormat(FIXED_FORMAT));
+    return os;
+  }
+};
+
+
+/**
+ * Enables an operator only for fixed-size operands.
+ */
+template <int R1, int C1, int R2, int C2>
+using FixedOperands = std::enable_if_t<R1 != DYNAMIC && C1 != DYNAMIC && R2 != DYNAMIC && C2 != DYNAMIC>;
+
+
+/**
+ * Combines every element with one expanded statement per element.
+ *
+ * @param a - the first operand.
+ * @param b - the second operand.
+ * @param op - the element operation.
+ * @return BasicMatrix - the result.
+ */
+template <typename T, int R, int C, typename Op, size_t... I>
+constexpr BasicMatrix<T, R, C> combineFixed(const BasicMatrix<T, R, C> &a, const BasicMatrix<T, R, C> &b,
+                                            Op op, std::index_sequence<I...>) {
+  using Traits = ElementTraits<T>;
+  BasicMatrix<T, R, C> result;
+  ((result.at(I / C, I % C) = Traits::narrow(op(Traits::widen(a.at(I / C, I % C)),
+                                                Traits::widen(b.at(I / C, I % C))))), ...);
+  return result;
+}
+
+
+/**
+ * Computes one element of a product as an expanded dot product, accumulated
+ * in the element type's accumulator from left to right.
+ *
+ * @param a - the left operand.
+ * @param b - the right operand.
+ * @param i - the row of the element.
+ * @param j - the column of the element.
+ * @return Accumulator - the dot product.
+ */
+template <typename T, int R, int K, int C, size_t... P>
+constexpr typename ElementTraits<T>::Accumulator dotFixed(const BasicMatrix<T, R, K> &a,
+                                                          const BasicMatrix<T, K, C> &b, int i, int j,
+                                                          std::index_sequence<P...>) {
+  using Traits = ElementTraits<T>;
+  typename Traits::Accumulator sum = 0;
+  ((sum += Traits::widen(a.at(i, P)) * Traits::widen(b.at(P, j))), ...);
+  return sum;
+}
+
+
+/**
+ * Computes every element of a product.
+ *
+ * @param a - the left operand.
+ * @param b - the right operand.
+ * @return BasicMatrix - the product.
+ */
+template <typename T, int R, int K, int C, size_t... I>
+constexpr BasicMatrix<typename ElementTraits<T>::Product, R, C> multiplyFixed(const BasicMatrix<T, R, K> &a,
+                                                                              const BasicMatrix<T, K, C> &b,
+                                                                              std::index_sequence<I...>) {
+  using Product = typename ElementTraits<T>::Product;
+  BasicMatrix<Product, R, C> result;
+  ((result.at(I / C, I % C) =
+        ElementTraits<Product>::narrow(dotFixed(a, b, I / C, I % C, std::make_index_sequence<K>()))), ...);
+  return result;
+}
+
+
+/**
+ * Operator overloading for addition of fixed-size matrices.
+ *
+ * @param matrix1 - the lhs matrix.
+ * @param matrix2 - the rhs matrix (same dimensions, checked at compile time).
+ * @return BasicMatrix - the sum.
+ */
+template <typename T, int R1, int C1, int R2, int C2, typename = FixedOperands<R1, C1, R2, C2>>
+constexpr BasicMatrix<T, R1, C1> operator+(const BasicMatrix<T, R1, C1> &matrix1,
+                                           const BasicMatrix<T, R2, C2> &matrix2) {
+  static_assert(R1 == R2 && C1 == C2, "[Sum] ERROR: dimensions are not matching.");
+  return combineFixed(matrix1, matrix2, [](auto x, auto y) { return x + y; },
+                      std::make_index_sequence<R1 * C1>());
+}
+
+
+/**
+ * Operator overloading for subtraction of fixed-size matrices.
+ *
+ * @param matrix1 - the lhs matrix.
+ * @param matrix2 - the rhs matrix (same dimensions, checked at compile time).
+ * @return BasicMatrix - the difference.
+ */
+template <typename T, int R1, int C1, int R2, int C2, typename = FixedOperands<R1, C1, R2, C2>>
+constexpr BasicMatrix<T, R1, C1> operator-(const BasicMatrix<T, R1, C1> &matrix1,
+                                           const BasicMatrix<T, R2, C2> &matrix2) {
+  static_assert(R1 == R2 && C1 == C2, "[Difference] ERROR: dimensions are not matching.");
+  return combineFixed(matrix1, matrix2, [](auto x, auto y) { return x - y; },
+                      std::make_index_sequence<R1 * C1>());
+}
+
+
+/**
+ * Operator overloading for multiplication of fixed-size matrices.
+ * int8 matrices give an int32 product, as for runtime-sized ones.
+ *
+ * @param matrix1 - the lhs matrix.
+ * @param matrix2 - the rhs matrix (as high as matrix1 is wide, checked at compile time).
+ * @return BasicMatrix - the product.
+ */
+template <typename T, int R1, int C1, int R2, int C2, typename = FixedOperands<R1, C1, R2, C2>>
+constexpr BasicMatrix<typename ElementTraits<T>::Product, R1, C2> operator*(const BasicMatrix<T, R1, C1> &matrix1,
+                                                                           const BasicMatrix<T, R2, C2> &matrix2) {
+  static_assert(C1 == R2, "[Product] ERROR: matrix 1's width does not match matrix 2's height.");
+  if constexpr (C1 == R2) {
+    return multiplyFixed(matrix1, matrix2, std::make_index_sequence<R1 * C2>());
+  } else {
+    return {};
+  }
+}
+
+#endif  // MATRIX_FIXED_H_
@@ -0,0 +1,311 @@
+/**
+ * matrix_format.h
+ * Buffered matrix output.
+ * Elements are converted with std::to_chars into one reusable buffer that is
+ * handed to the stream in large blocks and flushed once per matrix, instead of
+ * a formatted insertion (and often a flush) per element or row.
+ * Large matrices are formatted by several threads, a window of rows at a time.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_FORMAT_H_
+#define MATRIX_FORMAT_H_
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdlib>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "matrix_instrumentation.h"
+#include "matrix_storage.h"
+#include "thread_pool.h"
+
+
+// Most characters one element can take, including its separator.
+const size_t FORMAT_MAX_CHARS = 64;
+
+// Bytes collected before they are handed to the stream.
+const size_t FORMAT_BUFFER_SIZE = size_t(1) << 20;
+
+// Matrices with at least this many elements are formatted in parallel.
+const size_t FORMAT_PARALLEL_THRESHOLD = size_t(1) << 20;
+
+// Elements formatted per parallel task.
+const size_t FORMAT_TASK_ELEMENTS = size_t(1) << 16;
+
+// Largest precision accepted (float has at most 9 significant digits).
+const int FORMAT_MAX_PRECISION = 9;
+
+
+/**
+ * How elements are written.
+ */
+enum class FloatStyle {
+  SHORTEST,   // Fewest digits that read back to the same float.
+  FIXED,      // precision digits after the point (like %f).
+  GENERAL     // precision significant digits (like %g, the iostream default).
+};
+
+
+struct NumberFormat {
+  FloatStyle style;
+  int precision;
+};
+
+
+// Format of std::to_string(float), used by the class calculator.
+const NumberFormat FIXED_FORMAT = {FloatStyle::FIXED, 6};
+
+// Format of the default std::ostream << float, used by the other calculators.
+const NumberFormat GENERAL_FORMAT = {FloatStyle::GENERAL, 6};
+
+
+/**
+ * Parses a format description: "shortest", "fixed[:N]" or "general[:N]".
+ *
+ * @param text - the description.
+ * @param format - receives the format.
+ * @return bool - whether the description was valid.
+ */
+inline bool parseNumberFormat(const std::string &text, NumberFormat* format) {
+  std::string style = text.substr(0, text.find(':'));
+  NumberFormat parsed = {FloatStyle::SHORTEST, 0};
+  if (style == "fixed") {
+    parsed = FIXED_FORMAT;
+  } else if (style == "general") {
+    parsed = GENERAL_FORMAT;
+  } else if (style != "shortest") {
+    return false;
+  }
+
+  if (style.size() < text.size()) {
+    const char* first = text.data() + style.size() + 1;
+    const char* last = text.data() + text.size();
+    std::from_chars_result result = std::from_chars(first, last, parsed.precision);
+    if (parsed.style == FloatStyle::SHORTEST || result.ec != std::errc() || result.ptr != last
+        || parsed.precision < 0 || parsed.precision > FORMAT_MAX_PRECISION) {
+      return false;
+    }
+  }
+  *format = parsed;
+  return true;
+}
+
+
+/**
+ * Picks the output format: MATRIX_PRECISION when it is set and valid,
+ * otherwise the calculator's own default.
+ *
+ * @param fallback - the calculator's default.
+ * @return NumberFormat - the format.
+ */
+inline NumberFormat outputFormat(NumberFormat fallback) {
+  static const char* env = std::getenv("MATRIX_PRECISION");
+  NumberFormat format = fallback;
+  if (env != nullptr && !parseNumberFormat(env, &format)) {
+    format = fallback;
+  }
+  return format;
+}
+
+
+/**
+ * Converts one element to text.
+ *
+ * @param first - where to write (at least FORMAT_MAX_CHARS free).
+ * @param value - the element.
+ * @param format - the format.
+ * @return char* - one past the last character written.
+ */
+inline char* formatFloat(char* first, float value, NumberFormat format) {
+  char* last = first + FORMAT_MAX_CHARS;
+  switch (format.style) {
+    case FloatStyle::FIXED:
+      return std::to_chars(first, last, value, std::chars_format::fixed, format.precision).ptr;
+    case FloatStyle::GENERAL:
+      return std::to_chars(first, last, value, std::chars_format::general, format.precision).ptr;
+    default:
+      return std::to_chars(first, last, value).ptr;
+  }
+}
+
+
+/**
+ * Growable text buffer whose storage is kept when it is cleared.
+ */
+struct TextBuffer {
+  std::vector<char> storage;
+  size_t size = 0;
+
+  /**
+   * Makes room for more characters.
+   *
+   * @param count - the number of characters about to be appended.
+   * @return char* - where to append them.
+   */
+  char* reserve(size_t count) {
+    if (storage.size() - size < count) {
+      storage.resize(std::max(storage.size() * 2, size + count));
+    }
+    return storage.data() + size;
+  }
+};
+
+
+/**
+ * Formats one row ("v v v \n") onto the end of a buffer.
+ *
+ * @param text - the buffer to append to.
+ * @param row - the row.
+ * @param width - the number of elements.
+ * @param format - the format.
+ */
+inline void appendRow(TextBuffer &text, const float* row, int width, NumberFormat format) {
+  char* first = text.reserve(static_cast<size_t>(width) * FORMAT_MAX_CHARS + 1);
+  char* out = first;
+  for (int j = 0; j < width; ++j) {
+    out = formatFloat(out, row[j], format);
+    *out++ = ' ';
+  }
+  *out++ = '\n';
+  text.size += out - first;
+}
+
+
+/**
+ * Writes rows to a stream through a reusable per-thread buffer.
+ */
+class MatrixWriter {
+ public:
+  /**
+   * Constructor.
+   *
+   * @param os - the output stream.
+   * @param format - the element format.
+   */
+  MatrixWriter(std::ostream &os, NumberFormat format) : _os(os), _format(format), _buffer(buffer()) {
+    _buffer.size = 0;
+  }
+
+  MatrixWriter(const MatrixWriter &) = delete;
+  MatrixWriter &operator=(const MatrixWriter &) = delete;
+
+
+  /**
+   * Destructor; writes what is left and flushes the stream.
+   */
+  ~MatrixWriter() {
+    drain();
+    _os.flush();
+  }
+
+
+  /**
+   * Writes a row.
+   *
+   * @param row - the row.
+   * @param width - the number of elements.
+   */
+  void writeRow(const float* row, int width) {
+    appendRow(_buffer, row, width, _format);
+    if (_buffer.size >= FORMAT_BUFFER_SIZE) {
+      drain();
+    }
+  }
+
+
+  /**
+   * Hands the buffered text to the stream (without flushing it).
+   */
+  void drain() {
+    _os.write(_buffer.storage.data(), static_cast<std::streamsize>(_buffer.size));
+    _buffer.size = 0;
+  }
+
+
+  /**
+   * Writes a block of text that was formatted elsewhere.
+   *
+   * @param text - the text.
+   */
+  void writeText(const TextBuffer &text) {
+    drain();
+    _os.write(text.storage.data(), static_cast<std::streamsize>(text.size));
+  }
+
+
+  /**
+   * Retrieves the element format.
+   *
+   * @return NumberFormat - the format.
+   */
+  NumberFormat format() const {
+    return _format;
+  }
+
+
+ private:
+  std::ostream &_os;
+  NumberFormat _format;
+  TextBuffer &_buffer;
+
+
+  /**
+   * Retrieves this thread's output buffer; its capacity is kept between matrices.
+   *
+   * @return TextBuffer& - the buffer.
+   */
+  static TextBuffer &buffer() {
+    static thread_local TextBuffer text;
+    return text;
+  }
+};
+
+
+/**
+ * Writes a matrix, one line per row with a space after every element, and
+ * flushes the stream once at the end. May be called from any thread (e.g. the
+ * batch write stage); large matrices are formatted on the shared pool.
+ *
+ * @param os - the output stream.
+ * @param matrix - the matrix.
+ * @param format - the element format.
+ */
+inline void writeMatrix(std::ostream &os, const MatrixView &matrix, NumberFormat format) {
+  size_t elements = static_cast<size_t>(matrix.width) * matrix.height;
+  ProfileScope profile(ProfileSection::PRINT, 0, static_cast<double>(sizeof(float) * elements));
+  MatrixWriter writer(os, format);
+  ThreadPool &pool = defaultThreadPool();
+  if (elements < FORMAT_PARALLEL_THRESHOLD || pool.size() == 1) {
+    for (int i = 0; i < matrix.height; ++i) {
+      writer.writeRow(matrix.row(i), matrix.width);
+    }
+    return;
+  }
+
+  // Format a window of row blocks in parallel, then write it out in order.
+  int blockRows = static_cast<int>(FORMAT_TASK_ELEMENTS / matrix.width) + 1;
+  size_t blocks = (static_cast<size_t>(matrix.height) + blockRows - 1) / blockRows;
+  size_t window = static_cast<size_t>(pool.size()) * 4;
+  std::vector<TextBuffer> texts(window);
+  for (size_t start = 0; start < blocks; start += window) {
+    size_t count = std::min(window, blocks - start);
+    pool.parallelFor(count, [&](size_t t) {
+      int first = static_cast<int>((start + t) * blockRows);
+      int last = std::min(first + blockRows, matrix.height);
+      texts[t].size = 0;
+      for (int i = first; i < last; ++i) {
+        appendRow(texts[t], matrix.row(i), matrix.width, format);
+      }
+    });
+    for (size_t t = 0; t < count; ++t) {
+      writer.writeText(texts[t]);
+    }
+  }
+}
+
+#endif  // MATRIX_FORMAT_H_
@@ -0,0 +1,1099 @@
+/**
+ * matrix_gemm.h
+ * Matrix multiplication engine shared by the calculators.
+ * Provides the reference triple loop and a cache-blocked, register-tiled
+ * kernel that packs panels of both operands before multiplying them.
+ * Operands are row-major with an explicit leading dimension (see matrix_storage.h).
+ * Large products are split into output tiles and spread over the thread pool.
+ * Big, near-square products can instead take the Strassen-Winograd recursion,
+ * which trades a little accuracy for fewer multiplications.
+ * Either operand may be used transposed (A^T B, A B^T, A^T B^T): the packing
+ * routines read it in its stored order, so no transposed copy is ever made.
+ * An operand that is mostly zeros is compressed and multiplied through its
+ * nonzeros instead (see matrix_sparse.h).
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_GEMM_H_
+#define MATRIX_GEMM_H_
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "matrix_instrumentation.h"
+#include "matrix_simd.h"
+#include "matrix_sparse.h"
+#include "matrix_storage.h"
+#include "thread_pool.h"
+
+
+// Register tile computed by one micro-kernel call (rows x columns of C).
+const int GEMM_MR = 6;
+const int GEMM_NR = 16;
+
+// Cache blocks: an MC x KC panel of A stays in L2, a KC x NR sliver of B in L1.
+const int GEMM_MC = 120;
+const int GEMM_KC = 256;
+const int GEMM_NC = 4080;
+
+// Largest output tile handed to one pool task (multiples of the register tile).
+const int GEMM_TILE_M = 2 * GEMM_MC;
+const int GEMM_TILE_N = 32 * GEMM_NR;
+
+// Products with fewer multiply-adds than this are not worth waking the pool for.
+const double GEMM_PARALLEL_THRESHOLD = 96.0 * 96.0 * 96.0;
+
+// Strassen-Winograd recursion stops once a dimension is at most this (MATRIX_STRASSEN_CUTOFF).
+const int DEFAULT_STRASSEN_CUTOFF = 512;
+
+
+/**
+ * Algorithms that can carry out a matrix product.
+ */
+enum class GemmAlgorithm {
+  REFERENCE,  // Naive triple loop; kept as the correctness baseline.
+  BLOCKED,    // Cache-blocked, packed, register-tiled kernel (multi-threaded when large).
+  STRASSEN    // Strassen-Winograd recursion down to the blocked kernel.
+};
+
+
+/**
+ * How a product operand is read: as stored, or as its transpose.
+ */
+enum class Transpose {
+  NONE,       // op(X) = X.
+  TRANSPOSED  // op(X) = X^T; X is stored with the rows and columns swapped.
+};
+
+
+/**
+ * Retrieves the mutable, process-wide algorithm selection.
+ * Defaults to BLOCKED unless the MATRIX_GEMM environment variable says
+ * "reference" or "strassen".
+ *
+ * @return GemmAlgorithm& - the current selection.
+ */
+inline GemmAlgorithm &gemmAlgorithmSetting() {
+  static GemmAlgorithm algorithm = [] {
+    const char* env = std::getenv("MATRIX_GEMM");
+    if (env != nullptr && std::string(env) == "reference") {
+      return GemmAlgorithm::REFERENCE;
+    } else if (env != nullptr && std::string(env) == "strassen") {
+      return GemmAlgorithm::STRASSEN;
+    }
+    return GemmAlgorithm::BLOCKED;
+  }();
+  return algorithm;
+}
+
+
+/**
+ * Retrieves the name of an algorithm.
+ *
+ * @param algorithm - the algorithm.
+ * @return const char* - the name MATRIX_GEMM accepts.
+ */
+inline const char* gemmAlgorithmName(GemmAlgorithm algorithm) {
+  switch (algorithm) {
+    case GemmAlgorithm::REFERENCE:
+      return "reference";
+    case GemmAlgorithm::STRASSEN:
+      return "strassen";
+    default:
+      return "blocked";
+  }
+}
+
+
+/**
+ * Retrieves the algorithm used by multiply() when none is given.
+ *
+ * @return GemmAlgorithm - the current selection.
+ */
+inline GemmAlgorithm getGemmAlgorithm() {
+  return gemmAlgorithmSetting();
+}
+
+
+/**
+ * Changes the algorithm used by multiply() when none is given.
+ *
+ * @param algorithm - the new selection.
+ */
+inline void setGemmAlgorithm(GemmAlgorithm algorithm) {
+  gemmAlgorithmSetting() = algorithm;
+}
+
+
+/**
+ * Retrieves the mutable, process-wide deterministic mode setting.
+ * Defaults to on when the MATRIX_DETERMINISTIC environment variable is "1".
+ *
+ * @return bool& - the current setting.
+ */
+inline bool &gemmDeterministicSetting() {
+  static bool deterministic = [] {
+    const char* env = std::getenv("MATRIX_DETERMINISTIC");
+    return env != nullptr && std::string(env) == "1";
+  }();
+  return deterministic;
+}
+
+
+/**
+ * Retrieves whether parallel products must be reproducible bit for bit.
+ *
+ * @return bool - the current setting.
+ */
+inline bool getGemmDeterministic() {
+  return gemmDeterministicSetting();
+}
+
+
+/**
+ * Changes whether parallel products must be reproducible bit for bit.
+ * When on, every element is summed in the same order as on one thread, whatever
+ * the thread count or schedule; when off, shapes with too few output tiles may
+ * also be split along K and reduced in completion order.
+ *
+ * @param deterministic - the new setting.
+ */
+inline void setGemmDeterministic(bool deterministic) {
+  gemmDeterministicSetting() = deterministic;
+}
+
+
+/**
+ * Retrieves the mutable, process-wide Strassen-Winograd cutoff.
+ * Defaults to MATRIX_STRASSEN_CUTOFF, or DEFAULT_STRASSEN_CUTOFF.
+ *
+ * @return int& - the cutoff.
+ */
+inline int &strassenCutoffSetting() {
+  static int cutoff = [] {
+    const char* env = std::getenv("MATRIX_STRASSEN_CUTOFF");
+    if (env != nullptr && std::atoi(env) > 0) {
+      return std::atoi(env);
+    }
+    return DEFAULT_STRASSEN_CUTOFF;
+  }();
+  return cutoff;
+}
+
+
+/**
+ * Retrieves the dimension at or below which Strassen-Winograd uses the blocked kernel.
+ *
+ * @return int - the cutoff.
+ */
+inline int getStrassenCutoff() {
+  return strassenCutoffSetting();
+}
+
+
+/**
+ * Changes the dimension at or below which Strassen-Winograd uses the blocked kernel.
+ *
+ * @param cutoff - the cutoff (at least 16).
+ */
+inline void setStrassenCutoff(int cutoff) {
+  strassenCutoffSetting() = std::max(cutoff, 16);
+}
+
+
+/**
+ * Aligned scratch space that grows on demand and is reused between calls.
+ */
+class GemmBuffer {
+ public:
+  GemmBuffer() = default;
+  GemmBuffer(const GemmBuffer &) = delete;
+  GemmBuffer &operator=(const GemmBuffer &) = delete;
+
+  ~GemmBuffer() {
+    std::free(_data);
+  }
+
+  /**
+   * Makes sure the buffer holds at least count floats.
+   *
+   * @param count - the number of floats needed.
+   * @return float* - the 64-byte aligned buffer.
+   */
+  float* reserve(size_t count) {
+    if (count > _capacity) {
+      std::free(_data);
+      size_t bytes = (count * sizeof(float) + 63) / 64 * 64;
+      _data = static_cast<float*>(std::aligned_alloc(64, bytes));
+      _capacity = count;
+    }
+    return _data;
+  }
+
+ private:
+  float* _data = nullptr;
+  size_t _capacity = 0;
+};
+
+
+/**
+ * Finds element (row, col) of op(X) in the storage of X.
+ *
+ * @param trans - whether X is used transposed.
+ * @param ld - the leading dimension of X.
+ * @param row - the row in op(X).
+ * @param col - the column in op(X).
+ * @return size_t - the offset from the first element of X.
+ */
+inline size_t operandOffset(Transpose trans, int ld, int row, int col) {
+  if (trans == Transpose::TRANSPOSED) {
+    return static_cast<size_t>(col) * ld + row;
+  }
+  return static_cast<size_t>(row) * ld + col;
+}
+
+
+/**
+ * Copies an mc x kc block of op(A) into MR-row slivers, column by column.
+ * Rows past the edge of A are zero filled so the micro-kernel never branches.
+ * A transposed A is read along its stored rows, which are op(A)'s columns.
+ *
+ * @param a - the elements of A.
+ * @param lda - the leading dimension of A.
+ * @param trans - whether A is used transposed.
+ * @param row - the first row of the block in op(A).
+ * @param col - the first column of the block in op(A).
+ * @param mc - the block height.
+ * @param kc - the block width.
+ * @param packed - the destination buffer.
+ */
+inline void packPanelA(const float* a, int lda, Transpose trans, int row, int col, int mc, int kc,
+                       float* packed) {
+  for (int ir = 0; ir < mc; ir += GEMM_MR) {
+    int rows = std::min(GEMM_MR, mc - ir);
+    const float* source = a + operandOffset(trans, lda, row + ir, col);
+    for (int p = 0; p < kc; ++p) {
+      if (trans == Transpose::TRANSPOSED) {
+        const float* column = source + static_cast<size_t>(p) * lda;
+        for (int i = 0; i < rows; ++i) {
+          packed[i] = column[i];
+        }
+      } else {
+        for (int i = 0; i < rows; ++i) {
+          packed[i] = source[static_cast<size_t>(i) * lda + p];
+        }
+      }
+      for (int i = rows; i < GEMM_MR; ++i) {
+        packed[i] = 0.0f;
+      }
+      packed += GEMM_MR;
+    }
+  }
+}
+
+
+/**
+ * Copies a kc x nc block of op(B) into NR-column slivers, row by row.
+ * Columns past the edge of B are zero filled.
+ * A transposed B is read along its stored rows, which are op(B)'s columns.
+ *
+ * @param b - the elements of B.
+ * @param ldb - the leading dimension of B.
+ * @param trans - whether B is used transposed.
+ * @param row - the first row of the block in op(B).
+ * @param col - the first column of the block in op(B).
+ * @param kc - the block height.
+ * @param nc - the block width.
+ * @param packed - the destination buffer.
+ */
+inline void packPanelB(const float* b, int ldb, Transpose trans, int row, int col, int kc, int nc,
+                       float* packed) {
+  for (int jr = 0; jr < nc; jr += GEMM_NR) {
+    int cols = std::min(GEMM_NR, nc - jr);
+    if (trans == Transpose::TRANSPOSED) {
+      // Each stored row fills one column of the sliver.
+      for (int j = 0; j < cols; ++j) {
+        const float* source = b + operandOffset(trans, ldb, row, col + jr + j);
+        for (int p = 0; p < kc; ++p) {
+          packed[p * GEMM_NR + j] = source[p];
+        }
+      }
+      for (int p = 0; p < kc; ++p) {
+        for (int j = cols; j < GEMM_NR; ++j) {
+          packed[p * GEMM_NR + j] = 0.0f;
+        }
+      }
+      packed += static_cast<size_t>(kc) * GEMM_NR;
+      continue;
+    }
+    for (int p = 0; p < kc; ++p) {
+      const float* source = b + static_cast<size_t>(row + p) * ldb + col + jr;
+      for (int j = 0; j < cols; ++j) {
+        packed[j] = source[j];
+      }
+      for (int j = cols; j < GEMM_NR; ++j) {
+        packed[j] = 0.0f;
+      }
+      packed += GEMM_NR;
+    }
+  }
+}
+
+
+/**
+ * Portable micro-kernel: multiplies an MR sliver of A by an NR sliver of B.
+ *
+ * @param kc - the shared dimension of the slivers.
+ * @param a - the packed A sliver.
+ * @param b - the packed B sliver.
+ * @param tile - the MR x NR output tile (row-major, overwritten).
+ */
+inline void microKernelGeneric(int kc, const float* a, const float* b, float* tile) {
+  float accumulator[GEMM_MR][GEMM_NR] = {};
+  for (int p = 0; p < kc; ++p) {
+    for (int i = 0; i < GEMM_MR; ++i) {
+      float value = a[i];
+      for (int j = 0; j < GEMM_NR; ++j) {
+        accumulator[i][j] += value * b[j];
+      }
+    }
+    a += GEMM_MR;
+    b += GEMM_NR;
+  }
+  std::memcpy(tile, accumulator, sizeof(accumulator));
+}
+
+
+#ifdef MATRIX_SIMD_X86
+/**
+ * AVX2/FMA micro-kernel: keeps the whole 6 x 16 tile in twelve ymm registers.
+ *
+ * @param kc - the shared dimension of the slivers.
+ * @param a - the packed A sliver.
+ * @param b - the packed B sliver.
+ * @param tile - the MR x NR output tile (row-major, overwritten).
+ */
+__attribute__((target("avx2,fma")))
+inline void microKernelAvx2(int kc, const float* a, const float* b, float* tile) {
+  __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+  __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+  __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+  __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+  __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+  __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+
+  for (int p = 0; p < kc; ++p) {
+    __m256 b0 = _mm256_load_ps(b);
+    __m256 b1 = _mm256_load_ps(b + 8);
+    __m256 value;
+    value = _mm256_broadcast_ss(a + 0);
+    c00 = _mm256_fmadd_ps(value, b0, c00);
+    c01 = _mm256_fmadd_ps(value, b1, c01);
+    value = _mm256_broadcast_ss(a + 1);
+    c10 = _mm256_fmadd_ps(value, b0, c10);
+    c11 = _mm256_fmadd_ps(value, b1, c11);
+    value = _mm256_broadcast_ss(a + 2);
+    c20 = _mm256_fmadd_ps(value, b0, c20);
+    c21 = _mm256_fmadd_ps(value, b1, c21);
+    value = _mm256_broadcast_ss(a + 3);
+    c30 = _mm256_fmadd_ps(value, b0, c30);
+    c31 = _mm256_fmadd_ps(value, b1, c31);
+    value = _mm256_broadcast_ss(a + 4);
+    c40 = _mm256_fmadd_ps(value, b0, c40);
+    c41 = _mm256_fmadd_ps(value, b1, c41);
+    value = _mm256_broadcast_ss(a + 5);
+    c50 = _mm256_fmadd_ps(value, b0, c50);
+    c51 = _mm256_fmadd_ps(value, b1, c51);
+    a += GEMM_MR;
+    b += GEMM_NR;
+  }
+
+  _mm256_storeu_ps(tile + 0 * GEMM_NR, c00);
+  _mm256_storeu_ps(tile + 0 * GEMM_NR + 8, c01);
+  _mm256_storeu_ps(tile + 1 * GEMM_NR, c10);
+  _mm256_storeu_ps(tile + 1 * GEMM_NR + 8, c11);
+  _mm256_storeu_ps(tile + 2 * GEMM_NR, c20);
+  _mm256_storeu_ps(tile + 2 * GEMM_NR + 8, c21);
+  _mm256_storeu_ps(tile + 3 * GEMM_NR, c30);
+  _mm256_storeu_ps(tile + 3 * GEMM_NR + 8, c31);
+  _mm256_storeu_ps(tile + 4 * GEMM_NR, c40);
+  _mm256_storeu_ps(tile + 4 * GEMM_NR + 8, c41);
+  _mm256_storeu_ps(tile + 5 * GEMM_NR, c50);
+  _mm256_storeu_ps(tile + 5 * GEMM_NR + 8, c51);
+}
+#endif
+
+
+/**
+ * Picks the fastest micro-kernel the running CPU supports (see simdLevel()).
+ *
+ * @return function pointer - the micro-kernel.
+ */
+inline void (*selectMicroKernel())(int, const float*, const float*, float*) {
+  static void (*kernel)(int, const float*, const float*, float*) = [] {
+#ifdef MATRIX_SIMD_X86
+    if (simdLevel() >= SimdLevel::AVX2) {
+      return &microKernelAvx2;
+    }
+#endif
+    return &microKernelGeneric;
+  }();
+  return kernel;
+}
+
+
+/**
+ * Reference product: C = op(A) * op(B) with the plain triple loop.
+ *
+ * @param m - the rows of op(A) and C.
+ * @param n - the columns of op(B) and C.
+ * @param k - the columns of op(A) and rows of op(B).
+ * @param a - the elements of A.
+ * @param lda - the leading dimension of A.
+ * @param b - the elements of B.
+ * @param ldb - the leading dimension of B.
+ * @param c - the elements of C.
+ * @param ldc - the leading dimension of C.
+ * @param transA - whether A is used transposed.
+ * @param transB - whether B is used transposed.
+ */
+inline void multiplyReference(int m, int n, int k, const float* a, int lda, const float* b, int ldb,
+                              float* c, int ldc, Transpose transA = Transpose::NONE,
+                              Transpose transB = Transpose::NONE) {
+  // For each row of A.
+  for (int i = 0; i < m; ++i) {
+    // For each column of B.
+    for (int j = 0; j < n; ++j) {
+      float sum = 0;
+      // For each column in row of A.
+      for (int p = 0; p < k; ++p) {
+        sum += a[operandOffset(transA, lda, i, p)] * b[operandOffset(transB, ldb, p, j)];
+      }
+      c[static_cast<size_t>(i) * ldc + j] = sum;
+    }
+  }
+}
+
+
+/**
+ * Blocked product: C = op(A) * op(B) through packed panels and the micro-kernel.
+ *
+ * @param m - the rows of op(A) and C.
+ * @param n - the columns of op(B) and C.
+ * @param k - the columns of op(A) and rows of op(B).
+ * @param a - the elements of A.
+ * @param lda - the leading dimension of A.
+ * @param b - the elements of B.
+ * @param ldb - the leading dimension of B.
+ * @param c - the elements of C.
+ * @param ldc - the leading dimension of C.
+ * @param transA - whether A is used transposed.
+ * @param transB - whether B is used transposed.
+ */
+inline void multiplyBlocked(int m, int n, int k, const float* a, int lda, const float* b, int ldb,
+                            float* c, int ldc, Transpose transA = Transpose::NONE,
+                            Transpose transB = Transpose::NONE) {
+  static thread_local GemmBuffer bufferA;
+  static thread_local GemmBuffer bufferB;
+  void (*kernel)(int, const float*, const float*, float*) = selectMicroKernel();
+  alignas(64) float tile[GEMM_MR * GEMM_NR];
+
+  for (int jc = 0; jc < n; jc += GEMM_NC) {
+    int nc = std::min(GEMM_NC, n - jc);
+    int ncPadded = (nc + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+
+    for (int pc = 0; pc < k; pc += GEMM_KC) {
+      int kc = std::min(GEMM_KC, k - pc);
+      float* packedB = bufferB.reserve(static_cast<size_t>(kc) * ncPadded);
+      packPanelB(b, ldb, transB, pc, jc, kc, nc, packedB);
+
+      for (int ic = 0; ic < m; ic += GEMM_MC) {
+        int mc = std::min(GEMM_MC, m - ic);
+        int mcPadded = (mc + GEMM_MR - 1) / GEMM_MR * GEMM_MR;
+        float* packedA = bufferA.reserve(static_cast<size_t>(kc) * mcPadded);
+        packPanelA(a, lda, transA, ic, pc, mc, kc, packedA);
+
+        for (int jr = 0; jr < nc; jr += GEMM_NR) {
+          int cols = std::min(GEMM_NR, nc - jr);
+          for (int ir = 0; ir < mc; ir += GEMM_MR) {
+            int rows = std::min(GEMM_MR, mc - ir);
+            kernel(kc, packedA + static_cast<size_t>(ir) * kc,
+                   packedB + static_cast<size_t>(jr) * kc, tile);
+
+            // Write back the valid part of the tile; later K blocks accumulate.
+            for (int i = 0; i < rows; ++i) {
+              float* row = c + static_cast<size_t>(ic + ir + i) * ldc + jc + jr;
+              const float* source = tile + i * GEMM_NR;
+              if (pc == 0) {
+                for (int j = 0; j < cols; ++j) {
+                  row[j] = source[j];
+                }
+              } else {
+                for (int j = 0; j < cols; ++j) {
+                  row[j] += source[j];
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+
+/**
+ * Parallel product: C = op(A) * op(B) with output tiles spread over the thread pool.
+ * Each tile runs the blocked kernel on its own rows of op(A) and columns of op(B).
+ *
+ * @param m - the rows of op(A) and C.
+ * @param n - the columns of op(B) and C.
+ * @param k - the columns of op(A) and rows of op(B).
+ * @param a - the elements of A.
+ * @param lda - the leading dimension of A.
+ * @param b - the elements of B.
+ * @param ldb - the leading dimension of B.
+ * @param c - the elements of C.
+ * @param ldc - the leading dimension of C.
+ * @param transA - whether A is used transposed.
+ * @param transB - whether B is used transposed.
+ */
+inline void multiplyParallel(int m, int n, int k, const float* a, int lda, const float* b, int ldb,
+                             float* c, int ldc, Transpose transA = Transpose::NONE,
+                             Transpose transB = Transpose::NONE) {
+  int threads = getThreadCount();
+  if (threads == 1 || static_cast<double>(m) * n * k < GEMM_PARALLEL_THRESHOLD) {
+    multiplyBlocked(m, n, k, a, lda, b, ldb, c, ldc, transA, transB);
+    return;
+  }
+  ThreadPool &pool = defaultThreadPool();
+
+  // Shrink the tiles until there are a few per thread for stealing to balance.
+  int tileM = GEMM_TILE_M;
+  int tileN = GEMM_TILE_N;
+  auto countTiles = [&] {
+    return static_cast<long>((m + tileM - 1) / tileM) * ((n + tileN - 1) / tileN);
+  };
+  while (countTiles() < 4L * threads && (tileM > 4 * GEMM_MR || tileN > 4 * GEMM_NR)) {
+    bool shrinkRows = tileN <= 4 * GEMM_NR || (tileM > 4 * GEMM_MR && tileM >= tileN / 2);
+    if (shrinkRows) {
+      tileM = std::max(4 * GEMM_MR, tileM / 2 / GEMM_MR * GEMM_MR);
+    } else {
+      tileN = std::max(4 * GEMM_NR, tileN / 2 / GEMM_NR * GEMM_NR);
+    }
+  }
+  int tilesM = (m + tileM - 1) / tileM;
+  int tilesN = (n + tileN - 1) / tileN;
+  size_t tiles = static_cast<size_t>(tilesM) * tilesN;
+
+  // Too few tiles for the threads (e.g. a long, thin K): split K as well, unless
+  // results have to be reproducible.
+  int splits = 1;
+  if (!getGemmDeterministic() && tiles < static_cast<size_t>(threads) && k >= 2 * GEMM_KC) {
+    splits = std::min(static_cast<int>((threads + tiles - 1) / tiles), k / GEMM_KC);
+  }
+
+  if (splits == 1) {
+    pool.parallelFor(tiles, [&](size_t tile) {
+      int row = static_cast<int>(tile / tilesN) * tileM;
+      int col = static_cast<int>(tile % tilesN) * tileN;
+      multiplyBlocked(std::min(tileM, m - row), std::min(tileN, n - col), k,
+                      a + operandOffset(transA, lda, row, 0), lda,
+                      b + operandOffset(transB, ldb, 0, col), ldb,
+                      c + static_cast<size_t>(row) * ldc + col, ldc, transA, transB);
+    });
+    return;
+  }
+
+  // K split: every (tile, chunk) product is added into C as soon as it is done.
+  for (int i = 0; i < m; ++i) {
+    std::fill(c + static_cast<size_t>(i) * ldc, c + static_cast<size_t>(i) * ldc + n, 0.0f);
+  }
+  int chunk = (k / splits + GEMM_KC - 1) / GEMM_KC * GEMM_KC;
+  std::unique_ptr<std::mutex[]> tileLocks(new std::mutex[tiles]);
+  pool.parallelFor(tiles * splits, [&](size_t task) {
+    static thread_local GemmBuffer partialBuffer;
+    size_t tile = task / splits;
+    int depth = static_cast<int>(task % splits) * chunk;
+    if (depth >= k) {
+      return;
+    }
+    int row = static_cast<int>(tile / tilesN) * tileM;
+    int col = static_cast<int>(tile % tilesN) * tileN;
+    int rows = std::min(tileM, m - row);
+    int cols = std::min(tileN, n - col);
+    float* partial = partialBuffer.reserve(static_cast<size_t>(rows) * cols);
+    multiplyBlocked(rows, cols, std::min(chunk, k - depth),
+                    a + operandOffset(transA, lda, row, depth), lda,
+                    b + operandOffset(transB, ldb, depth, col), ldb, partial, cols, transA, transB);
+
+    std::lock_guard<std::mutex> lock(tileLocks[tile]);
+    for (int i = 0; i < rows; ++i) {
+      float* out = c + static_cast<size_t>(row + i) * ldc + col;
+      const float* source = partial + static_cast<size_t>(i) * cols;
+      for (int j = 0; j < cols; ++j) {
+        out[j] += source[j];
+      }
+    }
+  });
+}
+
+
+/**
+ * Counts the Strassen-Winograd levels for a product: every level halves all
+ * three dimensions, and recursion stops once any of them reaches the cutoff.
+ *
+ * @param m - the rows of A and C.
+ * @param n - the columns of B and C.
+ * @param k - the columns of A and rows of B.
+ * @return int - the number of levels (0 runs the blocked kernel directly).
+ */
+inline int strassenDepth(int m, int n, int k) {
+  int cutoff = getStrassenCutoff();
+  int depth = 0;
+  while (std::min(std::min(m, n), k) > cutoff) {
+    m = (m + 1) / 2;
+    n = (n + 1) / 2;
+    k = (k + 1) / 2;
+    ++depth;
+  }
+  return depth;
+}
+
+
+/**
+ * Counts the floats a matrix takes up in scratch space.
+ *
+ * @param width - the width of op(X).
+ * @param height - the height of op(X).
+ * @param trans - whether X is stored transposed.
+ * @return size_t - the floats.
+ */
+inline size_t strassenScratchSize(int width, int height, Transpose trans = Transpose::NONE) {
+  if (trans == Transpose::TRANSPOSED) {
+    std::swap(width, height);
+  }
+  return static_cast<size_t>(paddedStride(width)) * height;
+}
+
+
+/**
+ * Counts the scratch floats the recursion needs below a product.
+ *
+ * @param m - the (padded) rows of op(A) and C.
+ * @param n - the (padded) columns of op(B) and C.
+ * @param k - the (padded) columns of op(A) and rows of op(B).
+ * @param depth - the number of levels.
+ * @param transA - whether A is used transposed.
+ * @param transB - whether B is used transposed.
+ * @return size_t - the floats.
+ */
+inline size_t strassenWorkspace(int m, int n, int k, int depth, Transpose transA = Transpose::NONE,
+                                Transpose transB = Transpose::NONE) {
+  size_t total = 0;
+  for (; depth > 0; --depth) {
+    m /= 2;
+    n /= 2;
+    k /= 2;
+    // Four S sums (like A), four T sums (like B) and two products (like C) per level.
+    total += 4 * strassenScratchSize(k, m, transA) + 4 * strassenScratchSize(n, k, transB)
+             + 2 * strassenScratchSize(n, m);
+  }
+  return total;
+}
+
+
+/**
+ * Carves a matrix out of scratch space.
+ *
+ * @param workspace - the scratch space; advanced past the matrix.
+ * @param width - the width of op(X).
+ * @param height - the height of op(X).
+ * @param trans - whether X is stored transposed.
+ * @return MatrixView - the stored matrix X.
+ */
+inline MatrixView takeStrassenScratch(float** workspace, int width, int height,
+                                      Transpose trans = Transpose::NONE) {
+  if (trans == Transpose::TRANSPOSED) {
+    std::swap(width, height);
+  }
+  MatrixView view = {*workspace, width, height, paddedStride(width)};
+  *workspace += static_cast<size_t>(view.stride) * height;
+  return view;
+}
+
+
+/**
+ * Selects a block of op(X) from the storage of X.
+ *
+ * @param x - the stored matrix X.
+ * @param trans - whether X is used transposed.
+ * @param row - the first row of the block in op(X).
+ * @param col - the first column of the block in op(X).
+ * @param width - the block width in op(X).
+ * @param height - the block height in op(X).
+ * @return MatrixView - the stored block.
+ */
+inline MatrixView operandBlock(const MatrixView &x, Transpose trans, int row, int col, int width,
+                               int height) {
+  if (trans == Transpose::TRANSPOSED) {
+    return x.block(col, row, height, width);
+  }
+  return x.block(row, col, width, height);
+}
+
+
+/**
+ * Wraps the storage of a product operand in a view.
+ *
+ * @param x - the elements of X.
+ * @param ld - the leading dimension of X.
+ * @param trans - whether X is used transposed.
+ * @param width - the width of op(X).
+ * @param height - the height of op(X).
+ * @return MatrixView - the stored matrix X.
+ */
+inline MatrixView operandView(const float* x, int ld, Transpose trans, int width, int height) {
+  if (trans == Transpose::TRANSPOSED) {
+    return MatrixView{const_cast<float*>(x), height, width, ld};
+  }
+  return MatrixView{const_cast<float*>(x), width, height, ld};
+}
+
+
+/**
+ * Strassen-Winograd step: C = op(A) * op(B) with 7 half-size products and 15 additions.
+ * Dimensions must be divisible by 2^depth. The sums of a transposed operand are
+ * formed in its stored layout, so they are transposed operands one level down.
+ *
+ * @param a - A as stored.
+ * @param b - B as stored.
+ * @param c - C (must not overlap A or B).
+ * @param depth - the levels left.
+ * @param workspace - scratch of strassenWorkspace() floats.
+ * @param transA - whether A is used transposed.
+ * @param transB - whether B is used transposed.
+ */
+inline void multiplyStrassenLevel(const MatrixView &a, const MatrixView &b, const MatrixView &c, int depth,
+                                  float* workspace, Transpose transA = Transpose::NONE,
+                                  Transpose transB = Transpose::NONE) {
+  int depthA = transA == Transpose::TRANSPOSED ? a.height : a.width;
+  if (depth == 0) {
+    multiplyParallel(c.height, c.width, depthA, a.data, a.stride, b.data, b.stride, c.data, c.stride,
+                     transA, transB);
+    return;
+  }
+
+  int m = c.height / 2;
+  int n = c.width / 2;
+  int k = depthA / 2;
+  MatrixView a11 = operandBlock(a, transA, 0, 0, k, m);
+  MatrixView a12 = operandBlock(a, transA, 0, k, k, m);
+  MatrixView a21 = operandBlock(a, transA, m, 0, k, m);
+  MatrixView a22 = operandBlock(a, transA, m, k, k, m);
+  MatrixView b11 = operandBlock(b, transB, 0, 0, n, k);
+  MatrixView b12 = operandBlock(b, transB, 0, n, n, k);
+  MatrixView b21 = operandBlock(b, transB, k, 0, n, k);
+  MatrixView b22 = operandBlock(b, transB, k, n, n, k);
+  MatrixView c11 = c.block(0, 0, n, m);
+  MatrixView c12 = c.block(0, n, n, m);
+  MatrixView c21 = c.block(m, 0, n, m);
+  MatrixView c22 = c.block(m, n, n, m);
+
+  MatrixView s1 = takeStrassenScratch(&workspace, k, m, transA);
+  MatrixView s2 = takeStrassenScratch(&workspace, k, m, transA);
+  MatrixView s3 = takeStrassenScratch(&workspace, k, m, transA);
+  MatrixView s4 = takeStrassenScratch(&workspace, k, m, transA);
+  MatrixView t1 = takeStrassenScratch(&workspace, n, k, transB);
+  MatrixView t2 = takeStrassenScratch(&workspace, n, k, transB);
+  MatrixView t3 = takeStrassenScratch(&workspace, n, k, transB);
+  MatrixView t4 = takeStrassenScratch(&workspace, n, k, transB);
+  MatrixView p = takeStrassenScratch(&workspace, n, m);
+  MatrixView q = takeStrassenScratch(&workspace, n, m);
+
+  addMatrices(a21, a22, s1);
+  subtractMatrices(s1, a11, s2);
+  subtractMatrices(a11, a21, s3);
+  subtractMatrices(a12, s2, s4);
+  subtractMatrices(b12, b11, t1);
+  subtractMatrices(b22, t1, t2);
+  subtractMatrices(b22, b12, t3);
+  subtractMatrices(t2, b21, t4);
+
+  // P and Q hold the products; C's quadrants collect the sums.
+  multiplyStrassenLevel(a11, b11, p, depth - 1, workspace, transA, transB);   // M1
+  multiplyStrassenLevel(a12, b21, c11, depth - 1, workspace, transA, transB); // M2
+  addMatrices(c11, p, c11);                                                   // C11 = M1 + M2
+  multiplyStrassenLevel(s2, t2, q, depth - 1, workspace, transA, transB);     // M6
+  addMatrices(p, q, p);                                                       // U2 = M1 + M6
+  multiplyStrassenLevel(s3, t3, c21, depth - 1, workspace, transA, transB);   // M7
+  addMatrices(c21, p, c21);                                                   // U3 = U2 + M7
+  multiplyStrassenLevel(s1, t1, q, depth - 1, workspace, transA, transB);     // M5
+  addMatrices(p, q, p);                                                       // U4 = U2 + M5
+  addMatrices(c21, q, c22);                                                   // C22 = U3 + M5
+  multiplyStrassenLevel(s4, b22, q, depth - 1, workspace, transA, transB);    // M3
+  addMatrices(p, q, c12);                                                     // C12 = U4 + M3
+  multiplyStrassenLevel(a22, t4, q, depth - 1, workspace, transA, transB);    // M4
+  subtractMatrices(c21, q, c21);                                              // C21 = U3 - M4
+}
+
+
+/**
+ * Strassen-Winograd product: C = op(A) * op(B). Dimensions that do not halve evenly
+ * down to the cutoff are zero padded in scratch copies.
+ *
+ * @param m - the rows of op(A) and C.
+ * @param n - the columns of op(B) and C.
+ * @param k - the columns of op(A) and rows of op(B).
+ * @param a - the elements of A.
+ * @param lda - the leading dimension of A.
+ * @param b - the elements of B.
+ * @param ldb - the leading dimension of B.
+ * @param c - the elements of C.
+ * @param ldc - the leading dimension of C.
+ * @param transA - whether A is used transposed.
+ * @param transB - whether B is used transposed.
+ */
+inline void multiplyStrassen(int m, int n, int k, const float* a, int lda, const float* b, int ldb,
+                             float* c, int ldc, Transpose transA = Transpose::NONE,
+                             Transpose transB = Transpose::NONE) {
+  int depth = strassenDepth(m, n, k);
+  if (depth == 0) {
+    multiplyParallel(m, n, k, a, lda, b, ldb, c, ldc, transA, transB);
+    return;
+  }
+
+  int unit = 1 << depth;
+  int paddedM = (m + unit - 1) / unit * unit;
+  int paddedN = (n + unit - 1) / unit * unit;
+  int paddedK = (k + unit - 1) / unit * unit;
+  bool padded = paddedM != m || paddedN != n || paddedK != k;
+  size_t copies = 0;
+  if (padded) {
+    copies = strassenScratchSize(paddedK, paddedM, transA) + strassenScratchSize(paddedN, paddedK, transB)
+             + strassenScratchSize(paddedN, paddedM);
+  }
+  static thread_local GemmBuffer strassenBuffer;
+  float* workspace = strassenBuffer.reserve(
+      copies + strassenWorkspace(paddedM, paddedN, paddedK, depth, transA, transB));
+
+  MatrixView viewA = operandView(a, lda, transA, k, m);
+  MatrixView viewB = operandView(b, ldb, transB, n, k);
+  MatrixView viewC = {c, n, m, ldc};
+  if (!padded) {
+    multiplyStrassenLevel(viewA, viewB, viewC, depth, workspace, transA, transB);
+    return;
+  }
+
+  // Copy the operands into zero-padded scratch, then keep the valid part of the result.
+  MatrixView paddedA = takeStrassenScratch(&workspace, paddedK, paddedM, transA);
+  MatrixView paddedB = takeStrassenScratch(&workspace, paddedN, paddedK, transB);
+  MatrixView paddedC = takeStrassenScratch(&workspace, paddedN, paddedM);
+  auto copyPadded = [](const MatrixView &from, const MatrixView &to) {
+    for (int i = 0; i < to.height; ++i) {
+      float* row = to.row(i);
+      int copied = 0;
+      if (i < from.height) {
+        std::copy(from.row(i), from.row(i) + from.width, row);
+        copied = from.width;
+      }
+      std::fill(row + copied, row + to.width, 0.0f);
+    }
+  };
+  copyPadded(viewA, paddedA);
+  copyPadded(viewB, paddedB);
+  multiplyStrassenLevel(paddedA, paddedB, paddedC, depth, workspace, transA, transB);
+  for (int i = 0; i < m; ++i) {
+    std::copy(paddedC.row(i), paddedC.row(i) + n, viewC.row(i));
+  }
+}
+
+
+/**
+ * Bounds the error of a product computed by multiply() with the given algorithm:
+ * every element of the result is within the bound of the exact product.
+ * For Strassen-Winograd with d levels and leaves of size n0 (padded size
+ * N = n0 * 2^d) the factor is 18^d * (n0^2 + 6 n0) - 6N (Higham, Accuracy and
+ * Stability of Numerical Algorithms, section 23.2.2); the conventional kernels
+ * have k.
+ *
+ * @param algorithm - the algorithm.
+ * @param m - the rows of op(A) and C.
+ * @param n - the columns of op(B) and C.
+ * @param k - the columns of op(A) and rows of op(B).
+ * @param a - A, as stored.
+ * @param b - B, as stored.
+ * @return double - the bound, factor * u * max|A| * max|B|.
+ */
+inline double gemmErrorBound(GemmAlgorithm algorithm, int m, int n, int k, const MatrixView &a,
+                             const MatrixView &b) {
+  auto largest = [](const MatrixView &matrix) {
+    float value = 0.0f;
+    for (int i = 0; i < matrix.height; ++i) {
+      const float* row = matrix.row(i);
+      for (int j = 0; j < matrix.width; ++j) {
+        value = std::max(value, std::fabs(row[j]));
+      }
+    }
+    return static_cast<double>(value);
+  };
+
+  double factor = k;
+  int depth = algorithm == GemmAlgorithm::STRASSEN ? strassenDepth(m, n, k) : 0;
+  if (depth > 0) {
+    int unit = 1 << depth;
+    int size = (std::max(std::max(m, n), k) + unit - 1) / unit * unit;
+    double leaf = size / unit;
+    factor = std::pow(18.0, depth) * (leaf * leaf + 6 * leaf) - 6.0 * size;
+  }
+  return factor * (FLT_EPSILON / 2) * largest(a) * largest(b);
+}
+
+
+/**
+ * Sparse product: C = op(A) * op(B) through the nonzeros of whichever operand
+ * is below the density threshold (see isSparseEnough()). The other operand has
+ * to be used as stored, since the sparse kernels read its rows.
+ *
+ * @param transA - whether A is used transposed.
+ * @param transB - whether B is used transposed.
+ * @param m - the rows of op(A) and C.
+ * @param n - the columns of op(B) and C.
+ * @param k - the columns of op(A) and rows of op(B).
+ * @param a - the elements of A.
+ * @param lda - the leading dimension of A.
+ * @param b - the elements of B.
+ * @param ldb - the leading dimension of B.
+ * @param c - the elements of C.
+ * @param ldc - the leading dimension of C.
+ * @return bool - whether C was computed; false leaves it to the dense kernels.
+ */
+inline bool multiplySparseOperand(Transpose transA, Transpose transB, int m, int n, int k, const float* a,
+                                  int lda, const float* b, int ldb, float* c, int ldc) {
+  MatrixView viewA = operandView(a, lda, transA, k, m);
+  MatrixView viewB = operandView(b, ldb, transB, n, k);
+  MatrixView viewC = {c, n, m, ldc};
+
+  // The CSC arrays of a stored operand are the CSR arrays of its transpose.
+  auto compress = [](const MatrixView &view, Transpose trans) {
+    if (trans == Transpose::TRANSPOSED) {
+      return SparseMatrix::fromDense(view, SparseLayout::CSC).transposed();
+    }
+    return SparseMatrix::fromDense(view);
+  };
+  if (transB == Transpose::NONE && isSparseEnough(viewA)) {
+    multiplySparseDense(compress(viewA, transA), viewB, viewC);
+    return true;
+  }
+  if (transA == Transpose::NONE && isSparseEnough(viewB)) {
+    multiplyDenseSparse(viewA, compress(viewB, transB), viewC);
+    return true;
+  }
+  return false;
+}
+
+
+/**
+ * Computes C = op(A) * op(B) with the given algorithm.
+ * A transposed operand is read in place; its transpose is never formed.
+ * Unless the algorithm is REFERENCE, a mostly-zero operand takes the sparse path.
+ *
+ * @param algorithm - the algorithm to use.
+ * @param transA - whether A is used transposed.
+ * @param transB - whether B is used transposed.
+ * @param m - the rows of op(A) and C.
+ * @param n - the columns of op(B) and C.
+ * @param k - the columns of op(A) and rows of op(B).
+ * @param a - the elements of A.
+ * @param lda - the leading dimension of A.
+ * @param b - the elements of B.
+ * @param ldb - the leading dimension of B.
+ * @param c - the elements of C.
+ * @param ldc - the leading dimension of C.
+ */
+inline void multiply(GemmAlgorithm algorithm, Transpose transA, Transpose transB, int m, int n, int k,
+                     const float* a, int lda, const float* b, int ldb, float* c, int ldc) {
+  if (algorithm == GemmAlgorithm::REFERENCE) {
+    multiplyReference(m, n, k, a, lda, b, ldb, c, ldc, transA, transB);
+  } else if (multiplySparseOperand(transA, transB, m, n, k, a, lda, b, ldb, c, ldc)) {
+    return;
+  } else if (algorithm == GemmAlgorithm::STRASSEN) {
+    if (profilingEnabled() && strassenDepth(m, n, k) > 0) {
+      MatrixView viewA = operandView(a, lda, transA, k, m);
+      MatrixView viewB = operandView(b, ldb, transB, n, k);
+      profiler().recordErrorBound(gemmErrorBound(algorithm, m, n, k, viewA, viewB));
+    }
+    multiplyStrassen(m, n, k, a, lda, b, ldb, c, ldc, transA, transB);
+  } else {
+    multiplyParallel(m, n, k, a, lda, b, ldb, c, ldc, transA, transB);
+  }
+}
+
+
+/**
+ * Computes C = A * B with the given algorithm.
+ *
+ * @param algorithm - the algorithm to use.
+ * @param m - the rows of A and C.
+ * @param n - the columns of B and C.
+ * @param k - the columns of A and rows of B.
+ * @param a - the elements of A.
+ * @param lda - the leading dimension of A.
+ * @param b - the elements of B.
+ * @param ldb - the leading dimension of B.
+ * @param c - the elements of C.
+ * @param ldc - the leading dimension of C.
+ */
+inline void multiply(GemmAlgorithm algorithm, int m, int n, int k, const float* a, int lda,
+                     const float* b, int ldb, float* c, int ldc) {
+  multiply(algorithm, Transpose::NONE, Transpose::NONE, m, n, k, a, lda, b, ldb, c, ldc);
+}
+
+
+/**
+ * Computes C = op(A) * op(B) with the process-wide algorithm selection.
+ *
+ * @param transA - whether A is used transposed.
+ * @param transB - whether B is used transposed.
+ * @param m - the rows of op(A) and C.
+ * @param n - the columns of op(B) and C.
+ * @param k - the columns of op(A) and rows of op(B).
+ * @param a - the elements of A.
+ * @param lda - the leading dimension of A.
+ * @param b - the elements of B.
+ * @param ldb - the leading dimension of B.
+ * @param c - the elements of C.
+ * @param ldc - the leading dimension of C.
+ */
+inline void multiply(Transpose transA, Transpose transB, int m, int n, int k, const float* a, int lda,
+                     const float* b, int ldb, float* c, int ldc) {
+  multiply(getGemmAlgorithm(), transA, transB, m, n, k, a, lda, b, ldb, c, ldc);
+}
+
+
+/**
+ * Computes C = A * B with the process-wide algorithm selection.
+ *
+ * @param m - the rows of A and C.
+ * @param n - the columns of B and C.
+ * @param k - the columns of A and rows of B.
+ * @param a - the elements of A.
+ * @param lda - the leading dimension of A.
+ * @param b - the elements of B.
+ * @param ldb - the leading dimension of B.
+ * @param c - the elements of C.
+ * @param ldc - the leading dimension of C.
+ */
+inline void multiply(int m, int n, int k, const float* a, int lda, const float* b, int ldb,
+                     float* c, int ldc) {
+  multiply(getGemmAlgorithm(), m, n, k, a, lda, b, ldb, c, ldc);
+}
+
+#endif  // MATRIX_GEMM_H_
@@ -0,0 +1,430 @@
+/**
+ * matrix_incremental.h
+ * Edits of a few rows or elements of an operand, and patches that bring the
+ * results computed from it up to date without redoing them. Each edited row
+ * remembers the span of columns that changed and its values from before the
+ * first edit, so:
+ *   a + b, a - b   only the changed spans are recomputed;
+ *   a * b, a edited   only the changed rows of the product are recomputed;
+ *   a * b, b edited   each changed row j of b adds a(:, j) times its change
+ *                     to the product (a rank-1 update), or once more than
+ *                     1/RANK_UPDATE_LIMIT of b's rows changed, only the
+ *                     changed columns of the product are recomputed.
+ * A patch costs O(changed elements) for sums and O(changed rows * n * k) or
+ * O(changed rows * m * n) for products instead of a full O(m * n * k).
+ * Rank-1 updates add a difference to the old result, so a patched float
+ * product can differ from a freshly computed one in the last bits; integer
+ * products stay exact, and fp16/bf16 products, which are rounded per result,
+ * are always recomputed by columns.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_INCREMENTAL_H_
+#define MATRIX_INCREMENTAL_H_
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "matrix_cache.h"
+#include "matrix_element.h"
+#include "matrix_instrumentation.h"
+#include "matrix_parser.h"
+#include "matrix_simd.h"
+#include "matrix_storage.h"
+
+
+// Rank-1 updates patch a product while at most 1/RANK_UPDATE_LIMIT of the
+// right operand's rows changed; past that, recomputing the changed columns
+// with the blocked kernels is faster.
+const int RANK_UPDATE_LIMIT = 8;
+
+
+/**
+ * The edits made to one matrix: which rows changed, where, and what they held.
+ */
+template <typename T>
+class DirtyRegion {
+ public:
+  /**
+   * One edited row.
+   */
+  struct DirtyRow {
+    int first;           // First column that changed.
+    int last;            // Last column that changed.
+    std::vector<T> old;  // The whole row before the first edit.
+  };
+
+
+  /**
+   * Constructor.
+   *
+   * @param matrix - the matrix that set() edits.
+   */
+  explicit DirtyRegion(const BasicMatrixView<T> &matrix) : _matrix(matrix) {}
+
+
+  /**
+   * Overwrites a run of elements of one row. Values equal to the ones they
+   * replace do not dirty anything.
+   *
+   * @param row - the row (from 0).
+   * @param column - the first column (from 0).
+   * @param values - the new values.
+   * @param count - the number of values.
+   * @throws std::string - the run is not inside the matrix.
+   */
+  void set(int row, int column, const T* values, int count) {
+    if (row < 0 || row >= _matrix.height) {
+      throw(std::string("[Update] ERROR: row " + std::to_string(row + 1) + " is outside the matrix."));
+    }
+    if (column < 0 || count < 1 || count > _matrix.width - column) {
+      throw(std::string("[Update] ERROR: columns " + std::to_string(column + 1) + " to "
+                        + std::to_string(column + count) + " are outside the matrix."));
+    }
+
+    T* elements = _matrix.row(row);
+    int first = column;
+    int last = column + count - 1;
+    while (first <= last && same(elements[first], values[first - column])) {
+      ++first;
+    }
+    while (last >= first && same(elements[last], values[last - column])) {
+      --last;
+    }
+    if (first > last) {
+      return;
+    }
+
+    auto found = _rows.find(row);
+    if (found == _rows.end()) {
+      _rows.emplace(row, DirtyRow{first, last, std::vector<T>(elements, elements + _matrix.width)});
+    } else {
+      found->second.first = std::min(found->second.first, first);
+      found->second.last = std::max(found->second.last, last);
+    }
+    std::copy(values + (first - column), values + (last - column) + 1, elements + first);
+  }
+
+
+  /**
+   * Retrieves the width of the matrix.
+   *
+   * @return int - the width.
+   */
+  int getWidth() const {
+    return _matrix.width;
+  }
+
+
+  /**
+   * Retrieves whether anything changed.
+   *
+   * @return bool - whether no element changed.
+   */
+  bool empty() const {
+    return _rows.empty();
+  }
+
+
+  /**
+   * Retrieves the edited rows.
+   *
+   * @return const std::map<int, DirtyRow>& - the rows, by row number.
+   */
+  const std::map<int, DirtyRow> &rows() const {
+    return _rows;
+  }
+
+
+  /**
+   * Retrieves the number of elements in the changed spans.
+   *
+   * @return double - the elements.
+   */
+  double getElementCount() const {
+    double elements = 0.0;
+    for (const auto &entry : _rows) {
+      elements += entry.second.last - entry.second.first + 1;
+    }
+    return elements;
+  }
+
+
+ private:
+  BasicMatrixView<T> _matrix;
+  std::map<int, DirtyRow> _rows;
+
+
+  /**
+   * Checks whether two elements hold the same bits.
+   *
+   * @param x - an element.
+   * @param y - another element.
+   * @return bool - whether they are identical.
+   */
+  static bool same(const T &x, const T &y) {
+    return std::memcmp(&x, &y, sizeof(T)) == 0;
+  }
+};
+
+
+/**
+ * Patches out = a + b or a - b after a or b (or both) had the given edits.
+ *
+ * @param dirty - the edits.
+ * @param a - the first operand, edited or not.
+ * @param b - the second operand.
+ * @param out - the result from before the edits.
+ * @param subtract - whether out is a difference.
+ */
+template <typename T>
+inline void patchCombined(const DirtyRegion<T> &dirty, const BasicMatrixView<T> &a, const BasicMatrixView<T> &b,
+                          const BasicMatrixView<T> &out, bool subtract) {
+  double elements = dirty.getElementCount();
+  ProfileScope profile(ProfileSection::UPDATE, elements, 3 * sizeof(T) * elements);
+  for (const auto &entry : dirty.rows()) {
+    int row = entry.first;
+    int first = entry.second.first;
+    int width = entry.second.last - first + 1;
+    combineElements(a.block(row, first, width, 1), b.block(row, first, width, 1), out.block(row, first, width, 1),
+                    subtract);
+  }
+}
+
+
+/**
+ * Patches out = a * b after a had the given edits, by recomputing the edited
+ * rows of the product; adjacent rows are recomputed together.
+ *
+ * @param dirty - the edits of a.
+ * @param a - the left operand, edited.
+ * @param b - the right operand.
+ * @param out - the product from before the edits.
+ */
+template <typename T>
+inline void patchProductLeft(const DirtyRegion<T> &dirty, const BasicMatrixView<T> &a, const BasicMatrixView<T> &b,
+                             const BasicMatrixView<typename ElementTraits<T>::Product> &out) {
+  int rows = static_cast<int>(dirty.rows().size());
+  ProfileScope profile(ProfileSection::UPDATE, productFlops(rows, b.width, a.width),
+                       productBytes(rows, b.width, a.width));
+  auto entry = dirty.rows().begin();
+  while (entry != dirty.rows().end()) {
+    int first = entry->first;
+    int last = first;
+    for (++entry; entry != dirty.rows().end() && entry->first == last + 1; ++entry) {
+      last = entry->first;
+    }
+    int height = last - first + 1;
+    multiplyElements(a.block(first, 0, a.width, height), b, out.block(first, 0, out.width, height));
+  }
+}
+
+
+/**
+ * Patches out = a * b after b had the given edits: a rank-1 update per
+ * edited row while few rows changed, else the changed columns are recomputed.
+ *
+ * @param dirty - the edits of b.
+ * @param a - the left operand.
+ * @param b - the right operand, edited.
+ * @param out - the product from before the edits.
+ */
+template <typename T>
+inline void patchProductRight(const DirtyRegion<T> &dirty, const BasicMatrixView<T> &a, const BasicMatrixView<T> &b,
+                              const BasicMatrixView<typename ElementTraits<T>::Product> &out) {
+  using Traits = ElementTraits<T>;
+  using Accumulator = typename Traits::Accumulator;
+
+  // Products rounded per result (fp16, bf16) cannot take a difference exactly.
+  constexpr bool additive = std::is_same<Accumulator, typename Traits::Product>::value;
+  int rank = static_cast<int>(dirty.rows().size());
+  if (!additive || static_cast<long>(rank) * RANK_UPDATE_LIMIT > b.height) {
+    int first = b.width;
+    int last = -1;
+    for (const auto &entry : dirty.rows()) {
+      first = std::min(first, entry.second.first);
+      last = std::max(last, entry.second.last);
+    }
+    int width = last - first + 1;
+    ProfileScope profile(ProfileSection::UPDATE, productFlops(a.height, width, a.width),
+                         productBytes(a.height, width, a.width));
+    multiplyElements(a, b.block(0, first, width, b.height), out.block(0, first, width, out.height));
+    return;
+  }
+
+  double elements = a.height * dirty.getElementCount();
+  ProfileScope profile(ProfileSection::UPDATE, 2 * elements, 2 * sizeof(Accumulator) * elements);
+  if constexpr (additive) {
+    auto kernel = selectAccumulateRow<T>();
+    std::vector<T> change;
+    for (const auto &entry : dirty.rows()) {
+      int row = entry.first;
+      int first = entry.second.first;
+      int width = entry.second.last - first + 1;
+      const T* now = b.row(row) + first;
+      const T* old = entry.second.old.data() + first;
+      if constexpr (std::is_same<T, Accumulator>::value) {
+        // out(i, :) += a(i, row) * (new - old), one pass per row of out.
+        change.resize(width);
+        for (int j = 0; j < width; ++j) {
+          change[j] = now[j] - old[j];
+        }
+        for (int i = 0; i < out.height; ++i) {
+          T scale = a.at(i, row);
+          if (scale == T(0)) {
+            continue;
+          }
+          if constexpr (std::is_same<T, float>::value) {
+            elementwiseKernels().scaledAdd(out.row(i) + first, change.data(), out.row(i) + first, width, scale,
+                                           false);
+          } else {
+            kernel(out.row(i) + first, change.data(), scale, width);
+          }
+        }
+      } else {
+        // Narrow integers: the difference may not fit T, so add the new row and take the old one away.
+        for (int i = 0; i < out.height; ++i) {
+          Accumulator scale = Traits::widen(a.at(i, row));
+          if (scale == 0) {
+            continue;
+          }
+          kernel(out.row(i) + first, now, scale, width);
+          kernel(out.row(i) + first, old, -scale, width);
+        }
+      }
+    }
+  }
+}
+
+
+/**
+ * Patches one cached result after an operand was edited and files it under
+ * the operand's new content hash. Results of transposed operands are left alone.
+ *
+ * @param key - the result's key, with the edited operand's old hash.
+ * @param dirty - the edits.
+ * @param first - whether the first operand was edited (else the second).
+ * @param matrix1 - the first operand.
+ * @param matrix2 - the second operand.
+ * @param hash - the edited operand's new hash.
+ * @return bool - whether the result was cached and is now patched.
+ */
+template <typename T>
+inline bool patchCachedResult(const ResultKey &key, const DirtyRegion<T> &dirty, bool first,
+                              const BasicMatrixView<T> &matrix1, const BasicMatrixView<T> &matrix2, uint64_t hash) {
+  if (key.transpose1 != Transpose::NONE || key.transpose2 != Transpose::NONE) {
+    return false;
+  }
+  ResultKey patched = key;
+  (first ? patched.hash1 : patched.hash2) = hash;
+
+  if (key.operation == CachedOperation::PRODUCT) {
+    using Product = typename ElementTraits<T>::Product;
+    BasicMatrixView<Product> result = resultCache().rekey<Product>(key, patched);
+    if (result.data == nullptr) {
+      return false;
+    }
+    if (first) {
+      patchProductLeft(dirty, matrix1, matrix2, result);
+    } else {
+      patchProductRight(dirty, matrix1, matrix2, result);
+    }
+    return true;
+  }
+
+  BasicMatrixView<T> result = resultCache().rekey<T>(key, patched);
+  if (result.data == nullptr) {
+    return false;
+  }
+  patchCombined(dirty, matrix1, matrix2, result, key.operation == CachedOperation::DIFFERENCE);
+  return true;
+}
+
+
+/**
+ * Patches the cached sum, difference and product of two matrices after one
+ * of them was edited. Results that were not cached are computed on demand.
+ *
+ * @param dirty - the edits.
+ * @param first - whether matrix1 was edited (else matrix2).
+ * @param matrix1 - the first matrix.
+ * @param hash1 - its content hash, after the edits.
+ * @param matrix2 - the second matrix.
+ * @param hash2 - its content hash, after the edits.
+ * @param oldHash - the edited matrix's content hash before the edits.
+ */
+template <typename T>
+inline void patchCachedResults(const DirtyRegion<T> &dirty, bool first, const BasicMatrixView<T> &matrix1,
+                               uint64_t hash1, const BasicMatrixView<T> &matrix2, uint64_t hash2,
+                               uint64_t oldHash) {
+  for (CachedOperation operation : {CachedOperation::SUM, CachedOperation::DIFFERENCE, CachedOperation::PRODUCT}) {
+    ResultKey key = resultKey(operation, matrix1, first ? oldHash : hash1, matrix2, first ? hash2 : oldHash);
+    patchCachedResult(key, dirty, first, matrix1, matrix2, first ? hash1 : hash2);
+  }
+}
+
+
+/**
+ * Reads edits "row column count values..." (rows and columns count from 1)
+ * until a row of 0, and applies them. Malformed tokens and edits outside the
+ * matrix are reported and skipped.
+ *
+ * @param reader - the input.
+ * @param dirty - the region of the matrix to edit.
+ * @param errors - where to report problems.
+ * @return bool - false when the input ended first.
+ */
+template <typename T>
+inline bool readMatrixUpdates(MatrixTextReader &reader, DirtyRegion<T> &dirty, std::ostream &errors) {
+  std::vector<T> values;
+  while (true) {
+    long numbers[3] = {0, 0, 0};
+    for (int i = 0; i < 3; ++i) {
+      ReadStatus status = reader.readLong(numbers + i);
+      while (status == ReadStatus::MALFORMED) {
+        errors << reader.error() << std::endl;
+        status = reader.readLong(numbers + i);
+      }
+      if (status == ReadStatus::END) {
+        return false;
+      }
+      if (i == 0 && numbers[0] == 0) {
+        return true;
+      }
+    }
+    if (numbers[2] < 1 || numbers[2] > dirty.getWidth()) {
+      errors << "[Update] ERROR: the count must be between 1 and " << dirty.getWidth() << "." << std::endl;
+      reader.skipLine();
+      continue;
+    }
+
+    values.resize(static_cast<size_t>(numbers[2]));
+    for (T &value : values) {
+      ReadStatus status = readElement(reader, &value);
+      while (status == ReadStatus::MALFORMED) {
+        errors << reader.error() << std::endl;
+        status = readElement(reader, &value);
+      }
+      if (status == ReadStatus::END) {
+        return false;
+      }
+    }
+    try {
+      dirty.set(static_cast<int>(std::clamp<long>(numbers[0], 0, INT_MAX)) - 1,
+                static_cast<int>(std::clamp<long>(numbers[1], 0, INT_MAX)) - 1, values.data(),
+                static_cast<int>(numbers[2]));
+    } catch (const std::string &error) {
+      errors << error << std::endl;
+    }
+  }
+}
+
+#endif  // MATRIX_INCREMENTAL_H_
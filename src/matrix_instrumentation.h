@@ -0,0 +1,428 @@
+/**
+ * matrix_instrumentation.h
+ * Built-in profiling of the calculators' hot paths, off unless MATRIX_PROFILE
+ * is set. Every add, subtract, multiply, expression evaluation, incremental
+ * update, parse and print is timed into a per-section latency histogram,
+ * together with the FLOPs and bytes it moved and the matrix buffers it
+ * allocated, so latency can be attributed to input, compute or output without
+ * an external profiler.
+ * The totals are printed (MATRIX_PROFILE=1) or written as JSON
+ * (MATRIX_PROFILE=<path>) when the program exits.
+ * Disabled, each probe costs one predictable branch.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_INSTRUMENTATION_H_
+#define MATRIX_INSTRUMENTATION_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+
+// Latency histogram buckets; bucket b counts durations in [2^(b-1), 2^b) ns.
+const int PROFILE_BUCKETS = 48;
+
+
+/**
+ * Parts of a request that are measured separately.
+ */
+enum class ProfileSection {
+  ADD,          // Matrix sums.
+  SUBTRACT,     // Matrix differences.
+  MULTIPLY,     // Matrix products.
+  TRANSPOSE,    // Matrix transposes.
+  EXPRESSION,   // Mixed expressions evaluated in one pass (class calculator).
+  UPDATE,       // Cached results patched after an operand was edited.
+  PARSE,        // Reading matrix values.
+  PRINT,        // Writing matrices.
+  COUNT
+};
+
+
+/**
+ * Totals of one section. Counters are atomic so probes on any thread may record.
+ */
+struct ProfileCounters {
+  std::atomic<uint64_t> calls{0};
+  std::atomic<uint64_t> nanoseconds{0};
+  std::atomic<uint64_t> maxNanoseconds{0};
+  std::atomic<uint64_t> flops{0};
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> allocations{0};
+  std::atomic<uint64_t> allocatedBytes{0};
+  std::atomic<uint64_t> histogram[PROFILE_BUCKETS] = {};
+};
+
+
+/**
+ * Retrieves the name of a section.
+ *
+ * @param section - the section.
+ * @return const char* - the name.
+ */
+inline const char* profileSectionName(ProfileSection section) {
+  switch (section) {
+    case ProfileSection::ADD:
+      return "add";
+    case ProfileSection::SUBTRACT:
+      return "subtract";
+    case ProfileSection::MULTIPLY:
+      return "multiply";
+    case ProfileSection::TRANSPOSE:
+      return "transpose";
+    case ProfileSection::EXPRESSION:
+      return "expression";
+    case ProfileSection::UPDATE:
+      return "update";
+    case ProfileSection::PARSE:
+      return "parse";
+    default:
+      return "print";
+  }
+}
+
+
+/**
+ * Counts the floating-point operations of an (m x k) * (k x n) product.
+ *
+ * @param m - the rows of the result.
+ * @param n - the columns of the result.
+ * @param k - the inner dimension.
+ * @return double - the operations (one multiply and one add per term).
+ */
+inline double productFlops(int m, int n, int k) {
+  return 2.0 * m * n * k;
+}
+
+
+/**
+ * Counts the bytes an (m x k) * (k x n) product must read and write at least.
+ *
+ * @param m - the rows of the result.
+ * @param n - the columns of the result.
+ * @param k - the inner dimension.
+ * @return double - the bytes.
+ */
+inline double productBytes(int m, int n, int k) {
+  return sizeof(float) * (static_cast<double>(m) * k + static_cast<double>(k) * n
+                          + static_cast<double>(m) * n);
+}
+
+
+/**
+ * Process-wide profile: one set of counters per section, plus every matrix
+ * buffer allocated while profiling.
+ */
+class Profiler {
+ public:
+  /**
+   * Records one measured call.
+   *
+   * @param section - the section.
+   * @param nanoseconds - its duration.
+   * @param flops - the floating-point operations it did.
+   * @param bytes - the bytes it read and wrote.
+   * @param allocations - the matrix buffers it allocated.
+   * @param allocatedBytes - their total size.
+   */
+  void record(ProfileSection section, uint64_t nanoseconds, uint64_t flops, uint64_t bytes,
+              uint64_t allocations, uint64_t allocatedBytes) {
+    ProfileCounters &counters = _sections[static_cast<int>(section)];
+    counters.calls.fetch_add(1, std::memory_order_relaxed);
+    counters.nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+    counters.flops.fetch_add(flops, std::memory_order_relaxed);
+    counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    counters.allocations.fetch_add(allocations, std::memory_order_relaxed);
+    counters.allocatedBytes.fetch_add(allocatedBytes, std::memory_order_relaxed);
+    counters.histogram[bucketOf(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t max = counters.maxNanoseconds.load(std::memory_order_relaxed);
+    while (nanoseconds > max
+           && !counters.maxNanoseconds.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed)) {
+    }
+  }
+
+
+  /**
+   * Counts a matrix buffer allocation.
+   *
+   * @param bytes - its size.
+   */
+  void countAllocation(size_t bytes) {
+    _allocations.fetch_add(1, std::memory_order_relaxed);
+    _allocatedBytes.fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+
+  /**
+   * Keeps the largest error bound reported by an inexact product algorithm.
+   *
+   * @param bound - the bound on any element's error.
+   */
+  void recordErrorBound(double bound) {
+    double largest = _errorBound.load(std::memory_order_relaxed);
+    while (bound > largest
+           && !_errorBound.compare_exchange_weak(largest, bound, std::memory_order_relaxed)) {
+    }
+  }
+
+
+  /**
+   * Retrieves the allocations counted so far.
+   *
+   * @return uint64_t - the number of buffers.
+   */
+  uint64_t allocations() const {
+    return _allocations.load(std::memory_order_relaxed);
+  }
+
+
+  /**
+   * Retrieves the bytes allocated so far.
+   *
+   * @return uint64_t - the bytes.
+   */
+  uint64_t allocatedBytes() const {
+    return _allocatedBytes.load(std::memory_order_relaxed);
+  }
+
+
+  /**
+   * Prints a table of every section that was called.
+   *
+   * @param os - the output stream.
+   */
+  void print(std::ostream &os) const {
+    char line[256];
+    std::snprintf(line, sizeof(line), "%-10s %8s %12s %10s %10s %10s %10s %10s %9s %12s\n",
+                  "[Profile]", "calls", "total ms", "mean us", "p50 us", "p99 us", "max us",
+                  "GFLOP/s", "allocs", "alloc MiB");
+    os << line;
+    for (int s = 0; s < static_cast<int>(ProfileSection::COUNT); ++s) {
+      const ProfileCounters &counters = _sections[s];
+      uint64_t calls = counters.calls.load(std::memory_order_relaxed);
+      if (calls == 0) {
+        continue;
+      }
+      double nanoseconds = static_cast<double>(counters.nanoseconds.load(std::memory_order_relaxed));
+      std::snprintf(line, sizeof(line),
+                    "%-10s %8llu %12.3f %10.3f %10.3f %10.3f %10.3f %10.3f %9llu %12.3f\n",
+                    profileSectionName(static_cast<ProfileSection>(s)),
+                    static_cast<unsigned long long>(calls), nanoseconds / 1e6, nanoseconds / calls / 1e3,
+                    percentile(counters, 0.50) / 1e3, percentile(counters, 0.99) / 1e3,
+                    counters.maxNanoseconds.load(std::memory_order_relaxed) / 1e3,
+                    nanoseconds > 0 ? counters.flops.load(std::memory_order_relaxed) / nanoseconds : 0.0,
+                    static_cast<unsigned long long>(counters.allocations.load(std::memory_order_relaxed)),
+                    counters.allocatedBytes.load(std::memory_order_relaxed) / 1048576.0);
+      os << line;
+    }
+    double bound = _errorBound.load(std::memory_order_relaxed);
+    if (bound > 0.0) {
+      std::snprintf(line, sizeof(line), "[Profile] largest Strassen-Winograd error bound: %.3e\n", bound);
+      os << line;
+    }
+    os.flush();
+  }
+
+
+  /**
+   * Writes every section as JSON.
+   *
+   * @param path - the file.
+   * @return bool - whether the file was written.
+   */
+  bool writeJson(const std::string &path) const {
+    std::ofstream file(path, std::ios::trunc);
+    file << "{\n  \"sections\": {";
+    const char* separator = "\n";
+    for (int s = 0; s < static_cast<int>(ProfileSection::COUNT); ++s) {
+      const ProfileCounters &counters = _sections[s];
+      file << separator << "    \"" << profileSectionName(static_cast<ProfileSection>(s)) << "\": {"
+           << "\"calls\": " << counters.calls.load(std::memory_order_relaxed)
+           << ", \"total_ns\": " << counters.nanoseconds.load(std::memory_order_relaxed)
+           << ", \"max_ns\": " << counters.maxNanoseconds.load(std::memory_order_relaxed)
+           << ", \"p50_ns\": " << percentile(counters, 0.50)
+           << ", \"p90_ns\": " << percentile(counters, 0.90)
+           << ", \"p99_ns\": " << percentile(counters, 0.99)
+           << ", \"flops\": " << counters.flops.load(std::memory_order_relaxed)
+           << ", \"bytes\": " << counters.bytes.load(std::memory_order_relaxed)
+           << ", \"allocations\": " << counters.allocations.load(std::memory_order_relaxed)
+           << ", \"allocated_bytes\": " << counters.allocatedBytes.load(std::memory_order_relaxed)
+           << ", \"histogram_ns\": [";
+      for (int b = 0; b < PROFILE_BUCKETS; ++b) {
+        file << (b == 0 ? "" : ", ") << counters.histogram[b].load(std::memory_order_relaxed);
+      }
+      file << "]}";
+      separator = ",\n";
+    }
+    file << "\n  },\n  \"allocations\": " << allocations() << ",\n  \"allocated_bytes\": "
+         << allocatedBytes() << ",\n  \"error_bound\": " << _errorBound.load(std::memory_order_relaxed)
+         << "\n}\n";
+    return static_cast<bool>(file);
+  }
+
+
+ private:
+  ProfileCounters _sections[static_cast<int>(ProfileSection::COUNT)];
+  std::atomic<uint64_t> _allocations{0};
+  std::atomic<uint64_t> _allocatedBytes{0};
+  std::atomic<double> _errorBound{0.0};
+
+
+  /**
+   * Finds the histogram bucket of a duration.
+   *
+   * @param nanoseconds - the duration.
+   * @return int - the bucket.
+   */
+  static int bucketOf(uint64_t nanoseconds) {
+    int bucket = 0;
+    while (nanoseconds != 0 && bucket < PROFILE_BUCKETS - 1) {
+      nanoseconds >>= 1;
+      ++bucket;
+    }
+    return bucket;
+  }
+
+
+  /**
+   * Estimates a latency percentile from the histogram (upper edge of its bucket).
+   *
+   * @param counters - the section.
+   * @param fraction - the percentile, e.g. 0.99.
+   * @return uint64_t - the latency (ns).
+   */
+  static uint64_t percentile(const ProfileCounters &counters, double fraction) {
+    uint64_t calls = counters.calls.load(std::memory_order_relaxed);
+    uint64_t rank = static_cast<uint64_t>(fraction * calls + 0.5);
+    uint64_t seen = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; ++b) {
+      seen += counters.histogram[b].load(std::memory_order_relaxed);
+      if (seen >= rank && seen > 0) {
+        return std::min(uint64_t(1) << b, counters.maxNanoseconds.load(std::memory_order_relaxed));
+      }
+    }
+    return counters.maxNanoseconds.load(std::memory_order_relaxed);
+  }
+};
+
+
+/**
+ * Retrieves the process-wide profile.
+ *
+ * @return Profiler& - the profile.
+ */
+inline Profiler &profiler() {
+  static Profiler profile;
+  return profile;
+}
+
+
+/**
+ * Reports the profile where MATRIX_PROFILE says: standard error for "1",
+ * otherwise a JSON file at that path.
+ */
+inline void reportProfile() {
+  const char* target = std::getenv("MATRIX_PROFILE");
+  if (target == nullptr) {
+    return;
+  }
+  if (std::string(target) == "1") {
+    profiler().print(std::cerr);
+  } else if (!profiler().writeJson(target)) {
+    std::cerr << "[Profile] ERROR: cannot write \"" << target << "\"." << std::endl;
+  }
+}
+
+
+/**
+ * Checks whether profiling is on (MATRIX_PROFILE set and not "0").
+ * The first call also arranges for the profile to be reported at exit.
+ *
+ * @return bool - whether probes record.
+ */
+inline bool profilingEnabled() {
+  static const bool enabled = [] {
+    const char* env = std::getenv("MATRIX_PROFILE");
+    if (env == nullptr || *env == '\0' || std::string(env) == "0") {
+      return false;
+    }
+    profiler();  // Constructed first, so it outlives the exit handler.
+    std::atexit(reportProfile);
+    return true;
+  }();
+  return enabled;
+}
+
+
+/**
+ * Counts a matrix buffer allocation when profiling.
+ *
+ * @param bytes - its size.
+ */
+inline void profileAllocation(size_t bytes) {
+  if (profilingEnabled()) {
+    profiler().countAllocation(bytes);
+  }
+}
+
+
+/**
+ * Times the enclosing block into a section, with the allocations made meanwhile.
+ */
+class ProfileScope {
+ public:
+  /**
+   * Constructor; starts the clock.
+   *
+   * @param section - the section.
+   * @param flops - the floating-point operations the block does.
+   * @param bytes - the bytes the block reads and writes.
+   */
+  ProfileScope(ProfileSection section, double flops, double bytes)
+      : _enabled(profilingEnabled()), _section(section), _flops(flops), _bytes(bytes) {
+    if (_enabled) {
+      _allocations = profiler().allocations();
+      _allocatedBytes = profiler().allocatedBytes();
+      _start = std::chrono::steady_clock::now();
+    }
+  }
+
+  ProfileScope(const ProfileScope &) = delete;
+  ProfileScope &operator=(const ProfileScope &) = delete;
+
+
+  /**
+   * Destructor; records the block.
+   */
+  ~ProfileScope() {
+    if (_enabled) {
+      auto elapsed = std::chrono::steady_clock::now() - _start;
+      Profiler &profile = profiler();
+      profile.record(_section,
+                     static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()),
+                     static_cast<uint64_t>(_flops), static_cast<uint64_t>(_bytes),
+                     profile.allocations() - _allocations, profile.allocatedBytes() - _allocatedBytes);
+    }
+  }
+
+
+ private:
+  bool _enabled;
+  ProfileSection _section;
+  double _flops;
+  double _bytes;
+  uint64_t _allocations = 0;
+  uint64_t _allocatedBytes = 0;
+  std::chrono::steady_clock::time_point _start;
+};
+
+#endif  // MATRIX_INSTRUMENTATION_H_
@@ -0,0 +1,449 @@
+/**
+ * matrix_out_of_core.h
+ * Multiplication of binary matrix files that do not fit in memory.
+ * C = A * B is computed one output tile at a time: the row panel of A and
+ * column panel of B are streamed through tile-sized buffers, the next pair of
+ * tiles is read by a background thread while the current pair is multiplied,
+ * and every finished output tile is written back while the next one is
+ * computed. Only the tile buffers live in memory, sized from a byte budget.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_OUT_OF_CORE_H_
+#define MATRIX_OUT_OF_CORE_H_
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <string>
+
+#include "matrix_binary.h"
+#include "matrix_gemm.h"
+#include "matrix_simd.h"
+#include "matrix_storage.h"
+
+
+// Memory budget when MATRIX_MEMORY_BUDGET is not set.
+const size_t DEFAULT_MEMORY_BUDGET = size_t(256) << 20;
+
+// Tile buffers that share the budget: two A, two B, two C and one partial product.
+const size_t OUT_OF_CORE_TILE_BUFFERS = 7;
+
+// Tile edges are multiples of this (keeps rows aligned and the kernel's blocks full).
+const int OUT_OF_CORE_TILE_STEP = MATRIX_ALIGNMENT_FLOATS;
+
+
+/**
+ * Parses a byte count with an optional K, M or G suffix.
+ *
+ * @param text - the text.
+ * @param bytes - receives the count.
+ * @return bool - whether the text was a valid, non-zero count.
+ */
+inline bool parseByteCount(const char* text, size_t* bytes) {
+  char* end = nullptr;
+  errno = 0;
+  unsigned long long value = std::strtoull(text, &end, 10);
+  if (errno != 0 || end == text) {
+    return false;
+  }
+  int shift = 0;
+  if (*end == 'K' || *end == 'k') {
+    shift = 10;
+  } else if (*end == 'M' || *end == 'm') {
+    shift = 20;
+  } else if (*end == 'G' || *end == 'g') {
+    shift = 30;
+  }
+  if (shift != 0) {
+    ++end;
+  }
+  if (*end != '\0' || value == 0 || value > (SIZE_MAX >> shift)) {
+    return false;
+  }
+  *bytes = static_cast<size_t>(value) << shift;
+  return true;
+}
+
+
+/**
+ * Retrieves the mutable, process-wide memory budget of out-of-core products.
+ * Defaults to MATRIX_MEMORY_BUDGET (e.g. 512M), or DEFAULT_MEMORY_BUDGET.
+ *
+ * @return size_t& - the budget in bytes.
+ */
+inline size_t &memoryBudgetSetting() {
+  static size_t budget = [] {
+    size_t bytes = DEFAULT_MEMORY_BUDGET;
+    const char* env = std::getenv("MATRIX_MEMORY_BUDGET");
+    if (env != nullptr && !parseByteCount(env, &bytes)) {
+      bytes = DEFAULT_MEMORY_BUDGET;
+    }
+    return bytes;
+  }();
+  return budget;
+}
+
+
+/**
+ * Picks the edge of the square tiles that fit a memory budget.
+ *
+ * @param budget - the budget in bytes.
+ * @return int - the tile edge (at least OUT_OF_CORE_TILE_STEP).
+ */
+inline int outOfCoreTileSize(size_t budget) {
+  double edge = std::sqrt(static_cast<double>(budget) / (OUT_OF_CORE_TILE_BUFFERS * sizeof(float)));
+  int tile = static_cast<int>(std::min(edge, 1e9)) / OUT_OF_CORE_TILE_STEP * OUT_OF_CORE_TILE_STEP;
+  return std::max(tile, OUT_OF_CORE_TILE_STEP);
+}
+
+
+/**
+ * Open matrix file plus its validated header.
+ */
+class MatrixFile {
+ public:
+  /**
+   * Constructor; opens and validates an existing file.
+   *
+   * @param path - the file.
+   * @throws std::string - unreadable or malformed file.
+   */
+  explicit MatrixFile(const std::string &path) : _path(path) {
+    _fd = open(path.c_str(), O_RDONLY);
+    if (_fd < 0) {
+      throw(std::string("[Out-of-core] ERROR: cannot open \"" + path + "\": " + std::strerror(errno)));
+    }
+    struct stat status;
+    std::string error = "too short for a matrix file";
+    if (fstat(_fd, &status) != 0 || static_cast<size_t>(status.st_size) < sizeof(_header)
+        || pread(_fd, &_header, sizeof(_header), 0) != static_cast<ssize_t>(sizeof(_header))
+        || !checkMatrixFileHeader(_header, static_cast<size_t>(status.st_size), &error)) {
+      close(_fd);
+      throw(std::string("[Out-of-core] ERROR: \"" + path + "\": " + error + "."));
+    }
+  }
+
+
+  /**
+   * Constructor; creates a zero-filled file in the native layout.
+   *
+   * @param path - the file.
+   * @param width - the width of the matrix.
+   * @param height - the height of the matrix.
+   * @throws std::string - the file cannot be created.
+   */
+  MatrixFile(const std::string &path, int width, int height) : _path(path) {
+    _header = makeMatrixFileHeader(width, height, 0, 0);
+    off_t bytes = static_cast<off_t>(_header.dataOffset + sizeof(float) * _header.stride * height);
+    _fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (_fd < 0 || ftruncate(_fd, bytes) != 0
+        || pwrite(_fd, &_header, sizeof(_header), 0) != static_cast<ssize_t>(sizeof(_header))) {
+      std::string reason = std::strerror(errno);
+      if (_fd >= 0) {
+        close(_fd);
+      }
+      throw(std::string("[Out-of-core] ERROR: cannot write \"" + path + "\": " + reason));
+    }
+  }
+
+  MatrixFile(const MatrixFile &) = delete;
+  MatrixFile &operator=(const MatrixFile &) = delete;
+
+
+  /**
+   * Destructor; closes the file.
+   */
+  ~MatrixFile() {
+    close(_fd);
+  }
+
+
+  int getWidth() const {
+    return static_cast<int>(_header.width);
+  }
+
+
+  int getHeight() const {
+    return static_cast<int>(_header.height);
+  }
+
+
+  /**
+   * Reads a block of the matrix.
+   *
+   * @param tile - receives the block; its width and height select the size.
+   * @param row - the first row of the block.
+   * @param col - the first column of the block.
+   * @throws std::string - read error.
+   */
+  void readTile(const MatrixView &tile, int row, int col) const {
+    for (int i = 0; i < tile.height; ++i) {
+      transfer(false, tile.row(i), elementOffset(row + i, col), sizeof(float) * tile.width);
+    }
+  }
+
+
+  /**
+   * Writes a block of the matrix.
+   *
+   * @param tile - the block.
+   * @param row - the first row of the block.
+   * @param col - the first column of the block.
+   * @throws std::string - write error.
+   */
+  void writeTile(const MatrixView &tile, int row, int col) const {
+    for (int i = 0; i < tile.height; ++i) {
+      transfer(true, tile.row(i), elementOffset(row + i, col), sizeof(float) * tile.width);
+    }
+  }
+
+
+ private:
+  std::string _path;
+  int _fd = -1;
+  MatrixFileHeader _header;
+
+
+  /**
+   * Finds an element in the file.
+   *
+   * @param row - the row.
+   * @param col - the column.
+   * @return off_t - its byte offset.
+   */
+  off_t elementOffset(int row, int col) const {
+    return static_cast<off_t>(_header.dataOffset + sizeof(float) * (_header.stride * row + col));
+  }
+
+
+  /**
+   * Reads or writes a byte range completely.
+   *
+   * @param write - whether to write (else read).
+   * @param data - the memory side of the transfer.
+   * @param offset - the file offset.
+   * @param bytes - the length.
+   * @throws std::string - I/O error or unexpected end of file.
+   */
+  void transfer(bool write, float* data, off_t offset, size_t bytes) const {
+    char* cursor = reinterpret_cast<char*>(data);
+    while (bytes > 0) {
+      ssize_t done = write ? pwrite(_fd, cursor, bytes, offset) : pread(_fd, cursor, bytes, offset);
+      if (done < 0 && errno == EINTR) {
+        continue;
+      }
+      if (done <= 0) {
+        std::string reason = done < 0 ? std::strerror(errno) : "unexpected end of file";
+        throw(std::string("[Out-of-core] ERROR: " + std::string(write ? "writing" : "reading")
+                          + " \"" + _path + "\": " + reason));
+      }
+      cursor += done;
+      offset += done;
+      bytes -= static_cast<size_t>(done);
+    }
+  }
+};
+
+
+/**
+ * Aligned tile buffer from the matrix allocator.
+ */
+class TileBuffer {
+ public:
+  TileBuffer(int width, int height)
+      : _stride(paddedStride(width)),
+        _data(allocateMatrixData(static_cast<size_t>(_stride) * height)) {}
+
+  TileBuffer(const TileBuffer &) = delete;
+  TileBuffer &operator=(const TileBuffer &) = delete;
+
+  ~TileBuffer() {
+    freeMatrixData(_data);
+  }
+
+  /**
+   * Retrieves a view of the top-left width x height corner.
+   *
+   * @param width - the width of the view.
+   * @param height - the height of the view.
+   * @return MatrixView - the view.
+   */
+  MatrixView view(int width, int height) const {
+    return MatrixView{_data, width, height, _stride};
+  }
+
+ private:
+  int _stride;
+  float* _data;
+};
+
+
+/**
+ * One step of an out-of-core product: output tile (row, col) gets the
+ * contribution of the inner tile starting at depth.
+ */
+struct OutOfCoreStep {
+  size_t output;   // Index of the output tile.
+  bool first;      // First inner tile of the output tile.
+  bool last;       // Last inner tile of the output tile.
+  int row;         // First row of A and C.
+  int col;         // First column of B and C.
+  int depth;       // First column of A and row of B.
+  int rows;        // Rows of the A and C tiles.
+  int cols;        // Columns of the B and C tiles.
+  int inner;       // Columns of the A tile and rows of the B tile.
+};
+
+
+/**
+ * Computes C = A * B for binary matrix files with bounded memory.
+ * The result is built under a temporary name and renamed into place.
+ *
+ * @param pathA - the file of A.
+ * @param pathB - the file of B.
+ * @param pathC - the file to write C to.
+ * @param budget - the bytes the tile buffers may use.
+ * @throws std::string - I/O errors or invalid dimensions.
+ */
+inline void multiplyOutOfCore(const std::string &pathA, const std::string &pathB,
+                              const std::string &pathC, size_t budget) {
+  MatrixFile fileA(pathA);
+  MatrixFile fileB(pathB);
+  if (fileA.getWidth() != fileB.getHeight()) {
+    throw(std::string("[Product] ERROR: matrix 1's width does not match matrix 2's height."));
+  }
+  int m = fileA.getHeight();
+  int n = fileB.getWidth();
+  int k = fileA.getWidth();
+
+  int tile = outOfCoreTileSize(budget);
+  int tileM = std::min(tile, m);
+  int tileN = std::min(tile, n);
+  int tileK = std::min(tile, k);
+  int tilesN = (n + tileN - 1) / tileN;
+  int tilesK = (k + tileK - 1) / tileK;
+  size_t steps = static_cast<size_t>((m + tileM - 1) / tileM) * tilesN * tilesK;
+  auto stepAt = [&](size_t s) {
+    OutOfCoreStep step;
+    step.output = s / tilesK;
+    int inner = static_cast<int>(s % tilesK);
+    step.first = inner == 0;
+    step.last = inner == tilesK - 1;
+    step.row = static_cast<int>(step.output / tilesN) * tileM;
+    step.col = static_cast<int>(step.output % tilesN) * tileN;
+    step.depth = inner * tileK;
+    step.rows = std::min(tileM, m - step.row);
+    step.cols = std::min(tileN, n - step.col);
+    step.inner = std::min(tileK, k - step.depth);
+    return step;
+  };
+
+  std::string temporary = pathC + ".tmp";
+  try {
+    MatrixFile fileC(temporary, n, m);
+
+    // Buffers are declared before the futures so pending I/O finishes before they go.
+    TileBuffer bufferA[2] = {{tileK, tileM}, {tileK, tileM}};
+    TileBuffer bufferB[2] = {{tileN, tileK}, {tileN, tileK}};
+    TileBuffer bufferC[2] = {{tileN, tileM}, {tileN, tileM}};
+    TileBuffer partial(tileN, tileM);
+    auto load = [&](size_t s) {
+      OutOfCoreStep step = stepAt(s);
+      fileA.readTile(bufferA[s % 2].view(step.inner, step.rows), step.row, step.depth);
+      fileB.readTile(bufferB[s % 2].view(step.cols, step.inner), step.depth, step.col);
+    };
+
+    std::future<void> writing;
+    std::future<void> reading = std::async(std::launch::async, load, 0);
+    for (size_t s = 0; s < steps; ++s) {
+      // Wait for this step's tiles, then start reading the next step's.
+      reading.get();
+      if (s + 1 < steps) {
+        reading = std::async(std::launch::async, load, s + 1);
+      }
+
+      OutOfCoreStep step = stepAt(s);
+      MatrixView a = bufferA[s % 2].view(step.inner, step.rows);
+      MatrixView b = bufferB[s % 2].view(step.cols, step.inner);
+      MatrixView c = bufferC[step.output % 2].view(step.cols, step.rows);
+      if (step.first) {
+        multiply(c.height, c.width, a.width, a.data, a.stride, b.data, b.stride, c.data, c.stride);
+      } else {
+        MatrixView product = partial.view(c.width, c.height);
+        multiply(c.height, c.width, a.width, a.data, a.stride, b.data, b.stride, product.data,
+                 product.stride);
+        for (int i = 0; i < c.height; ++i) {
+          elementwiseKernels().add(c.row(i), product.row(i), c.row(i), c.width, 1.0f, false);
+        }
+      }
+
+      // Write the finished tile in the background; the other C buffer is free by then.
+      if (step.last) {
+        if (writing.valid()) {
+          writing.get();
+        }
+        writing = std::async(std::launch::async, [&fileC, c, step] {
+          fileC.writeTile(c, step.row, step.col);
+        });
+      }
+    }
+    writing.get();
+  } catch (std::string errorMessage) {
+    unlink(temporary.c_str());
+    throw;
+  }
+
+  if (std::rename(temporary.c_str(), pathC.c_str()) != 0) {
+    std::string reason = std::strerror(errno);
+    unlink(temporary.c_str());
+    throw(std::string("[Out-of-core] ERROR: cannot write \"" + pathC + "\": " + reason));
+  }
+}
+
+
+/**
+ * Computes C = A * B for binary matrix files with the process-wide budget.
+ *
+ * @param pathA - the file of A.
+ * @param pathB - the file of B.
+ * @param pathC - the file to write C to.
+ * @throws std::string - I/O errors or invalid dimensions.
+ */
+inline void multiplyOutOfCore(const std::string &pathA, const std::string &pathB,
+                              const std::string &pathC) {
+  multiplyOutOfCore(pathA, pathB, pathC, memoryBudgetSetting());
+}
+
+
+/**
+ * Multiplies two binary matrix files out of core for the command line.
+ *
+ * @param pathA - the file of A.
+ * @param pathB - the file of B.
+ * @param pathC - the file to write C to.
+ * @return int - the process exit status.
+ */
+inline int multiplyMatrixFiles(const std::string &pathA, const std::string &pathB,
+                               const std::string &pathC) {
+  try {
+    multiplyOutOfCore(pathA, pathB, pathC);
+  } catch (std::string errorMessage) {
+    std::cerr << errorMessage << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+#endif  // MATRIX_OUT_OF_CORE_H_
@@ -0,0 +1,421 @@
+/**
+ * matrix_parser.h
+ * Bulk text input for matrices.
+ * Input is read straight from a file descriptor in large chunks and numbers
+ * are converted with std::from_chars, which skips the locale and sentry work
+ * that makes formatted stream extraction slow on large inputs.
+ * Malformed tokens are reported with their line and column.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_PARSER_H_
+#define MATRIX_PARSER_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "matrix_instrumentation.h"
+#include "matrix_storage.h"
+
+
+// Bytes requested from the descriptor per read.
+const size_t PARSER_CHUNK_SIZE = size_t(1) << 18;
+
+
+/**
+ * Outcome of reading one value.
+ */
+enum class ReadStatus {
+  OK,          // A value was read.
+  MALFORMED,   // The next token was not a valid value; it has been skipped.
+  END          // No tokens are left.
+};
+
+
+class MatrixTextReader {
+ public:
+  /**
+   * Constructor for a descriptor that stays owned by the caller.
+   *
+   * @param fd - the descriptor to read from.
+   * @param tie - stream flushed before every read, so prompts show (may be nullptr).
+   */
+  explicit MatrixTextReader(int fd, std::ostream* tie = nullptr)
+      : _fd(fd), _owned(false), _tie(tie), _buffer(PARSER_CHUNK_SIZE) {}
+
+
+  /**
+   * Constructor for a file.
+   *
+   * @param path - the file to read.
+   * @throws std::string - the file cannot be opened.
+   */
+  explicit MatrixTextReader(const std::string &path)
+      : _fd(open(path.c_str(), O_RDONLY)), _owned(true), _tie(nullptr), _buffer(PARSER_CHUNK_SIZE) {
+    if (_fd < 0) {
+      throw(std::string("[Input] ERROR: cannot open \"" + path + "\": " + std::strerror(errno)));
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  }
+
+  MatrixTextReader(const MatrixTextReader &) = delete;
+  MatrixTextReader &operator=(const MatrixTextReader &) = delete;
+
+
+  /**
+   * Destructor; closes the file if the reader opened it.
+   */
+  ~MatrixTextReader() {
+    if (_owned) {
+      close(_fd);
+    }
+  }
+
+
+  /**
+   * Reads a float.
+   *
+   * @param value - receives the value.
+   * @return ReadStatus - the outcome (see error() when MALFORMED).
+   */
+  ReadStatus readFloat(float* value) {
+    return readNumber(value, "malformed value", "out of range value");
+  }
+
+
+  /**
+   * Reads a double.
+   *
+   * @param value - receives the value.
+   * @return ReadStatus - the outcome (see error() when MALFORMED).
+   */
+  ReadStatus readDouble(double* value) {
+    return readNumber(value, "malformed value", "out of range value");
+  }
+
+
+  /**
+   * Reads an integer.
+   *
+   * @param value - receives the value.
+   * @return ReadStatus - the outcome (see error() when MALFORMED).
+   */
+  ReadStatus readLong(long* value) {
+    return readNumber(value, "malformed integer", "out of range integer");
+  }
+
+
+  /**
+   * Reads an integer of another type; values that do not fit it are out of range.
+   *
+   * @param value - receives the value.
+   * @return ReadStatus - the outcome (see error() when MALFORMED).
+   */
+  template <typename T>
+  ReadStatus readInteger(T* value) {
+    return readNumber(value, "malformed integer", "out of range integer");
+  }
+
+
+  /**
+   * Reads a whitespace separated word.
+   *
+   * @param word - receives the word.
+   * @return ReadStatus - OK, or END when no tokens are left.
+   */
+  ReadStatus readWord(std::string* word) {
+    size_t first = 0;
+    size_t last = 0;
+    if (!nextToken(&first, &last)) {
+      return ReadStatus::END;
+    }
+    word->assign(_buffer.data() + first, last - first);
+    return ReadStatus::OK;
+  }
+
+
+  /**
+   * Skips the rest of the current line.
+   */
+  void skipLine() {
+    while (true) {
+      if (_position == _size && !refill()) {
+        return;
+      }
+      if (_buffer[_position++] == '\n') {
+        ++_line;
+        _lineStart = _base + _position;
+        return;
+      }
+    }
+  }
+
+
+  /**
+   * Retrieves the line of the last token read.
+   *
+   * @return size_t - the line (1-based).
+   */
+  size_t line() const {
+    return _line;
+  }
+
+
+  /**
+   * Retrieves the description of the last malformed token.
+   *
+   * @return const std::string& - the message, with line and column.
+   */
+  const std::string &error() const {
+    return _error;
+  }
+
+
+ private:
+  int _fd;
+  bool _owned;
+  std::ostream* _tie;
+  std::vector<char> _buffer;
+  size_t _position = 0;       // Next unread byte in the buffer.
+  size_t _size = 0;           // Bytes filled in the buffer.
+  bool _end = false;          // The descriptor is exhausted.
+  size_t _base = 0;           // Input offset of _buffer[0].
+  size_t _line = 1;           // Line of the next unread byte.
+  size_t _lineStart = 0;      // Input offset where that line starts.
+  std::string _error;
+
+
+  /**
+   * Keeps the unread bytes and appends the next chunk after them.
+   *
+   * @return bool - whether any bytes were added.
+   */
+  bool refill() {
+    if (_end) {
+      return false;
+    }
+    if (_tie != nullptr) {
+      _tie->flush();
+    }
+
+    // Slide the unread tail to the front, growing the buffer for huge tokens.
+    _base += _position;
+    std::memmove(_buffer.data(), _buffer.data() + _position, _size - _position);
+    _size -= _position;
+    _position = 0;
+    if (_buffer.size() - _size < PARSER_CHUNK_SIZE / 2) {
+      _buffer.resize(_buffer.size() * 2);
+    }
+
+    ssize_t bytes = 0;
+    do {
+      bytes = read(_fd, _buffer.data() + _size, _buffer.size() - _size);
+    } while (bytes < 0 && errno == EINTR);
+    if (bytes <= 0) {
+      _end = true;
+      return false;
+    }
+    _size += static_cast<size_t>(bytes);
+    return true;
+  }
+
+
+  /**
+   * Finds the next whitespace separated token.
+   *
+   * @param first - receives the buffer index of the token.
+   * @param last - receives the buffer index just past the token.
+   * @return bool - whether a token was found.
+   */
+  bool nextToken(size_t* first, size_t* last) {
+    // Skip whitespace, counting lines.
+    while (true) {
+      if (_position == _size && !refill()) {
+        return false;
+      }
+      char c = _buffer[_position];
+      if (c == '\n') {
+        ++_line;
+        _lineStart = _base + _position + 1;
+      } else if (c != ' ' && c != '\t' && c != '\r' && c != '\v' && c != '\f') {
+        break;
+      }
+      ++_position;
+    }
+
+    // Scan the token; a refill moves it to the front of the buffer.
+    size_t length = 0;
+    while (true) {
+      if (_position + length == _size && !refill()) {
+        break;
+      }
+      char c = _buffer[_position + length];
+      if (c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f') {
+        break;
+      }
+      ++length;
+    }
+
+    *first = _position;
+    *last = _position + length;
+    _position += length;
+    return true;
+  }
+
+
+  /**
+   * Reads one token with std::from_chars.
+   *
+   * @param value - receives the value.
+   * @param malformedWhat - the error for a token that is not a number.
+   * @param rangeWhat - the error for a number that does not fit.
+   * @return ReadStatus - the outcome.
+   */
+  template <typename T>
+  ReadStatus readNumber(T* value, const char* malformedWhat, const char* rangeWhat) {
+    size_t first = 0;
+    size_t last = 0;
+    if (!nextToken(&first, &last)) {
+      return ReadStatus::END;
+    }
+
+    const char* begin = _buffer.data() + first;
+    const char* end = _buffer.data() + last;
+    if (*begin == '+' && end - begin > 1) {
+      ++begin;
+    }
+    std::from_chars_result result = std::from_chars(begin, end, *value);
+    if (result.ec != std::errc() || result.ptr != end) {
+      return malformed(first, last, result.ec == std::errc::result_out_of_range ? rangeWhat : malformedWhat);
+    }
+    return ReadStatus::OK;
+  }
+
+
+  /**
+   * Records a malformed token.
+   *
+   * @param first - the buffer index of the token.
+   * @param last - the buffer index just past the token.
+   * @param what - what was wrong with it.
+   * @return ReadStatus - MALFORMED.
+   */
+  ReadStatus malformed(size_t first, size_t last, const char* what) {
+    size_t column = _base + first - _lineStart + 1;
+    _error = "[Input] ERROR: " + std::string(what) + " \""
+             + std::string(_buffer.data() + first, last - first) + "\" at line "
+             + std::to_string(_line) + ", column " + std::to_string(column) + ".";
+    return ReadStatus::MALFORMED;
+  }
+};
+
+
+/**
+ * Retrieves the reader shared by everything that reads standard input.
+ * Prompts written to std::cout are flushed before it blocks for input.
+ *
+ * @return MatrixTextReader& - the reader.
+ */
+inline MatrixTextReader &standardInput() {
+  static MatrixTextReader reader(STDIN_FILENO, &std::cout);
+  return reader;
+}
+
+
+/**
+ * Ends an interactive program whose input ran out mid-question.
+ */
+[[noreturn]] inline void exitAtEndOfInput() {
+  std::cout << std::endl << "[Input] ERROR: unexpected end of input." << std::endl;
+  std::exit(EXIT_FAILURE);
+}
+
+
+/**
+ * Reads the answer to a "Dimensions <x y>" prompt from standard input.
+ * Malformed tokens are reported; the program exits at end of input.
+ *
+ * @param width - receives the width.
+ * @param height - receives the height.
+ * @return bool - whether both numbers were read.
+ */
+inline bool readDimensions(long* width, long* height) {
+  ReadStatus status = standardInput().readLong(width);
+  if (status == ReadStatus::OK) {
+    status = standardInput().readLong(height);
+  }
+  if (status == ReadStatus::END) {
+    exitAtEndOfInput();
+  }
+  if (status == ReadStatus::MALFORMED) {
+    std::cout << standardInput().error() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+
+/**
+ * Reads a menu choice from standard input.
+ * Malformed tokens are reported and give 0 (no option).
+ *
+ * @param exitChoice - the choice returned at end of input.
+ * @return int - the choice.
+ */
+inline int readMenuChoice(int exitChoice) {
+  long choice = 0;
+  ReadStatus status = standardInput().readLong(&choice);
+  if (status == ReadStatus::END) {
+    return exitChoice;
+  }
+  if (status == ReadStatus::MALFORMED) {
+    std::cout << standardInput().error() << std::endl;
+    return 0;
+  }
+  return static_cast<int>(choice);
+}
+
+
+/**
+ * Fills a matrix with values read row by row.
+ * Malformed tokens are reported and skipped, so the next valid value takes
+ * their place.
+ *
+ * @param reader - the input.
+ * @param matrix - the matrix to fill.
+ * @param errors - where to report malformed tokens.
+ * @return bool - whether every value was read (false at end of input).
+ */
+inline bool readMatrixValues(MatrixTextReader &reader, const MatrixView &matrix, std::ostream &errors) {
+  double bytes = sizeof(float) * static_cast<double>(matrix.width) * matrix.height;
+  ProfileScope profile(ProfileSection::PARSE, 0, bytes);
+  for (int i = 0; i < matrix.height; ++i) {
+    float* row = matrix.row(i);
+    for (int j = 0; j < matrix.width; ++j) {
+      ReadStatus status = reader.readFloat(row + j);
+      while (status == ReadStatus::MALFORMED) {
+        errors << reader.error() << std::endl;
+        status = reader.readFloat(row + j);
+      }
+      if (status == ReadStatus::END) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+#endif  // MATRIX_PARSER_H_
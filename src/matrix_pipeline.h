@@ -0,0 +1,234 @@
+/**
+ * matrix_pipeline.h
+ * Three-stage pipeline for streams of jobs: parse -> compute -> write.
+ * Each stage runs on its own thread and hands items to the next through a
+ * bounded queue, so reading the next job's input and formatting the previous
+ * job's output overlap the current job's arithmetic, and a stream runs about
+ * as fast as its slowest stage instead of the sum of all three. A full queue
+ * blocks the stage feeding it (backpressure), so a fast parser cannot run
+ * arbitrarily far ahead of the compute stage or hold more than a few parsed
+ * inputs in memory. Items leave every stage in the order they entered it.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_PIPELINE_H_
+#define MATRIX_PIPELINE_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+
+// Items that may wait between two stages (MATRIX_PIPELINE_DEPTH).
+const int DEFAULT_PIPELINE_DEPTH = 4;
+
+
+/**
+ * Retrieves the queue depth between stages; parsed once from MATRIX_PIPELINE_DEPTH.
+ * 0 runs the stages one after another on the calling thread.
+ *
+ * @return int - the depth.
+ */
+inline int pipelineDepth() {
+  static const int depth = [] {
+    const char* setting = std::getenv("MATRIX_PIPELINE_DEPTH");
+    if (setting == nullptr || *setting == '\0') {
+      return DEFAULT_PIPELINE_DEPTH;
+    }
+    char* end = nullptr;
+    long value = std::strtol(setting, &end, 10);
+    if (*end != '\0' || value < 0 || value > 1024) {
+      return DEFAULT_PIPELINE_DEPTH;
+    }
+    return static_cast<int>(value);
+  }();
+  return depth;
+}
+
+
+/**
+ * FIFO queue of at most a fixed number of items. push() blocks while it is
+ * full and pop() while it is empty; close() wakes both for good.
+ */
+template <typename Item>
+class BoundedQueue {
+ public:
+  /**
+   * Constructor.
+   *
+   * @param capacity - the most items the queue holds (at least 1).
+   */
+  explicit BoundedQueue(size_t capacity) : _capacity(capacity > 0 ? capacity : 1) {}
+
+  BoundedQueue(const BoundedQueue &) = delete;
+  BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+
+  /**
+   * Appends an item, waiting for room.
+   *
+   * @param item - the item.
+   * @return bool - whether it was queued (false once the queue is closed).
+   */
+  bool push(Item &&item) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _notFull.wait(lock, [this] { return _closed || _items.size() < _capacity; });
+    if (_closed) {
+      return false;
+    }
+    _items.push_back(std::move(item));
+    _notEmpty.notify_one();
+    return true;
+  }
+
+
+  /**
+   * Removes the oldest item, waiting for one.
+   *
+   * @param item - receives the item.
+   * @return bool - whether an item was removed (false once the queue is closed and drained).
+   */
+  bool pop(Item* item) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _notEmpty.wait(lock, [this] { return _closed || !_items.empty(); });
+    if (_items.empty()) {
+      return false;
+    }
+    *item = std::move(_items.front());
+    _items.pop_front();
+    _notFull.notify_one();
+    return true;
+  }
+
+
+  /**
+   * Closes the queue: later pushes fail, pops drain what is left.
+   */
+  void close() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _closed = true;
+    _notFull.notify_all();
+    _notEmpty.notify_all();
+  }
+
+
+ private:
+  size_t _capacity;
+  std::deque<Item> _items;
+  bool _closed = false;
+  std::mutex _mutex;
+  std::condition_variable _notFull;
+  std::condition_variable _notEmpty;
+};
+
+
+/**
+ * Keeps the first exception thrown by any stage.
+ */
+class PipelineError {
+ public:
+  /**
+   * Records the exception being handled, unless one was recorded already.
+   */
+  void capture() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_error == nullptr) {
+      _error = std::current_exception();
+    }
+  }
+
+  /**
+   * Rethrows the recorded exception, if any.
+   */
+  void rethrow() {
+    if (_error != nullptr) {
+      std::rethrow_exception(_error);
+    }
+  }
+
+ private:
+  std::mutex _mutex;
+  std::exception_ptr _error;
+};
+
+
+/**
+ * Runs items through parse, compute and write until parse runs out.
+ * Parse and write each get a thread, compute runs on the caller. Stages
+ * report per-item failures in the item; an exception escaping a stage stops
+ * the pipeline and is rethrown here once every stage has stopped.
+ *
+ * @param parse - bool(Item*): fills the next item, false at the end of the stream.
+ * @param compute - void(Item&): carries the item out.
+ * @param write - void(Item&): writes the item's output.
+ * @param depth - the queue depth between stages (0 = one stage after another on the caller).
+ * @throws - the first exception thrown by a stage.
+ */
+template <typename Item, typename Parse, typename Compute, typename Write>
+void runPipeline(Parse parse, Compute compute, Write write, int depth = pipelineDepth()) {
+  if (depth == 0) {
+    Item item;
+    while (parse(&item)) {
+      compute(item);
+      write(item);
+      item = Item();
+    }
+    return;
+  }
+
+  BoundedQueue<Item> parsed(depth);
+  BoundedQueue<Item> computed(depth);
+  PipelineError error;
+
+  std::thread parser([&] {
+    try {
+      Item item;
+      while (parse(&item) && parsed.push(std::move(item))) {
+        item = Item();
+      }
+    } catch (...) {
+      error.capture();
+    }
+    parsed.close();
+  });
+
+  std::thread writer([&] {
+    try {
+      Item item;
+      while (computed.pop(&item)) {
+        write(item);
+        item = Item();
+      }
+    } catch (...) {
+      error.capture();
+      parsed.close();
+      computed.close();
+    }
+  });
+
+  try {
+    Item item;
+    while (parsed.pop(&item)) {
+      compute(item);
+      if (!computed.push(std::move(item))) {
+        break;
+      }
+    }
+  } catch (...) {
+    error.capture();
+    parsed.close();
+  }
+  computed.close();
+
+  parser.join();
+  writer.join();
+  error.rethrow();
+}
+
+#endif  // MATRIX_PIPELINE_H_
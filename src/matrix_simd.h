@@ -0,0 +1,433 @@
+/**
+ * matrix_simd.h
+ * Vectorized element-wise kernels (add, subtract, a + alpha * b) with
+ * SSE2, AVX2 and AVX-512 variants chosen once at startup from CPUID, so one
+ * binary uses the widest vectors each host supports.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_SIMD_H_
+#define MATRIX_SIMD_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+#include "matrix_storage.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MATRIX_SIMD_X86 1
+#endif
+
+
+// Results at least this large are written with non-temporal (streaming) stores,
+// since they cannot stay in cache anyway.
+const size_t SIMD_STREAM_THRESHOLD = size_t(4) << 20;
+
+
+/**
+ * Instruction set levels, from narrowest to widest.
+ */
+enum class SimdLevel {
+  SCALAR,
+  SSE2,
+  AVX2,    // AVX2 + FMA.
+  AVX512   // AVX-512F.
+};
+
+
+/**
+ * Element-wise operations that share one kernel template.
+ */
+enum class ElementwiseOp {
+  ADD,        // out = a + b
+  SUBTRACT,   // out = a - b
+  SCALED_ADD  // out = a + alpha * b
+};
+
+
+/**
+ * Retrieves the widest instruction set supported by the CPU (checked once).
+ * MATRIX_SIMD=scalar|sse2|avx2|avx512 lowers the level, e.g. for comparisons.
+ *
+ * @return SimdLevel - the level in use.
+ */
+inline SimdLevel simdLevel() {
+  static SimdLevel level = [] {
+    SimdLevel detected = SimdLevel::SCALAR;
+#ifdef MATRIX_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+      detected = SimdLevel::SSE2;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      detected = SimdLevel::AVX2;
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+      detected = SimdLevel::AVX512;
+    }
+#endif
+
+    const char* env = std::getenv("MATRIX_SIMD");
+    if (env != nullptr) {
+      std::string requested(env);
+      SimdLevel cap = detected;
+      if (requested == "scalar") {
+        cap = SimdLevel::SCALAR;
+      } else if (requested == "sse2") {
+        cap = SimdLevel::SSE2;
+      } else if (requested == "avx2") {
+        cap = SimdLevel::AVX2;
+      }
+      if (cap < detected) {
+        detected = cap;
+      }
+    }
+    return detected;
+  }();
+  return level;
+}
+
+
+/**
+ * Retrieves the name of an instruction set level.
+ *
+ * @param level - the level.
+ * @return const char* - the name.
+ */
+inline const char* simdLevelName(SimdLevel level) {
+  switch (level) {
+    case SimdLevel::SSE2:
+      return "sse2";
+    case SimdLevel::AVX2:
+      return "avx2";
+    case SimdLevel::AVX512:
+      return "avx512";
+    default:
+      return "scalar";
+  }
+}
+
+
+/**
+ * Scalar element-wise kernel; also finishes the tails of the vector kernels.
+ *
+ * @param a - the first operand.
+ * @param b - the second operand.
+ * @param out - the result (may alias a or b).
+ * @param n - the number of elements.
+ * @param alpha - the scale applied to b by SCALED_ADD.
+ */
+template <ElementwiseOp OP>
+inline void elementwiseScalar(const float* a, const float* b, float* out, size_t n, float alpha) {
+  for (size_t i = 0; i < n; ++i) {
+    if constexpr (OP == ElementwiseOp::ADD) {
+      out[i] = a[i] + b[i];
+    } else if constexpr (OP == ElementwiseOp::SUBTRACT) {
+      out[i] = a[i] - b[i];
+    } else {
+      out[i] = a[i] + alpha * b[i];
+    }
+  }
+}
+
+
+/**
+ * Scalar entry point with the common kernel signature.
+ *
+ * @param a - the first operand.
+ * @param b - the second operand.
+ * @param out - the result.
+ * @param n - the number of elements.
+ * @param alpha - the scale applied to b by SCALED_ADD.
+ * @param stream - ignored; there is no scalar streaming store.
+ */
+template <ElementwiseOp OP>
+inline void elementwiseGeneric(const float* a, const float* b, float* out, size_t n, float alpha,
+                               bool stream) {
+  (void) stream;
+  elementwiseScalar<OP>(a, b, out, n, alpha);
+}
+
+
+#ifdef MATRIX_SIMD_X86
+/**
+ * SSE2 element-wise kernel (4 floats per step).
+ *
+ * @param a - the first operand.
+ * @param b - the second operand.
+ * @param out - the result.
+ * @param n - the number of elements.
+ * @param alpha - the scale applied to b by SCALED_ADD.
+ * @param stream - whether to bypass the cache with non-temporal stores.
+ */
+template <ElementwiseOp OP>
+__attribute__((target("sse2")))
+inline void elementwiseSse2(const float* a, const float* b, float* out, size_t n, float alpha,
+                            bool stream) {
+  // Peel until the output is aligned for the stores.
+  size_t i = 0;
+  size_t head = (16 - reinterpret_cast<uintptr_t>(out) % 16) % 16 / sizeof(float);
+  if (head > n || reinterpret_cast<uintptr_t>(out) % sizeof(float) != 0) {
+    head = n;
+  }
+  elementwiseScalar<OP>(a, b, out, head, alpha);
+  i = head;
+
+  __m128 scale = _mm_set1_ps(alpha);
+  for (; i + 4 <= n; i += 4) {
+    __m128 x = _mm_loadu_ps(a + i);
+    __m128 y = _mm_loadu_ps(b + i);
+    __m128 result;
+    if constexpr (OP == ElementwiseOp::ADD) {
+      result = _mm_add_ps(x, y);
+    } else if constexpr (OP == ElementwiseOp::SUBTRACT) {
+      result = _mm_sub_ps(x, y);
+    } else {
+      result = _mm_add_ps(x, _mm_mul_ps(scale, y));
+    }
+    if (stream) {
+      _mm_stream_ps(out + i, result);
+    } else {
+      _mm_store_ps(out + i, result);
+    }
+  }
+  if (stream) {
+    _mm_sfence();
+  }
+  elementwiseScalar<OP>(a + i, b + i, out + i, n - i, alpha);
+}
+
+
+/**
+ * AVX2 element-wise kernel (two 8-float vectors per step, FMA for SCALED_ADD).
+ *
+ * @param a - the first operand.
+ * @param b - the second operand.
+ * @param out - the result.
+ * @param n - the number of elements.
+ * @param alpha - the scale applied to b by SCALED_ADD.
+ * @param stream - whether to bypass the cache with non-temporal stores.
+ */
+template <ElementwiseOp OP>
+__attribute__((target("avx2,fma")))
+inline void elementwiseAvx2(const float* a, const float* b, float* out, size_t n, float alpha,
+                            bool stream) {
+  size_t i = 0;
+  size_t head = (32 - reinterpret_cast<uintptr_t>(out) % 32) % 32 / sizeof(float);
+  if (head > n || reinterpret_cast<uintptr_t>(out) % sizeof(float) != 0) {
+    head = n;
+  }
+  elementwiseScalar<OP>(a, b, out, head, alpha);
+  i = head;
+
+  __m256 scale = _mm256_set1_ps(alpha);
+  for (; i + 16 <= n; i += 16) {
+    __m256 x0 = _mm256_loadu_ps(a + i);
+    __m256 x1 = _mm256_loadu_ps(a + i + 8);
+    __m256 y0 = _mm256_loadu_ps(b + i);
+    __m256 y1 = _mm256_loadu_ps(b + i + 8);
+    __m256 r0;
+    __m256 r1;
+    if constexpr (OP == ElementwiseOp::ADD) {
+      r0 = _mm256_add_ps(x0, y0);
+      r1 = _mm256_add_ps(x1, y1);
+    } else if constexpr (OP == ElementwiseOp::SUBTRACT) {
+      r0 = _mm256_sub_ps(x0, y0);
+      r1 = _mm256_sub_ps(x1, y1);
+    } else {
+      r0 = _mm256_fmadd_ps(scale, y0, x0);
+      r1 = _mm256_fmadd_ps(scale, y1, x1);
+    }
+    if (stream) {
+      _mm256_stream_ps(out + i, r0);
+      _mm256_stream_ps(out + i + 8, r1);
+    } else {
+      _mm256_store_ps(out + i, r0);
+      _mm256_store_ps(out + i + 8, r1);
+    }
+  }
+  if (stream) {
+    _mm_sfence();
+  }
+  elementwiseScalar<OP>(a + i, b + i, out + i, n - i, alpha);
+}
+
+
+/**
+ * AVX-512 element-wise kernel (16 floats per step, masked tail).
+ *
+ * @param a - the first operand.
+ * @param b - the second operand.
+ * @param out - the result.
+ * @param n - the number of elements.
+ * @param alpha - the scale applied to b by SCALED_ADD.
+ * @param stream - whether to bypass the cache with non-temporal stores.
+ */
+template <ElementwiseOp OP>
+__attribute__((target("avx512f")))
+inline void elementwiseAvx512(const float* a, const float* b, float* out, size_t n, float alpha,
+                              bool stream) {
+  size_t i = 0;
+  size_t head = (64 - reinterpret_cast<uintptr_t>(out) % 64) % 64 / sizeof(float);
+  if (head > n || reinterpret_cast<uintptr_t>(out) % sizeof(float) != 0) {
+    head = n;
+  }
+  elementwiseScalar<OP>(a, b, out, head, alpha);
+  i = head;
+
+  __m512 scale = _mm512_set1_ps(alpha);
+  for (; i + 16 <= n; i += 16) {
+    __m512 x = _mm512_loadu_ps(a + i);
+    __m512 y = _mm512_loadu_ps(b + i);
+    __m512 result;
+    if constexpr (OP == ElementwiseOp::ADD) {
+      result = _mm512_add_ps(x, y);
+    } else if constexpr (OP == ElementwiseOp::SUBTRACT) {
+      result = _mm512_sub_ps(x, y);
+    } else {
+      result = _mm512_fmadd_ps(scale, y, x);
+    }
+    if (stream) {
+      _mm512_stream_ps(out + i, result);
+    } else {
+      _mm512_store_ps(out + i, result);
+    }
+  }
+  if (stream) {
+    _mm_sfence();
+  }
+
+  // Masked tail instead of a scalar loop.
+  if (i < n) {
+    __mmask16 mask = static_cast<__mmask16>((1u << (n - i)) - 1);
+    __m512 x = _mm512_maskz_loadu_ps(mask, a + i);
+    __m512 y = _mm512_maskz_loadu_ps(mask, b + i);
+    __m512 result;
+    if constexpr (OP == ElementwiseOp::ADD) {
+      result = _mm512_add_ps(x, y);
+    } else if constexpr (OP == ElementwiseOp::SUBTRACT) {
+      result = _mm512_sub_ps(x, y);
+    } else {
+      result = _mm512_fmadd_ps(scale, y, x);
+    }
+    _mm512_mask_storeu_ps(out + i, mask, result);
+  }
+}
+#endif
+
+
+// Common signature of every element-wise kernel.
+typedef void (*ElementwiseKernel)(const float*, const float*, float*, size_t, float, bool);
+
+
+/**
+ * Kernels for each operation at the detected instruction set level.
+ */
+struct ElementwiseKernels {
+  ElementwiseKernel add;
+  ElementwiseKernel subtract;
+  ElementwiseKernel scaledAdd;
+};
+
+
+/**
+ * Retrieves the dispatch table, filled in once from simdLevel().
+ *
+ * @return const ElementwiseKernels& - the kernels.
+ */
+inline const ElementwiseKernels &elementwiseKernels() {
+  static const ElementwiseKernels kernels = [] {
+    ElementwiseKernels table = {&elementwiseGeneric<ElementwiseOp::ADD>,
+                                &elementwiseGeneric<ElementwiseOp::SUBTRACT>,
+                                &elementwiseGeneric<ElementwiseOp::SCALED_ADD>};
+#ifdef MATRIX_SIMD_X86
+    switch (simdLevel()) {
+      case SimdLevel::AVX512:
+        table = {&elementwiseAvx512<ElementwiseOp::ADD>, &elementwiseAvx512<ElementwiseOp::SUBTRACT>,
+                 &elementwiseAvx512<ElementwiseOp::SCALED_ADD>};
+        break;
+      case SimdLevel::AVX2:
+        table = {&elementwiseAvx2<ElementwiseOp::ADD>, &elementwiseAvx2<ElementwiseOp::SUBTRACT>,
+                 &elementwiseAvx2<ElementwiseOp::SCALED_ADD>};
+        break;
+      case SimdLevel::SSE2:
+        table = {&elementwiseSse2<ElementwiseOp::ADD>, &elementwiseSse2<ElementwiseOp::SUBTRACT>,
+                 &elementwiseSse2<ElementwiseOp::SCALED_ADD>};
+        break;
+      default:
+        break;
+    }
+#endif
+    return table;
+  }();
+  return kernels;
+}
+
+
+/**
+ * Applies an element-wise kernel to whole matrices.
+ * Gap-free storage is processed as one long array; padded rows one row at a time.
+ *
+ * @param kernel - the kernel.
+ * @param a - the first operand.
+ * @param b - the second operand.
+ * @param out - the result (same dimensions; may alias a or b).
+ * @param alpha - the scale applied to b by SCALED_ADD.
+ */
+inline void applyElementwise(ElementwiseKernel kernel, const MatrixView &a, const MatrixView &b,
+                             const MatrixView &out, float alpha) {
+  size_t total = static_cast<size_t>(out.width) * out.height;
+  bool stream = total * sizeof(float) >= SIMD_STREAM_THRESHOLD;
+
+  if (a.stride == a.width && b.stride == b.width && out.stride == out.width) {
+    kernel(a.data, b.data, out.data, total, alpha, stream);
+    return;
+  }
+  for (int i = 0; i < out.height; ++i) {
+    kernel(a.row(i), b.row(i), out.row(i), out.width, alpha, stream);
+  }
+}
+
+
+/**
+ * Computes out = a + b.
+ *
+ * @param a - the first operand.
+ * @param b - the second operand.
+ * @param out - the result.
+ */
+inline void addMatrices(const MatrixView &a, const MatrixView &b, const MatrixView &out) {
+  applyElementwise(elementwiseKernels().add, a, b, out, 1.0f);
+}
+
+
+/**
+ * Computes out = a - b.
+ *
+ * @param a - the first operand.
+ * @param b - the second operand.
+ * @param out - the result.
+ */
+inline void subtractMatrices(const MatrixView &a, const MatrixView &b, const MatrixView &out) {
+  applyElementwise(elementwiseKernels().subtract, a, b, out, 1.0f);
+}
+
+
+/**
+ * Computes out = a + alpha * b in one pass.
+ *
+ * @param a - the first operand.
+ * @param b - the second operand.
+ * @param alpha - the scale applied to b.
+ * @param out - the result.
+ */
+inline void scaledAddMatrices(const MatrixView &a, const MatrixView &b, float alpha,
+                              const MatrixView &out) {
+  applyElementwise(elementwiseKernels().scaledAdd, a, b, out, alpha);
+}
+
+#endif  // MATRIX_SIMD_H_
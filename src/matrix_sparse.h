@@ -0,0 +1,877 @@
+/**
+ * matrix_sparse.h
+ * Compressed sparse matrices (CSR, or CSC) for inputs that are mostly zeros.
+ * Only the nonzeros are stored, and sums and products visit only them, so
+ * memory and time scale with the nonzeros rather than with the dimensions.
+ * Dense matrices below the density threshold (MATRIX_SPARSE_DENSITY) are
+ * converted automatically by the GEMM engine and by batch mode.
+ * Sparse data can be read from and written to Matrix Market coordinate files.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_SPARSE_H_
+#define MATRIX_SPARSE_H_
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "matrix_format.h"
+#include "matrix_parser.h"
+#include "matrix_simd.h"
+#include "matrix_storage.h"
+#include "thread_pool.h"
+
+
+// Matrices with at most this fraction of nonzeros are treated as sparse.
+const double DEFAULT_SPARSE_DENSITY = 0.05;
+
+// Smaller matrices are always kept dense; converting them costs more than it saves.
+const size_t SPARSE_MIN_ELEMENTS = size_t(64) * 64;
+
+// Sparse products with fewer multiply-adds than this run on one thread.
+const double SPARSE_PARALLEL_THRESHOLD = 1 << 18;
+
+// Rows of the result handed to one pool task.
+const int SPARSE_TASK_ROWS = 64;
+
+// First line of a Matrix Market file.
+const char MATRIX_MARKET_BANNER[] = "%%MatrixMarket";
+
+// Most entries reserved up front from a Matrix Market size line; beyond this
+// the entry list grows as the entries are actually read.
+const size_t MATRIX_MARKET_RESERVE_LIMIT = size_t(1) << 20;
+
+
+/**
+ * Which dimension a sparse matrix is compressed along.
+ */
+enum class SparseLayout {
+  CSR,  // Compressed rows: offsets per row, column indices.
+  CSC   // Compressed columns: offsets per column, row indices.
+};
+
+
+/**
+ * One nonzero given by its coordinates.
+ */
+struct SparseEntry {
+  int row;
+  int col;
+  float value;
+};
+
+
+/**
+ * Retrieves the mutable, process-wide density threshold.
+ * Defaults to MATRIX_SPARSE_DENSITY (0 turns automatic conversion off), or
+ * DEFAULT_SPARSE_DENSITY.
+ *
+ * @return double& - the threshold.
+ */
+inline double &sparseDensitySetting() {
+  static double density = [] {
+    const char* env = std::getenv("MATRIX_SPARSE_DENSITY");
+    if (env != nullptr && std::atof(env) >= 0.0) {
+      return std::atof(env);
+    }
+    return DEFAULT_SPARSE_DENSITY;
+  }();
+  return density;
+}
+
+
+/**
+ * Retrieves the fraction of nonzeros at or below which a matrix is treated as sparse.
+ *
+ * @return double - the threshold.
+ */
+inline double getSparseDensity() {
+  return sparseDensitySetting();
+}
+
+
+/**
+ * Changes the fraction of nonzeros at or below which a matrix is treated as sparse.
+ *
+ * @param density - the threshold (0 turns automatic conversion off).
+ */
+inline void setSparseDensity(double density) {
+  sparseDensitySetting() = std::max(density, 0.0);
+}
+
+
+/**
+ * Checks whether a matrix is worth converting to a sparse matrix.
+ * The scan stops as soon as there are too many nonzeros, so a dense matrix
+ * is rejected after reading only a small fraction of it.
+ *
+ * @param matrix - the matrix.
+ * @return bool - whether it is large enough and at most getSparseDensity() full.
+ */
+inline bool isSparseEnough(const MatrixView &matrix) {
+  size_t elements = static_cast<size_t>(matrix.width) * matrix.height;
+  double density = getSparseDensity();
+  if (density <= 0.0 || elements < SPARSE_MIN_ELEMENTS) {
+    return false;
+  }
+
+  size_t limit = static_cast<size_t>(density * static_cast<double>(elements));
+  size_t count = 0;
+  for (int i = 0; i < matrix.height; ++i) {
+    const float* row = matrix.row(i);
+    for (int j = 0; j < matrix.width; ++j) {
+      count += row[j] != 0.0f;
+    }
+    if (count > limit) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+class SparseMatrix {
+ public:
+  /**
+   * Default constructor; an empty 0 x 0 matrix.
+   */
+  SparseMatrix() = default;
+
+
+  /**
+   * Constructor for an all-zero matrix.
+   *
+   * @param width - the width.
+   * @param height - the height.
+   * @param layout - the compressed dimension.
+   * @throws std::invalid_argument - negative dimensions.
+   */
+  SparseMatrix(int width, int height, SparseLayout layout = SparseLayout::CSR)
+      : SparseMatrix(width, height, layout,
+                     std::vector<size_t>((layout == SparseLayout::CSR ? height : width) + 1, 0),
+                     std::vector<int>(), std::vector<float>()) {}
+
+
+  /**
+   * Constructor from compressed arrays.
+   *
+   * @param width - the width.
+   * @param height - the height.
+   * @param layout - the compressed dimension.
+   * @param offsets - where each compressed row (column) starts in indices and values; one extra at the end.
+   * @param indices - the column (row) of every nonzero, ascending within a row (column).
+   * @param values - the nonzeros.
+   * @throws std::invalid_argument - negative dimensions or inconsistent arrays.
+   */
+  SparseMatrix(int width, int height, SparseLayout layout, std::vector<size_t> offsets,
+               std::vector<int> indices, std::vector<float> values)
+      : _width(width), _height(height), _layout(layout), _offsets(std::move(offsets)),
+        _indices(std::move(indices)), _values(std::move(values)) {
+    if (width < 0 || height < 0) {
+      throw std::invalid_argument("Invalid size, dimensions may not be negative");
+    }
+    if (_offsets.size() != static_cast<size_t>(majorCount()) + 1 || _indices.size() != _values.size()
+        || _offsets.back() != _values.size()) {
+      throw std::invalid_argument("Invalid sparse matrix, offsets do not match the nonzeros");
+    }
+  }
+
+
+  /**
+   * Compresses a dense matrix.
+   *
+   * @param matrix - the dense matrix.
+   * @param layout - the compressed dimension.
+   * @return SparseMatrix - its nonzeros.
+   */
+  static SparseMatrix fromDense(const MatrixView &matrix, SparseLayout layout = SparseLayout::CSR) {
+    std::vector<size_t> offsets(static_cast<size_t>(matrix.height) + 1, 0);
+    for (int i = 0; i < matrix.height; ++i) {
+      const float* row = matrix.row(i);
+      size_t count = 0;
+      for (int j = 0; j < matrix.width; ++j) {
+        count += row[j] != 0.0f;
+      }
+      offsets[i + 1] = offsets[i] + count;
+    }
+
+    std::vector<int> indices(offsets.back());
+    std::vector<float> values(offsets.back());
+    size_t next = 0;
+    for (int i = 0; i < matrix.height; ++i) {
+      const float* row = matrix.row(i);
+      for (int j = 0; j < matrix.width; ++j) {
+        if (row[j] != 0.0f) {
+          indices[next] = j;
+          values[next] = row[j];
+          ++next;
+        }
+      }
+    }
+
+    SparseMatrix sparse(matrix.width, matrix.height, SparseLayout::CSR, std::move(offsets),
+                        std::move(indices), std::move(values));
+    return layout == SparseLayout::CSR ? sparse : sparse.converted(layout);
+  }
+
+
+  /**
+   * Builds a matrix from coordinates. Duplicates are summed and zeros dropped.
+   *
+   * @param width - the width.
+   * @param height - the height.
+   * @param entries - the nonzeros in any order (reordered by the call).
+   * @param layout - the compressed dimension.
+   * @return SparseMatrix - the matrix.
+   * @throws std::invalid_argument - an entry lies outside the matrix.
+   */
+  static SparseMatrix fromEntries(int width, int height, std::vector<SparseEntry> &entries,
+                                  SparseLayout layout = SparseLayout::CSR) {
+    for (const SparseEntry &entry : entries) {
+      if (entry.row < 0 || entry.row >= height || entry.col < 0 || entry.col >= width) {
+        throw std::invalid_argument("Invalid sparse matrix, an entry lies outside the matrix");
+      }
+    }
+    std::sort(entries.begin(), entries.end(), [](const SparseEntry &a, const SparseEntry &b) {
+      return a.row != b.row ? a.row < b.row : a.col < b.col;
+    });
+
+    std::vector<size_t> offsets(static_cast<size_t>(height) + 1, 0);
+    std::vector<int> indices;
+    std::vector<float> values;
+    indices.reserve(entries.size());
+    values.reserve(entries.size());
+    for (size_t e = 0; e < entries.size();) {
+      // Sum the duplicates of one coordinate.
+      const SparseEntry &entry = entries[e];
+      float value = 0.0f;
+      for (; e < entries.size() && entries[e].row == entry.row && entries[e].col == entry.col; ++e) {
+        value += entries[e].value;
+      }
+      if (value != 0.0f) {
+        indices.push_back(entry.col);
+        values.push_back(value);
+        ++offsets[entry.row + 1];
+      }
+    }
+    for (int i = 0; i < height; ++i) {
+      offsets[i + 1] += offsets[i];
+    }
+
+    SparseMatrix sparse(width, height, SparseLayout::CSR, std::move(offsets), std::move(indices),
+                        std::move(values));
+    return layout == SparseLayout::CSR ? sparse : sparse.converted(layout);
+  }
+
+
+  /**
+   * Retrieves the width of the matrix.
+   *
+   * @return int - the width.
+   */
+  int getWidth() const {
+    return _width;
+  }
+
+
+  /**
+   * Retrieves the height of the matrix.
+   *
+   * @return int - the height.
+   */
+  int getHeight() const {
+    return _height;
+  }
+
+
+  /**
+   * Retrieves the compressed dimension.
+   *
+   * @return SparseLayout - CSR or CSC.
+   */
+  SparseLayout layout() const {
+    return _layout;
+  }
+
+
+  /**
+   * Retrieves the number of stored nonzeros.
+   *
+   * @return size_t - the nonzeros.
+   */
+  size_t nonzeros() const {
+    return _values.size();
+  }
+
+
+  /**
+   * Retrieves the fraction of elements that are nonzero.
+   *
+   * @return double - the density (0 for an empty matrix).
+   */
+  double density() const {
+    double elements = static_cast<double>(_width) * _height;
+    return elements > 0 ? static_cast<double>(nonzeros()) / elements : 0.0;
+  }
+
+
+  /**
+   * Retrieves where each compressed row (CSR) or column (CSC) starts.
+   *
+   * @return const std::vector<size_t>& - one offset per row (column), plus the total.
+   */
+  const std::vector<size_t> &offsets() const {
+    return _offsets;
+  }
+
+
+  /**
+   * Retrieves the column (CSR) or row (CSC) of every nonzero.
+   *
+   * @return const std::vector<int>& - the indices.
+   */
+  const std::vector<int> &indices() const {
+    return _indices;
+  }
+
+
+  /**
+   * Retrieves the nonzeros.
+   *
+   * @return const std::vector<float>& - the values.
+   */
+  const std::vector<float> &values() const {
+    return _values;
+  }
+
+
+  /**
+   * Converts the matrix to another layout with a counting sort, O(nonzeros + dimensions).
+   *
+   * @param layout - the layout.
+   * @return SparseMatrix - the same matrix compressed along the other dimension.
+   */
+  SparseMatrix converted(SparseLayout layout) const {
+    if (layout == _layout) {
+      return *this;
+    }
+
+    int minor = _layout == SparseLayout::CSR ? _width : _height;
+    std::vector<size_t> offsets(static_cast<size_t>(minor) + 1, 0);
+    for (int index : _indices) {
+      ++offsets[index + 1];
+    }
+    for (int i = 0; i < minor; ++i) {
+      offsets[i + 1] += offsets[i];
+    }
+
+    std::vector<int> indices(nonzeros());
+    std::vector<float> values(nonzeros());
+    std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+    for (int major = 0; major < majorCount(); ++major) {
+      for (size_t e = _offsets[major]; e < _offsets[major + 1]; ++e) {
+        size_t slot = next[_indices[e]]++;
+        indices[slot] = major;
+        values[slot] = _values[e];
+      }
+    }
+    return SparseMatrix(_width, _height, layout, std::move(offsets), std::move(indices), std::move(values));
+  }
+
+
+  /**
+   * Transposes the matrix. The CSC arrays of a matrix are the CSR arrays of
+   * its transpose, so only the dimensions and the layout change.
+   *
+   * @return SparseMatrix - the transpose.
+   */
+  SparseMatrix transposed() const {
+    SparseLayout layout = _layout == SparseLayout::CSR ? SparseLayout::CSC : SparseLayout::CSR;
+    return SparseMatrix(_height, _width, layout, _offsets, _indices, _values);
+  }
+
+
+  /**
+   * Expands the matrix into dense storage.
+   *
+   * @param out - the destination (same dimensions).
+   */
+  void toDense(const MatrixView &out) const {
+    for (int i = 0; i < out.height; ++i) {
+      std::fill(out.row(i), out.row(i) + out.width, 0.0f);
+    }
+    for (int major = 0; major < majorCount(); ++major) {
+      for (size_t e = _offsets[major]; e < _offsets[major + 1]; ++e) {
+        if (_layout == SparseLayout::CSR) {
+          out.row(major)[_indices[e]] = _values[e];
+        } else {
+          out.row(_indices[e])[major] = _values[e];
+        }
+      }
+    }
+  }
+
+
+ private:
+  int _width = 0;
+  int _height = 0;
+  SparseLayout _layout = SparseLayout::CSR;
+  std::vector<size_t> _offsets = std::vector<size_t>(1, 0);
+  std::vector<int> _indices;
+  std::vector<float> _values;
+
+
+  /**
+   * Counts the compressed rows (CSR) or columns (CSC).
+   *
+   * @return int - the height or the width.
+   */
+  int majorCount() const {
+    return _layout == SparseLayout::CSR ? _height : _width;
+  }
+};
+
+
+/**
+ * Checks whether a sparse matrix is worth keeping compressed.
+ *
+ * @param matrix - the matrix.
+ * @return bool - whether it is large enough and at most getSparseDensity() full.
+ */
+inline bool isSparseEnough(const SparseMatrix &matrix) {
+  size_t elements = static_cast<size_t>(matrix.getWidth()) * matrix.getHeight();
+  return elements >= SPARSE_MIN_ELEMENTS && matrix.density() <= getSparseDensity();
+}
+
+
+/**
+ * Runs a task over blocks of rows, on the thread pool when the work is large.
+ *
+ * @param rows - the number of rows.
+ * @param work - the estimated multiply-adds.
+ * @param task - called with the first row and the end of each block.
+ */
+template <typename Task>
+void forEachSparseRowBlock(int rows, double work, const Task &task) {
+  size_t blocks = static_cast<size_t>((rows + SPARSE_TASK_ROWS - 1) / SPARSE_TASK_ROWS);
+  if (getThreadCount() == 1 || work < SPARSE_PARALLEL_THRESHOLD || blocks < 2) {
+    task(0, rows);
+    return;
+  }
+  defaultThreadPool().parallelFor(blocks, [&](size_t block) {
+    int first = static_cast<int>(block) * SPARSE_TASK_ROWS;
+    task(first, std::min(rows, first + SPARSE_TASK_ROWS));
+  });
+}
+
+
+/**
+ * Computes a + alpha * b for two sparse matrices by merging their rows.
+ *
+ * @param a - the first operand.
+ * @param b - the second operand.
+ * @param alpha - the scale of b.
+ * @param name - the operation, for the error.
+ * @return SparseMatrix - the result (CSR).
+ * @throws std::string - invalid dimensions.
+ */
+inline SparseMatrix combineSparse(const SparseMatrix &a, const SparseMatrix &b, float alpha,
+                                  const char* name) {
+  if (a.getWidth() != b.getWidth() || a.getHeight() != b.getHeight()) {
+    throw(std::string("[") + name + "] ERROR: dimensions are not matching.");
+  }
+  SparseMatrix left = a.converted(SparseLayout::CSR);
+  SparseMatrix right = b.converted(SparseLayout::CSR);
+  const std::vector<size_t> &leftOffsets = left.offsets();
+  const std::vector<size_t> &rightOffsets = right.offsets();
+  const std::vector<int> &leftIndices = left.indices();
+  const std::vector<int> &rightIndices = right.indices();
+
+  std::vector<size_t> offsets(static_cast<size_t>(a.getHeight()) + 1, 0);
+  std::vector<int> indices;
+  std::vector<float> values;
+  indices.reserve(left.nonzeros() + right.nonzeros());
+  values.reserve(left.nonzeros() + right.nonzeros());
+  auto emit = [&](int col, float value) {
+    if (value != 0.0f) {
+      indices.push_back(col);
+      values.push_back(value);
+    }
+  };
+
+  for (int i = 0; i < a.getHeight(); ++i) {
+    size_t p = leftOffsets[i];
+    size_t q = rightOffsets[i];
+    while (p < leftOffsets[i + 1] || q < rightOffsets[i + 1]) {
+      int leftCol = p < leftOffsets[i + 1] ? leftIndices[p] : a.getWidth();
+      int rightCol = q < rightOffsets[i + 1] ? rightIndices[q] : a.getWidth();
+      if (leftCol < rightCol) {
+        emit(leftCol, left.values()[p++]);
+      } else if (rightCol < leftCol) {
+        emit(rightCol, alpha * right.values()[q++]);
+      } else {
+        emit(leftCol, left.values()[p++] + alpha * right.values()[q++]);
+      }
+    }
+    offsets[i + 1] = values.size();
+  }
+  return SparseMatrix(a.getWidth(), a.getHeight(), SparseLayout::CSR, std::move(offsets),
+                      std::move(indices), std::move(values));
+}
+
+
+/**
+ * Computes a + b for two sparse matrices.
+ *
+ * @param a - the first operand.
+ * @param b - the second operand.
+ * @return SparseMatrix - the sum (CSR).
+ * @throws std::string - invalid dimensions.
+ */
+inline SparseMatrix addSparse(const SparseMatrix &a, const SparseMatrix &b) {
+  return combineSparse(a, b, 1.0f, "Sum");
+}
+
+
+/**
+ * Computes a - b for two sparse matrices.
+ *
+ * @param a - the first operand.
+ * @param b - the second operand.
+ * @return SparseMatrix - the difference (CSR).
+ * @throws std::string - invalid dimensions.
+ */
+inline SparseMatrix subtractSparse(const SparseMatrix &a, const SparseMatrix &b) {
+  return combineSparse(a, b, -1.0f, "Difference");
+}
+
+
+/**
+ * Computes out = alpha * a + beta * b for a sparse a and a dense b.
+ *
+ * @param alpha - the scale of a.
+ * @param a - the sparse operand.
+ * @param beta - the scale of b.
+ * @param b - the dense operand.
+ * @param out - the dense result (may alias b).
+ * @param name - the operation, for the error.
+ * @throws std::string - invalid dimensions.
+ */
+inline void combineSparseDense(float alpha, const SparseMatrix &a, float beta, const MatrixView &b,
+                               const MatrixView &out, const char* name) {
+  if (a.getWidth() != b.width || a.getHeight() != b.height) {
+    throw(std::string("[") + name + "] ERROR: dimensions are not matching.");
+  }
+  SparseMatrix rows = a.converted(SparseLayout::CSR);
+  for (int i = 0; i < out.height; ++i) {
+    const float* source = b.row(i);
+    float* row = out.row(i);
+    for (int j = 0; j < out.width; ++j) {
+      row[j] = beta * source[j];
+    }
+    for (size_t e = rows.offsets()[i]; e < rows.offsets()[i + 1]; ++e) {
+      row[rows.indices()[e]] += alpha * rows.values()[e];
+    }
+  }
+}
+
+
+/**
+ * Computes out = a * b for a sparse a and a dense b: every nonzero a(i, p)
+ * adds a(i, p) times row p of b to row i of out, O(nonzeros(a) * width(b)).
+ *
+ * @param a - the sparse operand.
+ * @param b - the dense operand.
+ * @param out - the dense result (must not overlap b).
+ * @throws std::string - invalid dimensions.
+ */
+inline void multiplySparseDense(const SparseMatrix &a, const MatrixView &b, const MatrixView &out) {
+  if (a.getWidth() != b.height) {
+    throw(std::string("[Product] ERROR: matrix 1's width does not match matrix 2's height."));
+  }
+  SparseMatrix rows = a.converted(SparseLayout::CSR);
+  ElementwiseKernel scaledAdd = elementwiseKernels().scaledAdd;
+  double work = static_cast<double>(rows.nonzeros()) * b.width;
+  forEachSparseRowBlock(out.height, work, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      float* row = out.row(i);
+      std::fill(row, row + out.width, 0.0f);
+      for (size_t e = rows.offsets()[i]; e < rows.offsets()[i + 1]; ++e) {
+        scaledAdd(row, b.row(rows.indices()[e]), row, out.width, rows.values()[e], false);
+      }
+    }
+  });
+}
+
+
+/**
+ * Computes out = a * b for a dense a and a sparse b: every a(i, p) scatters
+ * row p of b into row i of out, O(width(a) * height(a) + height(a) * nonzeros(b)).
+ *
+ * @param a - the dense operand.
+ * @param b - the sparse operand.
+ * @param out - the dense result (must not overlap a).
+ * @throws std::string - invalid dimensions.
+ */
+inline void multiplyDenseSparse(const MatrixView &a, const SparseMatrix &b, const MatrixView &out) {
+  if (a.width != b.getHeight()) {
+    throw(std::string("[Product] ERROR: matrix 1's width does not match matrix 2's height."));
+  }
+  SparseMatrix rows = b.converted(SparseLayout::CSR);
+  double work = static_cast<double>(a.height) * rows.nonzeros();
+  forEachSparseRowBlock(out.height, work, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      const float* source = a.row(i);
+      float* row = out.row(i);
+      std::fill(row, row + out.width, 0.0f);
+      for (int p = 0; p < a.width; ++p) {
+        if (source[p] == 0.0f) {
+          continue;
+        }
+        for (size_t e = rows.offsets()[p]; e < rows.offsets()[p + 1]; ++e) {
+          row[rows.indices()[e]] += source[p] * rows.values()[e];
+        }
+      }
+    }
+  });
+}
+
+
+/**
+ * Computes a * b for two sparse matrices with Gustavson's row-by-row algorithm:
+ * row i of the result accumulates the rows of b picked by the nonzeros of row
+ * i of a, in a dense scratch row that remembers which columns were touched.
+ * Time and memory scale with the multiply-adds and the nonzeros of the result.
+ *
+ * @param a - the first operand.
+ * @param b - the second operand.
+ * @return SparseMatrix - the product (CSR).
+ * @throws std::string - invalid dimensions.
+ */
+inline SparseMatrix multiplySparse(const SparseMatrix &a, const SparseMatrix &b) {
+  if (a.getWidth() != b.getHeight()) {
+    throw(std::string("[Product] ERROR: matrix 1's width does not match matrix 2's height."));
+  }
+  SparseMatrix left = a.converted(SparseLayout::CSR);
+  SparseMatrix right = b.converted(SparseLayout::CSR);
+  int height = a.getHeight();
+  int width = b.getWidth();
+
+  // Each block of rows is multiplied into its own arrays, which are then joined.
+  struct RowBlock {
+    std::vector<size_t> counts;
+    std::vector<int> indices;
+    std::vector<float> values;
+  };
+  std::vector<RowBlock> blocks(static_cast<size_t>((height + SPARSE_TASK_ROWS - 1) / SPARSE_TASK_ROWS));
+  double work = 0.0;
+  for (int index : left.indices()) {
+    work += static_cast<double>(right.offsets()[index + 1] - right.offsets()[index]);
+  }
+
+  forEachSparseRowBlock(height, work, [&](int first, int last) {
+    static thread_local std::vector<float> accumulator;
+    static thread_local std::vector<int> touched;
+    static thread_local std::vector<char> marked;
+    accumulator.assign(width, 0.0f);
+    marked.assign(width, 0);
+
+    for (int blockFirst = first; blockFirst < last; blockFirst += SPARSE_TASK_ROWS) {
+      RowBlock &block = blocks[blockFirst / SPARSE_TASK_ROWS];
+      int blockLast = std::min(last, blockFirst + SPARSE_TASK_ROWS);
+      for (int i = blockFirst; i < blockLast; ++i) {
+        touched.clear();
+        for (size_t e = left.offsets()[i]; e < left.offsets()[i + 1]; ++e) {
+          int p = left.indices()[e];
+          float value = left.values()[e];
+          for (size_t f = right.offsets()[p]; f < right.offsets()[p + 1]; ++f) {
+            int col = right.indices()[f];
+            if (!marked[col]) {
+              marked[col] = 1;
+              touched.push_back(col);
+            }
+            accumulator[col] += value * right.values()[f];
+          }
+        }
+
+        // Emit the row in column order and reset the scratch for the next one.
+        std::sort(touched.begin(), touched.end());
+        size_t count = 0;
+        for (int col : touched) {
+          if (accumulator[col] != 0.0f) {
+            block.indices.push_back(col);
+            block.values.push_back(accumulator[col]);
+            ++count;
+          }
+          accumulator[col] = 0.0f;
+          marked[col] = 0;
+        }
+        block.counts.push_back(count);
+      }
+    }
+  });
+
+  std::vector<size_t> offsets(static_cast<size_t>(height) + 1, 0);
+  size_t total = 0;
+  for (const RowBlock &block : blocks) {
+    total += block.values.size();
+  }
+  std::vector<int> indices;
+  std::vector<float> values;
+  indices.reserve(total);
+  values.reserve(total);
+  int row = 0;
+  for (const RowBlock &block : blocks) {
+    for (size_t count : block.counts) {
+      offsets[row + 1] = offsets[row] + count;
+      ++row;
+    }
+    indices.insert(indices.end(), block.indices.begin(), block.indices.end());
+    values.insert(values.end(), block.values.begin(), block.values.end());
+  }
+  return SparseMatrix(width, height, SparseLayout::CSR, std::move(offsets), std::move(indices),
+                      std::move(values));
+}
+
+
+/**
+ * Checks whether a file starts with the Matrix Market banner.
+ *
+ * @param path - the file.
+ * @return bool - whether it is a Matrix Market file.
+ */
+inline bool isMatrixMarketFile(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  char banner[sizeof(MATRIX_MARKET_BANNER) - 1] = {};
+  return file.read(banner, sizeof(banner))
+         && std::memcmp(banner, MATRIX_MARKET_BANNER, sizeof(banner)) == 0;
+}
+
+
+/**
+ * Reads one integer of a Matrix Market file.
+ *
+ * @param reader - the file.
+ * @param value - receives the integer.
+ * @throws std::string - missing or malformed.
+ */
+inline void readMatrixMarketLong(MatrixTextReader &reader, long* value) {
+  ReadStatus status = reader.readLong(value);
+  if (status == ReadStatus::END) {
+    throw(std::string("[Input] ERROR: Matrix Market file ends early."));
+  } else if (status == ReadStatus::MALFORMED) {
+    throw(reader.error());
+  }
+}
+
+
+/**
+ * Loads a Matrix Market coordinate file ("%%MatrixMarket matrix coordinate
+ * real|integer|pattern general|symmetric|skew-symmetric"). Entries are 1-based
+ * "row column value" lines; duplicates are summed.
+ *
+ * @param path - the file.
+ * @return SparseMatrix - the matrix (CSR).
+ * @throws std::string - unreadable, unsupported or malformed file.
+ */
+inline SparseMatrix loadMatrixMarket(const std::string &path) {
+  MatrixTextReader reader(path);
+  std::string banner[5];
+  for (std::string &word : banner) {
+    if (reader.readWord(&word) != ReadStatus::OK) {
+      break;
+    }
+  }
+  const std::string &field = banner[3];
+  const std::string &symmetry = banner[4];
+  if (banner[0] != MATRIX_MARKET_BANNER || banner[1] != "matrix" || banner[2] != "coordinate"
+      || (field != "real" && field != "integer" && field != "pattern")
+      || (symmetry != "general" && symmetry != "symmetric" && symmetry != "skew-symmetric")) {
+    throw(std::string("[Input] ERROR: \"" + path + "\" is not a supported Matrix Market coordinate file."));
+  }
+  reader.skipLine();
+
+  // Comment lines start with %; the first other line holds "rows columns entries".
+  std::string word;
+  while (reader.readWord(&word) == ReadStatus::OK && word[0] == '%') {
+    reader.skipLine();
+  }
+  long height = std::atol(word.c_str());
+  long width = 0;
+  long count = 0;
+  readMatrixMarketLong(reader, &width);
+  readMatrixMarketLong(reader, &count);
+  const DimensionPolicy &policy = dimensionPolicy();
+  if (width < policy.minSize || height < policy.minSize || width > policy.maxSize || height > policy.maxSize
+      || count < 0 || count > width * height) {
+    throw(std::string("[Input] ERROR: \"" + path + "\" has an invalid size."));
+  }
+
+  // The count is only a claim until the entries are read, so do not trust it for memory.
+  std::vector<SparseEntry> entries;
+  size_t expected = static_cast<size_t>(count) * (symmetry == "general" ? 1 : 2);
+  entries.reserve(std::min(expected, MATRIX_MARKET_RESERVE_LIMIT));
+  for (long e = 0; e < count; ++e) {
+    long row = 0;
+    long col = 0;
+    float value = 1.0f;
+    readMatrixMarketLong(reader, &row);
+    readMatrixMarketLong(reader, &col);
+    if (field != "pattern") {
+      ReadStatus status = reader.readFloat(&value);
+      if (status != ReadStatus::OK) {
+        throw(status == ReadStatus::END ? std::string("[Input] ERROR: Matrix Market file ends early.")
+                                        : reader.error());
+      }
+    }
+    if (row < 1 || row > height || col < 1 || col > width) {
+      throw(std::string("[Input] ERROR: entry (" + std::to_string(row) + ", " + std::to_string(col)
+                        + ") lies outside the matrix."));
+    }
+    entries.push_back(SparseEntry{static_cast<int>(row - 1), static_cast<int>(col - 1), value});
+    if (symmetry != "general" && row != col) {
+      float mirrored = symmetry == "symmetric" ? value : -value;
+      entries.push_back(SparseEntry{static_cast<int>(col - 1), static_cast<int>(row - 1), mirrored});
+    }
+  }
+  return SparseMatrix::fromEntries(static_cast<int>(width), static_cast<int>(height), entries);
+}
+
+
+/**
+ * Saves a sparse matrix as a Matrix Market coordinate file.
+ *
+ * @param path - the file.
+ * @param matrix - the matrix.
+ * @throws std::string - the file cannot be written.
+ */
+inline void saveMatrixMarket(const std::string &path, const SparseMatrix &matrix) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    throw(std::string("[Batch] ERROR: cannot write \"" + path + "\"."));
+  }
+  SparseMatrix rows = matrix.converted(SparseLayout::CSR);
+  file << MATRIX_MARKET_BANNER << " matrix coordinate real general\n"
+       << rows.getHeight() << " " << rows.getWidth() << " " << rows.nonzeros() << "\n";
+  char text[FORMAT_MAX_CHARS];
+  for (int i = 0; i < rows.getHeight(); ++i) {
+    for (size_t e = rows.offsets()[i]; e < rows.offsets()[i + 1]; ++e) {
+      char* end = formatFloat(text, rows.values()[e], NumberFormat{FloatStyle::SHORTEST, 0});
+      file << i + 1 << " " << rows.indices()[e] + 1 << " ";
+      file.write(text, end - text);
+      file << "\n";
+    }
+  }
+  if (!file) {
+    throw(std::string("[Batch] ERROR: failed writing \"" + path + "\"."));
+  }
+}
+
+#endif  // MATRIX_SPARSE_H_
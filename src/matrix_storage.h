@@ -0,0 +1,271 @@
+/**
+ * matrix_storage.h
+ * Contiguous, aligned storage for matrices.
+ * A matrix lives in one row-major buffer; row i starts at data + i * stride,
+ * where the stride (leading dimension) may be larger than the width.
+ * Buffers come from the pluggable allocator in matrix_allocator.h.
+ * The allowed dimensions are a runtime policy rather than a compile-time cap.
+ * Storage is float by default; BasicMatrixView and allocateElements() hold
+ * the other element types (see matrix_element.h) in the same layout.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_STORAGE_H_
+#define MATRIX_STORAGE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include "matrix_allocator.h"
+#include "matrix_instrumentation.h"
+
+
+// Byte alignment of every matrix buffer and of every padded row.
+const int MATRIX_ALIGNMENT = 64;
+const int MATRIX_ALIGNMENT_FLOATS = MATRIX_ALIGNMENT / static_cast<int>(sizeof(float));
+
+// Default policy limits: no dimension cap beyond what keeps strides in an int.
+const int DEFAULT_MIN_SIZE = 1;
+const int DEFAULT_MAX_SIZE = 1 << 30;
+
+
+/**
+ * Limits on the dimensions of user supplied matrices.
+ * Defaults can be overridden with MATRIX_MAX_SIZE (largest width/height) and
+ * MATRIX_MAX_BYTES (largest single matrix, 0 = only bounded by memory).
+ */
+struct DimensionPolicy {
+  int minSize;
+  int maxSize;
+  size_t maxBytes;
+};
+
+
+/**
+ * Retrieves the mutable, process-wide dimension policy.
+ *
+ * @return DimensionPolicy& - the policy.
+ */
+inline DimensionPolicy &dimensionPolicy() {
+  static DimensionPolicy policy = [] {
+    DimensionPolicy defaults = {DEFAULT_MIN_SIZE, DEFAULT_MAX_SIZE, 0};
+    const char* maxSize = std::getenv("MATRIX_MAX_SIZE");
+    if (maxSize != nullptr && std::atol(maxSize) >= DEFAULT_MIN_SIZE) {
+      defaults.maxSize = static_cast<int>(std::min<long>(std::atol(maxSize), DEFAULT_MAX_SIZE));
+    }
+    const char* maxBytes = std::getenv("MATRIX_MAX_BYTES");
+    if (maxBytes != nullptr) {
+      defaults.maxBytes = std::strtoull(maxBytes, nullptr, 10);
+    }
+    return defaults;
+  }();
+  return policy;
+}
+
+
+/**
+ * Checks dimensions against the dimension policy.
+ *
+ * @param width - the requested width.
+ * @param height - the requested height.
+ * @param error - receives the reason when the dimensions are rejected (may be nullptr).
+ * @param elementSize - the bytes per element, for MATRIX_MAX_BYTES.
+ * @return bool - whether the dimensions are allowed.
+ */
+inline bool checkDimensions(long width, long height, std::string* error,
+                            size_t elementSize = sizeof(float)) {
+  const DimensionPolicy &policy = dimensionPolicy();
+  std::string reason;
+  if (width < policy.minSize || height < policy.minSize) {
+    reason = "Invalid size, min is " + std::to_string(policy.minSize);
+  } else if (width > policy.maxSize || height > policy.maxSize) {
+    reason = "Invalid size, max is " + std::to_string(policy.maxSize);
+  } else if (policy.maxBytes != 0
+             && static_cast<size_t>(width) * height * elementSize > policy.maxBytes) {
+    reason = "Invalid size, a matrix may use at most " + std::to_string(policy.maxBytes) + " bytes";
+  }
+
+  if (error != nullptr) {
+    *error = reason;
+  }
+  return reason.empty();
+}
+
+
+/**
+ * Rounds a row width up so that every row starts on an aligned boundary.
+ *
+ * @param width - the number of columns.
+ * @return int - the padded stride in floats.
+ */
+inline int paddedStride(int width) {
+  return (width + MATRIX_ALIGNMENT_FLOATS - 1) / MATRIX_ALIGNMENT_FLOATS * MATRIX_ALIGNMENT_FLOATS;
+}
+
+
+/**
+ * Rounds a row width up so that every row of T starts on an aligned boundary.
+ *
+ * @param width - the number of columns.
+ * @return int - the padded stride in elements.
+ */
+template <typename T>
+inline int paddedStrideOf(int width) {
+  const int alignment = MATRIX_ALIGNMENT / static_cast<int>(sizeof(T));
+  return (width + alignment - 1) / alignment * alignment;
+}
+
+
+/**
+ * Bookkeeping stored in the aligned slot just in front of every buffer.
+ */
+struct MatrixAllocationHeader {
+  size_t bytes;                 // Total size including this header.
+  MatrixAllocator* allocator;   // Where the block came from (and goes back to).
+};
+
+
+/**
+ * Allocates an aligned buffer for count floats from the current allocator.
+ * The allocator is remembered per buffer, so a buffer may outlive a change of
+ * allocator (e.g. the end of a RequestAllocatorScope).
+ *
+ * @param count - the number of floats.
+ * @return float* - the buffer (release it with freeMatrixData()).
+ * @throws std::bad_alloc - out of memory.
+ */
+inline float* allocateMatrixData(size_t count) {
+  if (count > (SIZE_MAX - 2 * MATRIX_ALIGNMENT) / sizeof(float)) {
+    throw std::bad_alloc();
+  }
+  size_t payload = (count * sizeof(float) + MATRIX_ALIGNMENT - 1) / MATRIX_ALIGNMENT * MATRIX_ALIGNMENT;
+  size_t bytes = payload + MATRIX_ALIGNMENT;
+
+  MatrixAllocator* allocator = currentMatrixAllocator();
+  void* block = allocator->allocate(bytes);
+  profileAllocation(bytes);
+
+  MatrixAllocationHeader* header = static_cast<MatrixAllocationHeader*>(block);
+  header->bytes = bytes;
+  header->allocator = allocator;
+  return reinterpret_cast<float*>(static_cast<char*>(block) + MATRIX_ALIGNMENT);
+}
+
+
+/**
+ * Frees a buffer from allocateMatrixData().
+ *
+ * @param data - the buffer (may be nullptr).
+ */
+inline void freeMatrixData(float* data) {
+  if (data == nullptr) {
+    return;
+  }
+
+  char* block = reinterpret_cast<char*>(data) - MATRIX_ALIGNMENT;
+  MatrixAllocationHeader* header = reinterpret_cast<MatrixAllocationHeader*>(block);
+  header->allocator->deallocate(block, header->bytes);
+}
+
+
+/**
+ * Allocates an aligned buffer for count elements of another type.
+ *
+ * @param count - the number of elements.
+ * @return T* - the buffer (release it with freeElements()).
+ * @throws std::bad_alloc - out of memory.
+ */
+template <typename T>
+inline T* allocateElements(size_t count) {
+  if (count > SIZE_MAX / sizeof(T) - sizeof(float)) {
+    throw std::bad_alloc();
+  }
+  return reinterpret_cast<T*>(allocateMatrixData((count * sizeof(T) + sizeof(float) - 1) / sizeof(float)));
+}
+
+
+/**
+ * Frees a buffer from allocateElements().
+ *
+ * @param data - the buffer (may be nullptr).
+ */
+template <typename T>
+inline void freeElements(T* data) {
+  freeMatrixData(reinterpret_cast<float*>(data));
+}
+
+
+/**
+ * Hands a block that did not come from allocateMatrixData() to the matrix
+ * storage, e.g. a mapped file. The first MATRIX_ALIGNMENT bytes of the block
+ * become the allocation header and the elements start right after them.
+ *
+ * @param block - the block (its first MATRIX_ALIGNMENT bytes may be overwritten).
+ * @param bytes - the size of the block.
+ * @param allocator - what frees the block when freeMatrixData() is called.
+ * @return float* - the elements.
+ */
+inline float* adoptMatrixData(void* block, size_t bytes, MatrixAllocator* allocator) {
+  MatrixAllocationHeader* header = static_cast<MatrixAllocationHeader*>(block);
+  header->bytes = bytes;
+  header->allocator = allocator;
+  return reinterpret_cast<float*>(static_cast<char*>(block) + MATRIX_ALIGNMENT);
+}
+
+
+/**
+ * Non-owning window onto strided matrix storage.
+ * Views of a block share the parent's stride, so they can be handed to the
+ * kernels without copying.
+ */
+template <typename T>
+struct BasicMatrixView {
+  T* data;
+  int width;
+  int height;
+  int stride;
+
+  /**
+   * Retrieves a row.
+   *
+   * @param i - the row index.
+   * @return T* - the first element of the row.
+   */
+  T* row(int i) const {
+    return data + static_cast<size_t>(i) * stride;
+  }
+
+  /**
+   * Retrieves an element.
+   *
+   * @param i - the row index.
+   * @param j - the column index.
+   * @return T& - the element.
+   */
+  T &at(int i, int j) const {
+    return data[static_cast<size_t>(i) * stride + j];
+  }
+
+  /**
+   * Creates a view of a rectangular block of this view.
+   *
+   * @param rowOffset - the first row of the block.
+   * @param colOffset - the first column of the block.
+   * @param blockWidth - the width of the block.
+   * @param blockHeight - the height of the block.
+   * @return BasicMatrixView - the block.
+   */
+  BasicMatrixView block(int rowOffset, int colOffset, int blockWidth, int blockHeight) const {
+    return BasicMatrixView{row(rowOffset) + colOffset, blockWidth, blockHeight, stride};
+  }
+};
+
+// The float storage every calculator uses.
+using MatrixView = BasicMatrixView<float>;
+
+#endif  // MATRIX_STORAGE_H_
@@ -0,0 +1,185 @@
+/**
+ * matrix_transpose.h
+ * Cache-oblivious matrix transpose shared by the calculators.
+ * The matrix is halved along its longer side until the pieces fit in L1, so
+ * both the reads and the strided writes stay in cache at every level of the
+ * hierarchy without tuning for a particular cache size. Large matrices are
+ * cut into strips that are transposed on the thread pool.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef MATRIX_TRANSPOSE_H_
+#define MATRIX_TRANSPOSE_H_
+
+#include <algorithm>
+#include <cstddef>
+
+#include "matrix_simd.h"
+#include "matrix_storage.h"
+#include "thread_pool.h"
+
+
+// Pieces at most this wide and high are transposed directly (2 x 4 KiB, well within L1).
+const int TRANSPOSE_BLOCK = 32;
+
+// Transposes with fewer elements than this are not worth waking the pool for.
+const size_t TRANSPOSE_PARALLEL_THRESHOLD = size_t(256) * 256;
+
+
+/**
+ * Portable kernel: transposes a piece element by element.
+ *
+ * @param in - the piece.
+ * @param out - the destination (in.height wide, in.width high).
+ */
+inline void transposeTileGeneric(const MatrixView &in, const MatrixView &out) {
+  for (int i = 0; i < in.height; ++i) {
+    const float* row = in.row(i);
+    for (int j = 0; j < in.width; ++j) {
+      out.row(j)[i] = row[j];
+    }
+  }
+}
+
+
+#ifdef MATRIX_SIMD_X86
+/**
+ * AVX kernel: transposes a piece 8 x 8 at a time in registers; the ragged
+ * edges fall back to the element loop.
+ *
+ * @param in - the piece.
+ * @param out - the destination (in.height wide, in.width high).
+ */
+__attribute__((target("avx")))
+inline void transposeTileAvx(const MatrixView &in, const MatrixView &out) {
+  int rows = in.height / 8 * 8;
+  int cols = in.width / 8 * 8;
+  for (int i = 0; i < rows; i += 8) {
+    for (int j = 0; j < cols; j += 8) {
+      __m256 r0 = _mm256_loadu_ps(in.row(i + 0) + j);
+      __m256 r1 = _mm256_loadu_ps(in.row(i + 1) + j);
+      __m256 r2 = _mm256_loadu_ps(in.row(i + 2) + j);
+      __m256 r3 = _mm256_loadu_ps(in.row(i + 3) + j);
+      __m256 r4 = _mm256_loadu_ps(in.row(i + 4) + j);
+      __m256 r5 = _mm256_loadu_ps(in.row(i + 5) + j);
+      __m256 r6 = _mm256_loadu_ps(in.row(i + 6) + j);
+      __m256 r7 = _mm256_loadu_ps(in.row(i + 7) + j);
+
+      // Interleave pairs of rows, then pairs of pairs, then swap 128-bit halves.
+      __m256 t0 = _mm256_unpacklo_ps(r0, r1);
+      __m256 t1 = _mm256_unpackhi_ps(r0, r1);
+      __m256 t2 = _mm256_unpacklo_ps(r2, r3);
+      __m256 t3 = _mm256_unpackhi_ps(r2, r3);
+      __m256 t4 = _mm256_unpacklo_ps(r4, r5);
+      __m256 t5 = _mm256_unpackhi_ps(r4, r5);
+      __m256 t6 = _mm256_unpacklo_ps(r6, r7);
+      __m256 t7 = _mm256_unpackhi_ps(r6, r7);
+      __m256 s0 = _mm256_shuffle_ps(t0, t2, 0x44);
+      __m256 s1 = _mm256_shuffle_ps(t0, t2, 0xEE);
+      __m256 s2 = _mm256_shuffle_ps(t1, t3, 0x44);
+      __m256 s3 = _mm256_shuffle_ps(t1, t3, 0xEE);
+      __m256 s4 = _mm256_shuffle_ps(t4, t6, 0x44);
+      __m256 s5 = _mm256_shuffle_ps(t4, t6, 0xEE);
+      __m256 s6 = _mm256_shuffle_ps(t5, t7, 0x44);
+      __m256 s7 = _mm256_shuffle_ps(t5, t7, 0xEE);
+      _mm256_storeu_ps(out.row(j + 0) + i, _mm256_permute2f128_ps(s0, s4, 0x20));
+      _mm256_storeu_ps(out.row(j + 1) + i, _mm256_permute2f128_ps(s1, s5, 0x20));
+      _mm256_storeu_ps(out.row(j + 2) + i, _mm256_permute2f128_ps(s2, s6, 0x20));
+      _mm256_storeu_ps(out.row(j + 3) + i, _mm256_permute2f128_ps(s3, s7, 0x20));
+      _mm256_storeu_ps(out.row(j + 4) + i, _mm256_permute2f128_ps(s0, s4, 0x31));
+      _mm256_storeu_ps(out.row(j + 5) + i, _mm256_permute2f128_ps(s1, s5, 0x31));
+      _mm256_storeu_ps(out.row(j + 6) + i, _mm256_permute2f128_ps(s2, s6, 0x31));
+      _mm256_storeu_ps(out.row(j + 7) + i, _mm256_permute2f128_ps(s3, s7, 0x31));
+    }
+  }
+  if (cols < in.width) {
+    transposeTileGeneric(in.block(0, cols, in.width - cols, rows), out.block(cols, 0, rows, in.width - cols));
+  }
+  if (rows < in.height) {
+    transposeTileGeneric(in.block(rows, 0, in.width, in.height - rows),
+                         out.block(0, rows, in.height - rows, in.width));
+  }
+}
+#endif
+
+
+/**
+ * Picks the fastest tile kernel the running CPU supports (see simdLevel()).
+ *
+ * @return function pointer - the kernel.
+ */
+inline void (*selectTransposeKernel())(const MatrixView &, const MatrixView &) {
+  static void (*kernel)(const MatrixView &, const MatrixView &) = [] {
+#ifdef MATRIX_SIMD_X86
+    if (simdLevel() >= SimdLevel::AVX2) {
+      return &transposeTileAvx;
+    }
+#endif
+    return &transposeTileGeneric;
+  }();
+  return kernel;
+}
+
+
+/**
+ * Cache-oblivious step: halves the longer side until the piece fits a tile.
+ *
+ * @param in - the piece.
+ * @param out - the destination (in.height wide, in.width high).
+ * @param kernel - the tile kernel.
+ */
+inline void transposeRecursive(const MatrixView &in, const MatrixView &out,
+                               void (*kernel)(const MatrixView &, const MatrixView &)) {
+  if (in.width <= TRANSPOSE_BLOCK && in.height <= TRANSPOSE_BLOCK) {
+    kernel(in, out);
+  } else if (in.height >= in.width) {
+    // Split on a multiple of the tile so every leaf but the last is a full tile.
+    int half = (in.height / 2 + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK * TRANSPOSE_BLOCK;
+    transposeRecursive(in.block(0, 0, in.width, half), out.block(0, 0, half, in.width), kernel);
+    transposeRecursive(in.block(half, 0, in.width, in.height - half),
+                       out.block(0, half, in.height - half, in.width), kernel);
+  } else {
+    int half = (in.width / 2 + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK * TRANSPOSE_BLOCK;
+    transposeRecursive(in.block(0, 0, half, in.height), out.block(0, 0, in.height, half), kernel);
+    transposeRecursive(in.block(0, half, in.width - half, in.height),
+                       out.block(half, 0, in.height, in.width - half), kernel);
+  }
+}
+
+
+/**
+ * Computes out = in^T.
+ *
+ * @param in - the matrix.
+ * @param out - the result (in.height wide, in.width high; must not overlap in).
+ */
+inline void transposeMatrix(const MatrixView &in, const MatrixView &out) {
+  size_t total = static_cast<size_t>(in.width) * in.height;
+  void (*kernel)(const MatrixView &, const MatrixView &) = selectTransposeKernel();
+
+  int threads = getThreadCount();
+  if (threads == 1 || total < TRANSPOSE_PARALLEL_THRESHOLD) {
+    transposeRecursive(in, out, kernel);
+    return;
+  }
+
+  // Strips of whole tiles along the longer side; each one owns its own rows or
+  // columns of out, so the tasks never write the same cache line.
+  bool byRows = in.height >= in.width;
+  int length = byRows ? in.height : in.width;
+  int strip = (length / (4 * threads) + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK * TRANSPOSE_BLOCK;
+  strip = std::max(strip, TRANSPOSE_BLOCK);
+  size_t strips = static_cast<size_t>((length + strip - 1) / strip);
+  defaultThreadPool().parallelFor(strips, [&](size_t index) {
+    int start = static_cast<int>(index) * strip;
+    int size = std::min(strip, length - start);
+    if (byRows) {
+      transposeRecursive(in.block(start, 0, in.width, size), out.block(0, start, size, in.width), kernel);
+    } else {
+      transposeRecursive(in.block(0, start, size, in.height), out.block(start, 0, in.height, size), kernel);
+    }
+  });
+}
+
+#endif  // MATRIX_TRANSPOSE_H_
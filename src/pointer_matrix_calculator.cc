@@ -1,41 +1,348 @@
 /**
  * pointer_matrix_calculator.cc
  * Basic calculator for matrices which use pointers and malloc for declaration.
- * Possible operations are addition, subtraction, and multiplication.
+ * Possible operations are addition, subtraction, multiplication and transposition.
  *
  * Copyright (c) 2024, Thomas Truong.
  */
 
+#include <cstdint>
+#include <cstring>
 #include <iostream>
-
-
-const int MIN_SIZE = 1;
-const int MAX_SIZE = 100;
-
-
-void getDimensions(int matrixNumber, int dimensions[2]);
+#include <new>
+#include <string>
+#include <unordered_map>
+
+#include "matrix_allocator.h"
+#include "matrix_batch.h"
+#include "matrix_benchmark.h"
+#include "matrix_cache.h"
+#include "matrix_format.h"
+#include "matrix_gemm.h"
+#include "matrix_incremental.h"
+#include "matrix_instrumentation.h"
+#include "matrix_out_of_core.h"
+#include "matrix_parser.h"
+#include "matrix_simd.h"
+#include "matrix_storage.h"
+#include "matrix_transpose.h"
+
+
+float** getDimensions(int matrixNumber, int dimensions[2]);
 float** createMatrix(const int dimensions[2]);
+float** adoptMatrix(float* data, const int dimensions[2]);
+MatrixView viewMatrix(float** matrix, const int dimensions[2]);
 void deleteMatrix(float** matrix, int height);
 void getMatrixValues(const int matrixNumber, float** matrix, const int dimensions[2]);
+void updateMatrixValues(const int matrixNumber, float** matrix1, const int dimensions1[2], uint64_t* hash1,
+                        float** matrix2, const int dimensions2[2], uint64_t* hash2);
 void printMatrix(const int matrixNumber, float** matrix, const int dimensions[2]);
 void printMatrix(float** matrix, const int dimensions[2]);
+bool printCachedResult(const char* title, const ResultKey &key);
 void printMenu();
 float** getSum(float** matrix1, float** matrix2, const int dimensions1[2], const int dimensions2[2]);
 float** getDifference(float** matrix1, float** matrix2, const int dimensions1[2],
                     const int dimensions2[2]);
 float** getProduct(float** matrix1, float** matrix2, const int dimensions1[2], const int dimensions2[2]);
+float** getProduct(float** matrix1, float** matrix2, const int dimensions1[2], const int dimensions2[2],
+                   Transpose transpose1, Transpose transpose2);
+float** getTranspose(float** matrix, const int dimensions[2]);
+void getOperandDimensions(const int dimensions[2], Transpose transpose, int operand[2]);
+
+
+/**
+ * Named matrices for batch mode (see matrix_batch.h).
+ */
+class BatchWorkspace {
+ public:
+  BatchWorkspace() = default;
+  BatchWorkspace(const BatchWorkspace &) = delete;
+  BatchWorkspace &operator=(const BatchWorkspace &) = delete;
+
+
+  /**
+   * Destructor; frees every stored matrix.
+   */
+  ~BatchWorkspace() {
+    for (auto &entry : _matrices) {
+      deleteMatrix(entry.second.data, entry.second.dimensions[1]);
+    }
+  }
+
+
+  /**
+   * Stores a matrix whose storage was loaded elsewhere (e.g. a mapped file).
+   *
+   * @param name - the name.
+   * @param storage - the storage (stride paddedStride(width)), which the workspace now owns.
+   */
+  void adopt(const std::string &name, const MatrixView &storage) {
+    int dimensions[2] = {storage.width, storage.height};
+    store(name, adoptMatrix(storage.data, dimensions), dimensions);
+  }
+
+
+  /**
+   * Stores lhs + rhs under target.
+   *
+   * @param target - the result name.
+   * @param lhs - the left operand.
+   * @param rhs - the right operand.
+   * @throws std::string - unknown operand or invalid dimensions.
+   */
+  void add(const std::string &target, const std::string &lhs, const std::string &rhs) {
+    StoredMatrix &matrix1 = find(lhs);
+    StoredMatrix &matrix2 = find(rhs);
+    float** sum = getSum(matrix1.data, matrix2.data, matrix1.dimensions, matrix2.dimensions);
+    if (sum == nullptr) {
+      throw(std::string("[Sum] ERROR: dimensions are not matching."));
+    }
+    store(target, sum, matrix1.dimensions);
+  }
+
+
+  /**
+   * Stores lhs - rhs under target.
+   *
+   * @param target - the result name.
+   * @param lhs - the left operand.
+   * @param rhs - the right operand.
+   * @throws std::string - unknown operand or invalid dimensions.
+   */
+  void subtract(const std::string &target, const std::string &lhs, const std::string &rhs) {
+    StoredMatrix &matrix1 = find(lhs);
+    StoredMatrix &matrix2 = find(rhs);
+    float** difference = getDifference(matrix1.data, matrix2.data, matrix1.dimensions,
+                                       matrix2.dimensions);
+    if (difference == nullptr) {
+      throw(std::string("[Difference] ERROR: dimensions are not matching."));
+    }
+    store(target, difference, matrix1.dimensions);
+  }
+
+
+  /**
+   * Stores op(lhs) * op(rhs) under target.
+   *
+   * @param target - the result name.
+   * @param lhs - the left operand.
+   * @param rhs - the right operand.
+   * @param transposeLhs - whether lhs is used transposed.
+   * @param transposeRhs - whether rhs is used transposed.
+   * @throws std::string - unknown operand or invalid dimensions.
+   */
+  void multiply(const std::string &target, const std::string &lhs, const std::string &rhs,
+                Transpose transposeLhs, Transpose transposeRhs) {
+    StoredMatrix &matrix1 = find(lhs);
+    StoredMatrix &matrix2 = find(rhs);
+    float** product = getProduct(matrix1.data, matrix2.data, matrix1.dimensions, matrix2.dimensions,
+                                 transposeLhs, transposeRhs);
+    if (product == nullptr) {
+      throw(std::string("[Product] ERROR: matrix 1's width does not match matrix 2's height."));
+    }
+    int operand1[2] = {0, 0};
+    int operand2[2] = {0, 0};
+    getOperandDimensions(matrix1.dimensions, transposeLhs, operand1);
+    getOperandDimensions(matrix2.dimensions, transposeRhs, operand2);
+    int dimensions[2] = {operand2[0], operand1[1]};
+    store(target, product, dimensions);
+  }
+
+
+  /**
+   * Stores source^T under target.
+   *
+   * @param target - the result name.
+   * @param source - the operand.
+   * @throws std::string - unknown operand.
+   */
+  void transpose(const std::string &target, const std::string &source) {
+    StoredMatrix &matrix = find(source);
+    int dimensions[2] = {matrix.dimensions[1], matrix.dimensions[0]};
+    store(target, getTranspose(matrix.data, matrix.dimensions), dimensions);
+  }
+
+
+  /**
+   * Retrieves a view of a stored matrix.
+   *
+   * @param name - the name.
+   * @return MatrixView - the view.
+   * @throws std::string - unknown name.
+   */
+  MatrixView view(const std::string &name) {
+    StoredMatrix &matrix = find(name);
+    return viewMatrix(matrix.data, matrix.dimensions);
+  }
+
+
+  /**
+   * Checks whether a matrix is stored under a name.
+   *
+   * @param name - the name.
+   * @return bool - whether it is.
+   */
+  bool contains(const std::string &name) const {
+    return _matrices.count(name) > 0;
+  }
+
+
+  /**
+   * Releases a stored matrix.
+   *
+   * @param name - the name.
+   * @throws std::string - unknown name.
+   */
+  void release(const std::string &name) {
+    StoredMatrix &matrix = find(name);
+    deleteMatrix(matrix.data, matrix.dimensions[1]);
+    _matrices.erase(name);
+  }
+
+
+ private:
+  struct StoredMatrix {
+    float** data;
+    int dimensions[2];
+  };
+
+  std::unordered_map<std::string, StoredMatrix> _matrices;
 
 
-int main(void) {
+  /**
+   * Looks up a stored matrix.
+   *
+   * @param name - the name.
+   * @return StoredMatrix& - the matrix.
+   * @throws std::string - unknown name.
+   */
+  StoredMatrix &find(const std::string &name) {
+    auto found = _matrices.find(name);
+    if (found == _matrices.end()) {
+      throw(std::string("[Batch] ERROR: no matrix named \"" + name + "\"."));
+    }
+    return found->second;
+  }
+
+
+  /**
+   * Stores a matrix, freeing any previous matrix of that name.
+   *
+   * @param name - the name.
+   * @param matrix - the matrix (now owned by the workspace).
+   * @param dimensions - its dimensions.
+   */
+  void store(const std::string &name, float** matrix, const int dimensions[2]) {
+    auto found = _matrices.find(name);
+    if (found != _matrices.end()) {
+      deleteMatrix(found->second.data, found->second.dimensions[1]);
+    }
+    _matrices[name] = StoredMatrix{matrix, {dimensions[0], dimensions[1]}};
+  }
+};
+
+
+/**
+ * Benchmark subject (see matrix_benchmark.h): operands and results are
+ * pointer-to-pointer matrices from createMatrix() and the get* functions.
+ */
+class BenchmarkSubject {
+ public:
+  /**
+   * Creates and fills the operands of a case.
+   *
+   * @param operation - the operation.
+   * @param shape - the shape.
+   */
+  void setUp(BenchmarkOperation operation, const BenchmarkShape &shape) {
+    _operation = operation;
+    bool product = operation == BenchmarkOperation::MULTIPLY;
+    _dimensions1[0] = product ? shape.k : shape.n;
+    _dimensions1[1] = shape.m;
+    _dimensions2[0] = shape.n;
+    _dimensions2[1] = product ? shape.k : shape.m;
+    _matrix1 = createMatrix(_dimensions1);
+    _matrix2 = createMatrix(_dimensions2);
+    fillBenchmarkMatrix(viewMatrix(_matrix1, _dimensions1), 1);
+    fillBenchmarkMatrix(viewMatrix(_matrix2, _dimensions2), 2);
+  }
+
+
+  /**
+   * Carries out the operation once, like the menu does.
+   *
+   * @return float - the first element of the result.
+   */
+  float run() {
+    RequestAllocatorScope requestScope;
+    float** result = nullptr;
+    if (_operation == BenchmarkOperation::ADD) {
+      result = getSum(_matrix1, _matrix2, _dimensions1, _dimensions2);
+    } else if (_operation == BenchmarkOperation::SUBTRACT) {
+      result = getDifference(_matrix1, _matrix2, _dimensions1, _dimensions2);
+    } else {
+      result = getProduct(_matrix1, _matrix2, _dimensions1, _dimensions2);
+    }
+    float first = result[0][0];
+    deleteMatrix(result, _dimensions1[1]);
+    return first;
+  }
+
+
+  /**
+   * Frees the operands.
+   */
+  void tearDown() {
+    deleteMatrix(_matrix1, _dimensions1[1]);
+    deleteMatrix(_matrix2, _dimensions2[1]);
+  }
+
+
+ private:
+  BenchmarkOperation _operation = BenchmarkOperation::ADD;
+  float** _matrix1 = nullptr;
+  float** _matrix2 = nullptr;
+  int _dimensions1[2] = {0, 0};
+  int _dimensions2[2] = {0, 0};
+};
+
+
+int main(int argc, char* argv[]) {
+  // Convert a matrix file between the text and binary formats.
+  if (argc == 4 && std::strcmp(argv[1], "--convert") == 0) {
+    return convertMatrixFile(argv[2], argv[3]);
+  }
+
+  // Multiply binary matrix files too large for memory, a tile at a time.
+  if (argc == 5 && std::strcmp(argv[1], "--multiply") == 0) {
+    return multiplyMatrixFiles(argv[2], argv[3], argv[4]);
+  }
+
+  // Benchmark add, subtract and multiply; optionally save the results as JSON.
+  if ((argc == 2 || argc == 3) && std::strcmp(argv[1], "--benchmark") == 0) {
+    BenchmarkSubject subject;
+    return runBenchmarks("pointer", subject, argc == 3 ? argv[2] : nullptr);
+  }
+
+  // Batch mode: run a job file (or standard input with "-") without prompts.
+  if (argc == 3 && std::strcmp(argv[1], "--batch") == 0) {
+    int status = EXIT_SUCCESS;
+    {
+      BatchWorkspace workspace;
+      status = runBatchFile(argv[2], workspace, outputFormat(GENERAL_FORMAT));
+    }
+    reportAllocatorStats(std::cerr);
+    reportResultCacheStats(std::cerr);
+    return status;
+  }
+
   std::cout << "[ Pointer Matrix Calculator ]" << std::endl;
 
   // Get dimensions and allocate matrix.
   int dimensions1[2] = {0, 0};
   int dimensions2[2] = {0, 0};
-  getDimensions(1, dimensions1);
-  getDimensions(2, dimensions2);
-  float** matrix1 = createMatrix(dimensions1);
-  float** matrix2 = createMatrix(dimensions2);
+  float** matrix1 = getDimensions(1, dimensions1);
+  float** matrix2 = getDimensions(2, dimensions2);
 
   // Get values for matrix 1.
   std::cout << std::endl;
@@ -47,6 +354,10 @@ int main(void) {
   getMatrixValues(2, matrix2, dimensions2);
   printMatrix(2, matrix2, dimensions2);
 
+  // Content hashes key the cached results until a matrix changes.
+  uint64_t hash1 = hashMatrix(viewMatrix(matrix1, dimensions1));
+  uint64_t hash2 = hashMatrix(viewMatrix(matrix2, dimensions2));
+
   bool exit = false;
   int choice = 0;
   do {
@@ -54,40 +365,65 @@ int main(void) {
     std::cout << std::endl;
     printMenu();
     std::cout << "Input: ";
-    std::cin >> choice;
+    choice = readMenuChoice(10);
 
     // Process choice.
     std::cout << std::endl;
     switch (choice) {
       case 1: {  // Print sum.
+        // Results only live for this request; recycle their buffers.
+        RequestAllocatorScope requestScope;
+        ResultKey key = resultKey(CachedOperation::SUM, viewMatrix(matrix1, dimensions1), hash1,
+                                  viewMatrix(matrix2, dimensions2), hash2);
+        if (printCachedResult("Sum", key)) {
+          break;
+        }
         float** sum = getSum(matrix1, matrix2, dimensions1, dimensions2);
 
         if (sum != nullptr) {
-          std::cout << "[[[ Sum ]]]" << std::endl;
+          resultCache().insert(key, viewMatrix(sum, dimensions1));
+          std::cout << "[[[ Sum ]]]\n";
           printMatrix(sum, dimensions1);
+          deleteMatrix(sum, dimensions1[1]);
         } else {  // Invalid dimensions.
           std::cout << "[Sum] ERROR: dimensions are not matching." << std::endl;
         }
         break;
       }
       case 2: {  // Print difference.
+        RequestAllocatorScope requestScope;
+        ResultKey key = resultKey(CachedOperation::DIFFERENCE, viewMatrix(matrix1, dimensions1), hash1,
+                                  viewMatrix(matrix2, dimensions2), hash2);
+        if (printCachedResult("Difference", key)) {
+          break;
+        }
         float** difference = getDifference(matrix1, matrix2, dimensions1, dimensions2);
 
         if (difference != nullptr) {
-          std::cout << "[[[ Difference ]]]" << std::endl;
+          resultCache().insert(key, viewMatrix(difference, dimensions1));
+          std::cout << "[[[ Difference ]]]\n";
           printMatrix(difference, dimensions1);
+          deleteMatrix(difference, dimensions1[1]);
         } else {  // Invalid dimensions.
           std::cout << "[Difference] ERROR: dimensions are not matching." << std::endl;
         }
         break;
       }
       case 3: {  // Print product.
+        RequestAllocatorScope requestScope;
+        ResultKey key = resultKey(CachedOperation::PRODUCT, viewMatrix(matrix1, dimensions1), hash1,
+                                  viewMatrix(matrix2, dimensions2), hash2);
+        if (printCachedResult("Product", key)) {
+          break;
+        }
         float** product = getProduct(matrix1, matrix2, dimensions1, dimensions2);
 
         if (product != nullptr) {
-          std::cout << "[[[ Product ]]]" << std::endl;
-          int dimensions[2] = {dimensions1[1], dimensions2[0]};
+          int dimensions[2] = {dimensions2[0], dimensions1[1]};
+          resultCache().insert(key, viewMatrix(product, dimensions));
+          std::cout << "[[[ Product ]]]\n";
           printMatrix(product, dimensions);
+          deleteMatrix(product, dimensions[1]);
         } else {  // Invalid dimensions.
           std::cout << "[Product] ERROR: matrix 1's width does not match matrix 2's height."
                     << std::endl;
@@ -103,18 +439,34 @@ int main(void) {
         break;
       }
       case 6: {  // Re-input matrix 1.
-        getDimensions(1, dimensions1);
+        resultCache().invalidate(hash1);
+        deleteMatrix(matrix1, dimensions1[1]);
+        matrix1 = getDimensions(1, dimensions1);
         getMatrixValues(1, matrix1, dimensions1);
+        hash1 = hashMatrix(viewMatrix(matrix1, dimensions1));
         printMatrix(1, matrix1, dimensions1);
         break;
       }
       case 7: {  // Re-input matrix 2.
-        getDimensions(2, dimensions2);
+        resultCache().invalidate(hash2);
+        deleteMatrix(matrix2, dimensions2[1]);
+        matrix2 = getDimensions(2, dimensions2);
         getMatrixValues(2, matrix2, dimensions2);
+        hash2 = hashMatrix(viewMatrix(matrix2, dimensions2));
+        printMatrix(2, matrix2, dimensions2);
+        break;
+      }
+      case 8: {  // Update matrix 1.
+        updateMatrixValues(1, matrix1, dimensions1, &hash1, matrix2, dimensions2, &hash2);
+        printMatrix(1, matrix1, dimensions1);
+        break;
+      }
+      case 9: {  // Update matrix 2.
+        updateMatrixValues(2, matrix1, dimensions1, &hash1, matrix2, dimensions2, &hash2);
         printMatrix(2, matrix2, dimensions2);
         break;
       }
-      case 8: {  // Exit program.
+      case 10: {  // Exit program.
         exit = true;
         break;
       }
@@ -125,6 +477,8 @@ int main(void) {
   deleteMatrix(matrix1, dimensions1[1]);
   deleteMatrix(matrix2, dimensions2[1]);
   std::cout << "Goodbye!" << std::endl;
+  reportAllocatorStats(std::cerr);
+  reportResultCacheStats(std::cerr);
 
   return 0;
 }
@@ -137,59 +491,101 @@ int main(void) {
  * @param height - the height of the matrix.
  */
 void deleteMatrix(float** matrix, int height) {
-  // For each row, delete array.
-  for (int i = 0; i < height; ++i) {
-    delete[] matrix[i];
+  // Rows share one block that starts at the first row.
+  if (height > 0) {
+    freeMatrixData(matrix[0]);
   }
   delete[] matrix;
 }
 
 
 /**
- * Asks user to input the dimensions of the matrices.
+ * Asks user to input the dimensions of the matrices and allocates the matrix.
  * 
  * @param matrixNumber - the ID number of the matrix.
  * @param dimensions - the array that will contain the user's inputs.
+ * @return float** - the matrix (free it with deleteMatrix()).
  */
-void getDimensions(int matrixNumber, int dimensions[2]) {
+float** getDimensions(int matrixNumber, int dimensions[2]) {
   std::cout << "Enter the dimensions for matrix " << matrixNumber
             << " (width x height)." << std::endl;
-  bool valid = false;
-
-  // Get input and repeat if invalid (invalid = MIN_SIZE < x > MAX_SIZE).
-  do {
+  // Get input and repeat if rejected by the dimension policy or too large for memory.
+  while (true) {
+    long width = 0;
+    long height = 0;
     std::cout << "Dimensions <x y>: ";
-    std::cin >> dimensions[0];
-    std::cin >> dimensions[1];
+    if (!readDimensions(&width, &height)) {
+      continue;
+    }
 
     // Validate input.
-    if (dimensions[0] < MIN_SIZE || dimensions[1] < MIN_SIZE) {
-      std::cout << "Invalid size, min is " << MIN_SIZE << std::endl;
-    } else if (dimensions[0] > MAX_SIZE || dimensions[1] > MAX_SIZE) {
-      std::cout << "Invalid size, max is " << MAX_SIZE << std::endl;
-    } else {
-      valid = true;
+    std::string error;
+    if (!checkDimensions(width, height, &error)) {
+      std::cout << error << std::endl;
+      continue;
+    }
+    dimensions[0] = static_cast<int>(width);
+    dimensions[1] = static_cast<int>(height);
+    try {
+      return createMatrix(dimensions);
+    } catch (const std::bad_alloc &) {
+      std::cout << "Invalid size, not enough memory" << std::endl;
     }
-  } while (!valid);
+  }
 }
 
 
 /**
  * Allocates the matrix.
+ * The elements live in one aligned block with padded rows (stride of
+ * paddedStride(width)); the row pointers point into that block.
  * 
  * @param dimensions - the matrix's dimensions.
  */
 float** createMatrix(const int dimensions[2]) {
+  int stride = paddedStride(dimensions[0]);
+  float* data = allocateMatrixData(static_cast<size_t>(stride) * dimensions[1]);
+  try {
+    return adoptMatrix(data, dimensions);
+  } catch (const std::bad_alloc &) {
+    freeMatrixData(data);
+    throw;
+  }
+}
+
+
+/**
+ * Builds the row pointers for a block from allocateMatrixData() or
+ * loadMatrixBinary(), with rows paddedStride(width) apart.
+ * 
+ * @param data - the block; the matrix now owns it.
+ * @param dimensions - the dimensions of the matrix.
+ * @return float** - the matrix (free it with deleteMatrix()).
+ */
+float** adoptMatrix(float* data, const int dimensions[2]) {
+  int stride = paddedStride(dimensions[0]);
   float** matrix = new float*[dimensions[1]];
-  // Create array inside of array.
+  // Point each row into the block.
   for (int i = 0; i < dimensions[1]; ++i) {
-    matrix[i] = new float[dimensions[0]];
+    matrix[i] = data + static_cast<size_t>(i) * stride;
   }
 
   return matrix;
 }
 
 
+/**
+ * Retrieves the contiguous block behind a matrix from createMatrix().
+ * 
+ * @param matrix - the matrix.
+ * @param dimensions - the matrix's dimensions.
+ * @return MatrixView - the view of the matrix's block.
+ */
+MatrixView viewMatrix(float** matrix, const int dimensions[2]) {
+  return MatrixView{matrix[0], dimensions[0], dimensions[1], paddedStride(dimensions[0])};
+}
+
+
 /**
  * Asks user to input values for the matrix.
  * 
@@ -199,15 +595,48 @@ float** createMatrix(const int dimensions[2]) {
  */
 void getMatrixValues(const int matrixNumber, float** matrix, const int dimensions[2]) {
   std::cout << "===== Matrix " << matrixNumber << " =====" << std::endl;
-  std::cout << "Enter " << dimensions[0] * dimensions[1] << " value(s) individually or seperated by space."
-            << std::endl;
+  std::cout << "Enter " << static_cast<long>(dimensions[0]) * dimensions[1]
+            << " value(s) individually or seperated by space." << std::endl;
 
   // Take user input for each valid slot.
-  for (int i = 0; i < dimensions[1]; ++i) {
-    for (int j = 0; j < dimensions[0]; ++j) {
-      std::cin >> matrix[i][j];
-    }
+  if (!readMatrixValues(standardInput(), viewMatrix(matrix, dimensions), std::cout)) {
+    exitAtEndOfInput();
+  }
+}
+
+
+/**
+ * Asks user to change some values of a matrix, and patches the cached
+ * results made from it instead of dropping them.
+ * 
+ * @param matrixNumber - the ID number of the matrix to change.
+ * @param matrix1 - the first matrix.
+ * @param dimensions1 - the dimensions of the first matrix.
+ * @param hash1 - the content hash of the first matrix; updated if it changes.
+ * @param matrix2 - the second matrix.
+ * @param dimensions2 - the dimensions of the second matrix.
+ * @param hash2 - the content hash of the second matrix; updated if it changes.
+ */
+void updateMatrixValues(const int matrixNumber, float** matrix1, const int dimensions1[2], uint64_t* hash1,
+                        float** matrix2, const int dimensions2[2], uint64_t* hash2) {
+  std::cout << "===== Matrix " << matrixNumber << " =====" << std::endl;
+  std::cout << "Enter changes as <row column count> followed by count value(s), counting from 1."
+            << " Enter 0 to finish." << std::endl;
+
+  bool first = matrixNumber == 1;
+  MatrixView view1 = viewMatrix(matrix1, dimensions1);
+  MatrixView view2 = viewMatrix(matrix2, dimensions2);
+  DirtyRegion<float> dirty(first ? view1 : view2);
+  if (!readMatrixUpdates(standardInput(), dirty, std::cout)) {
+    exitAtEndOfInput();
+  }
+  if (dirty.empty()) {
+    return;
   }
+  uint64_t* hash = first ? hash1 : hash2;
+  uint64_t oldHash = *hash;
+  *hash = hashMatrix(first ? view1 : view2);
+  patchCachedResults(dirty, first, view1, *hash1, view2, *hash2, oldHash);
 }
 
 
@@ -219,15 +648,8 @@ void getMatrixValues(const int matrixNumber, float** matrix, const int dimension
  * @param dimensions - the dimensions of the matrix.
  */
 void printMatrix(const int matrixNumber, float** matrix, const int dimensions[2]) {
-  std::cout << "----- Matrix " << matrixNumber << " -----" << std::endl;
-  // For every row.
-  for (int i = 0; i < dimensions[1]; ++i) {
-    // For every column.
-    for (int j = 0; j < dimensions[0]; ++j) {
-      std::cout << matrix[i][j] << " ";
-    }
-    std::cout << std::endl;
-  }
+  std::cout << "----- Matrix " << matrixNumber << " -----\n";
+  writeMatrix(std::cout, viewMatrix(matrix, dimensions), outputFormat(GENERAL_FORMAT));
 }
 
 
@@ -238,14 +660,25 @@ void printMatrix(const int matrixNumber, float** matrix, const int dimensions[2]
  * @param dimensions - the dimensions of the matrix.
  */
 void printMatrix(float** matrix, const int dimensions[2]) {
-  // For every row.
-  for (int i = 0; i < dimensions[1]; ++i) {
-    // For every column.
-    for (int j = 0; j < dimensions[0]; ++j) {
-      std::cout << matrix[i][j] << " ";
-    }
-    std::cout << std::endl;
+  writeMatrix(std::cout, viewMatrix(matrix, dimensions), outputFormat(GENERAL_FORMAT));
+}
+
+
+/**
+ * Prints a result computed earlier from the same operands, if it is cached.
+ * 
+ * @param title - the name of the result, e.g. "Sum".
+ * @param key - the operation and its operands.
+ * @return bool - whether the result was cached and printed.
+ */
+bool printCachedResult(const char* title, const ResultKey &key) {
+  MatrixView cached = resultCache().find<float>(key);
+  if (cached.data == nullptr) {
+    return false;
   }
+  std::cout << "[[[ " << title << " ]]]\n";
+  writeMatrix(std::cout, cached, outputFormat(GENERAL_FORMAT));
+  return true;
 }
 
 
@@ -261,7 +694,9 @@ void printMenu() {
   std::cout << "[5] Print Matrix 2" << std::endl;
   std::cout << "[6] Re-input Matrix 1" << std::endl;
   std::cout << "[7] Re-input Matrix 2" << std::endl;
-  std::cout << "[8] Exit" << std::endl;
+  std::cout << "[8] Update Matrix 1" << std::endl;
+  std::cout << "[9] Update Matrix 2" << std::endl;
+  std::cout << "[10] Exit" << std::endl;
 }
 
 
@@ -280,12 +715,11 @@ float** getSum(float** matrix1, float** matrix2, const int dimensions1[2], const
   }
 
   // Add each position from both matrices with each other.
+  double elements = static_cast<double>(dimensions1[0]) * dimensions1[1];
+  ProfileScope profile(ProfileSection::ADD, elements, 3 * sizeof(float) * elements);
   float** sum = createMatrix(dimensions1);
-  for (int i = 0; i < dimensions1[1]; ++i) {
-    for (int j = 0; j < dimensions1[0]; ++j) {
-      sum[i][j] = matrix1[i][j] + matrix2[i][j];
-    }
-  }
+  addMatrices(viewMatrix(matrix1, dimensions1), viewMatrix(matrix2, dimensions2),
+              viewMatrix(sum, dimensions1));
 
   return sum;
 }
@@ -307,12 +741,11 @@ float** getDifference(float** matrix1, float** matrix2, const int dimensions1[2]
   }
 
   // Subtract each position from both matrices with each other.
+  double elements = static_cast<double>(dimensions1[0]) * dimensions1[1];
+  ProfileScope profile(ProfileSection::SUBTRACT, elements, 3 * sizeof(float) * elements);
   float** difference = createMatrix(dimensions1);
-  for (int i = 0; i < dimensions1[1]; ++i) {
-    for (int j = 0; j < dimensions1[0]; ++j) {
-      difference[i][j] = matrix1[i][j] - matrix2[i][j];
-    }
-  }
+  subtractMatrices(viewMatrix(matrix1, dimensions1), viewMatrix(matrix2, dimensions2),
+                   viewMatrix(difference, dimensions1));
 
   return difference;
 }
@@ -327,27 +760,77 @@ float** getDifference(float** matrix1, float** matrix2, const int dimensions1[2]
  * @param dimensions2 - the dimensions of the second matrix.
  */
 float** getProduct(float** matrix1, float** matrix2, const int dimensions1[2], const int dimensions2[2]) {
+  return getProduct(matrix1, matrix2, dimensions1, dimensions2, Transpose::NONE, Transpose::NONE);
+}
+
+
+/**
+ * Calculates the product of the two matrices, either of which may be used transposed.
+ * A transposed matrix is read in place by the blocked kernel, never copied.
+ * 
+ * @param matrix1 - the first matrix.
+ * @param matrix2 - the second matrix.
+ * @param dimensions1 - the dimensions of the first matrix, as stored.
+ * @param dimensions2 - the dimensions of the second matrix, as stored.
+ * @param transpose1 - whether the first matrix is used transposed.
+ * @param transpose2 - whether the second matrix is used transposed.
+ */
+float** getProduct(float** matrix1, float** matrix2, const int dimensions1[2], const int dimensions2[2],
+                   Transpose transpose1, Transpose transpose2) {
+  int operand1[2] = {0, 0};
+  int operand2[2] = {0, 0};
+  getOperandDimensions(dimensions1, transpose1, operand1);
+  getOperandDimensions(dimensions2, transpose2, operand2);
+
   // Check if matrix1's width == matrix2's height.
-  if (dimensions1[0] != dimensions2[1]) {
+  if (operand1[0] != operand2[1]) {
     return nullptr;
   }
 
-  // Matrix 1's height & matrix 2's width = new matrix's dimensions.
-  int dimensions[2] = {dimensions1[1], dimensions2[0]};
+  // Matrix 2's width & matrix 1's height = new matrix's dimensions.
+  int dimensions[2] = {operand2[0], operand1[1]};
+  ProfileScope profile(ProfileSection::MULTIPLY, productFlops(dimensions[1], dimensions[0], operand1[0]),
+                       productBytes(dimensions[1], dimensions[0], operand1[0]));
   float** product = createMatrix(dimensions);
 
-  // For each row for matrix 1.
-  for (int i = 0; i < dimensions1[1]; ++i) {
-    // For each column for matrix 2.
-    for (int k = 0; k < dimensions2[0]; ++k) {
-      float sum = 0;
-      // For each column in row for matrix 1.
-      for (int j = 0; j < dimensions1[0]; ++j) {
-        sum += matrix1[i][j] * matrix2[j][k];
-      }
-      product[i][k] = sum;
-    }
-  }
+  // Storage is contiguous, so the blocked kernel can run on it directly.
+  MatrixView lhs = viewMatrix(matrix1, dimensions1);
+  MatrixView rhs = viewMatrix(matrix2, dimensions2);
+  MatrixView out = viewMatrix(product, dimensions);
+  multiply(transpose1, transpose2, out.height, out.width, operand1[0], lhs.data, lhs.stride, rhs.data,
+           rhs.stride, out.data, out.stride);
 
   return product;
 }
+
+
+/**
+ * Calculates the transpose of a matrix.
+ * 
+ * @param matrix - the matrix.
+ * @param dimensions - the dimensions of the matrix.
+ */
+float** getTranspose(float** matrix, const int dimensions[2]) {
+  // Matrix's height & width = new matrix's dimensions.
+  int transposed[2] = {dimensions[1], dimensions[0]};
+  double elements = static_cast<double>(dimensions[0]) * dimensions[1];
+  ProfileScope profile(ProfileSection::TRANSPOSE, 0.0, 2 * sizeof(float) * elements);
+  float** result = createMatrix(transposed);
+  transposeMatrix(viewMatrix(matrix, dimensions), viewMatrix(result, transposed));
+
+  return result;
+}
+
+
+/**
+ * Finds the dimensions of a matrix as a product operand.
+ * 
+ * @param dimensions - the dimensions of the matrix, as stored.
+ * @param transpose - whether the matrix is used transposed.
+ * @param operand - receives the width and height it is used with.
+ */
+void getOperandDimensions(const int dimensions[2], Transpose transpose, int operand[2]) {
+  bool transposed = transpose == Transpose::TRANSPOSED;
+  operand[0] = transposed ? dimensions[1] : dimensions[0];
+  operand[1] = transposed ? dimensions[0] : dimensions[1];
+}
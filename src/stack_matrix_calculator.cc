@@ -6,48 +6,135 @@
  * Copyright (c) 2024, Thomas Truong.
  */
 
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <new>
+#include <vector>
+
+#include "matrix_benchmark.h"
+#include "matrix_cache.h"
+#include "matrix_format.h"
+#include "matrix_gemm.h"
+#include "matrix_incremental.h"
+#include "matrix_instrumentation.h"
+#include "matrix_parser.h"
+#include "matrix_simd.h"
+#include "matrix_storage.h"
+
+
+// Matrices up to STACK_SIZE x STACK_SIZE live in stack arrays; larger ones spill to the heap.
+const int STACK_SIZE = 64;
+
+
+MatrixView getDimensions(int matrixNumber, int dimensions[2], float stackArray[STACK_SIZE][STACK_SIZE]);
+MatrixView placeMatrix(float stackArray[STACK_SIZE][STACK_SIZE], const int dimensions[2]);
+void releaseMatrix(const MatrixView &matrix, float stackArray[STACK_SIZE][STACK_SIZE]);
+void getMatrixValues(const int matrixNumber, const MatrixView &matrix);
+void updateMatrixValues(const int matrixNumber, const MatrixView &matrix1, uint64_t* hash1,
+                        const MatrixView &matrix2, uint64_t* hash2);
+void printMatrix(const int matrixNumber, const MatrixView &matrix);
+void printSum(const MatrixView &matrix1, uint64_t hash1, const MatrixView &matrix2, uint64_t hash2);
+void printDifference(const MatrixView &matrix1, uint64_t hash1, const MatrixView &matrix2, uint64_t hash2);
+void printProduct(const MatrixView &matrix1, uint64_t hash1, const MatrixView &matrix2, uint64_t hash2);
+void printMenu();
 
 
-const int MIN_SIZE = 1;
-const int MAX_SIZE = 100;
+/**
+ * Benchmark subject (see matrix_benchmark.h): operands and results live in
+ * stack arrays, spilling to the heap like the menu's matrices when too large.
+ */
+class BenchmarkSubject {
+ public:
+  /**
+   * Places and fills the operands of a case.
+   *
+   * @param operation - the operation.
+   * @param shape - the shape.
+   */
+  void setUp(BenchmarkOperation operation, const BenchmarkShape &shape) {
+    _operation = operation;
+    bool product = operation == BenchmarkOperation::MULTIPLY;
+    int dimensions1[2] = {product ? shape.k : shape.n, shape.m};
+    int dimensions2[2] = {shape.n, product ? shape.k : shape.m};
+    _matrix1 = placeMatrix(_stack1, dimensions1);
+    _matrix2 = placeMatrix(_stack2, dimensions2);
+    fillBenchmarkMatrix(_matrix1, 1);
+    fillBenchmarkMatrix(_matrix2, 2);
+  }
 
 
-void getDimensions(int matrixNumber, int dimensions[2]);
-void getMatrixValues(const int matrixNumber, float matrix[MAX_SIZE][MAX_SIZE],
-                     const int dimensions[2]);
-void printMatrix(const int matrixNumber, const float matrix[MAX_SIZE][MAX_SIZE],
-                 const int dimensions[2]);
-void printSum(const float matrix1[MAX_SIZE][MAX_SIZE], const float matrix2[MAX_SIZE][MAX_SIZE],
-              const int dimensions1[2], const int dimensions2[2]);
-void printDifference(const float matrix1[MAX_SIZE][MAX_SIZE], const float matrix2[MAX_SIZE][MAX_SIZE],
-                     const int dimensions1[2], const int dimensions2[2]);
-void printProduct(const float matrix1[MAX_SIZE][MAX_SIZE], const float matrix2[MAX_SIZE][MAX_SIZE],
-                  const int dimensions1[2], const int dimensions2[2]);
-void printMenu();
+  /**
+   * Carries out the operation once into a stack-placed result.
+   *
+   * @return float - the first element of the result.
+   */
+  float run() {
+    int dimensions[2] = {_matrix2.width, _matrix1.height};
+    MatrixView result = placeMatrix(_stack3, dimensions);
+    if (_operation == BenchmarkOperation::ADD) {
+      addMatrices(_matrix1, _matrix2, result);
+    } else if (_operation == BenchmarkOperation::SUBTRACT) {
+      subtractMatrices(_matrix1, _matrix2, result);
+    } else {
+      multiply(result.height, result.width, _matrix1.width, _matrix1.data, _matrix1.stride,
+               _matrix2.data, _matrix2.stride, result.data, result.stride);
+    }
+    float first = result.row(0)[0];
+    releaseMatrix(result, _stack3);
+    return first;
+  }
+
 
+  /**
+   * Releases any heap spill of the operands.
+   */
+  void tearDown() {
+    releaseMatrix(_matrix1, _stack1);
+    releaseMatrix(_matrix2, _stack2);
+  }
+
+
+ private:
+  BenchmarkOperation _operation = BenchmarkOperation::ADD;
+  float _stack1[STACK_SIZE][STACK_SIZE];
+  float _stack2[STACK_SIZE][STACK_SIZE];
+  float _stack3[STACK_SIZE][STACK_SIZE];
+  MatrixView _matrix1 = {nullptr, 0, 0, 0};
+  MatrixView _matrix2 = {nullptr, 0, 0, 0};
+};
+
+
+int main(int argc, char* argv[]) {
+  // Benchmark add, subtract and multiply; optionally save the results as JSON.
+  if ((argc == 2 || argc == 3) && std::strcmp(argv[1], "--benchmark") == 0) {
+    BenchmarkSubject subject;
+    return runBenchmarks("stack", subject, argc == 3 ? argv[2] : nullptr);
+  }
 
-int main(void) {
   std::cout << "[ Stack Matrix Calculator ]" << std::endl;
 
-  // Get dimensions.
+  // Get dimensions and place the matrices.
   int dimensions1[2] = {0, 0};
   int dimensions2[2] = {0, 0};
-  getDimensions(1, dimensions1);
-  getDimensions(2, dimensions2);
-
-  float matrix1[MAX_SIZE][MAX_SIZE];
-  float matrix2[MAX_SIZE][MAX_SIZE];
+  float stack1[STACK_SIZE][STACK_SIZE];
+  float stack2[STACK_SIZE][STACK_SIZE];
+  MatrixView matrix1 = getDimensions(1, dimensions1, stack1);
+  MatrixView matrix2 = getDimensions(2, dimensions2, stack2);
 
   // Get values for matrix 1.
   std::cout << std::endl;
-  getMatrixValues(1, matrix1, dimensions1);
-  printMatrix(1, matrix1, dimensions1);
+  getMatrixValues(1, matrix1);
+  printMatrix(1, matrix1);
 
   // Get values for matrix 2.
   std::cout << std::endl;
-  getMatrixValues(2, matrix2, dimensions2);
-  printMatrix(2, matrix2, dimensions2);
+  getMatrixValues(2, matrix2);
+  printMatrix(2, matrix2);
+
+  // Content hashes key the cached results until a matrix changes.
+  uint64_t hash1 = hashMatrix(matrix1);
+  uint64_t hash2 = hashMatrix(matrix2);
 
   bool exit = false;
   int choice = 0;
@@ -56,75 +143,131 @@ int main(void) {
     std::cout << std::endl;
     printMenu();
     std::cout << "Input: ";
-    std::cin >> choice;
+    choice = readMenuChoice(10);
 
     // Process choice.
     std::cout << std::endl;
     switch (choice) {
       case 1:  // Print sum.
-        printSum(matrix1, matrix2, dimensions1, dimensions2);
+        printSum(matrix1, hash1, matrix2, hash2);
         break;
       case 2:  // Print difference.
-        printDifference(matrix1, matrix2, dimensions1, dimensions2);
+        printDifference(matrix1, hash1, matrix2, hash2);
         break;
       case 3:  // Print product.
-        printProduct(matrix1, matrix2, dimensions1, dimensions2);
+        printProduct(matrix1, hash1, matrix2, hash2);
         break;
       case 4:  // Print matrix 1.
-        printMatrix(1, matrix1, dimensions1);
+        printMatrix(1, matrix1);
         break;
       case 5:  // Print matrix 2.
-        printMatrix(2, matrix2, dimensions2);
+        printMatrix(2, matrix2);
         break;
       case 6:  // Re-input matrix 1.
-        getDimensions(1, dimensions1);
-        getMatrixValues(1, matrix1, dimensions1);
-        printMatrix(1, matrix1, dimensions1);
+        resultCache().invalidate(hash1);
+        releaseMatrix(matrix1, stack1);
+        matrix1 = getDimensions(1, dimensions1, stack1);
+        getMatrixValues(1, matrix1);
+        hash1 = hashMatrix(matrix1);
+        printMatrix(1, matrix1);
         break;
       case 7:  // Re-input matrix 2.
-        getDimensions(2, dimensions2);
-        getMatrixValues(2, matrix2, dimensions2);
-        printMatrix(2, matrix2, dimensions2);
+        resultCache().invalidate(hash2);
+        releaseMatrix(matrix2, stack2);
+        matrix2 = getDimensions(2, dimensions2, stack2);
+        getMatrixValues(2, matrix2);
+        hash2 = hashMatrix(matrix2);
+        printMatrix(2, matrix2);
+        break;
+      case 8:  // Update matrix 1.
+        updateMatrixValues(1, matrix1, &hash1, matrix2, &hash2);
+        printMatrix(1, matrix1);
         break;
-      case 8:  // Exit program.
+      case 9:  // Update matrix 2.
+        updateMatrixValues(2, matrix1, &hash1, matrix2, &hash2);
+        printMatrix(2, matrix2);
+        break;
+      case 10:  // Exit program.
         exit = true;
         break;
     }
   } while (!exit);
 
-  // User exited.
+  // User exited; release any heap spill.
+  releaseMatrix(matrix1, stack1);
+  releaseMatrix(matrix2, stack2);
   std::cout << "Goodbye!" << std::endl;
+  reportResultCacheStats(std::cerr);
 
   return 0;
 }
 
 
 /**
- * Asks user to input the dimensions of the matrices.
+ * Asks user to input the dimensions of the matrices and places the matrix.
  * 
  * @param matrixNumber - the ID number of the matrix.
  * @param dimensions - the array that will contain the user's inputs.
+ * @param stackArray - the stack array reserved for the matrix.
+ * @return MatrixView - the matrix's storage.
  */
-void getDimensions(int matrixNumber, int dimensions[2]) {
+MatrixView getDimensions(int matrixNumber, int dimensions[2], float stackArray[STACK_SIZE][STACK_SIZE]) {
   std::cout << "Enter the dimensions for matrix " << matrixNumber
             << " (width x height)." << std::endl;
-  bool valid = false;
-
-  // Get input and repeat if invalid (invalid = MIN_SIZE < x > MAX_SIZE).
-  do {
+  // Get input and repeat if rejected by the dimension policy or too large for memory.
+  while (true) {
+    long width = 0;
+    long height = 0;
     std::cout << "Dimensions <x y>: ";
-    std::cin >> dimensions[0];
-    std::cin >> dimensions[1];
+    if (!readDimensions(&width, &height)) {
+      continue;
+    }
 
     // Validate input.
-    if (dimensions[0] < MIN_SIZE || dimensions[1] < MIN_SIZE) {
-      std::cout << "Invalid size, min is " << MIN_SIZE << std::endl;
-    } else if (dimensions[0] > MAX_SIZE || dimensions[1] > MAX_SIZE) {
-      std::cout << "Invalid size, max is " << MAX_SIZE << std::endl;
-    } else {
-      valid = true;
+    std::string error;
+    if (!checkDimensions(width, height, &error)) {
+      std::cout << error << std::endl;
+      continue;
     }
-  } while (!valid);
+    dimensions[0] = static_cast<int>(width);
+    dimensions[1] = static_cast<int>(height);
+    try {
+      return placeMatrix(stackArray, dimensions);
+    } catch (const std::bad_alloc &) {
+      std::cout << "Invalid size, not enough memory" << std::endl;
+    }
+  }
+}
+
+
+/**
+ * Picks the storage for a matrix: the stack array when it fits, the heap otherwise.
+ * 
+ * @param stackArray - the stack array reserved for the matrix.
+ * @param dimensions - the dimensions of the matrix.
+ * @return MatrixView - the matrix's storage.
+ */
+MatrixView placeMatrix(float stackArray[STACK_SIZE][STACK_SIZE], const int dimensions[2]) {
+  if (dimensions[0] <= STACK_SIZE && dimensions[1] <= STACK_SIZE) {
+    return MatrixView{&stackArray[0][0], dimensions[0], dimensions[1], STACK_SIZE};
+  }
+
+  int stride = paddedStride(dimensions[0]);
+  float* data = allocateMatrixData(static_cast<size_t>(stride) * dimensions[1]);
+  return MatrixView{data, dimensions[0], dimensions[1], stride};
+}
+
+
+/**
+ * Frees a matrix's storage if it spilled to the heap.
+ * 
+ * @param matrix - the matrix.
+ * @param stackArray - the stack array reserved for the matrix.
+ */
+void releaseMatrix(const MatrixView &matrix, float stackArray[STACK_SIZE][STACK_SIZE]) {
+  if (matrix.data != &stackArray[0][0]) {
+    freeMatrixData(matrix.data);
+  }
 }
 
 
@@ -133,20 +276,47 @@ void getDimensions(int matrixNumber, int dimensions[2]) {
  * 
  * @param matrixNumber - the ID number of the matrix.
  * @param matrix - the matrix to fill out with user input.
- * @param dimensions - the dimensions of the matrix.
  */
-void getMatrixValues(const int matrixNumber, float matrix[MAX_SIZE][MAX_SIZE],
-                     const int dimensions[2]) {
+void getMatrixValues(const int matrixNumber, const MatrixView &matrix) {
   std::cout << "===== Matrix " << matrixNumber << " =====" << std::endl;
-  std::cout << "Enter " << dimensions[0] * dimensions[1] << " value(s) individually or seperated by space."
-            << std::endl;
+  std::cout << "Enter " << static_cast<long>(matrix.width) * matrix.height
+            << " value(s) individually or seperated by space." << std::endl;
 
   // Take user input for each valid slot.
-  for (int i = 0; i < dimensions[1]; ++i) {
-    for (int j = 0; j < dimensions[0]; ++j) {
-      std::cin >> matrix[i][j];
-    }
+  if (!readMatrixValues(standardInput(), matrix, std::cout)) {
+    exitAtEndOfInput();
+  }
+}
+
+
+/**
+ * Asks user to change some values of a matrix, and patches the cached
+ * results made from it instead of dropping them.
+ * 
+ * @param matrixNumber - the ID number of the matrix to change.
+ * @param matrix1 - the first matrix.
+ * @param hash1 - the content hash of the first matrix; updated if it changes.
+ * @param matrix2 - the second matrix.
+ * @param hash2 - the content hash of the second matrix; updated if it changes.
+ */
+void updateMatrixValues(const int matrixNumber, const MatrixView &matrix1, uint64_t* hash1,
+                        const MatrixView &matrix2, uint64_t* hash2) {
+  std::cout << "===== Matrix " << matrixNumber << " =====" << std::endl;
+  std::cout << "Enter changes as <row column count> followed by count value(s), counting from 1."
+            << " Enter 0 to finish." << std::endl;
+
+  bool first = matrixNumber == 1;
+  DirtyRegion<float> dirty(first ? matrix1 : matrix2);
+  if (!readMatrixUpdates(standardInput(), dirty, std::cout)) {
+    exitAtEndOfInput();
   }
+  if (dirty.empty()) {
+    return;
+  }
+  uint64_t* hash = first ? hash1 : hash2;
+  uint64_t oldHash = *hash;
+  *hash = hashMatrix(first ? matrix1 : matrix2);
+  patchCachedResults(dirty, first, matrix1, *hash1, matrix2, *hash2, oldHash);
 }
 
 
@@ -155,19 +325,10 @@ void getMatrixValues(const int matrixNumber, float matrix[MAX_SIZE][MAX_SIZE],
  * 
  * @param matrixNumber - the ID number of the matrix.
  * @param matrix - the matrix to print out.
- * @param dimensions - the dimensions of the matrix.
  */
-void printMatrix(const int matrixNumber, const float matrix[MAX_SIZE][MAX_SIZE],
-                 const int dimensions[2]) {
-  std::cout << "----- Matrix " << matrixNumber << " -----" << std::endl;
-  // For every row.
-  for (int i = 0; i < dimensions[1]; ++i) {
-    // For every column.
-    for (int j = 0; j < dimensions[0]; ++j) {
-      std::cout << matrix[i][j] << " ";
-    }
-    std::cout << std::endl;
-  }
+void printMatrix(const int matrixNumber, const MatrixView &matrix) {
+  std::cout << "----- Matrix " << matrixNumber << " -----\n";
+  writeMatrix(std::cout, matrix, outputFormat(GENERAL_FORMAT));
 }
 
 
@@ -183,7 +344,9 @@ void printMenu() {
   std::cout << "[5] Print Matrix 2" << std::endl;
   std::cout << "[6] Re-input Matrix 1" << std::endl;
   std::cout << "[7] Re-input Matrix 2" << std::endl;
-  std::cout << "[8] Exit" << std::endl;
+  std::cout << "[8] Update Matrix 1" << std::endl;
+  std::cout << "[9] Update Matrix 2" << std::endl;
+  std::cout << "[10] Exit" << std::endl;
 }
 
 
@@ -191,26 +354,33 @@ void printMenu() {
  * Calculates and prints the sum of the two matrices.
  * 
  * @param matrix1 - the first matrix.
+ * @param hash1 - the content hash of the first matrix.
  * @param matrix2 - the second matrix.
- * @param dimensions1 - the dimensions of the first matrix.
- * @param dimensions2 - the dimensions of the second matrix.
+ * @param hash2 - the content hash of the second matrix.
  */
-void printSum(const float matrix1[MAX_SIZE][MAX_SIZE], const float matrix2[MAX_SIZE][MAX_SIZE],
-              const int dimensions1[2], const int dimensions2[2]) {
+void printSum(const MatrixView &matrix1, uint64_t hash1, const MatrixView &matrix2, uint64_t hash2) {
   // Check for same size.
-  if (dimensions1[0] != dimensions2[0] || dimensions1[1] != dimensions2[1]) {
+  if (matrix1.width != matrix2.width || matrix1.height != matrix2.height) {
     std::cout << "[Sum] ERROR: dimensions are not matching." << std::endl;
     return;
   }
 
-  // Add each position from both matrices with each other.
-  std::cout << "[[[ Sum ]]]" << std::endl;
-  for (int i = 0; i < dimensions1[1]; ++i) {
-    for (int j = 0; j < dimensions1[0]; ++j) {
-      std::cout << matrix1[i][j] + matrix2[i][j] << " ";
-    }
-    std::cout << std::endl;
+  // Add each position from both matrices with each other (unless the same sum
+  // is cached), then print the sum.
+  ResultKey key = resultKey(CachedOperation::SUM, matrix1, hash1, matrix2, hash2);
+  MatrixView result = resultCache().find<float>(key);
+  std::vector<float> sum;
+  if (result.data == nullptr) {
+    sum.resize(static_cast<size_t>(matrix1.height) * matrix1.width);
+    result = {sum.data(), matrix1.width, matrix1.height, matrix1.width};
+    double elements = static_cast<double>(sum.size());
+    ProfileScope profile(ProfileSection::ADD, elements, 3 * sizeof(float) * elements);
+    addMatrices(matrix1, matrix2, result);
+    resultCache().insert(key, result);
   }
+
+  std::cout << "[[[ Sum ]]]\n";
+  writeMatrix(std::cout, result, outputFormat(GENERAL_FORMAT));
 }
 
 
@@ -218,26 +388,33 @@ void printSum(const float matrix1[MAX_SIZE][MAX_SIZE], const float matrix2[MAX_S
  * Calculates and prints the difference of the two matrices.
  * 
  * @param matrix1 - the first matrix.
+ * @param hash1 - the content hash of the first matrix.
  * @param matrix2 - the second matrix.
- * @param dimensions1 - the dimensions of the first matrix.
- * @param dimensions2 - the dimensions of the second matrix.
+ * @param hash2 - the content hash of the second matrix.
  */
-void printDifference(const float matrix1[MAX_SIZE][MAX_SIZE], const float matrix2[MAX_SIZE][MAX_SIZE],
-                     const int dimensions1[2], const int dimensions2[2]) {
+void printDifference(const MatrixView &matrix1, uint64_t hash1, const MatrixView &matrix2, uint64_t hash2) {
   // Check for same size.
-  if (dimensions1[0] != dimensions2[0] || dimensions1[1] != dimensions2[1]) {
+  if (matrix1.width != matrix2.width || matrix1.height != matrix2.height) {
     std::cout << "[Difference] ERROR: dimensions are not matching." << std::endl;
     return;
   }
 
-  // Subtract each position from both matrices with each other.
-  std::cout << "[[[ Difference ]]]" << std::endl;
-  for (int i = 0; i < dimensions1[1]; ++i) {
-    for (int j = 0; j < dimensions1[0]; ++j) {
-      std::cout << matrix1[i][j] - matrix2[i][j] << " ";
-    }
-    std::cout << std::endl;
+  // Subtract each position from both matrices with each other (unless the
+  // same difference is cached), then print the difference.
+  ResultKey key = resultKey(CachedOperation::DIFFERENCE, matrix1, hash1, matrix2, hash2);
+  MatrixView result = resultCache().find<float>(key);
+  std::vector<float> difference;
+  if (result.data == nullptr) {
+    difference.resize(static_cast<size_t>(matrix1.height) * matrix1.width);
+    result = {difference.data(), matrix1.width, matrix1.height, matrix1.width};
+    double elements = static_cast<double>(difference.size());
+    ProfileScope profile(ProfileSection::SUBTRACT, elements, 3 * sizeof(float) * elements);
+    subtractMatrices(matrix1, matrix2, result);
+    resultCache().insert(key, result);
   }
+
+  std::cout << "[[[ Difference ]]]\n";
+  writeMatrix(std::cout, result, outputFormat(GENERAL_FORMAT));
 }
 
 
@@ -245,30 +422,33 @@ void printDifference(const float matrix1[MAX_SIZE][MAX_SIZE], const float matrix
  * Calculates and prints the product of the two matrices.
  * 
  * @param matrix1 - the first matrix.
+ * @param hash1 - the content hash of the first matrix.
  * @param matrix2 - the second matrix.
- * @param dimensions1 - the dimensions of the first matrix.
- * @param dimensions2 - the dimensions of the second matrix.
+ * @param hash2 - the content hash of the second matrix.
  */
-void printProduct(const float matrix1[MAX_SIZE][MAX_SIZE], const float matrix2[MAX_SIZE][MAX_SIZE],
-                  const int dimensions1[2], const int dimensions2[2]) {
+void printProduct(const MatrixView &matrix1, uint64_t hash1, const MatrixView &matrix2, uint64_t hash2) {
   // Check if matrix1's width == matrix2's height.
-  if (dimensions1[0] != dimensions2[1]) {
+  if (matrix1.width != matrix2.height) {
     std::cout << "[Product] ERROR: matrix 1's width does not match matrix 2's height." << std::endl;
     return;
   }
 
-  std::cout << "[[[ Product ]]]" << std::endl;
-  // For each row for matrix 1.
-  for (int i = 0; i < dimensions1[1]; ++i) {
-    // For each column for matrix 2.
-    for (int k = 0; k < dimensions2[0]; ++k) {
-      float sum = 0;
-      // For each column in row for matrix 1.
-      for (int j = 0; j < dimensions1[0]; ++j) {
-        sum += matrix1[i][j] * matrix2[j][k];
-      }
-      std::cout << sum << " ";
-    }
-    std::cout << std::endl;
+  // Compute the whole product (multi-threaded when large) unless the same
+  // product is cached, then print it.
+  ResultKey key = resultKey(CachedOperation::PRODUCT, matrix1, hash1, matrix2, hash2);
+  MatrixView result = resultCache().find<float>(key);
+  std::vector<float> product;
+  if (result.data == nullptr) {
+    product.resize(static_cast<size_t>(matrix1.height) * matrix2.width);
+    result = {product.data(), matrix2.width, matrix1.height, matrix2.width};
+    ProfileScope profile(ProfileSection::MULTIPLY,
+                         productFlops(matrix1.height, matrix2.width, matrix1.width),
+                         productBytes(matrix1.height, matrix2.width, matrix1.width));
+    multiply(matrix1.height, matrix2.width, matrix1.width, matrix1.data, matrix1.stride,
+             matrix2.data, matrix2.stride, product.data(), matrix2.width);
+    resultCache().insert(key, result);
   }
+
+  std::cout << "[[[ Product ]]]\n";
+  writeMatrix(std::cout, result, outputFormat(GENERAL_FORMAT));
 }
@@ -0,0 +1,307 @@
+/**
+ * thread_pool.h
+ * Persistent worker pool with per-worker deques and work stealing.
+ * Each parallelFor() deals contiguous index ranges to the workers; a worker
+ * takes from the back of its own deque and steals from the front of others
+ * once it runs dry, so uneven tiles still keep every core busy.
+ *
+ * Copyright (c) 2024, Thomas Truong.
+ */
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+class ThreadPool {
+ public:
+  /**
+   * Constructor; starts threads - 1 workers (the caller is the last one).
+   *
+   * @param threads - the total number of threads that run tasks.
+   */
+  explicit ThreadPool(int threads) {
+    if (threads < 1) {
+      threads = 1;
+    }
+    for (int i = 0; i < threads; ++i) {
+      _queues.push_back(std::make_unique<TaskQueue>());
+    }
+    for (int i = 1; i < threads; ++i) {
+      _workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+
+  /**
+   * Destructor; stops and joins the workers.
+   */
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(_stateMutex);
+      _stopping = true;
+    }
+    _wake.notify_all();
+    for (std::thread &worker : _workers) {
+      worker.join();
+    }
+  }
+
+
+  /**
+   * Retrieves the number of threads that run tasks (workers + caller).
+   *
+   * @return int - the thread count.
+   */
+  int size() const {
+    return static_cast<int>(_queues.size());
+  }
+
+
+  /**
+   * Runs task(i) for every i in [0, count) and waits for all of them.
+   * Calls made from inside a task run inline to avoid deadlock.
+   *
+   * @param count - the number of tasks.
+   * @param task - the task body.
+   * @throws - the first exception thrown by a task.
+   */
+  void parallelFor(size_t count, const std::function<void(size_t)> &task) {
+    if (count == 0) {
+      return;
+    }
+    if (_queues.size() == 1 || count == 1 || insideTask()) {
+      for (size_t i = 0; i < count; ++i) {
+        task(i);
+      }
+      return;
+    }
+
+    std::lock_guard<std::mutex> exclusive(_submitMutex);
+    _task = &task;
+    _error = nullptr;
+    _remaining.store(count);
+
+    // Deal a contiguous range to each queue so neighbouring tiles share caches.
+    size_t queues = _queues.size();
+    for (size_t q = 0; q < queues; ++q) {
+      size_t begin = count * q / queues;
+      size_t end = count * (q + 1) / queues;
+      std::lock_guard<std::mutex> lock(_queues[q]->mutex);
+      for (size_t i = begin; i < end; ++i) {
+        _queues[q]->indices.push_back(i);
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(_stateMutex);
+      ++_generation;
+    }
+    _wake.notify_all();
+
+    runTasks(0);
+
+    std::unique_lock<std::mutex> lock(_stateMutex);
+    _done.wait(lock, [this] { return _remaining.load() == 0; });
+    _task = nullptr;
+    if (_error != nullptr) {
+      std::rethrow_exception(_error);
+    }
+  }
+
+
+ private:
+  struct TaskQueue {
+    std::mutex mutex;
+    std::deque<size_t> indices;
+  };
+
+  std::vector<std::unique_ptr<TaskQueue>> _queues;
+  std::vector<std::thread> _workers;
+  std::mutex _submitMutex;
+  std::mutex _stateMutex;
+  std::condition_variable _wake;
+  std::condition_variable _done;
+  uint64_t _generation = 0;
+  bool _stopping = false;
+  const std::function<void(size_t)>* _task = nullptr;
+  std::atomic<size_t> _remaining{0};
+  std::exception_ptr _error;
+
+
+  /**
+   * Retrieves whether the current thread is running a pool task.
+   *
+   * @return bool& - the flag.
+   */
+  static bool &insideTask() {
+    static thread_local bool inside = false;
+    return inside;
+  }
+
+
+  /**
+   * Takes the next index from a worker's own deque (newest first).
+   *
+   * @param id - the worker.
+   * @param index - receives the task index.
+   * @return bool - whether a task was taken.
+   */
+  bool popLocal(size_t id, size_t* index) {
+    TaskQueue &queue = *_queues[id];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.indices.empty()) {
+      return false;
+    }
+    *index = queue.indices.back();
+    queue.indices.pop_back();
+    return true;
+  }
+
+
+  /**
+   * Steals the oldest index from another worker's deque.
+   *
+   * @param id - the thief.
+   * @param index - receives the task index.
+   * @return bool - whether a task was stolen.
+   */
+  bool steal(size_t id, size_t* index) {
+    size_t queues = _queues.size();
+    for (size_t offset = 1; offset < queues; ++offset) {
+      TaskQueue &queue = *_queues[(id + offset) % queues];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.indices.empty()) {
+        *index = queue.indices.front();
+        queue.indices.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+
+  /**
+   * Runs tasks until there is nothing left to take or steal.
+   *
+   * @param id - the worker.
+   */
+  void runTasks(size_t id) {
+    insideTask() = true;
+    size_t index = 0;
+    while (popLocal(id, &index) || steal(id, &index)) {
+      try {
+        (*_task)(index);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(_stateMutex);
+        if (_error == nullptr) {
+          _error = std::current_exception();
+        }
+      }
+      if (_remaining.fetch_sub(1) == 1) {
+        std::lock_guard<std::mutex> lock(_stateMutex);
+        _done.notify_all();
+      }
+    }
+    insideTask() = false;
+  }
+
+
+  /**
+   * Body of each worker thread: sleep until a new batch is posted, then run it.
+   *
+   * @param id - the worker.
+   */
+  void workerLoop(size_t id) {
+    uint64_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(_stateMutex);
+        _wake.wait(lock, [this, seen] { return _stopping || _generation != seen; });
+        if (_stopping) {
+          return;
+        }
+        seen = _generation;
+      }
+      runTasks(id);
+    }
+  }
+};
+
+
+/**
+ * Retrieves the mutable, process-wide thread count setting.
+ * Defaults to MATRIX_THREADS, or the number of hardware threads.
+ *
+ * @return std::atomic<int>& - the setting.
+ */
+inline std::atomic<int> &threadCountSetting() {
+  static std::atomic<int> threads([] {
+    const char* env = std::getenv("MATRIX_THREADS");
+    if (env != nullptr && std::atoi(env) > 0) {
+      return std::atoi(env);
+    }
+    unsigned int hardware = std::thread::hardware_concurrency();
+    return hardware == 0 ? 1 : static_cast<int>(hardware);
+  }());
+  return threads;
+}
+
+
+/**
+ * Retrieves the number of threads used by the parallel kernels.
+ *
+ * @return int - the thread count.
+ */
+inline int getThreadCount() {
+  return threadCountSetting().load();
+}
+
+
+/**
+ * Changes the number of threads used by the parallel kernels.
+ *
+ * @param threads - the thread count (at least 1).
+ */
+inline void setThreadCount(int threads) {
+  threadCountSetting().store(threads < 1 ? 1 : threads);
+}
+
+
+/**
+ * Retrieves the shared pool for the current thread count.
+ * Safe to call from several threads at once. A pool is created the first time
+ * its size is asked for and lives until exit, since another thread may still
+ * be running tasks on it after the thread count changes.
+ *
+ * @return ThreadPool& - the pool.
+ */
+inline ThreadPool &defaultThreadPool() {
+  static std::mutex mutex;
+  static std::vector<std::unique_ptr<ThreadPool>> pools;
+  int threads = getThreadCount();
+  std::lock_guard<std::mutex> lock(mutex);
+  for (const std::unique_ptr<ThreadPool> &pool : pools) {
+    if (pool->size() == threads) {
+      return *pool;
+    }
+  }
+  pools.push_back(std::make_unique<ThreadPool>(threads));
+  return *pools.back();
+}
+
+#endif  // THREAD_POOL_H_